@@ -25,6 +25,7 @@
 
 namespace mips {
 
+    const row_type NO_POSITION = std::numeric_limits<row_type>::max(); // the probe vector has been deleted
 
     // I can change between runs: theta, method, queryMatrix
     // I cannot change between runs: probeMatrix, k
@@ -35,36 +36,281 @@ namespace mips {
 
         std::vector<ProbeBucket> probeBuckets;
         std::vector<RetrievalArguments> retrArg;
+        SharedMinScore sharedMinScore; // for L2AP, BLSH
+        SharedTopkBounds topkBounds; // for top-k with intra-query parallelism
 
         row_type maxProbeBucketSize;
         LempArguments args;
         row_type activeBuckets;
+        bool acrossBuckets; // the threads share all queries and split the probe buckets
+        std::vector<double> seedBounds; // per query: lower bound of its top-k minimum known from elsewhere (e.g. other shards)
+        std::vector<int> queryK; // per query k of the next top-k call (empty: args.k for all)
+        std::vector<double> queryTheta; // per query theta of the next above-theta call (empty: args.theta for all)
+
+        // online retrieval (prepare, query, queryBatch)
+        VectorMatrix onlineQueries; // normalized copies of the queries of the current call
+        row_type onlineCapacity;
+        bool prepared;
+        bool keepAllBuckets; // above-theta: do not deactivate buckets based on the lengths of the current queries
+        VectorMatrix tuningSample; // the sample of prepare. Used again for retuning after a rebalance
+
+        // incremental updates of the probe vectors
+        row_type sortedRows; // probeMatrix[0, sortedRows) is bucketized. New vectors follow, in the delta bucket
+        row_type deletedRows; // tombstones in probeMatrix
+        row_type nextId; // id of the next new probe vector
+        bool hasDelta; // probeBuckets[1] is the delta bucket
+        std::vector<row_type> positions; // probe id -> row in probeMatrix (NO_POSITION if deleted). Built on the first update
+
+        TuningCache tuningCache; // tuned parameters of earlier runs
+        std::vector<std::vector<RetrievalArguments> > tuningArg; // scratch arguments of the tuning workers (worker 0 uses retrArg)
+        const ItemFilter* itemFilter; // items excluded from the results (nullptr: none)
+        QueryCache resultCache; // results of earlier online queries
+        CostModel costModel; // per-operation costs for the model-based tuning (calibrated on first use)
 
         inline row_type initProbeBuckets(VectorMatrix& rightMatrix);
+        inline row_type bucketizeProbeMatrix();
         inline void initializeRetrievers();
+        inline void initializeRetriever(row_type b);
+        inline void setRetriever(ProbeBucket& bucket, LEMP_Method method);
+        inline void buildIndex(ProbeBucket& bucket, int threads);
         inline void initQueryBatches(VectorMatrix& leftMatrix, row_type maxBlockSize, std::vector<RetrievalArguments>& retrArg);
+        inline void initRetrievalArguments();
+        inline void initIntervals();
+        inline void copyOnlineQueries(const double* queries, row_type n);
+        inline void scaleByQueryTheta(const double* queries, row_type n, const std::vector<double>& thetas, std::vector<double>& scaled) const;
+        inline void rescaleResults(std::vector<MatItem>& items, const std::vector<double>& thetas) const;
+        inline void initTopkSizes(row_type n);
         inline void initListsInBuckets();
+        inline void buildIndexesLargeFirst(row_type b0, row_type parallelPoints);
         inline void tune(std::vector<RetrievalArguments>& retrArg, row_type allQueries);
+        inline bool applyCachedTuning(row_type b, bool topk, bool withSample);
+        inline row_type tuneBuckets(row_type b0, row_type end, row_type cacheEnd, bool topk);
+        inline void initTuningArguments(row_type workers);
+        inline row_type applyTuningCache(row_type b0, bool topk);
+        inline void selectMethods(row_type b0, row_type end, bool topk);
+        inline double tuningPasses() const;
+        inline void fitSamples(row_type end);
         inline void printAlgoName(const VectorMatrix& queryMatrix);
+        inline void printIndexWaitTimes() const;
+        inline void initOnlineTuners();
+        inline void printOnlineTuning() const;
+        inline void maskQueries(const ProbeBucket& bucket, RetrievalArguments& arg) const;
+        inline void unmaskQueries(RetrievalArguments& arg) const;
+        inline void runTopKInBucket(row_type b, row_type tid, bool shareMinScores);
+        inline void runTopKAcrossBuckets(row_type tid, bool shareMinScores);
+        inline void runTopKForThread(row_type tid, bool shareMinScores);
+        inline void mergeTopkResults(row_type tid);
+        inline void initPositions();
+        inline void insertIntoDelta(const double* vec, row_type id);
+        inline void refreshDeltaBucket(bool rebuildIndexes);
+        inline bool markDeleted(row_type id);
+        inline void rebalanceIfNeeded();
+        inline void runQueryBatch(const double* queries, row_type n, std::vector<MatItem>& out);
+        inline void queryBatchWithCache(const double* queries, row_type n, std::vector<MatItem>& out);
 
     public:
 
         inline void setTheta(double theta) {
             args.theta = theta;
+            resultCache.clear();
         }
 
         inline void setMethod(LEMP_Method method) {
             args.method = method;
+            tuningCache.setMethod(method);
+            resultCache.clear();
+        }
+
+        inline void setBulkTree(bool bulkTree) {
+            args.bulkTree = bulkTree;
+        }
+
+        // LEMP_TREE: search each query batch with a cover tree of its own against the bucket tree (dual-tree)
+        inline void setDualTree(bool dualTree) {
+            args.dualTree = dualTree;
+        }
+
+        // LEMP_ANNOY: trees per bucket and candidates per query and bucket (more: higher recall, slower)
+        inline void setAnnoy(int numTrees, int search_k) {
+            args.numTrees = std::max(1, numTrees);
+            args.search_k = std::max(1, search_k);
+            tuningCache.clear(); // t_b depends on the forests
+            resultCache.clear();
+        }
+
+        // LEMP_HNSW: candidates kept per query and bucket (more: higher recall, slower)
+        inline void setHnsw(int ef) {
+            args.ef = std::max(1, ef);
+            tuningCache.clear(); // t_b depends on ef
+            resultCache.clear();
+        }
+
+        // LEMP_PQ: bytes per code. exact: verify all vectors the quantization error cannot rule out, otherwise the search_k best
+        inline void setPq(int subspaces, bool exact) {
+            args.pqSubspaces = std::max(1, subspaces);
+            args.pqExact = exact;
+            tuningCache.clear();
+            resultCache.clear();
+        }
+
+        /*
+         * Per bucket the range of each coordinate of its directions. Before each bucket a query whose best possible
+         * cosine in it (from the ranges) is below its local threshold skips the bucket. Set before initialize
+         */
+        inline void setRangeBounds(bool rangeBounds) {
+            args.rangeBounds = rangeBounds;
+        }
+
+        /*
+         * Per bucket up to clusters cones (centroid direction and angular radius) that cover its directions (0: none).
+         * Used like the range bounds, together with them if both are set. Set before initialize
+         */
+        inline void setConeBounds(int clusters) {
+            args.coneClusters = std::max(0, clusters);
+        }
+
+        /*
+         * Lower bounds (one per row of the next query matrix) of the k-th best score of each query, e.g., known from
+         * another part of the probe vectors. Items below the bound are not reported, so the next runTopK may return
+         * fewer than k results for a query. The bounds are used by the next runTopK call only.
+         */
+        inline void setTopkBounds(const std::vector<double>& bounds) {
+            seedBounds = bounds;
+        }
+
+        /*
+         * Per-query k (one value per row of the next query matrix, or per query of the next queryBatch), each
+         * between 1 and the k the engine was created with. Used by the next top-k call only.
+         */
+        inline void setQueryK(const std::vector<int>& ks) {
+            for (auto k : ks) {
+                if (k < 1 || k > args.k) {
+                    std::cerr << "[ERROR] Per-query k has to be between 1 and k (" << args.k << ")!" << std::endl;
+                    exit(1);
+                }
+            }
+            queryK = ks;
+        }
+
+        /*
+         * Per-query theta (one positive value per row of the next query matrix, or per query of the next
+         * queryBatch). A query q with threshold theta_q runs as q * theta / theta_q, so the local thresholds and
+         * the bucket pruning follow its own threshold. Scores are reported unscaled. Used by the next above-theta
+         * call only; theta has to be positive.
+         */
+        inline void setQueryTheta(const std::vector<double>& thetas) {
+            if (!thetas.empty() && args.theta <= 0) {
+                std::cerr << "[ERROR] Per-query theta needs a positive theta!" << std::endl;
+                exit(1);
+            }
+            for (auto theta : thetas) {
+                if (theta <= 0) {
+                    std::cerr << "[ERROR] Per-query theta has to be positive!" << std::endl;
+                    exit(1);
+                }
+            }
+            queryTheta = thetas;
+        }
+
+        inline void setIntraQuery(bool intraQuery) {
+            args.intraQuery = intraQuery;
+        }
+
+        // rebucketize when the new and the deleted vectors exceed this fraction of the probe vectors (0: only on rebalance())
+        inline void setRebalanceFraction(double fraction) {
+            args.rebalanceFraction = fraction;
+        }
+
+        /*
+         * Keep the tuned parameters of each run and reuse them in later runs (also with another theta or k) instead
+         * of tuning again. Buckets whose new sample mostly lies outside the tuned range of theta_b(q) are tuned again
+         * (see setTuningCoverage).
+         */
+        inline void setReuseTuning(bool reuse) {
+            args.reuseTuning = reuse;
+        }
+
+        // minimum fraction of the sample of a bucket that has to lie in the tuned range of theta_b(q) (0: always reuse, no sampling for top-k)
+        inline void setTuningCoverage(double coverage) {
+            args.tuningCoverage = coverage;
+        }
+
+        /*
+         * Choose phi and t_b from the costs the cost model predicts for the sample queries (interval lengths, expected
+         * candidates, bucket size) instead of timing them: deterministic and cheaper. Buckets where the model is
+         * uncertain, i.e., the best plan with lists and LENGTH are predicted within margin of each other, are still
+         * tuned by timing.
+         */
+        inline void setModelTuning(bool modelTuning, double margin = 0.1) {
+            args.modelTuning = modelTuning;
+            args.modelMargin = margin;
+        }
+
+        /*
+         * LEMP_LI, LEMP_LC: keep adjusting t_b and numLists of each bucket during retrieval, from the measured costs
+         * of its queries (a small fraction of the queries explores other parameters). Starts from the tuned
+         * parameters of every tuning.
+         */
+        inline void setOnlineTuning(bool onlineTuning) {
+            args.onlineTuning = onlineTuning;
+        }
+
+        /*
+         * Tuning sample per bucket: between sampleMin and sampleMax queries, grown until the mean cost of the sample
+         * queries is known within the relative error sampleError (0: a fixed rate of the queries). budget: seconds
+         * the tuning may take (0: no budget), the samples are cut to fit. Batches of fewer than 3 * sampleMin
+         * queries are not tuned.
+         */
+        inline void setTuningSample(row_type sampleMin, row_type sampleMax, double sampleError = SAMPLE_ERROR, double budget = 0) {
+            args.sampleMin = std::max<row_type>(1, sampleMin);
+            args.sampleMax = std::max(args.sampleMin, sampleMax);
+            args.sampleError = sampleError;
+            args.tuningBudget = budget;
+        }
+
+        inline void clearTuning() {
+            tuningCache.clear();
+        }
+
+        inline void saveTuning(const std::string& fileName) const {
+            tuningCache.save(fileName);
+            std::cout << "[INFO] Tuning parameters of " << tuningCache.size() << " bucket(s) written to " << fileName << std::endl;
+        }
+
+        // loads tuned parameters of an earlier process (same probe matrix and method) and turns reuse on
+        inline bool loadTuning(const std::string& fileName) {
+            if (!tuningCache.load(fileName))
+                return false;
+            args.reuseTuning = true;
+            std::cout << "[INFO] Tuning parameters of " << tuningCache.size() << " bucket(s) read from " << fileName << std::endl;
+            return true;
+        }
+
+        /*
+         * Items the results must not contain: a global allowlist or denylist and lists per query id (for queryBatch
+         * the id of a query is its position in the batch). The retrievers skip excluded items before computing the
+         * inner product, so top-k lists contain k allowed items. Tuning ignores the filter. nullptr: no filter.
+         */
+        inline void setItemFilter(const ItemFilter* filter) {
+            itemFilter = filter;
+            resultCache.clear();
+        }
+
+        inline void setPinThreads(bool pinThreads) {
+            args.pinThreads = pinThreads;
+            pool.init(args.threads, pinThreads);
         }
 
         inline Lemp(InputArguments& in, int cacheSizeinKB, LEMP_Method method, bool isTARR, double R, double epsilon) :
-        maxProbeBucketSize(0) {
+        maxProbeBucketSize(0), acrossBuckets(false), onlineCapacity(0), prepared(false), keepAllBuckets(false),
+        sortedRows(0), deletedRows(0), nextId(0), hasDelta(false), itemFilter(nullptr) {
             args.copyInputArguments(in);
             args.cacheSizeinKB = cacheSizeinKB;
             args.method = method;
             args.isTARR = isTARR;
             args.R = R;
             args.epsilon = epsilon;
+            tuningCache.setMethod(method);
 
             logging.open(args.logFile.c_str(), std::ios_base::app);
 
@@ -74,7 +320,7 @@ namespace mips {
                 std::cout << "[INFO] Logging in " << args.logFile << std::endl;
             }
 
-            omp_set_num_threads(args.threads);
+            pool.init(args.threads);
             retrArg.resize(args.threads);
         }
 
@@ -85,22 +331,50 @@ namespace mips {
         inline void initialize(VectorMatrix& rightMatrix) {
             std::cout << "[INIT] ProbeMatrix contains " << rightMatrix.rowNum << " vectors with dimensionality " << (0 + rightMatrix.colNum) << std::endl;
             timer.start();
+            pool.start();
             maxProbeBucketSize = initProbeBuckets(rightMatrix);
             timer.stop();
             dataPreprocessingTimeRight += timer.elapsedTime().nanos();
+
+            sortedRows = probeMatrix.rowNum;
+            deletedRows = 0;
+            nextId = rightMatrix.rowNum;
+            hasDelta = false;
+            positions.clear();
         }
 
         inline void runAboveTheta(VectorMatrix& leftMatrix, Results& results) {
+            if (!queryTheta.empty()) {
+                std::vector<double> thetas;
+                thetas.swap(queryTheta);
+
+                if (thetas.size() != leftMatrix.rowNum) {
+                    std::cout << "[WARNING] " << thetas.size() << " per-query thetas for " << leftMatrix.rowNum << " queries. Ignoring them" << std::endl;
+                } else {
+                    VectorMatrix scaledMatrix;
+                    scaledMatrix.initializeBasics(leftMatrix.colNum, leftMatrix.rowNum, false);
+                    for (row_type i = 0; i < leftMatrix.rowNum; ++i) {
+                        scaleAndCopy(scaledMatrix.getMatrixRowPtr(i), leftMatrix.getMatrixRowPtr(i), args.theta / thetas[i], leftMatrix.colNum);
+                        scaledMatrix.setLengthInData(i, 1);
+                    }
+
+                    runAboveTheta(scaledMatrix, results);
+                    for (auto& threadResults : results.resultsVector) {
+                        rescaleResults(threadResults, thetas);
+                    }
+                    return;
+                }
+            }
+
             printAlgoName(leftMatrix);
+            prepared = false; // the retrievers are rebuilt for this query matrix
 
             timer.start();
             //            std::vector<RetrievalArguments> retrArg; //one argument for each thread
             initQueryBatches(leftMatrix, maxProbeBucketSize, retrArg);
             initializeRetrievers();
             results.resultsVector.resize(args.threads);
-
-            for (auto& argument : retrArg)
-                argument.init(maxProbeBucketSize);
+            initRetrievalArguments();
 
             timer.stop();
             dataPreprocessingTimeLeft += timer.elapsedTime().nanos();
@@ -117,39 +391,25 @@ namespace mips {
             logging << "theta(" << args.theta << ")\t";
 
             timer.start();
-            col_type maxLists = 1;
-
-
-            switch (args.method) {
-                case LEMP_I:
-                case LEMP_LI:
-                case LEMP_C:
-                case LEMP_LC:
-
-                    std::for_each(probeBuckets.begin(), probeBuckets.begin() + activeBuckets, [&maxLists](const ProbeBucket & b) {
-                        if (maxLists < b.numLists) maxLists = b.numLists;
-                    });
-
-                    for (auto& argument : retrArg)
-                        argument.setIntervals(maxLists);
-
+            initIntervals();
 
-                    break;
-            }
-
-            for (auto& argument : retrArg)
+            for (auto& argument : retrArg) {
                 argument.clear();
+                argument.setItemFilter(itemFilter);
+            }
 
 
             comp_type comparisons = 0;
 
 
-#pragma omp parallel reduction(+ : comparisons)
+#pragma omp parallel num_threads(retrArg.size()) reduction(+ : comparisons)
             {
                 row_type tid = omp_get_thread_num();
 
                 for (row_type b = 0; b < activeBuckets; ++b) {
+                    maskQueries(probeBuckets[b], retrArg[tid]);
                     probeBuckets[b].ptrRetriever->run(probeBuckets[b], &retrArg[tid]);
+                    unmaskQueries(retrArg[tid]);
                 }
                 comparisons += retrArg[tid].comparisons;
                 results.moveAppend(retrArg[tid].results, tid);
@@ -164,22 +424,64 @@ namespace mips {
 
             std::cout << "[RETRIEVAL] ... and is finished with " << totalSize << " results" << std::endl;
             logging << totalSize << "\t";
+            printIndexWaitTimes();
+            printOnlineTuning();
+
+        }
+
+        /*
+         * Above-theta for several thresholds (sorted increasingly) in a single pass: the retrieval (bucket skipping,
+         * tuning, intervals) runs with the smallest threshold and each result goes to the tier of the highest
+         * threshold it passes. results[i] receives the results with thetas[i] <= score < thetas[i+1]; the results
+         * of thetas[i] are the union of the tiers i, i+1, ...
+         */
+        inline void runAboveThetaMulti(VectorMatrix& leftMatrix, const std::vector<double>& thetas, std::vector<Results>& results) {
+            if (thetas.empty() || !std::is_sorted(thetas.begin(), thetas.end())) {
+                std::cerr << "[ERROR] runAboveThetaMulti needs a non-empty, increasingly sorted list of thresholds!" << std::endl;
+                exit(1);
+            }
+
+            double oldTheta = args.theta;
+            args.theta = thetas.front();
+
+            Results all;
+            runAboveTheta(leftMatrix, all);
+            args.theta = oldTheta;
+
+            timer.start();
+            row_type streams = all.resultsVector.size();
+            results.resize(thetas.size());
+            for (auto& tier : results) {
+                tier.clearAll();
+                tier.resultsVector.resize(streams);
+            }
+
+#pragma omp parallel for schedule(static,1) num_threads(pool.size())
+            for (row_type t = 0; t < streams; ++t) {
+                for (auto& item : all.resultsVector[t]) {
+                    row_type tier = std::upper_bound(thetas.begin(), thetas.end(), item.result) - thetas.begin();
+                    results[tier > 0 ? tier - 1 : 0].resultsVector[t].push_back(item);
+                }
+                std::vector<MatItem>().swap(all.resultsVector[t]);
+            }
+            timer.stop();
+            retrievalTime += timer.elapsedTime().nanos();
 
+            for (row_type i = 0; i < thetas.size(); ++i) {
+                std::cout << "[RETRIEVAL] Tier theta >= " << thetas[i] << ": " << results[i].getResultSize() << " results" << std::endl;
+            }
         }
 
         inline void runTopK(VectorMatrix& leftMatrix, Results& results) {
             printAlgoName(leftMatrix);
+            prepared = false; // the retrievers are rebuilt for this query matrix
 
             // initialize Retrievers
             timer.start();
             initQueryBatches(leftMatrix, maxProbeBucketSize, retrArg);
             initializeRetrievers();
-            for (auto& argument : retrArg) {
-                argument.init(maxProbeBucketSize);
-                if (args.k > 0) {
-                    argument.allocTopkResults();
-                }
-            }
+            initRetrievalArguments();
+            initTopkSizes(leftMatrix.rowNum);
 
             results.resultsVector.resize(args.threads);
             timer.stop();
@@ -191,57 +493,37 @@ namespace mips {
             logging << "k(" << args.k << ")\t";
 
             timer.start();
-            col_type maxLists = 1;
+            initIntervals();
 
-            switch (args.method) {
-                case LEMP_I:
-                case LEMP_LI:
-                case LEMP_C:
-                case LEMP_LC:
-
-                    std::for_each(probeBuckets.begin(), probeBuckets.begin() + activeBuckets, [&maxLists](const ProbeBucket & b) {
-                        if (maxLists < b.numLists) maxLists = b.numLists;
-                    });
+            for (auto& argument : retrArg) {
+                argument.clear();
+                argument.setItemFilter(itemFilter);
+                argument.sharedMinScore = &sharedMinScore;
+            }
 
-                    for (auto& argument : retrArg)
-                        argument.setIntervals(maxLists);
+            // L2AP and BLSH build their indexes lazily with a threshold that has to be safe for the queries of all threads
+            bool shareMinScores = (args.method == LEMP_AP || args.method == LEMP_BLSH);
+            sharedMinScore.init(retrArg.size());
 
-                    break;
+            if (seedBounds.size() != leftMatrix.rowNum) {
+                seedBounds.clear();
             }
-            for (auto& argument : retrArg)
-                argument.clear();
 
+            if (acrossBuckets) {
+                topkBounds.init(leftMatrix.rowNum);
+                for (row_type q = 0; q < seedBounds.size(); ++q) {
+                    topkBounds.raise(q, seedBounds[retrArg[0].queryMatrix->getId(q)]);
+                }
+            }
 
             comp_type comparisons = 0;
-            double worstMinScore = std::numeric_limits<double>::max();
             double totalError = 0;
 
-#pragma omp parallel reduction(+ : comparisons, totalError)
+#pragma omp parallel num_threads(retrArg.size()) reduction(+ : comparisons, totalError)
             {
                 row_type tid = omp_get_thread_num();
 
-
-                for (row_type b = 0; b < probeBuckets.size(); ++b) {//
-
-                    probeBuckets[b].ptrRetriever->runTopK(probeBuckets[b], &retrArg[tid]);
-
-                    if (args.method == LEMP_AP || args.method == LEMP_BLSH) { // synchronize the worstMinScore      
-
-                        // obviously you should avoid using these guys in a parallel setting
-#pragma omp critical
-                        {
-                            if (worstMinScore > retrArg[tid].worstMinScore) {
-                                worstMinScore = retrArg[tid].worstMinScore;
-                            }
-                        }
-#pragma omp barrier
-                        retrArg[tid].worstMinScore = worstMinScore;
-#pragma omp barrier
-                        worstMinScore = std::numeric_limits<double>::max();
-
-                    }
-                }
-                retrArg[tid].extendIncompleteResultItems();
+                runTopKForThread(tid, shareMinScores);
                 results.moveAppend(retrArg[tid].results, tid);
                 comparisons += retrArg[tid].comparisons;
                 totalError += retrArg[tid].totalErrorAfterResults;
@@ -252,19 +534,209 @@ namespace mips {
             retrievalTime += timer.elapsedTime().nanos();
             totalComparisons += comparisons;
             std::cout << "[RETRIEVAL] ... and is finished with " << results.getResultSize() << " results" << std::endl;
+            printIndexWaitTimes();
+            printOnlineTuning();
+            seedBounds.clear();
+            queryK.clear();
 
 //             std::cout << "TOTAL ERROR: " << totalError / leftMatrix.rowNum << " countABOVE: " << countABOVE << std::endl;
             logging << totalError / leftMatrix.rowNum << "\t" << results.getResultSize() << "\t";
 
         }
 
+        /*
+         * Online retrieval: prepare tunes the engine once (for the k or theta that is set) with a sample of the
+         * expected queries and builds the indexes of all probe buckets. Afterwards, query and queryBatch answer
+         * queries without re-initialization, tuning or logging and reuse the scratch space of the threads.
+         * Calls must not overlap. A call to runTopK or runAboveTheta invalidates the preparation.
+         */
+        inline void prepare(VectorMatrix& sampleQueries) {
+            if (args.method == LEMP_AP || (args.method == LEMP_BLSH && args.k == 0)) {
+                std::cerr << "[ERROR] The indexes of this method depend on the query matrix. Use runTopK or runAboveTheta instead!" << std::endl;
+                exit(1);
+            }
+
+            printAlgoName(sampleQueries);
+            resultCache.clear();
+            std::cout << "[ONLINE] Preparing with a sample of " << sampleQueries.rowNum << " queries" << std::endl;
+
+            if (&sampleQueries != &tuningSample) {
+                std::vector<row_type> ids(sampleQueries.rowNum);
+                std::iota(ids.begin(), ids.end(), 0);
+                tuningSample.addVectors(sampleQueries, ids);
+            }
+
+            timer.start();
+            keepAllBuckets = true;
+            initQueryBatches(sampleQueries, maxProbeBucketSize, retrArg);
+            initializeRetrievers();
+            keepAllBuckets = false;
+            initRetrievalArguments();
+            timer.stop();
+            dataPreprocessingTimeLeft += timer.elapsedTime().nanos();
+
+            if (args.k == 0) {
+                timer.start();
+                initListsInBuckets();
+                timer.stop();
+                dataPreprocessingTimeRight += timer.elapsedTime().nanos();
+            }
+
+            tune(retrArg, sampleQueries.rowNum);
+
+            timer.start();
+            if (args.k > 0) { // build all indexes now instead of during the first queries
+                activeBuckets = probeBuckets.size();
+                initListsInBuckets();
+            }
+
+            // a small sample may have left threads without queries. Online calls use all threads
+            if (retrArg.size() < args.threads) {
+                row_type oldSize = retrArg.size();
+                retrArg.resize(args.threads);
+                for (row_type t = oldSize; t < retrArg.size(); ++t) {
+                    retrArg[t].initializeBasics(queryMatrices[0], probeMatrix, args.method, args.theta, args.k, args.threads, args.R, args.epsilon, args.numTrees, args.search_k, true, args.isTARR, args.ef);
+                }
+                initRetrievalArguments();
+            }
+            initIntervals();
+            timer.stop();
+            dataPreprocessingTimeRight += timer.elapsedTime().nanos();
+
+            prepared = true;
+            std::cout << "[ONLINE] Ready" << std::endl;
+        }
+
+        inline void query(const double* query, std::vector<MatItem>& out) {
+            queryBatch(query, 1, out);
+        }
+
+        /*
+         * queries: n vectors, one after the other (row-major). out receives (score, position of the query in queries,
+         * probe id) for each result
+         */
+        inline void queryBatch(const double* queries, row_type n, std::vector<MatItem>& out) {
+            if (!prepared) {
+                std::cerr << "[ERROR] Call prepare before query or queryBatch!" << std::endl;
+                exit(1);
+            }
+
+            // per-query k, theta, bounds and filters belong to positions in the batch, not to query vectors
+            bool perQuery = !queryK.empty() || !queryTheta.empty() || !seedBounds.empty() ||
+                    (itemFilter != nullptr && itemFilter->hasQueryFilters());
+
+            if ((resultCache.enabled() || args.dedupQueries) && !perQuery) {
+                queryBatchWithCache(queries, n, out);
+            } else {
+                runQueryBatch(queries, n, out);
+            }
+        }
+
+        /*
+         * Keep the results of the last capacity online queries and answer repeated queries from them (exact match of
+         * the coordinates). With directionLevels > 0 and top-k, a query whose direction quantized to directionLevels
+         * steps per coordinate matches a cached one gets its results, with scores scaled by the ratio of the
+         * lengths (approximate). Probe updates, a new filter, theta or method and prepare empty the cache.
+         */
+        inline void setQueryCache(row_type capacity, int directionLevels = 0) {
+            resultCache.init(capacity, directionLevels);
+        }
+
+        inline const QueryCache& getQueryCache() const {
+            return resultCache;
+        }
+
+        // online: identical queries of one batch are retrieved once
+        inline void setDeduplicateQueries(bool dedup) {
+            args.dedupQueries = dedup;
+        }
+
+        /*
+         * Incremental updates of the probe vectors (not normalized, colNum coordinates each). New vectors get the ids
+         * after the ones of the initial probe matrix and are kept, sorted by length, in a delta bucket that is
+         * scanned right after the first bucket. Deleted vectors become tombstones that all retrievers skip.
+         * Once the new and deleted vectors exceed the rebalance fraction, the probe matrix is merged and rebucketized
+         * (and retuned, if prepared). Updates must not overlap with queries.
+         */
+        inline void insertProbeVectors(const double* vectors, row_type n, std::vector<row_type>& ids) {
+            initPositions();
+            resultCache.clear();
+            ids.resize(n);
+
+            for (row_type i = 0; i < n; ++i) {
+                ids[i] = nextId++;
+                positions.push_back(NO_POSITION);
+                insertIntoDelta(vectors + (size_t) i * probeMatrix.colNum, ids[i]);
+            }
+            refreshDeltaBucket(n > 0);
+            rebalanceIfNeeded();
+        }
+
+        inline row_type insertProbeVector(const double* vector) {
+            std::vector<row_type> ids;
+            insertProbeVectors(vector, 1, ids);
+            return ids[0];
+        }
+
+        // returns false if there is no probe vector with this id
+        inline bool deleteProbeVector(row_type id) {
+            bool found = markDeleted(id);
+            if (found)
+                resultCache.clear();
+            rebalanceIfNeeded();
+            return found;
+        }
+
+        // replaces the probe vector with this id. Returns false if there is no probe vector with this id
+        inline bool updateProbeVector(row_type id, const double* vector) {
+            if (!markDeleted(id))
+                return false;
+
+            resultCache.clear();
+            insertIntoDelta(vector, id);
+            refreshDeltaBucket(true);
+            rebalanceIfNeeded();
+            return true;
+        }
+
+        /*
+         * Drops the tombstones, merges the delta bucket into the sorted probe vectors and rebucketizes them.
+         * A prepared engine is prepared again with its sample
+         */
+        inline void rebalance() {
+            if (sortedRows == probeMatrix.rowNum && deletedRows == 0)
+                return;
+
+            std::cout << "[UPDATE] Rebalancing " << sortedRows << " vectors with " << (probeMatrix.rowNum - sortedRows) << " new and "
+                    << deletedRows << " deleted ones" << std::endl;
+
+            timer.start();
+            probeMatrix.compactAndMerge(sortedRows);
+            maxProbeBucketSize = bucketizeProbeMatrix();
+            timer.stop();
+            dataPreprocessingTimeRight += timer.elapsedTime().nanos();
+
+            sortedRows = probeMatrix.rowNum;
+            deletedRows = 0;
+            hasDelta = false;
+            positions.clear();
+
+            if (prepared) {
+                prepared = false;
+                prepare(tuningSample);
+            }
+        }
 
     };
 
     inline row_type Lemp::initProbeBuckets(VectorMatrix& rightMatrix) {
-        std::vector<row_type> probeBucketOffsets;
+        probeMatrix.init(rightMatrix, true, false, args.threads); // normalize and sort
+        return bucketizeProbeMatrix();
+    }
 
-        probeMatrix.init(rightMatrix, true, false); // normalize and sort
+    // probeMatrix is normalized and sorted by length
+    inline row_type Lemp::bucketizeProbeMatrix() {
+        std::vector<row_type> probeBucketOffsets;
 
         row_type maxBlockSize = computeBlockOffsetsByFactorCacheFittingForItems(probeMatrix.lengthInfo,
                 probeMatrix.rowNum, probeBucketOffsets, FACTOR, ITEMS_PER_BLOCK, args.cacheSizeinKB, probeMatrix.colNum, args);
@@ -290,6 +762,9 @@ namespace mips {
                         if (maxUserLength < m.lengthInfo[0].data) maxUserLength = m.lengthInfo[0].data;
                     });
 
+            if (keepAllBuckets) // future queries can be longer than the current ones
+                maxUserLength = std::numeric_limits<double>::max();
+
 
 
             for (row_type i = 0; i < probeBuckets.size(); ++i) {
@@ -316,105 +791,127 @@ namespace mips {
 
         }
 
-        switch (args.method) {
+#pragma omp parallel for schedule(static,1) num_threads(pool.size())
+        for (row_type b = b0; b < activeBuckets; ++b) {
+            initializeRetriever(b);
+        }
+    }
+
+    // the retriever of the method for bucket b (LEMP_AUTO: LENGTH until tuning has chosen). Its indexes are created, but built later
+    inline void Lemp::initializeRetriever(row_type b) {
+        setRetriever(probeBuckets[b], (args.method == LEMP_AUTO ? LEMP_L : args.method));
+    }
+
+    inline void Lemp::setRetriever(ProbeBucket& bucket, LEMP_Method method) {
+        bucket.method = method;
+
+        switch (method) {
             case LEMP_LI:
-#pragma omp parallel for schedule(static,1)
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    retriever_ptr rPtr(new LX_Retriever<IncrRetriever>());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                    if (probeBuckets[b].ptrIndexes[SL] == 0) {
-                        probeBuckets[b].ptrIndexes[SL] = new QueueElementLists();
-                    }
-                }
+                bucket.ptrRetriever = retriever_ptr(new LX_Retriever<IncrRetriever>());
+                if (bucket.ptrIndexes[SL] == 0)
+                    bucket.ptrIndexes[SL] = new QueueElementLists();
                 break;
 
             case LEMP_I:
-#pragma omp parallel for schedule(static,1)
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    retriever_ptr rPtr(new IncrRetriever());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                    if (probeBuckets[b].ptrIndexes[SL] == 0)
-                        probeBuckets[b].ptrIndexes[SL] = new QueueElementLists();
-                }
+                bucket.ptrRetriever = retriever_ptr(new IncrRetriever());
+                if (bucket.ptrIndexes[SL] == 0)
+                    bucket.ptrIndexes[SL] = new QueueElementLists();
                 break;
 
             case LEMP_LC:
-#pragma omp parallel for schedule(static,1)
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    retriever_ptr rPtr(new LX_Retriever<CoordRetriever>());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                    if (probeBuckets[b].ptrIndexes[INT_SL] == 0)
-                        probeBuckets[b].ptrIndexes[INT_SL] = new IntLists();
-                }
+                bucket.ptrRetriever = retriever_ptr(new LX_Retriever<CoordRetriever>());
+                if (bucket.ptrIndexes[INT_SL] == 0)
+                    bucket.ptrIndexes[INT_SL] = new IntLists();
                 break;
 
             case LEMP_C:
-#pragma omp parallel for schedule(static,1)
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    retriever_ptr rPtr(new CoordRetriever());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                    if (probeBuckets[b].ptrIndexes[INT_SL] == 0)
-                        probeBuckets[b].ptrIndexes[INT_SL] = new IntLists();
-                }
+                bucket.ptrRetriever = retriever_ptr(new CoordRetriever());
+                if (bucket.ptrIndexes[INT_SL] == 0)
+                    bucket.ptrIndexes[INT_SL] = new IntLists();
                 break;
 
             case LEMP_TA:
-#pragma omp parallel for schedule(static,1)
-                for (row_type b = b0; b < activeBuckets; ++b) {
-
-                    retriever_ptr rPtr(new taRetriever());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                    if (probeBuckets[b].ptrIndexes[SL] == 0)
-                        probeBuckets[b].ptrIndexes[SL] = new QueueElementLists();
-                }
+                bucket.ptrRetriever = retriever_ptr(new taRetriever());
+                if (bucket.ptrIndexes[SL] == 0)
+                    bucket.ptrIndexes[SL] = new QueueElementLists();
                 break;
 
             case LEMP_L:
-#pragma omp parallel for schedule(static,1)
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    retriever_ptr rPtr(new LengthRetriever());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                }
+                bucket.ptrRetriever = retriever_ptr(new LengthRetriever());
                 break;
 
             case LEMP_TREE:
-#pragma omp parallel for schedule(static,1) 
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    retriever_ptr rPtr(new SingleTree());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                    if (probeBuckets[b].ptrIndexes[TREE] == 0)
-                        probeBuckets[b].ptrIndexes[TREE] = new TreeIndex();
-                }
+                bucket.ptrRetriever = retriever_ptr(new SingleTree(args.dualTree));
+                if (bucket.ptrIndexes[TREE] == 0)
+                    bucket.ptrIndexes[TREE] = new TreeIndex(args.bulkTree);
                 break;
 
             case LEMP_AP:
-#pragma omp parallel for schedule(static,1)
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    retriever_ptr rPtr(new apRetriever());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                    if (probeBuckets[b].ptrIndexes[AP] == 0)
-                        probeBuckets[b].ptrIndexes[AP] = new L2apIndex();
-                }
+                bucket.ptrRetriever = retriever_ptr(new apRetriever());
+                if (bucket.ptrIndexes[AP] == 0)
+                    bucket.ptrIndexes[AP] = new L2apIndex();
                 break;
 
             case LEMP_LSH:
-#pragma omp parallel for schedule(static,1)
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    retriever_ptr rPtr(new LshRetriever());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                    if (probeBuckets[b].ptrIndexes[LSH] == 0)
-                        probeBuckets[b].ptrIndexes[LSH] = new LshIndex();
-                }
+                bucket.ptrRetriever = retriever_ptr(new LshRetriever());
+                if (bucket.ptrIndexes[LSH] == 0)
+                    bucket.ptrIndexes[LSH] = new LshIndex();
                 break;
 
             case LEMP_BLSH:
-#pragma omp parallel for schedule(static,1)
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    retriever_ptr rPtr(new BlshRetriever());
-                    probeBuckets[b].ptrRetriever = rPtr;
-                    if (probeBuckets[b].ptrIndexes[BLSH] == 0)
-                        probeBuckets[b].ptrIndexes[BLSH] = new BlshIndex();
-                }
+                bucket.ptrRetriever = retriever_ptr(new BlshRetriever());
+                if (bucket.ptrIndexes[BLSH] == 0)
+                    bucket.ptrIndexes[BLSH] = new BlshIndex();
+                break;
+
+            case LEMP_ANNOY:
+                bucket.ptrRetriever = retriever_ptr(new AnnoyRetriever());
+                if (bucket.ptrIndexes[ANNOY] == 0)
+                    bucket.ptrIndexes[ANNOY] = new AnnoyIndex(args.numTrees);
+                break;
+
+            case LEMP_HNSW:
+                bucket.ptrRetriever = retriever_ptr(new HnswRetriever());
+                if (bucket.ptrIndexes[HNSW] == 0)
+                    bucket.ptrIndexes[HNSW] = new HnswIndex();
+                break;
+
+            case LEMP_PQ:
+                bucket.ptrRetriever = retriever_ptr(new PqRetriever(args.pqExact));
+                if (bucket.ptrIndexes[PQ] == 0)
+                    bucket.ptrIndexes[PQ] = new PqIndex(args.pqSubspaces);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    // builds the index of the method of the bucket, unless it is built already (for LEMP_AUTO, whose buckets differ)
+    inline void Lemp::buildIndex(ProbeBucket& bucket, int threads) {
+        switch (bucket.method) {
+            case LEMP_LI:
+            case LEMP_I:
+            case LEMP_TA:
+                static_cast<QueueElementLists*> (bucket.ptrIndexes[SL])->initializeLists(probeMatrix, bucket.startPos, bucket.endPos);
+                break;
+            case LEMP_LC:
+            case LEMP_C:
+                static_cast<IntLists*> (bucket.ptrIndexes[INT_SL])->initializeLists(probeMatrix, bucket.startPos, bucket.endPos);
+                break;
+            case LEMP_TREE:
+                static_cast<TreeIndex*> (bucket.ptrIndexes[TREE])->initializeTree(probeMatrix, threads, bucket.startPos, bucket.endPos);
+                break;
+            case LEMP_ANNOY:
+                static_cast<AnnoyIndex*> (bucket.ptrIndexes[ANNOY])->initializeForest(probeMatrix, threads, bucket.startPos, bucket.endPos);
+                break;
+            case LEMP_HNSW:
+                static_cast<HnswIndex*> (bucket.ptrIndexes[HNSW])->initializeGraph(probeMatrix, threads, bucket.startPos, bucket.endPos);
+                break;
+            case LEMP_PQ:
+                static_cast<PqIndex*> (bucket.ptrIndexes[PQ])->initializeCodes(probeMatrix, threads, bucket.startPos, bucket.endPos);
+                break;
+            default:
                 break;
         }
     }
@@ -427,13 +924,18 @@ namespace mips {
         row_type nCount = 0;
         row_type myNumThreads = args.threads;
 
-        if (leftMatrix.rowNum < args.threads) {
+        // few top-k queries: instead of leaving threads idle, all threads answer all queries, each one in different probe buckets
+        acrossBuckets = (args.k > 0 && args.intraQuery && leftMatrix.rowNum < args.threads && leftMatrix.rowNum > 0);
+
+        if (acrossBuckets) {
+            std::cout << "[INFO] Query matrix contains few elements. The " << myNumThreads << " thread(s) will split the probe buckets" << std::endl;
+        } else if (leftMatrix.rowNum < args.threads) {
             myNumThreads = leftMatrix.rowNum;
             std::cout << "[WARNING] Query matrix contains too few elements. Suboptimal running with " << myNumThreads << " thread(s)" << std::endl;
         }
-        omp_set_num_threads(myNumThreads);
-        queryMatrices.resize(myNumThreads);
-        retrArg.resize(myNumThreads);
+        pool.start();
+        queryMatrices.resize(acrossBuckets ? 1 : myNumThreads);
+        retrArg.resize(myNumThreads); // no reallocation as long as the number of threads stays the same
 
         if (args.k > 0) { // this is a top-k version
             initializeMatrices(leftMatrix, queryMatrices, false, true, args.epsilon); // normalize but don't sort
@@ -441,15 +943,16 @@ namespace mips {
             initializeMatrices(leftMatrix, queryMatrices, true, false); // normalize and sort
         }
 
-#pragma omp parallel reduction(+ : nCount)
+#pragma omp parallel num_threads(myNumThreads) reduction(+ : nCount)
         {
 
             row_type tid = omp_get_thread_num();
+            VectorMatrix& queryMatrix = queryMatrices[acrossBuckets ? 0 : tid];
             std::vector<row_type> blockOffsets;
-            computeBlockOffsetsForUsersFixed(queryMatrices[tid].rowNum, blockOffsets, args.cacheSizeinKB, queryMatrices[tid].colNum, args, maxBlockSize);
-            bucketize(retrArg[tid].queryBatches, queryMatrices[tid], blockOffsets, args);
+            computeBlockOffsetsForUsersFixed(queryMatrix.rowNum, blockOffsets, args.cacheSizeinKB, queryMatrix.colNum, args, maxBlockSize);
+            bucketize(retrArg[tid].queryBatches, queryMatrix, blockOffsets, args);
             nCount += retrArg[tid].queryBatches.size();
-            retrArg[tid].initializeBasics(queryMatrices[tid], probeMatrix, args.method, args.theta, args.k, myNumThreads, args.R, args.epsilon, args.numTrees, args.search_k, true, args.isTARR);
+            retrArg[tid].initializeBasics(queryMatrix, probeMatrix, args.method, args.theta, args.k, myNumThreads, args.R, args.epsilon, args.numTrees, args.search_k, true, args.isTARR, args.ef);
 
         }
 
@@ -482,39 +985,317 @@ namespace mips {
 
     }
 
-    inline void Lemp::initListsInBuckets() {
+    /*
+     * Bucket bounds: inactivates (for this bucket only) the queries whose direction cannot reach their local threshold
+     * theta_b(q) in the bucket, so that the retrievers skip them. unmaskQueries undoes it after the bucket
+     */
+    inline void Lemp::maskQueries(const ProbeBucket& bucket, RetrievalArguments& arg) const {
+        arg.maskedQueries.clear();
 
-        double maxQueryLength = 0;
-        // in the case of topk the tuning part has modified the activeBuckets
-        row_type b0 = (args.k == 0 ? 0 : 1);
+        if (!bucket.hasDirectionBounds())
+            return;
 
-        std::cout << "[RETRIEVAL] ProbeBuckets (active) = " << activeBuckets << std::endl;
+        for (row_type b = 0; b < arg.queryBatches.size(); ++b) {
+            QueryBatch& queryBatch = arg.queryBatches[b];
 
-        double worstCaseTheta;
+            if (args.k > 0) {
+                if (queryBatch.isWorkDone())
+                    continue;
+            } else if (queryBatch.maxLength() < bucket.bucketScanThreshold) {
+                break;
+            }
 
-        switch (args.method) {
-            case LEMP_LI:
-            case LEMP_I:
-            case LEMP_TA:
-#pragma omp parallel for schedule(dynamic,1) 
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    static_cast<QueueElementLists*> (probeBuckets[b].ptrIndexes[SL])->initializeLists(probeMatrix, probeBuckets[b].startPos, probeBuckets[b].endPos);
+            for (row_type i = queryBatch.startPos; i < queryBatch.endPos; ++i) {
+                if (queryBatch.isQueryInactive(i))
+                    continue;
+
+                const double* query = arg.queryMatrix->getMatrixRowPtr(i);
+                double localTheta;
+
+                if (args.k > 0) {
+                    double minScore = arg.topkResults[arg.topkOffset(i)].data;
+                    if (bucket.normL2.second < minScore) // the retriever inactivates it for all remaining buckets
+                        continue;
+                    localTheta = minScore * (minScore > 0 ? bucket.invNormL2.second : bucket.invNormL2.first);
+                } else {
+                    if (query[-1] < bucket.bucketScanThreshold) // the remaining queries do not scan the bucket anyway
+                        break;
+                    localTheta = bucket.bucketScanThreshold / query[-1];
                 }
-                break;
 
-            case LEMP_LC:
+                if (bucket.maxCosine(query) + 1e-9 < localTheta) { // slack for the rounding of the bounds
+                    queryBatch.inactivateQuery(i);
+                    arg.maskedQueries.emplace_back(b, i);
+                }
+            }
+        }
+    }
+
+    inline void Lemp::unmaskQueries(RetrievalArguments& arg) const {
+        for (const auto& masked : arg.maskedQueries) {
+            arg.queryBatches[masked.first].reactivateQuery(masked.second);
+        }
+        arg.maskedQueries.clear();
+    }
+
+    inline void Lemp::runTopKInBucket(row_type b, row_type tid, bool shareMinScores) {
+
+        maskQueries(probeBuckets[b], retrArg[tid]);
+        probeBuckets[b].ptrRetriever->runTopK(probeBuckets[b], &retrArg[tid]);
+        unmaskQueries(retrArg[tid]);
+
+        if (shareMinScores) { // publish the worstMinScore of this bucket. No need to wait for the other threads
+
+            if (retrArg[tid].worstMinScore < std::numeric_limits<double>::max()) {
+                sharedMinScore.publish(tid, retrArg[tid].worstMinScore);
+            }
+            retrArg[tid].worstMinScore = std::numeric_limits<double>::max();
+        }
+    }
+
+    /*
+     * Intra-query parallelism: every thread keeps its own topk lists for all queries and processes a part of the
+     * probe buckets (in increasing order, so that the early buckets with the long vectors raise the bounds fast).
+     * After each bucket the thread raises the shared bound of each query to its own topk minimum, and before each
+     * bucket it lifts its own lists to the shared bounds. Thus, pruning works as if a single thread saw all buckets.
+     * Must be called by all threads of the team.
+     */
+    inline void Lemp::runTopKAcrossBuckets(row_type tid, bool shareMinScores) {
+        RetrievalArguments& arg = retrArg[tid];
+        row_type queries = arg.queryMatrix->rowNum;
+
+        // the first bucket contains k items. Every thread scans it to start with full topk lists
+        runTopKInBucket(0, tid, shareMinScores);
+        for (row_type q = 0; q < queries; ++q) {
+            topkBounds.raise(q, arg.topkResults[arg.topkOffset(q)].data);
+        }
+#pragma omp barrier
+
+#pragma omp for schedule(dynamic,1)
+        for (row_type b = 1; b < probeBuckets.size(); ++b) {
+
+            for (row_type q = 0; q < queries; ++q) {
+                arg.liftTopk(q, topkBounds.get(q));
+            }
+
+            runTopKInBucket(b, tid, shareMinScores);
+
+            for (row_type q = 0; q < queries; ++q) {
+                topkBounds.raise(q, arg.topkResults[arg.topkOffset(q)].data);
+            }
+        }
+        // implicit barrier: the topk lists of all threads are final
+    }
+
+    // retrieval part of a top-k run. Must be called by all threads of the team
+    inline void Lemp::runTopKForThread(row_type tid, bool shareMinScores) {
+        RetrievalArguments& arg = retrArg[tid];
+
+        if (acrossBuckets) {
+            runTopKAcrossBuckets(tid, shareMinScores);
+            mergeTopkResults(tid);
+            return;
+        }
+
+        for (row_type b = 0; b < probeBuckets.size(); ++b) {//
+
+            runTopKInBucket(b, tid, shareMinScores);
+
+            if (b == 0 && !seedBounds.empty()) {
+                for (auto& queryBatch : arg.queryBatches) {
+                    for (row_type q = queryBatch.startPos; q < queryBatch.endPos; ++q) {
+                        arg.liftTopk(q, seedBounds[arg.queryMatrix->getId(q)]);
+                    }
+                }
+            }
+
+            if (shareMinScores && b == 0) { // the first bucket is tiny (k items). After it, every thread has a valid bound
+#pragma omp barrier
+            }
+        }
+        arg.extendIncompleteResultItems();
+    }
+
+    // copies and normalizes the queries of an online call. The space is kept for the next calls
+    inline void Lemp::copyOnlineQueries(const double* queries, row_type n) {
+        col_type colNum = probeMatrix.colNum;
+
+        if (onlineCapacity < n) {
+            onlineQueries.initializeBasics(colNum, n, true);
+            onlineCapacity = n;
+        }
+        onlineQueries.rowNum = n;
+        onlineQueries.lengthInfo.resize(n);
+
+        for (row_type i = 0; i < n; ++i) {
+            onlineQueries.lengthInfo[i] = QueueElement(calculateLength(queries + (size_t) i * colNum, colNum), i);
+        }
+
+        if (args.k == 0) { // above-theta needs the queries sorted by length
+            std::sort(onlineQueries.lengthInfo.begin(), onlineQueries.lengthInfo.end(), std::greater<QueueElement>());
+        }
+
+#if defined(ABS_APPROX) || defined(HYBRID_APPROX)
+        onlineQueries.epsilonEquivalents.assign(n, args.epsilon);
+#endif
+
+        for (row_type i = 0; i < n; ++i) {
+            double len = onlineQueries.lengthInfo[i].data;
+            double x = 1 / len;
+            scaleAndCopy(onlineQueries.getMatrixRowPtr(i), queries + (size_t) onlineQueries.lengthInfo[i].id * colNum, x, colNum);
+
+            if (args.k > 0) { // top-k ignores the lengths of the queries
+                onlineQueries.lengthInfo[i].data = 1;
+                onlineQueries.setLengthInData(i, 1);
+            } else {
+                onlineQueries.setLengthInData(i, len);
+            }
+#if defined(ABS_APPROX) || defined(HYBRID_APPROX)
+            onlineQueries.epsilonEquivalents[i] *= x;
+#endif
+        }
+    }
+
+    // merges the topk lists of all threads. Thread tid merges the queries tid, tid + threads, ...
+    inline void Lemp::mergeTopkResults(row_type tid) {
+        RetrievalArguments& arg = retrArg[tid];
+        std::vector<QueueElement> candidates;
+        candidates.reserve(arg.k * retrArg.size());
+
+        arg.results.clear();
+
+        for (row_type q = tid; q < arg.queryMatrix->rowNum; q += retrArg.size()) {
+            candidates.clear();
+
+            for (auto& other : retrArg) {
+                auto first = other.topkResults.begin() + other.topkOffset(q);
+                for (auto it = first; it != first + other.topkSize(q); ++it) {
+                    if (it->id != NO_ITEM)
+                        candidates.push_back(*it);
+                }
+            }
+
+            // all threads scanned the first bucket: drop the duplicates
+            std::sort(candidates.begin(), candidates.end(), [](const QueueElement & a, const QueueElement & b) {
+                return a.data > b.data || (a.data == b.data && a.id < b.id);
+            });
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            row_type queryId = arg.queryMatrix->getId(q);
+            row_type k = arg.topkSize(q);
+            for (row_type j = 0; j < k && j < candidates.size(); ++j) {
+                arg.results.push_back(MatItem(candidates[j].data, queryId, candidates[j].id));
+            }
+        }
+    }
+
+    // q * theta / theta_q for each query q (row-major, colNum coordinates each)
+    inline void Lemp::scaleByQueryTheta(const double* queries, row_type n, const std::vector<double>& thetas, std::vector<double>& scaled) const {
+        col_type colNum = probeMatrix.colNum;
+        scaled.resize((size_t) n * colNum);
+
+        for (row_type i = 0; i < n; ++i) {
+            scaleAndCopy(&scaled[(size_t) i * colNum], queries + (size_t) i * colNum, args.theta / thetas[i], colNum);
+        }
+    }
+
+    // undoes the scaling of the queries on the scores. item.i is the position of the query
+    inline void Lemp::rescaleResults(std::vector<MatItem>& items, const std::vector<double>& thetas) const {
+        for (auto& item : items) {
+            item.result *= thetas[item.i] / args.theta;
+        }
+    }
+
+    // per-query k for the topk lists of the threads (after initRetrievalArguments)
+    inline void Lemp::initTopkSizes(row_type n) {
+        if (queryK.empty())
+            return;
+
+        if (queryK.size() != n) {
+            std::cout << "[WARNING] " << queryK.size() << " per-query k for " << n << " queries. Using k = " << args.k << " for all" << std::endl;
+            queryK.clear();
+            return;
+        }
+
+#pragma omp parallel num_threads(retrArg.size())
+        {
+            row_type tid = omp_get_thread_num();
+            retrArg[tid].setTopkSizes(queryK);
+            retrArg[tid].allocTopkResults();
+        }
+    }
+
+    // the scratch space of each thread is allocated (and first touched) by the thread itself
+    inline void Lemp::initRetrievalArguments() {
+
+#pragma omp parallel num_threads(retrArg.size())
+        {
+            row_type tid = omp_get_thread_num();
+
+            retrArg[tid].init(maxProbeBucketSize);
+            retrArg[tid].setItemFilter(nullptr); // the tuning samples are not filtered
+            if (args.k > 0) {
+                retrArg[tid].topkOffsets.clear();
+                retrArg[tid].allocTopkResults();
+            }
+        }
+    }
+
+    // the tuned number of lists of the buckets determines the scratch space for the intervals (ICOORD, COORD)
+    inline void Lemp::initIntervals() {
+        col_type maxLists = 1;
+
+        switch (args.method) {
+            case LEMP_I:
+            case LEMP_LI:
+            case LEMP_C:
+            case LEMP_LC:
+            case LEMP_AUTO:
+
+                std::for_each(probeBuckets.begin(), probeBuckets.begin() + activeBuckets, [&maxLists](const ProbeBucket & b) {
+                    if (maxLists < b.numLists) maxLists = b.numLists;
+                });
+
+                if (args.onlineTuning) // numLists may change during retrieval
+                    maxLists = std::min<col_type>(NUM_LISTS, probeMatrix.colNum);
+
+                for (auto& argument : retrArg)
+                    argument.setIntervals(maxLists);
+
+                break;
+        }
+    }
+
+    inline void Lemp::initListsInBuckets() {
+
+        double maxQueryLength = 0;
+        // in the case of topk the tuning part has modified the activeBuckets
+        row_type b0 = (args.k == 0 ? 0 : 1);
+
+        std::cout << "[RETRIEVAL] ProbeBuckets (active) = " << activeBuckets << std::endl;
+
+        double worstCaseTheta;
+
+        switch (args.method) {
+            case LEMP_LI:
+            case LEMP_I:
+            case LEMP_TA:
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
+                for (row_type b = b0; b < activeBuckets; ++b) {
+                    static_cast<QueueElementLists*> (probeBuckets[b].ptrIndexes[SL])->initializeLists(probeMatrix, probeBuckets[b].startPos, probeBuckets[b].endPos);
+                }
+                break;
+
+            case LEMP_LC:
             case LEMP_C:
-#pragma omp parallel for schedule(dynamic,1) 
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
                 for (row_type b = b0; b < activeBuckets; ++b) {
                     static_cast<IntLists*> (probeBuckets[b].ptrIndexes[INT_SL])->initializeLists(probeMatrix, probeBuckets[b].startPos, probeBuckets[b].endPos);
                 }
                 break;
 
             case LEMP_TREE:
-#pragma omp parallel for schedule(dynamic,1) 
-                for (row_type b = b0; b < activeBuckets; ++b) {
-                    static_cast<TreeIndex*> (probeBuckets[b].ptrIndexes[TREE])->initializeTree(probeMatrix, args.threads, probeBuckets[b].startPos, probeBuckets[b].endPos);
-                }
+                buildIndexesLargeFirst(b0, TREE_PARALLEL_POINTS);
                 break;
 
             case LEMP_AP:
@@ -526,7 +1307,7 @@ namespace mips {
 
                 worstCaseTheta = args.theta / maxQueryLength;
 
-#pragma omp parallel for schedule(dynamic,1) 
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
                 for (row_type b = b0; b < activeBuckets; ++b) {
                     static_cast<L2apIndex*> (probeBuckets[b].ptrIndexes[AP])->initializeLists(probeMatrix, worstCaseTheta, cweights,
                             probeBuckets[b].startPos, probeBuckets[b].endPos);
@@ -535,7 +1316,7 @@ namespace mips {
 
             case LEMP_LSH:
 
-#pragma omp parallel for schedule(dynamic,1) 
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
                 for (row_type b = b0; b < activeBuckets; ++b) {
                     static_cast<LshIndex*> (probeBuckets[b].ptrIndexes[LSH])->initializeLists(probeMatrix, true, probeBuckets[b].startPos, probeBuckets[b].endPos);
 
@@ -562,7 +1343,7 @@ namespace mips {
                     // what happens here for tuning?
 
 
-#pragma omp parallel for schedule(dynamic,1) 
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
                     for (row_type b = b0; b < activeBuckets; ++b) {
                         static_cast<BlshIndex*> (probeBuckets[b].ptrIndexes[BLSH])->initializeLists(probeMatrix, worstCaseTheta, true, args.R, probeBuckets[b].startPos, probeBuckets[b].endPos);
 
@@ -571,10 +1352,54 @@ namespace mips {
                 }
                 break;
 
+            case LEMP_ANNOY:
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
+                for (row_type b = b0; b < activeBuckets; ++b) {
+                    static_cast<AnnoyIndex*> (probeBuckets[b].ptrIndexes[ANNOY])->initializeForest(probeMatrix, 1, probeBuckets[b].startPos, probeBuckets[b].endPos);
+                }
+                break;
+
+            case LEMP_HNSW:
+                buildIndexesLargeFirst(b0, HNSW_PARALLEL_POINTS);
+                break;
+
+            case LEMP_PQ:
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
+                for (row_type b = b0; b < activeBuckets; ++b) {
+                    static_cast<PqIndex*> (probeBuckets[b].ptrIndexes[PQ])->initializeCodes(probeMatrix, 1, probeBuckets[b].startPos, probeBuckets[b].endPos);
+                }
+                break;
+
+            case LEMP_AUTO: // the methods of the buckets are chosen by tuning. Until then they are LENGTH (no index)
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
+                for (row_type b = b0; b < activeBuckets; ++b) {
+                    buildIndex(probeBuckets[b], 1);
+                }
+                break;
+
         }
 //         std::cout << "Done creating lists" << std::endl;
     }
 
+    /*
+     * Builds the indexes of the active buckets from b0 on. Large buckets would dominate a per-bucket schedule, so the
+     * buckets with at least parallelPoints rows are built first, one after the other with all threads. Then the smaller
+     * ones are built one per thread
+     */
+    inline void Lemp::buildIndexesLargeFirst(row_type b0, row_type parallelPoints) {
+
+        for (row_type b = b0; b < activeBuckets; ++b) {
+            if (probeBuckets[b].rowNum >= parallelPoints)
+                buildIndex(probeBuckets[b], args.threads);
+        }
+
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
+        for (row_type b = b0; b < activeBuckets; ++b) {
+            if (probeBuckets[b].rowNum < parallelPoints)
+                buildIndex(probeBuckets[b], 1);
+        }
+    }
+
     inline void Lemp::tune(std::vector<RetrievalArguments>& retrArg, row_type allQueries) {
 
         if (activeBuckets > 0) {
@@ -585,34 +1410,58 @@ namespace mips {
                 case LEMP_C:
                 case LEMP_LSH:
                 case LEMP_BLSH:
+                case LEMP_ANNOY:
+                case LEMP_HNSW:
+                case LEMP_PQ:
+                case LEMP_AUTO:
 
-                    if (probeBuckets[0].isTunable(allQueries)) {
+                    if (probeBuckets[0].isTunable(allQueries, args)) {
                         if (args.k == 0) {
 
                             timer.start();
                             // first set-up the xValues in each retriever
                             for (row_type b = 0; b < activeBuckets; ++b) {
-                                probeBuckets[b].sampling(retrArg);
+                                probeBuckets[b].sampling(retrArg, args);
                             }
+                            fitSamples(activeBuckets);
 
 
                             // then do the actual tuning
-                            for (row_type b = 0; b < activeBuckets; ++b) {
-                                probeBuckets[b].ptrRetriever->tune(probeBuckets[b], (b == 0 ? probeBuckets[b] : probeBuckets[b - 1]), retrArg);                             
-                            }
+                            row_type reused = 0;
+                            if (args.method == LEMP_AUTO)
+                                selectMethods(0, activeBuckets, false);
+                            else
+                                reused = tuneBuckets(0, activeBuckets, activeBuckets, false);
 
                             timer.stop();
                             tuningTime += timer.elapsedTime().nanos();
 
+                            if (args.reuseTuning)
+                                std::cout << "[INFO] Tuning parameters of " << reused << " of " << activeBuckets << " bucket(s) reused" << std::endl;
+
+                        } else if (args.reuseTuning && args.method != LEMP_AUTO && args.tuningCoverage <= 0 && probeBuckets.size() > 1 && tuningCache.find(true, probeBuckets[1]) != nullptr) {
+                            // no drift check: neither the sample top-k nor the tuning have to run
+                            timer.start();
+                            activeBuckets = applyTuningCache(1, true);
+                            timer.stop();
+                            tuningTime += timer.elapsedTime().nanos();
+
+                            timer.start();
+                            initListsInBuckets();
+                            timer.stop();
+                            dataPreprocessingTimeRight += timer.elapsedTime().nanos();
+
+                            std::cout << "[INFO] Tuning parameters reused for " << activeBuckets - 1 << " bucket(s) without sampling" << std::endl;
+
                         } else {
                             timer.start();
                             std::pair<row_type, row_type> p(probeBuckets.size(), probeBuckets.size());
 
-                            p = findSampleForTuningTopk(probeBuckets, retrArg);
+                            p = findSampleForTuningTopk(probeBuckets, retrArg, args, tuningPasses());
 
 
                             activeBuckets = p.first;
-#pragma omp parallel for schedule(dynamic,1) 
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
                             for (row_type b = 1; b < activeBuckets; ++b) {
                                 probeBuckets[b].setup_xValues_topk(retrArg, probeBuckets[b - 1].sampleThetas);
                             }
@@ -629,17 +1478,27 @@ namespace mips {
 
                             timer.start();
 
-                            for (row_type b = 1; b < probeBuckets.size(); ++b) {
-                                probeBuckets[b].ptrRetriever->tuneTopk(probeBuckets[b], probeBuckets[b - 1], retrArg);
-                            }
+                            // beyond the active buckets the parameters are copied: the intervals are sized for the active ones
+                            row_type reused = 0;
+                            if (args.method == LEMP_AUTO)
+                                selectMethods(1, probeBuckets.size(), true);
+                            else
+                                reused = tuneBuckets(1, probeBuckets.size(), activeBuckets, true);
 
                             timer.stop();
                             tuningTime += timer.elapsedTime().nanos();
+
+                            if (args.reuseTuning)
+                                std::cout << "[INFO] Tuning parameters of " << reused << " of " << (activeBuckets - 1) << " bucket(s) reused" << std::endl;
                         }
+                    } else if (args.reuseTuning && args.method != LEMP_AUTO && tuningCache.size() > 0) {
+                        row_type b0 = (args.k == 0 ? 0 : 1);
+                        std::cout << "[WARNING] Too few queries (" << allQueries << ") for tuning. Using the tuning parameters of earlier runs" << std::endl;
+                        applyTuningCache(b0, args.k > 0);
                     } else {
-                        std::cout << "[WARNING] Too few queries (" << allQueries << ") for tuning (at least " << LOWER_LIMIT_PER_BUCKET * 3 << " needed)" << std::endl;
+                        std::cout << "[WARNING] Too few queries (" << allQueries << ") for tuning (at least " << args.sampleMin * 3 << " needed)" << std::endl;
                         std::cout << "[WARNING] Using default (t_b=1, lists=1) or previous tuning values for all probe buckets " << std::endl;
-                        std::cout << "[WARNING] You can either reduce LOWER_LIMIT_PER_BUCKET and recompile or use larger batches of queries" << std::endl;
+                        std::cout << "[WARNING] You can either reduce the minimum tuning sample (setTuningSample, --sampleMin) or use larger batches of queries" << std::endl;
                     }
 
 
@@ -648,7 +1507,294 @@ namespace mips {
             }
         }
 
+        initOnlineTuners();
+    }
+
+    // how often the tuning runs each sample query (LENGTH and each number of lists, LEMP_AUTO: for every candidate)
+    inline double Lemp::tuningPasses() const {
+        return (args.method == LEMP_AUTO ? 2 * NUM_LISTS + 5 : NUM_LISTS + 1);
+    }
+
+    /*
+     * Adaptive sampling (above-theta): times the sample queries of each bucket [0, end) with LENGTH, in their random
+     * order, until their mean cost is stable or the share of the bucket in the tuning budget is used up, and keeps
+     * only these. The buckets are sized concurrently, like they are tuned.
+     */
+    inline void Lemp::fitSamples(row_type end) {
+        if (args.sampleError <= 0)
+            return;
+
+        std::vector<row_type> sampled;
+        for (row_type b = 0; b < end; ++b) {
+            if (probeBuckets[b].xValues != nullptr && !probeBuckets[b].xValues->empty())
+                sampled.push_back(b);
+        }
+        if (sampled.empty())
+            return;
+
+        row_type workers = std::max<row_type>(1, std::min<row_type>(pool.size(), sampled.size()));
+        initTuningArguments(workers);
+        double bucketBudget = args.tuningBudget * 1E9 / sampled.size();
+        row_type kept = 0, candidates = 0;
+
+#pragma omp parallel for schedule(dynamic,1) num_threads(workers) reduction(+ : kept, candidates)
+        for (row_type i = 0; i < sampled.size(); ++i) {
+            row_type w = omp_get_thread_num();
+            std::vector<RetrievalArguments>& arg = (w == 0 ? retrArg : tuningArg[w]);
+            ProbeBucket& bucket = probeBuckets[sampled[i]];
+            const std::vector<MatItem>& sample = *(bucket.xValues);
+
+            LengthRetriever plainRetriever;
+            SampleSizer sizer(args.sampleMin, sample.size(), args.sampleError, bucketBudget, tuningPasses());
+
+            while (sizer.size() < sample.size() && !sizer.done()) {
+                const MatItem& item = sample[sizer.size()];
+                const double* query = arg[item.i].queryMatrix->getMatrixRowPtr(item.j);
+
+                arg[0].tunerTimer.start();
+                plainRetriever.run(query, bucket, &arg[0]);
+                arg[0].tunerTimer.stop();
+                sizer.add(arg[0].tunerTimer.elapsedTime().nanos());
+            }
+            arg[0].results.clear();
+
+            candidates += sample.size();
+            kept += sizer.size();
+            bucket.fitSample(sizer.size());
+        }
+
+        std::cout << "[INFO] Tuning samples: " << kept << " of " << candidates << " candidate queries in " << sampled.size() << " bucket(s)" << std::endl;
+    }
+
+    /*
+     * Tunes the buckets [b0, end). Buckets with a sample do not depend on each other and are tuned concurrently, each
+     * by one worker with its own scratch arguments and timer. Buckets without a sample take the parameters of the
+     * previous bucket afterwards, in order. Buckets below cacheEnd may take their parameters from the tuning cache
+     * and are stored in it. Returns the number of buckets whose parameters were reused.
+     */
+    inline row_type Lemp::tuneBuckets(row_type b0, row_type end, row_type cacheEnd, bool topk) {
+        enum { PENDING = 0, REUSED = 1, TUNED = 2 };
+        std::vector<char> state(end, PENDING);
+        std::vector<row_type> sampled;
+        row_type reused = 0;
+
+        for (row_type b = b0; b < end; ++b) {
+            if (b < cacheEnd && applyCachedTuning(b, topk, true)) {
+                state[b] = REUSED;
+                reused++;
+            } else if (probeBuckets[b].xValues != nullptr && !probeBuckets[b].xValues->empty()) {
+                sampled.push_back(b);
+            }
+        }
+
+        row_type workers = std::max<row_type>(1, std::min<row_type>(pool.size(), sampled.size()));
+        initTuningArguments(workers);
+
+        if (args.modelTuning && !costModel.calibrated)
+            costModel.calibrate(probeMatrix);
+        costModel.margin = args.modelMargin;
+
+#pragma omp parallel for schedule(dynamic,1) num_threads(workers)
+        for (row_type i = 0; i < sampled.size(); ++i) {
+            row_type w = omp_get_thread_num();
+            std::vector<RetrievalArguments>& arg = (w == 0 ? retrArg : tuningArg[w]);
+            row_type b = sampled[i];
+
+            arg[0].competitorMethod = nullptr; // set by the retriever of the bucket, if it has one
+            arg[0].costModel = (args.modelTuning ? &costModel : nullptr);
+            if (topk) {
+                probeBuckets[b].ptrRetriever->tuneTopk(probeBuckets[b], probeBuckets[b - 1], arg);
+            } else {
+                probeBuckets[b].ptrRetriever->tune(probeBuckets[b], (b == 0 ? probeBuckets[b] : probeBuckets[b - 1]), arg);
+            }
+            state[b] = TUNED;
+        }
+
+        for (row_type b = b0; b < end; ++b) {
+            if (state[b] == PENDING) { // copies the parameters of the previous bucket
+                retrArg[0].competitorMethod = nullptr;
+                if (topk) {
+                    probeBuckets[b].ptrRetriever->tuneTopk(probeBuckets[b], probeBuckets[b - 1], retrArg);
+                } else {
+                    probeBuckets[b].ptrRetriever->tune(probeBuckets[b], (b == 0 ? probeBuckets[b] : probeBuckets[b - 1]), retrArg);
+                }
+            }
+            if (args.reuseTuning && b < cacheEnd && state[b] != REUSED)
+                tuningCache.store(topk, probeBuckets[b]);
+        }
+        return reused;
+    }
+
+    // tuning workers 1, ..., workers - 1 get the queries of retrArg but their own scratch space and timers
+    inline void Lemp::initTuningArguments(row_type workers) {
+        if (tuningArg.size() < workers)
+            tuningArg.resize(workers);
+
+        for (row_type w = 1; w < workers; ++w) {
+            std::vector<RetrievalArguments>& arg = tuningArg[w];
 
+            if (arg.size() != retrArg.size()) {
+                arg.clear();
+                arg.resize(retrArg.size());
+            }
+            for (row_type t = 0; t < retrArg.size(); ++t) {
+                arg[t].initializeBasics(*retrArg[t].queryMatrix, probeMatrix, args.method, args.theta, args.k, retrArg[t].threads, args.R, args.epsilon,
+                        args.numTrees, args.search_k, true, args.isTARR, args.ef);
+            }
+            arg[0].init(maxProbeBucketSize);
+            arg[0].heap.resize(args.k);
+        }
+    }
+
+    /*
+     * Sets the parameters of bucket b from the tuning cache: from its own entry, if the current sample (withSample)
+     * lies mostly in the range it was tuned for, or interpolated between its neighbours if it has no sample to be
+     * tuned with. False if the bucket has to be tuned (or keeps its parameters).
+     */
+    inline bool Lemp::applyCachedTuning(row_type b, bool topk, bool withSample) {
+        if (!args.reuseTuning)
+            return false;
+
+        ProbeBucket& bucket = probeBuckets[b];
+        const TuningEntry* entry = tuningCache.find(topk, bucket);
+        bool hasSample = withSample && bucket.xValues != nullptr && !bucket.xValues->empty();
+
+        if (entry != nullptr) {
+            if (hasSample && args.tuningCoverage > 0 && tuningCache.coverage(*entry, bucket) < args.tuningCoverage)
+                return false; // the queries drifted away from the tuned range
+
+            bucket.setAfterTuning(entry->numLists, entry->t_b);
+            return true;
+        }
+
+        col_type numLists;
+        double t_b;
+        if (!hasSample && tuningCache.interpolate(topk, bucket, numLists, t_b)) {
+            bucket.setAfterTuning(numLists, t_b);
+            return true;
+        }
+        return false;
+    }
+
+    /*
+     * Sets the parameters of the buckets from b0 on from the cache only. Buckets after the last one found in the
+     * cache copy the parameters of their predecessor. Returns the number of buckets up to the last one found.
+     */
+    inline row_type Lemp::applyTuningCache(row_type b0, bool topk) {
+        row_type lastFound = b0;
+
+        for (row_type b = b0; b < probeBuckets.size(); ++b) {
+            if (tuningCache.find(topk, probeBuckets[b]) != nullptr)
+                lastFound = b + 1;
+        }
+
+        for (row_type b = b0; b < probeBuckets.size(); ++b) {
+            if (b < lastFound && applyCachedTuning(b, topk, false))
+                continue;
+            if (b > 0)
+                probeBuckets[b].setAfterTuning(probeBuckets[b - 1].numLists, probeBuckets[b - 1].t_b);
+        }
+        return lastFound;
+    }
+
+    /*
+     * LEMP_AUTO: chooses the method of each bucket in [b0, end) by timing its tuning sample with every candidate
+     * (LENGTH, LI, LC, TA, TREE) and keeping the cheapest, with its tuned parameters. The sampled buckets are
+     * handled concurrently as in tuneBuckets. Their candidate indexes are built for that and only the index of the
+     * chosen method is kept. Buckets without a sample take the method and the parameters of the previous bucket.
+     * Pure I and C are not candidates: LI and LC with a tuned t_b cover them, since a t_b at the bottom of the sample
+     * range sends every query to the lists.
+     */
+    inline void Lemp::selectMethods(row_type b0, row_type end, bool topk) {
+        const LEMP_Method candidates[] = {LEMP_L, LEMP_LI, LEMP_LC, LEMP_TA, LEMP_TREE};
+        const int numCandidates = sizeof (candidates) / sizeof (candidates[0]);
+        std::vector<char> hasSample(end, false);
+        std::vector<row_type> sampled;
+
+        for (row_type b = b0; b < end; ++b) {
+            if (probeBuckets[b].xValues != nullptr && !probeBuckets[b].xValues->empty()) {
+                hasSample[b] = true;
+                sampled.push_back(b);
+            }
+        }
+
+        row_type workers = std::max<row_type>(1, std::min<row_type>(pool.size(), sampled.size()));
+        initTuningArguments(workers);
+
+#pragma omp parallel for schedule(dynamic,1) num_threads(workers)
+        for (row_type i = 0; i < sampled.size(); ++i) {
+            row_type w = omp_get_thread_num();
+            std::vector<RetrievalArguments>& arg = (w == 0 ? retrArg : tuningArg[w]);
+            row_type b = sampled[i];
+            ProbeBucket& bucket = probeBuckets[b];
+            const ProbeBucket& prevBucket = (b == 0 ? bucket : probeBuckets[b - 1]);
+
+            LEMP_Method best = LEMP_L;
+            double bestCost = -1, bestT_b = 1;
+            col_type bestLists = 1;
+
+            for (int c = 0; c < numCandidates; ++c) {
+                setRetriever(bucket, candidates[c]);
+                buildIndex(bucket, 1);
+                bucket.setAfterTuning(1, 1);
+
+                arg[0].competitorMethod = nullptr;
+                arg[0].costModel = nullptr; // the candidates are compared by measured times
+                if (topk) {
+                    bucket.ptrRetriever->tuneTopk(bucket, prevBucket, arg);
+                } else {
+                    bucket.ptrRetriever->tune(bucket, prevBucket, arg);
+                }
+
+                double cost = bucket.ptrRetriever->sampleCost();
+                if (bestCost < 0 || cost < bestCost) {
+                    bestCost = cost;
+                    best = candidates[c];
+                    bestLists = bucket.numLists;
+                    bestT_b = bucket.t_b;
+                }
+            }
+
+            if ((best == LEMP_LI || best == LEMP_LC) && bestT_b == 1) // LENGTH for all queries: no lists needed
+                best = LEMP_L;
+            if (best != LEMP_LI && best != LEMP_LC) {
+                bestLists = 1;
+                bestT_b = 1;
+            }
+
+            if (best != LEMP_LI && best != LEMP_TA)
+                bucket.deleteIndex(SL);
+            if (best != LEMP_LC)
+                bucket.deleteIndex(INT_SL);
+            if (best != LEMP_TREE)
+                bucket.deleteIndex(TREE);
+
+            setRetriever(bucket, best);
+            bucket.setAfterTuning(bestLists, bestT_b);
+        }
+
+        std::vector<row_type> unsampled;
+        for (row_type b = std::max<row_type>(b0, 1); b < end; ++b) {
+            if (!hasSample[b]) {
+                const ProbeBucket& prevBucket = probeBuckets[b - 1];
+                setRetriever(probeBuckets[b], prevBucket.method);
+                probeBuckets[b].setAfterTuning(prevBucket.numLists, prevBucket.t_b);
+                if (b < activeBuckets)
+                    unsampled.push_back(b);
+            }
+        }
+
+#pragma omp parallel for schedule(dynamic,1) num_threads(pool.size())
+        for (row_type i = 0; i < unsampled.size(); ++i) {
+            buildIndex(probeBuckets[unsampled[i]], 1);
+        }
+
+        row_type counts[LEMP_AUTO] = {};
+        for (row_type b = b0; b < end; ++b) {
+            counts[probeBuckets[b].method]++;
+        }
+        std::cout << "[INFO] Methods chosen for " << (end - b0) << " bucket(s): LEMP_L " << counts[LEMP_L] << ", LEMP_LI " << counts[LEMP_LI]
+                << ", LEMP_LC " << counts[LEMP_LC] << ", LEMP_TA " << counts[LEMP_TA] << ", LEMP_TREE " << counts[LEMP_TREE] << std::endl;
     }
 
     inline void Lemp::printAlgoName(const VectorMatrix& queryMatrix) {
@@ -683,8 +1829,8 @@ namespace mips {
                 }
                 break;
             case LEMP_TREE:
-                logging << "LEMP_TREE" << "\t" << args.threads << "\t";
-                std::cout << "[ALGORITHM] LEMP_TREE with " << args.threads << " thread(s)" << std::endl;
+                logging << (args.dualTree ? "LEMP_TREE (DUAL)" : "LEMP_TREE") << "\t" << args.threads << "\t";
+                std::cout << "[ALGORITHM] LEMP_TREE" << (args.dualTree ? " (DUAL)" : "") << " with " << args.threads << " thread(s)" << std::endl;
                 break;
             case LEMP_AP:
                 logging << "LEMP_AP" << "\t" << args.threads << "\t";
@@ -698,6 +1844,22 @@ namespace mips {
                 logging << "LEMP_BLSH" << "\t" << args.threads << "\t";
                 std::cout << "[ALGORITHM] LEMP_BLSH with " << args.threads << " thread(s)" << std::endl;
                 break;
+            case LEMP_ANNOY:
+                logging << "LEMP_ANNOY" << "\t" << args.threads << "\t";
+                std::cout << "[ALGORITHM] LEMP_ANNOY (" << args.numTrees << " trees, search_k " << args.search_k << ") with " << args.threads << " thread(s)" << std::endl;
+                break;
+            case LEMP_HNSW:
+                logging << "LEMP_HNSW" << "\t" << args.threads << "\t";
+                std::cout << "[ALGORITHM] LEMP_HNSW (ef " << args.ef << ") with " << args.threads << " thread(s)" << std::endl;
+                break;
+            case LEMP_PQ:
+                logging << "LEMP_PQ" << "\t" << args.threads << "\t";
+                std::cout << "[ALGORITHM] LEMP_PQ (" << args.pqSubspaces << " subspaces, " << (args.pqExact ? "exact" : "approximate") << ") with " << args.threads << " thread(s)" << std::endl;
+                break;
+            case LEMP_AUTO:
+                logging << "LEMP_AUTO" << "\t" << args.threads << "\t";
+                std::cout << "[ALGORITHM] LEMP_AUTO with " << args.threads << " thread(s)" << std::endl;
+                break;
        
         }
 
@@ -705,6 +1867,404 @@ namespace mips {
         logging << "Q^T(" << queryMatrix.rowNum << "x" << (0 + queryMatrix.colNum) << ")\t";
     }
 
+    // after tuning: the online tuners of the buckets start from the tuned parameters
+    inline void Lemp::initOnlineTuners() {
+        col_type maxLists = std::min<col_type>(NUM_LISTS, probeMatrix.colNum);
+
+        for (auto& bucket : probeBuckets) {
+            bool mixed = (bucket.method == LEMP_LI || bucket.method == LEMP_LC);
+            if (!args.onlineTuning || !mixed) {
+                bucket.onlineTuner.reset();
+                continue;
+            }
+
+            double minTheta = -1, maxTheta = 1;
+            if (bucket.xValues != nullptr && !bucket.xValues->empty()) {
+                minTheta = bucket.xValues->front().result;
+                maxTheta = bucket.xValues->back().result;
+            }
+            bucket.onlineTuner.reset(new OnlineTuner(bucket.t_b, bucket.numLists, minTheta, maxTheta, maxLists));
+        }
+    }
+
+    inline void Lemp::printOnlineTuning() const {
+        if (!args.onlineTuning)
+            return;
+
+        row_type changes = 0, changed = 0;
+        for (auto& bucket : probeBuckets) {
+            if (bucket.onlineTuner != nullptr && bucket.onlineTuner->getChanges() > 0) {
+                changes += bucket.onlineTuner->getChanges();
+                changed++;
+            }
+        }
+        std::cout << "[STATS] online re-tuning: " << changes << " change(s) of t_b or numLists in " << changed << " bucket(s)" << std::endl;
+    }
+
+    // indexes are built lazily during retrieval. Reports how long threads spent on indexes that others were building
+    inline void Lemp::printIndexWaitTimes() const {
+        uint64_t totalWaitTime = 0, maxWaitTime = 0;
+        row_type maxBucket = 0;
+
+        for (row_type b = 0; b < probeBuckets.size(); ++b) {
+            uint64_t waitTime = probeBuckets[b].getIndexWaitTime();
+            totalWaitTime += waitTime;
+
+            if (waitTime > maxWaitTime) {
+                maxWaitTime = waitTime;
+                maxBucket = b;
+            }
+#ifdef TIME_IT
+            if (waitTime > 0)
+                std::cout << "bucket " << b << " index wait time: " << waitTime / 1E9 << std::endl;
+#endif
+        }
+
+        std::cout << "[STATS] index wait time = " << (totalWaitTime / 1E9) << "s";
+        if (maxWaitTime > 0)
+            std::cout << " (max " << (maxWaitTime / 1E9) << "s in bucket " << maxBucket << ")";
+        std::cout << std::endl;
+    }
+
+
+    // probe id -> row in probeMatrix. Built on the first update (and after a rebalance), then maintained
+    inline void Lemp::initPositions() {
+        if (positions.size() == nextId)
+            return;
+
+        positions.assign(nextId, NO_POSITION);
+        for (row_type r = 0; r < probeMatrix.rowNum; ++r) {
+            if (!probeMatrix.isDeleted(r))
+                positions[probeMatrix.getId(r)] = r;
+        }
+    }
+
+    inline bool Lemp::markDeleted(row_type id) {
+        initPositions();
+
+        if (id >= positions.size() || positions[id] == NO_POSITION) {
+            std::cout << "[WARNING] There is no probe vector with id " << id << std::endl;
+            return false;
+        }
+
+        probeMatrix.markDeleted(positions[id]);
+        positions[id] = NO_POSITION;
+        deletedRows++;
+        return true;
+    }
+
+    // the delta bucket is sorted by decreasing length, like every bucket. Its sorted lists are patched, not rebuilt
+    inline void Lemp::insertIntoDelta(const double* vec, row_type id) {
+        QueueElement element(calculateLength(vec, probeMatrix.colNum), id);
+        auto begin = probeMatrix.lengthInfo.begin();
+        row_type pos = std::upper_bound(begin + sortedRows, begin + probeMatrix.rowNum, element, std::greater<QueueElement>()) - begin;
+
+        probeMatrix.insertRow(pos, vec, id);
+
+        for (row_type r = pos; r < probeMatrix.rowNum; ++r) {
+            if (!probeMatrix.isDeleted(r))
+                positions[probeMatrix.getId(r)] = r;
+        }
+
+        if (hasDelta) {
+            ProbeBucket& delta = probeBuckets[1];
+
+            if (delta.ptrIndexes[SL] != nullptr && static_cast<QueueElementLists*> (delta.ptrIndexes[SL])->isInitialized())
+                static_cast<QueueElementLists*> (delta.ptrIndexes[SL])->insertRow(probeMatrix, pos - sortedRows);
+
+            if (delta.ptrIndexes[INT_SL] != nullptr && static_cast<IntLists*> (delta.ptrIndexes[INT_SL])->isInitialized())
+                static_cast<IntLists*> (delta.ptrIndexes[INT_SL])->insertRow(probeMatrix, pos - sortedRows);
+        }
+    }
+
+    /*
+     * After inserts: creates the delta bucket or updates its bounds and indexes. Retrieval visits the buckets in the
+     * order of their maximum lengths and stops early based on them. Thus, the delta bucket (second in this order)
+     * reports at least the maximum length of the bucket after it and the first bucket at least the one of the delta.
+     * Larger maxima are safe: they only weaken pruning.
+     */
+    inline void Lemp::refreshDeltaBucket(bool rebuildIndexes) {
+        if (sortedRows == probeMatrix.rowNum)
+            return;
+
+        bool created = !hasDelta;
+        if (created) {
+            probeBuckets.insert(probeBuckets.begin() + 1, ProbeBucket());
+            const ProbeBucket& neighbor = probeBuckets[probeBuckets.size() > 2 ? 2 : 0];
+            probeBuckets[1].setAfterTuning(neighbor.numLists, neighbor.t_b); // until the next tuning
+            hasDelta = true;
+        }
+
+        ProbeBucket& first = probeBuckets[0];
+        ProbeBucket& delta = probeBuckets[1];
+        delta.init(probeMatrix, sortedRows, probeMatrix.rowNum, args);
+
+        if (probeBuckets.size() > 2 && delta.normL2.second < probeBuckets[2].normL2.second)
+            delta.normL2.second = probeBuckets[2].normL2.second;
+        delta.invNormL2.second = 1 / delta.normL2.second;
+        delta.bucketScanThreshold = args.theta * delta.invNormL2.second;
+
+        if (first.normL2.second < delta.normL2.second) {
+            first.normL2.second = delta.normL2.second;
+            first.invNormL2.second = delta.invNormL2.second;
+            first.bucketScanThreshold = delta.bucketScanThreshold;
+        }
+
+        if (!first.ptrRetriever) // nothing ran yet. The next run sets up all buckets
+            return;
+
+        if (created) {
+            if (args.method == LEMP_AUTO) // the method of its neighbor, until the next tuning
+                setRetriever(delta, probeBuckets[probeBuckets.size() > 2 ? 2 : 0].method);
+            else
+                initializeRetriever(1);
+            if (activeBuckets > 0)
+                activeBuckets++;
+        } else if (rebuildIndexes) { // the sorted lists are patched. The other indexes are built again
+            switch (delta.method) {
+                case LEMP_TREE:
+                    delete static_cast<TreeIndex*> (delta.ptrIndexes[TREE]);
+                    delta.ptrIndexes[TREE] = new TreeIndex(args.bulkTree);
+                    break;
+                case LEMP_AP:
+                    delete static_cast<L2apIndex*> (delta.ptrIndexes[AP]);
+                    delta.ptrIndexes[AP] = new L2apIndex();
+                    break;
+                case LEMP_LSH:
+                    delete static_cast<LshIndex*> (delta.ptrIndexes[LSH]);
+                    delta.ptrIndexes[LSH] = new LshIndex();
+                    break;
+                case LEMP_BLSH:
+                    delete static_cast<BlshIndex*> (delta.ptrIndexes[BLSH]);
+                    delta.ptrIndexes[BLSH] = new BlshIndex();
+                    break;
+                case LEMP_ANNOY:
+                    delete static_cast<AnnoyIndex*> (delta.ptrIndexes[ANNOY]);
+                    delta.ptrIndexes[ANNOY] = new AnnoyIndex(args.numTrees);
+                    break;
+                case LEMP_HNSW:
+                    delete static_cast<HnswIndex*> (delta.ptrIndexes[HNSW]);
+                    delta.ptrIndexes[HNSW] = new HnswIndex();
+                    break;
+                case LEMP_PQ:
+                    delete static_cast<PqIndex*> (delta.ptrIndexes[PQ]);
+                    delta.ptrIndexes[PQ] = new PqIndex(args.pqSubspaces);
+                    break;
+            }
+        }
+
+        // the indexes that do not depend on the queries are built right away (L2AP and BLSH build theirs lazily)
+        switch (delta.method) {
+            case LEMP_LI:
+            case LEMP_I:
+            case LEMP_TA:
+                static_cast<QueueElementLists*> (delta.ptrIndexes[SL])->initializeLists(probeMatrix, delta.startPos, delta.endPos);
+                break;
+            case LEMP_LC:
+            case LEMP_C:
+                static_cast<IntLists*> (delta.ptrIndexes[INT_SL])->initializeLists(probeMatrix, delta.startPos, delta.endPos);
+                break;
+            case LEMP_TREE:
+                static_cast<TreeIndex*> (delta.ptrIndexes[TREE])->initializeTree(probeMatrix, args.threads, delta.startPos, delta.endPos);
+                break;
+            case LEMP_LSH:
+                static_cast<LshIndex*> (delta.ptrIndexes[LSH])->initializeLists(probeMatrix, true, delta.startPos, delta.endPos);
+                break;
+            case LEMP_ANNOY:
+                static_cast<AnnoyIndex*> (delta.ptrIndexes[ANNOY])->initializeForest(probeMatrix, args.threads, delta.startPos, delta.endPos);
+                break;
+            case LEMP_HNSW:
+                static_cast<HnswIndex*> (delta.ptrIndexes[HNSW])->initializeGraph(probeMatrix, args.threads, delta.startPos, delta.endPos);
+                break;
+            case LEMP_PQ:
+                static_cast<PqIndex*> (delta.ptrIndexes[PQ])->initializeCodes(probeMatrix, args.threads, delta.startPos, delta.endPos);
+                break;
+        }
+
+        if (maxProbeBucketSize < delta.rowNum) {
+            maxProbeBucketSize = delta.rowNum;
+            if (prepared)
+                initRetrievalArguments();
+        }
+        if (prepared)
+            initIntervals();
+    }
+
+    inline void Lemp::rebalanceIfNeeded() {
+        row_type churn = (probeMatrix.rowNum - sortedRows) + deletedRows;
+
+        if (args.rebalanceFraction > 0 && churn > args.rebalanceFraction * sortedRows)
+            rebalance();
+    }
+
+    // retrieval of the online queries (no cache)
+    inline void Lemp::runQueryBatch(const double* queries, row_type n, std::vector<MatItem>& out) {
+        out.clear();
+        if (n == 0)
+            return;
+
+        std::vector<double> thetas;
+        if (args.k == 0 && !queryTheta.empty()) {
+            thetas.swap(queryTheta);
+            if (thetas.size() != n) {
+                std::cout << "[WARNING] " << thetas.size() << " per-query thetas for " << n << " queries. Ignoring them" << std::endl;
+                thetas.clear();
+            }
+        }
+
+        if (thetas.empty()) {
+            copyOnlineQueries(queries, n);
+        } else {
+            std::vector<double> scaled;
+            scaleByQueryTheta(queries, n, thetas, scaled);
+            copyOnlineQueries(scaled.data(), n);
+        }
+
+        row_type threads = retrArg.size();
+        acrossBuckets = (args.k > 0 && args.intraQuery && n < threads);
+        bool shareMinScores = (args.k > 0 && args.method == LEMP_BLSH);
+
+        if (seedBounds.size() != n) {
+            seedBounds.clear();
+        }
+
+        if (args.k > 0) {
+            sharedMinScore.init(threads);
+
+            if (acrossBuckets) {
+                topkBounds.init(n);
+                for (row_type q = 0; q < seedBounds.size(); ++q) {
+                    topkBounds.raise(q, seedBounds[q]);
+                }
+            }
+        }
+
+        comp_type comparisons = 0;
+
+#pragma omp parallel num_threads(threads) reduction(+ : comparisons)
+        {
+            row_type tid = omp_get_thread_num();
+            RetrievalArguments& arg = retrArg[tid];
+
+            // one batch per thread. With intra-query parallelism all threads get all queries
+            row_type start = (acrossBuckets ? 0 : (uint64_t) n * tid / threads);
+            row_type end = (acrossBuckets ? n : (uint64_t) n * (tid + 1) / threads);
+
+            arg.queryMatrix = &onlineQueries;
+            arg.queryBatches.resize(1);
+            arg.queryBatches[0].reset(onlineQueries, start, end, args);
+            arg.clear();
+            arg.setItemFilter(itemFilter);
+
+            if (args.k > 0) {
+                arg.sharedMinScore = &sharedMinScore;
+                arg.setTopkSizes(queryK.size() == n ? queryK : std::vector<int>());
+                arg.allocTopkResults();
+                runTopKForThread(tid, shareMinScores);
+            } else {
+                for (row_type b = 0; b < activeBuckets; ++b) {
+                    maskQueries(probeBuckets[b], arg);
+                    probeBuckets[b].ptrRetriever->run(probeBuckets[b], &arg);
+                    unmaskQueries(arg);
+                }
+            }
+            comparisons += arg.comparisons;
+        }
+
+        for (auto& argument : retrArg) {
+            out.insert(out.end(), argument.results.begin(), argument.results.end());
+        }
+        if (!thetas.empty())
+            rescaleResults(out, thetas);
+        totalComparisons += comparisons;
+        seedBounds.clear();
+        queryK.clear();
+    }
+
+    // looks the queries up in the cache and retrieves the others (each distinct one once with dedupQueries)
+    inline void Lemp::queryBatchWithCache(const double* queries, row_type n, std::vector<MatItem>& out) {
+        out.clear();
+        col_type colNum = probeMatrix.colNum;
+        bool useDirection = (args.k > 0 && resultCache.byDirectionEnabled());
+
+        std::vector<uint64_t> keys(n);
+        std::vector<row_type> misses; // positions in queries that have to be retrieved
+        std::vector<std::vector<row_type> > copies; // per miss: later positions with the same vector
+        std::unordered_multimap<uint64_t, row_type> inBatch; // key -> miss
+
+        for (row_type q = 0; q < n; ++q) {
+            const double* query = queries + (size_t) q * colNum;
+            keys[q] = QueryCache::hash(query, colNum);
+
+            if (resultCache.enabled()) {
+                double scale = 1;
+                const CachedQuery* hit = resultCache.find(query, colNum, keys[q]);
+
+                if (hit == nullptr && useDirection) {
+                    double length = QueryCache::length(query, colNum);
+                    hit = resultCache.findDirection(query, colNum, length);
+                    if (hit != nullptr)
+                        scale = length / hit->length;
+                }
+
+                if (hit != nullptr) {
+                    for (auto& r : hit->results) {
+                        out.emplace_back(r.data * scale, q, r.id);
+                    }
+                    continue;
+                }
+            }
+
+            if (args.dedupQueries) {
+                bool duplicate = false;
+                auto range = inBatch.equal_range(keys[q]);
+                for (auto it = range.first; it != range.second; ++it) {
+                    if (memcmp(query, queries + (size_t) misses[it->second] * colNum, sizeof (double) * colNum) == 0) {
+                        copies[it->second].push_back(q);
+                        duplicate = true;
+                        break;
+                    }
+                }
+                if (duplicate)
+                    continue;
+                inBatch.emplace(keys[q], misses.size());
+            }
+
+            misses.push_back(q);
+            copies.emplace_back();
+        }
+
+        if (misses.empty())
+            return;
+
+        const double* toRetrieve = queries;
+        std::vector<double> missQueries;
+        if (misses.size() < n) {
+            missQueries.resize((size_t) misses.size() * colNum);
+            for (row_type m = 0; m < misses.size(); ++m) {
+                std::copy(queries + (size_t) misses[m] * colNum, queries + (size_t) (misses[m] + 1) * colNum, missQueries.begin() + (size_t) m * colNum);
+            }
+            toRetrieve = missQueries.data();
+        }
+
+        std::vector<MatItem> missResults;
+        runQueryBatch(toRetrieve, misses.size(), missResults);
+
+        std::vector<std::vector<QueueElement> > perMiss(resultCache.enabled() ? misses.size() : 0);
+        for (auto& item : missResults) {
+            row_type m = item.i;
+            out.emplace_back(item.result, misses[m], item.j);
+            for (auto q : copies[m]) {
+                out.emplace_back(item.result, q, item.j);
+            }
+            if (!perMiss.empty())
+                perMiss[m].emplace_back(item.result, item.j);
+        }
+
+        for (row_type m = 0; m < perMiss.size(); ++m) {
+            resultCache.store(queries + (size_t) misses[m] * colNum, colNum, keys[misses[m]], perMiss[m]);
+        }
+    }
 
 }
 
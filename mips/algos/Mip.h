@@ -20,6 +20,7 @@ namespace mips {
         double tuningTime = 0;
         double retrievalTime = 0;
         rg::Timer timer;
+        WorkerPool pool;
         comp_type totalComparisons = 0;
         double user_sample_ratio = 0;
         double blocked_mm_sample_time = 0;
@@ -55,6 +56,10 @@ namespace mips {
             exit(1);
         }
 
+        inline comp_type getComparisons() const {
+            return totalComparisons;
+        }
+
         inline void clearTimings() {
             dataPreprocessingTimeLeft = 0;
             tuningTime = 0;
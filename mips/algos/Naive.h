@@ -48,7 +48,7 @@ namespace mips {
                 myNumThreads = leftMatrix.rowNum;
                 std::cout << "[WARNING] Query matrix contains too few elements. Suboptimal running with " << myNumThreads << " thread(s)" << std::endl;
             }
-            omp_set_num_threads(myNumThreads);
+            pool.start();
             queryMatrices.resize(myNumThreads);
             splitMatrices(leftMatrix, queryMatrices);
 
@@ -72,7 +72,7 @@ namespace mips {
                 std::cout << "[INFO] Logging in " << args.logFile << std::endl;
             }
 
-            omp_set_num_threads(args.threads);
+            pool.init(args.threads);
         }
 
         inline ~Naive() {
@@ -102,7 +102,7 @@ namespace mips {
             timer.start();
 
             comp_type comparisons = 0;
-#pragma omp parallel reduction(+ : comparisons)
+#pragma omp parallel num_threads(queryMatrices.size()) reduction(+ : comparisons)
             {
                 row_type tid = omp_get_thread_num();
 
@@ -141,7 +141,7 @@ namespace mips {
             timer.start();
 
             comp_type comparisons = 0;
-#pragma omp parallel reduction(+ : comparisons)
+#pragma omp parallel num_threads(queryMatrices.size()) reduction(+ : comparisons)
             {
                 row_type tid = omp_get_thread_num();
 
@@ -161,7 +161,7 @@ namespace mips {
 
             mu.zeros(rightMatrix.colNum + 1);
 
-#pragma omp parallel for schedule(static,1000)
+#pragma omp parallel for schedule(static,1000) num_threads(pool.size())
             for (row_type i = 0; i < rightMatrix.rowNum; i++) {
                 double* dProbe = rightMatrix.getMatrixRowPtr(i);
                 A(0, i) = 0;
@@ -175,7 +175,7 @@ namespace mips {
             }
             mu /= rightMatrix.rowNum;
 
-#pragma omp parallel for schedule(static,1000)
+#pragma omp parallel for schedule(static,1000) num_threads(pool.size())
             for (row_type i = 0; i < rightMatrix.rowNum; i++) {
                 A.unsafe_col(i) -= mu;
             }
@@ -201,7 +201,7 @@ namespace mips {
 
             probeMatrix.initializeBasics(probeMatrix.colNum, probeMatrix.rowNum, false);
 
-#pragma omp parallel for schedule(static,1000)
+#pragma omp parallel for schedule(static,1000) num_threads(pool.size())
             for (row_type i = 0; i < probeMatrix.rowNum; i++) {
                 double* dProbe = probeMatrix.getMatrixRowPtr(i);
                 for (col_type j = 0; j < probeMatrix.colNum; ++j) {
@@ -216,7 +216,7 @@ namespace mips {
 
             arma::mat A(leftMatrix.colNum + 1, leftMatrix.rowNum); //cols x rows
 
-#pragma omp parallel for schedule(static,1000)
+#pragma omp parallel for schedule(static,1000) num_threads(pool.size())
             for (row_type i = 0; i < leftMatrix.rowNum; i++) {
                 double* dProbe = leftMatrix.getMatrixRowPtr(i);
                 A(0, i) = 0;
@@ -233,7 +233,7 @@ namespace mips {
             queryMatrix.colNum = leftMatrix.colNum + 1;
             queryMatrix.initializeBasics(queryMatrix.colNum, queryMatrix.rowNum, false);
 
-#pragma omp parallel for schedule(static,1000)
+#pragma omp parallel for schedule(static,1000) num_threads(pool.size())
             for (row_type i = 0; i < queryMatrix.rowNum; i++) {
                 double* dQuery = queryMatrix.getMatrixRowPtr(i);
                 for (col_type j = 0; j < queryMatrix.colNum; ++j) {
@@ -280,7 +280,7 @@ namespace mips {
                 myNumThreads = leftMatrix.rowNum;
                 std::cout << "[WARNING] Query matrix contains too few elements. Suboptimal running with " << myNumThreads << " thread(s)" << std::endl;
             }
-            omp_set_num_threads(myNumThreads);
+            pool.start();
             queryMatrices.resize(myNumThreads);
 
 
@@ -320,7 +320,7 @@ namespace mips {
                 std::cout << "[INFO] Logging in " << args.logFile << std::endl;
             }
 
-            omp_set_num_threads(args.threads);
+            pool.init(args.threads);
         }
 
         inline ~PcaTree() {
@@ -373,7 +373,7 @@ namespace mips {
                 retrArg[i].allocTopkResults();
 
             comp_type comparisons = 0;
-#pragma omp parallel reduction(+ : comparisons)
+#pragma omp parallel num_threads(queryMatrices.size()) reduction(+ : comparisons)
             {
                 row_type tid = omp_get_thread_num();
                 double minScore = 0;
@@ -0,0 +1,404 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   ShardedLemp.h
+ */
+
+#ifndef SHARDEDLEMP_H
+#define	SHARDEDLEMP_H
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace mips {
+
+    /*
+     * Coordinator of LEMP shards. The probe matrix is partitioned among worker processes (forked in initialize, one
+     * Lemp instance each) that talk to the coordinator over local Unix sockets. Query batches are sent to all shards
+     * and their partial results are merged.
+     *
+     * For top-k, the shard with the longest probe vectors (shard 0) can answer each batch first. The k-th score of
+     * each query is then sent as a bound to the other shards, which prune everything below it.
+     *
+     * initialize has to be called before the coordinator runs any OpenMP parallel region (OpenMP does not survive fork).
+     */
+    class ShardedLemp : public Mip {
+        LempArguments args;
+        int shards;
+        Shard_Partition partition;
+        bool propagateBounds;
+        row_type batchSize;
+
+        std::vector<ShardChannel> channels;
+        std::vector<pid_t> workers;
+
+        inline void printAlgoName(const VectorMatrix& leftMatrix) {
+            logging << "LEMP_SHARDED(" << shards << ")\t" << args.threads << "\t";
+            std::cout << "[ALGORITHM] LEMP with " << shards << " shard(s) and " << args.threads << " thread(s) in total" << std::endl;
+
+            logging << "P(" << probeMatrix.rowNum << "x" << (0 + probeMatrix.colNum) << ")\t";
+            logging << "Q^T(" << leftMatrix.rowNum << "x" << (0 + leftMatrix.colNum) << ")\t";
+        }
+
+        inline void partitionProbeMatrix(const VectorMatrix& rightMatrix, std::vector<std::vector<row_type> >& shardIds) const {
+            shardIds.resize(shards);
+
+            if (partition == SHARD_BY_HASH) {
+                for (row_type i = 0; i < rightMatrix.rowNum; ++i) {
+                    shardIds[(i * 2654435761u) % shards].push_back(i);
+                }
+                return;
+            }
+
+            // no OpenMP here: the workers are not forked yet
+            std::vector<QueueElement> lengths(rightMatrix.rowNum);
+            for (row_type i = 0; i < rightMatrix.rowNum; ++i) {
+                lengths[i] = QueueElement(calculateLength(rightMatrix.getMatrixRowPtr(i), rightMatrix.colNum), i);
+            }
+            std::sort(lengths.begin(), lengths.end(), std::greater<QueueElement>());
+
+            for (int s = 0; s < shards; ++s) {
+                row_type start = (uint64_t) rightMatrix.rowNum * s / shards;
+                row_type end = (uint64_t) rightMatrix.rowNum * (s + 1) / shards;
+
+                for (row_type i = start; i < end; ++i) {
+                    shardIds[s].push_back(lengths[i].id);
+                }
+            }
+        }
+
+        /*
+         * Main loop of a worker process. Never returns
+         */
+        inline void runWorker(ShardChannel& channel, const VectorMatrix& rightMatrix, const std::vector<row_type>& ids) {
+            std::cout.setstate(std::ios_base::badbit); // the coordinator does the reporting
+
+            InputArguments in;
+            in.copyInputArguments(args);
+            in.threads = std::max(1, args.threads / shards);
+            in.logFile = "";
+
+            VectorMatrix shardMatrix;
+            shardMatrix.addVectors(rightMatrix, ids);
+
+            Lemp algo(in, args.cacheSizeinKB, args.method, args.isTARR, args.R, args.epsilon);
+            algo.setBulkTree(args.bulkTree);
+            algo.setDualTree(args.dualTree);
+            algo.setAnnoy(args.numTrees, args.search_k);
+            algo.setHnsw(args.ef);
+            algo.setPq(args.pqSubspaces, args.pqExact);
+            algo.setRangeBounds(args.rangeBounds);
+            algo.setConeBounds(args.coneClusters);
+            algo.setIntraQuery(args.intraQuery);
+            algo.initialize(shardMatrix);
+
+            channel.send<row_type>(shardMatrix.rowNum); // ready
+
+            VectorMatrix queries;
+            std::vector<double> bounds;
+            std::vector<MatItem> items;
+
+            while (true) {
+                Shard_Command command = channel.receive<Shard_Command>();
+
+                if (command == SHARD_QUIT)
+                    break;
+
+                Results results;
+                comp_type comparisons = algo.getComparisons();
+
+                if (command == SHARD_TOPK) {
+                    channel.receiveVector(bounds);
+                    channel.receiveMatrix(queries);
+                    algo.setTopkBounds(bounds);
+                    algo.runTopK(queries, results);
+                } else {
+                    algo.setTheta(channel.receive<double>());
+                    channel.receiveMatrix(queries);
+                    algo.runAboveTheta(queries, results);
+                }
+
+                items.clear();
+                for (auto& threadResult : results.resultsVector) {
+                    for (auto& item : threadResult) {
+                        items.push_back(MatItem(item.result, item.i, ids[item.j]));
+                    }
+                }
+
+                channel.send<comp_type>(algo.getComparisons() - comparisons);
+                channel.sendVector(items);
+            }
+
+            channel.close();
+            _exit(0);
+        }
+
+        inline void sendTopk(int s, const VectorMatrix& leftMatrix, row_type start, row_type end, const std::vector<double>& bounds) {
+            channels[s].send<Shard_Command>(SHARD_TOPK);
+            channels[s].sendVector(bounds);
+            channels[s].sendMatrix(leftMatrix, start, end);
+        }
+
+        inline comp_type receiveResults(int s, std::vector<MatItem>& items) {
+            comp_type comparisons = channels[s].receive<comp_type>();
+            channels[s].receiveVector(items);
+            return comparisons;
+        }
+
+        inline void groupByQuery(const std::vector<MatItem>& items, std::vector<std::vector<QueueElement> >& perQuery) const {
+            for (auto& item : items) {
+                perQuery[item.i].emplace_back(item.result, item.j);
+            }
+        }
+
+        // k-th score of each query (or no bound if there are fewer than k results)
+        inline void computeBounds(const std::vector<MatItem>& items, row_type queries, std::vector<double>& bounds) const {
+            std::vector<std::vector<QueueElement> > perQuery(queries);
+            groupByQuery(items, perQuery);
+
+            bounds.assign(queries, -std::numeric_limits<double>::max());
+            for (row_type q = 0; q < queries; ++q) {
+                if (perQuery[q].size() >= args.k) {
+                    std::nth_element(perQuery[q].begin(), perQuery[q].begin() + args.k - 1, perQuery[q].end(), std::greater<QueueElement>());
+                    bounds[q] = perQuery[q][args.k - 1].data;
+                }
+            }
+        }
+
+    public:
+
+        inline ShardedLemp(InputArguments& in, int shards, int cacheSizeinKB, LEMP_Method method, bool isTARR, double R, double epsilon) :
+        shards(shards > 0 ? shards : 1), partition(SHARD_BY_LENGTH), propagateBounds(true), batchSize(10000) {
+            args.copyInputArguments(in);
+            args.cacheSizeinKB = cacheSizeinKB;
+            args.method = method;
+            args.isTARR = isTARR;
+            args.R = R;
+            args.epsilon = epsilon;
+
+            logging.open(args.logFile.c_str(), std::ios_base::app);
+
+            if (!logging.is_open()) {
+                std::cout << "[WARNING] No log will be created!" << std::endl;
+            } else {
+                std::cout << "[INFO] Logging in " << args.logFile << std::endl;
+            }
+        }
+
+        inline ~ShardedLemp() {
+            for (int s = 0; s < workers.size(); ++s) {
+                channels[s].send<Shard_Command>(SHARD_QUIT);
+                channels[s].close();
+                waitpid(workers[s], nullptr, 0);
+            }
+            logging.close();
+        }
+
+        inline void setPartition(Shard_Partition p) {
+            partition = p;
+        }
+
+        inline void setPropagateBounds(bool propagate) {
+            propagateBounds = propagate;
+        }
+
+        inline void setBatchSize(row_type size) {
+            batchSize = (size > 0 ? size : 1);
+        }
+
+        inline void setBulkTree(bool bulkTree) {
+            args.bulkTree = bulkTree;
+        }
+
+        inline void setDualTree(bool dualTree) {
+            args.dualTree = dualTree;
+        }
+
+        inline void setAnnoy(int numTrees, int search_k) {
+            args.numTrees = std::max(1, numTrees);
+            args.search_k = std::max(1, search_k);
+        }
+
+        inline void setHnsw(int ef) {
+            args.ef = std::max(1, ef);
+        }
+
+        inline void setPq(int subspaces, bool exact) {
+            args.pqSubspaces = std::max(1, subspaces);
+            args.pqExact = exact;
+        }
+
+        inline void setRangeBounds(bool rangeBounds) {
+            args.rangeBounds = rangeBounds;
+        }
+
+        inline void setConeBounds(int clusters) {
+            args.coneClusters = std::max(0, clusters);
+        }
+
+        inline void setIntraQuery(bool intraQuery) {
+            args.intraQuery = intraQuery;
+        }
+
+        inline void initialize(VectorMatrix& rightMatrix) {
+            std::cout << "[INIT] ProbeMatrix contains " << rightMatrix.rowNum << " vectors with dimensionality " << (0 + rightMatrix.colNum) << std::endl;
+            timer.start();
+
+            probeMatrix.rowNum = rightMatrix.rowNum;
+            probeMatrix.colNum = rightMatrix.colNum;
+
+            std::vector<std::vector<row_type> > shardIds;
+            partitionProbeMatrix(rightMatrix, shardIds);
+
+            channels.resize(shards);
+            workers.resize(shards);
+
+            for (int s = 0; s < shards; ++s) {
+                ShardChannel workerEnd;
+                ShardChannel::createPair(channels[s], workerEnd);
+
+                pid_t pid = fork();
+                if (pid < 0) {
+                    perror("[ERROR] fork");
+                    exit(1);
+                }
+
+                if (pid == 0) {
+                    for (int other = 0; other <= s; ++other) {
+                        channels[other].close();
+                    }
+                    runWorker(workerEnd, rightMatrix, shardIds[s]);
+                }
+
+                workerEnd.close();
+                workers[s] = pid;
+            }
+
+            for (int s = 0; s < shards; ++s) {
+                row_type shardSize = channels[s].receive<row_type>();
+                std::cout << "[INIT] Shard " << s << " (pid " << workers[s] << ") holds " << shardSize << " vectors" << std::endl;
+            }
+
+            timer.stop();
+            dataPreprocessingTimeRight += timer.elapsedTime().nanos();
+        }
+
+        inline void runTopK(VectorMatrix& leftMatrix, Results& results) {
+            printAlgoName(leftMatrix);
+            std::cout << "[RETRIEVAL] Retrieval (k = " << args.k << ") starts ..." << std::endl;
+            logging << "k(" << args.k << ")\t";
+
+            if (results.resultsVector.empty())
+                results.resultsVector.resize(1);
+
+            timer.start();
+
+            std::vector<std::vector<MatItem> > shardItems(shards);
+            std::vector<double> bounds;
+            comp_type comparisons = 0;
+
+            for (row_type start = 0; start < leftMatrix.rowNum; start += batchSize) {
+                row_type end = std::min(start + batchSize, leftMatrix.rowNum);
+                row_type queries = end - start;
+                int first = 0;
+
+                bounds.clear();
+                if (propagateBounds && shards > 1) {
+                    sendTopk(0, leftMatrix, start, end, bounds);
+                    comparisons += receiveResults(0, shardItems[0]);
+                    computeBounds(shardItems[0], queries, bounds);
+                    first = 1;
+                }
+
+                for (int s = first; s < shards; ++s) {
+                    sendTopk(s, leftMatrix, start, end, bounds);
+                }
+                for (int s = first; s < shards; ++s) {
+                    comparisons += receiveResults(s, shardItems[s]);
+                }
+
+                // merge
+                std::vector<std::vector<QueueElement> > perQuery(queries);
+                for (auto& items : shardItems) {
+                    groupByQuery(items, perQuery);
+                }
+
+                for (row_type q = 0; q < queries; ++q) {
+                    row_type top = std::min<row_type>(args.k, perQuery[q].size());
+                    std::partial_sort(perQuery[q].begin(), perQuery[q].begin() + top, perQuery[q].end(), std::greater<QueueElement>());
+
+                    for (row_type j = 0; j < top; ++j) {
+                        results.resultsVector[0].push_back(MatItem(perQuery[q][j].data, start + q, perQuery[q][j].id));
+                    }
+                }
+            }
+
+            timer.stop();
+            retrievalTime += timer.elapsedTime().nanos();
+            totalComparisons += comparisons;
+
+            std::cout << "[RETRIEVAL] ... and is finished with " << results.getResultSize() << " results" << std::endl;
+            logging << results.getResultSize() << "\t";
+        }
+
+        inline void runAboveTheta(VectorMatrix& leftMatrix, Results& results) {
+            printAlgoName(leftMatrix);
+            std::cout << "[RETRIEVAL] Retrieval (theta = " << args.theta << ") starts ..." << std::endl;
+            logging << "theta(" << args.theta << ")\t";
+
+            if (results.resultsVector.size() < shards)
+                results.resultsVector.resize(shards);
+
+            timer.start();
+
+            std::vector<MatItem> items;
+            comp_type comparisons = 0;
+
+            for (row_type start = 0; start < leftMatrix.rowNum; start += batchSize) {
+                row_type end = std::min(start + batchSize, leftMatrix.rowNum);
+
+                for (int s = 0; s < shards; ++s) {
+                    channels[s].send<Shard_Command>(SHARD_ABOVE_THETA);
+                    channels[s].send<double>(args.theta);
+                    channels[s].sendMatrix(leftMatrix, start, end);
+                }
+
+                for (int s = 0; s < shards; ++s) {
+                    comparisons += receiveResults(s, items);
+                    for (auto& item : items) {
+                        item.i += start;
+                    }
+                    results.moveAppend(items, s);
+                }
+            }
+
+            timer.stop();
+            retrievalTime += timer.elapsedTime().nanos();
+            totalComparisons += comparisons;
+
+            std::cout << "[RETRIEVAL] ... and is finished with " << results.getResultSize() << " results" << std::endl;
+            logging << results.getResultSize() << "\t";
+        }
+
+        inline void setTheta(double theta) {
+            args.theta = theta;
+        }
+
+    };
+
+}
+
+#endif	/* SHARDEDLEMP_H */
@@ -22,7 +22,7 @@ namespace mips {
             queryMatrix.colNum = leftMatrix.colNum + 1;
             queryMatrix.initializeBasics(queryMatrix.colNum, queryMatrix.rowNum, false);
 
-#pragma omp parallel for schedule(static,1000)
+#pragma omp parallel for schedule(static,1000) num_threads(pool.size())
             for (row_type i = 0; i < queryMatrix.rowNum; i++) {
                 double* dQuery = leftMatrix.getMatrixRowPtr(i);
                 double* dTmp = queryMatrix.getMatrixRowPtr(i);
@@ -53,7 +53,7 @@ namespace mips {
             probeMatrix.colNum = rightMatrix.colNum + 1;
             probeMatrix.initializeBasics(probeMatrix.colNum, probeMatrix.rowNum, false);
 
-#pragma omp parallel for schedule(static,1000)
+#pragma omp parallel for schedule(static,1000) num_threads(pool.size())
             for (row_type i = 0; i < probeMatrix.rowNum; i++) {
                 double* dProbe = rightMatrix.getMatrixRowPtr(i);
                 double* dTmp = probeMatrix.getMatrixRowPtr(i);
@@ -83,7 +83,7 @@ namespace mips {
                 myNumThreads = leftMatrix.rowNum;
                 std::cout << "[WARNING] Query matrix contains too few elements. Suboptimal running with " << myNumThreads << " thread(s)" << std::endl;
             }
-            omp_set_num_threads(myNumThreads);
+            pool.start();
             queryMatrices.resize(myNumThreads);
 
             timer.start();
@@ -134,7 +134,7 @@ namespace mips {
                 std::cout << "[INFO] Logging in " << args.logFile << std::endl;
             }
 
-            omp_set_num_threads(args.threads);
+            pool.init(args.threads);
             retrArg.resize(args.threads);
         }
 
@@ -191,7 +191,7 @@ namespace mips {
             timer.start();
 
             comp_type comparisons = 0;
-#pragma omp parallel reduction(+ : comparisons)
+#pragma omp parallel num_threads(queryMatrices.size()) reduction(+ : comparisons)
             {
                 row_type tid = omp_get_thread_num();
 
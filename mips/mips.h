@@ -29,6 +29,7 @@
 #include <mips/structs/Results.h>
 #include <mips/structs/Output.h>
 #include <mips/structs/Lists.h>
+#include <mips/structs/ItemFilter.h>
 
 ////////////////////////////// mlpack stuff//////////////////////
 #include <mips/my_mlpack/core.hpp>
@@ -37,6 +38,8 @@
 #include <mips/my_mlpack/fastmks/fastmks_impl.hpp>
 #include <mips/my_mlpack/fastmks/fastmks_rules.hpp>
 #include <mips/my_mlpack/fastmks/fastmks_rules_impl.hpp>
+#include <mips/my_mlpack/fastmks/fastmks_dual_rules.hpp>
+#include <mips/my_mlpack/fastmks/fastmks_dual_rules_impl.hpp>
 ///////////////////////////////////////////////////////////////////
 /////////// l2ap stuff ///////////////
 #include <mips/ap/includes.h>
@@ -53,12 +56,23 @@
 
 
 #include <mips/structs/TreeIndex.h>
+#include <mips/structs/AnnoyIndex.h>
+#include <mips/structs/HnswIndex.h>
+#include <mips/structs/PqIndex.h>
 #include <mips/structs/Candidates.h>
 #include <mips/structs/TAState.h>
 #include <mips/structs/TANRAState.h>
+#include <mips/structs/SharedMinScore.h>
+#include <mips/structs/WorkerPool.h>
+#include <mips/structs/ShardChannel.h>
+#include <mips/structs/CostModel.h>
+#include <mips/structs/SampleSizer.h>
 #include <mips/structs/RetrievalArguments.h>//////////////////////
 #include <mips/structs/QueryBatch.h>
+#include <mips/structs/OnlineTuner.h>
 #include <mips/structs/ProbeBucket.h>
+#include <mips/structs/TuningCache.h>
+#include <mips/structs/QueryCache.h>
 #include <mips/structs/Bucketize.h>
 #include <mips/structs/CandidateVerification.h>
 
@@ -74,6 +88,10 @@
 #include <mips/retrieval/apRetriever.h>
 #include <mips/retrieval/lshRetriever.h> 
 #include <mips/retrieval/blshRetriever.h> 
+#include <mips/retrieval/candidateIndexRetriever.h>
+#include <mips/retrieval/annoyRetriever.h>
+#include <mips/retrieval/hnswRetriever.h>
+#include <mips/retrieval/pqRetriever.h>
 
 #include <mips/algos/Mip.h>
 #include <mips/algos/Naive.h>
@@ -82,6 +100,7 @@
 #include <mips/algos/TaNra.h>
 #include <mips/algos/SimpleLsh.h>
 #include <mips/algos/Lemp.h>
+#include <mips/algos/ShardedLemp.h>
 
 
 #endif
@@ -110,11 +110,15 @@ class MyCoverTree
    *
    * @param dataset Reference to the dataset to build a tree on.
    * @param base Base to use during tree building (default 2.0).
+   * @param bulkBuild If true, the points are sorted by their distance to the
+   *     point of the node once, whenever distances are computed.  Splitting
+   *     near and far sets down the chain of self-children then becomes a binary
+   *     search.
    */
   MyCoverTree(const arma::mat& dataset, int threads,
             const double base = 2.0,
             VectorMatrix* my_matrix=NULL, size_t startPos=0, size_t endPos=0, 
-            MetricType* metric = NULL);
+            MetricType* metric = NULL, bool bulkBuild = false);
 
 
 
@@ -162,6 +166,8 @@ class MyCoverTree
    * @param farSetSize Size of the far set; may be modified (if this node uses
    *     any points in the far set).
    * @param usedSetSize The number of points used will be added to this number.
+   * @param sortedSet True if [ nearSet | farSet ] is sorted by distance (bulk
+   *     build only).
    */
   MyCoverTree(const arma::mat& dataset, int threads,
             const double base,
@@ -175,7 +181,8 @@ class MyCoverTree
             size_t& farSetSize,
             size_t& usedSetSize,
             MetricType& metric = NULL,
-            VectorMatrix* my_matrix=NULL, size_t startPos=0, size_t endPos=0);
+            VectorMatrix* my_matrix=NULL, size_t startPos=0, size_t endPos=0,
+            bool sortedSet = false);
 
   /**
    * Manually construct a cover tree node; no tree assembly is done in this
@@ -345,6 +352,7 @@ class MyCoverTree
 
   VectorMatrix* my_matrix; // this is to hack in my implementation
   size_t startPos, endPos; // tree will be built for only some part of the matrix
+  bool bulkBuild; // sort the points by distance once per distance computation
 
 
  private:
@@ -399,7 +407,8 @@ class MyCoverTree
       arma::vec& distances,
       size_t nearSetSize,
       size_t& farSetSize,
-      size_t& usedSetSize, int threads);
+      size_t& usedSetSize, int threads,
+      bool sortedSet = false);
 
   /**
    * Fill the vector of distances with the distances between the point specified
@@ -423,6 +432,30 @@ class MyCoverTree
       arma::vec& distances,
       const size_t pointSetSize);
 
+  /**
+   * True if a point set of this size is worth splitting across threads.  Trees
+   * that are built inside a parallel region (e.g. one bucket per thread) are
+   * built serially.
+   */
+  bool BuildInParallel(const size_t pointSetSize) const;
+
+  /**
+   * Sort the first pointSetSize indices and distances by distance (bulk build).
+   */
+  void SortByDistance(arma::Col<size_t>& indices,
+                      arma::vec& distances,
+                      const size_t pointSetSize);
+
+  /**
+   * Parallel stable partition of [first, last): points with distance less than
+   * or equal to bound go to the front.  Returns the number of these points.
+   */
+  size_t ParallelSplit(arma::Col<size_t>& indices,
+                       arma::vec& distances,
+                       const double bound,
+                       const size_t first,
+                       const size_t last);
+
   /**
    * Split the given indices and distances into a near and a far set, returning
    * the number of points in the near set.  The distances must already be
@@ -436,11 +469,13 @@ class MyCoverTree
    *      is placed into the near set.
    * @param pointSetSize Size of point set (because we may be sorting a smaller
    *      list than the indices vector will hold).
+   * @param sorted True if the point set is sorted by distance.
    */
   size_t SplitNearFar(arma::Col<size_t>& indices,
                       arma::vec& distances,
                       const double bound,
-                      const size_t pointSetSize);
+                      const size_t pointSetSize,
+                      const bool sorted = false);
 
   /**
    * Assuming that the list of indices and distances is sorted as
@@ -479,7 +514,8 @@ class MyCoverTree
                      arma::vec& distances,
                      const double bound,
                      const size_t nearSetSize,
-                     const size_t pointSetSize);
+                     const size_t pointSetSize,
+                     const bool sorted = false);
 
   /**
    * Take a look at the last child (the most recently created one) and remove
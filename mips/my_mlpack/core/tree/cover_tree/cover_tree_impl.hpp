@@ -19,6 +19,9 @@
 
 #include <mips/my_mlpack/core/util/string_util.hpp>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
 
 namespace mips {
     namespace tree {
@@ -32,7 +35,7 @@ namespace mips {
                 const arma::mat& dataset, int threads,
                 const double base,
                 VectorMatrix* my_matrix, size_t startPos, size_t endPos, 
-                MetricType* metric) :
+                MetricType* metric, bool bulkBuild) :
         dataset(dataset),
         point(RootPointPolicy::ChooseRoot(dataset)),
         scale(INT_MAX),
@@ -44,7 +47,7 @@ namespace mips {
         localMetric(metric == NULL),
         metric(metric),
         distanceComps(0),
-        my_matrix(my_matrix), startPos(startPos), endPos(endPos), threads(threads) {
+        my_matrix(my_matrix), startPos(startPos), endPos(endPos), bulkBuild(bulkBuild), threads(threads) {
 
             //	if(my_matrix == NULL){
             //		// If we need to create a metric, do that.  We'll just do it on the heap.
@@ -120,8 +123,11 @@ namespace mips {
                 this->metric = new MetricType();
 
             // If there is only one point in the dataset... uh, we're done.
-            if (my_matrix->rowNum == 1 || endPos - startPos == 1)
+            if (my_matrix->rowNum == 1 || endPos - startPos == 1) {
+                point = startPos;
+                stat = StatisticType(*this);
                 return;
+            }
 
             // Kick off the building.  Create the indices array and the distances array.
             arma::Col<size_t> indices = arma::linspace<arma::Col<size_t> >(startPos + 1,
@@ -143,12 +149,14 @@ namespace mips {
             // Build the initial distances.
             MyComputeDistances(point, indices, distances, endPos - 1 - startPos);
 
+            if (bulkBuild)
+                SortByDistance(indices, distances, endPos - 1 - startPos);
 
             // Create the children.
             size_t farSetSize = 0;
             size_t usedSetSize = 0;
             MyCreateChildren(indices, distances, endPos - 1 - startPos, farSetSize,
-                    usedSetSize, threads);
+                    usedSetSize, threads, bulkBuild);
 
 
             // If we ended up creating only one child, remove the implicit node.
@@ -208,7 +216,7 @@ namespace mips {
         localMetric(false),
         metric(&metric),
         distanceComps(0),
-        my_matrix(my_matrix), startPos(startPos), endPos(endPos), threads(threads) {
+        my_matrix(my_matrix), startPos(startPos), endPos(endPos), bulkBuild(false), threads(threads) {
             // If there is only one point in the dataset, uh, we're done.
             if (dataset.n_cols == 1)
                 return;
@@ -281,7 +289,8 @@ namespace mips {
                 size_t& farSetSize,
                 size_t& usedSetSize,
                 MetricType& metric,
-                VectorMatrix* my_matrix, size_t startPos, size_t endPos) :
+                VectorMatrix* my_matrix, size_t startPos, size_t endPos,
+                bool sortedSet) :
         dataset(dataset),
         point(pointIndex),
         scale(scale),
@@ -293,7 +302,8 @@ namespace mips {
         localMetric(false),
         metric(&metric),
         distanceComps(0),
-        my_matrix(my_matrix), startPos(startPos), endPos(endPos), threads(threads) {
+        my_matrix(my_matrix), startPos(startPos), endPos(endPos), bulkBuild(parent != NULL && parent->bulkBuild),
+        threads(threads) {
 
             
             // If the size of the near set is 0, this is a leaf.
@@ -311,7 +321,7 @@ namespace mips {
                 // Otherwise, create the children.
                 CreateChildren(indices, distances, nearSetSize, farSetSize, usedSetSize, threads);
             } else {
-                MyCreateChildren(indices, distances, nearSetSize, farSetSize, usedSetSize, threads);
+                MyCreateChildren(indices, distances, nearSetSize, farSetSize, usedSetSize, threads, sortedSet);
             }
 
 
@@ -342,7 +352,8 @@ namespace mips {
         localMetric(metric == NULL),
         metric(metric),
         distanceComps(0),
-        my_matrix(my_matrix), startPos(startPos), endPos(endPos), threads(threads) {
+        my_matrix(my_matrix), startPos(startPos), endPos(endPos), bulkBuild(parent != NULL && parent->bulkBuild),
+        threads(threads) {
             // If necessary, create a local metric.
             if (localMetric)
                 this->metric = new MetricType();
@@ -366,7 +377,7 @@ namespace mips {
         localMetric(false),
         metric(other.metric),
         distanceComps(0),
-        my_matrix(other.my_matrix), startPos(other.startPos), endPos(other.endPos), threads(other->threads) {
+        my_matrix(other.my_matrix), startPos(other.startPos), endPos(other.endPos), bulkBuild(other.bulkBuild), threads(other->threads) {
 
             //stat.resize(threads);
             // Copy each child by hand.
@@ -738,7 +749,8 @@ namespace mips {
                 arma::vec& distances,
                 size_t nearSetSize,
                 size_t& farSetSize,
-                size_t& usedSetSize, int threads) {
+                size_t& usedSetSize, int threads,
+                bool sortedSet) {
             // Determine the next scale level.  This should be the first level where there
             // are any points in the far set.  So, if we know the maximum distance in the
             // distances array, this will be the largest i such that
@@ -748,7 +760,9 @@ namespace mips {
             // will be created as a leaf, and a child to this node.  We also do not need
             // to change the furthestChildDistance or furthestDescendantDistance.
 
-            const double maxDistance = max(distances.rows(0, nearSetSize + farSetSize - 1));
+            // In a bulk build [ near | far ] is sorted, the maximum is the last distance.
+            const double maxDistance = (sortedSet ? distances[nearSetSize + farSetSize - 1] :
+                    max(distances.rows(0, nearSetSize + farSetSize - 1)));
 
 
             if (maxDistance == 0) {
@@ -790,7 +804,7 @@ namespace mips {
             // First, make the self child.  We must split the given near set into the near
             // set and far set for the self child.
             size_t childNearSetSize =
-                    SplitNearFar(indices, distances, bound, nearSetSize); /////////////////??????????????? seems ok
+                    SplitNearFar(indices, distances, bound, nearSetSize, sortedSet); /////////////////??????????????? seems ok
 
 
 
@@ -799,7 +813,7 @@ namespace mips {
             size_t childUsedSetSize = 0;
             children.push_back(new MyCoverTree(dataset, threads, base, point, nextScale, this, 0,
                     indices, distances, childNearSetSize, childFarSetSize, childUsedSetSize,
-                    *metric, my_matrix, startPos, endPos));
+                    *metric, my_matrix, startPos, endPos, sortedSet));
 
 
 
@@ -887,14 +901,16 @@ namespace mips {
                 MyComputeDistances(indices[0], childIndices, childDistances, nearSetSize
                         + farSetSize - 1);
 
+                if (bulkBuild)
+                    SortByDistance(childIndices, childDistances, nearSetSize + farSetSize - 1);
 
                 // Split into near and far sets for this point.
                 childNearSetSize = SplitNearFar(childIndices, childDistances, bound,
-                        nearSetSize + farSetSize - 1);
+                        nearSetSize + farSetSize - 1, bulkBuild);
 
                 childFarSetSize = PruneFarSet(childIndices, childDistances,
                         base * bound, childNearSetSize,
-                        (nearSetSize + farSetSize - 1));
+                        (nearSetSize + farSetSize - 1), bulkBuild);
 
                 // Now that we know the near and far set sizes, we can put the used point
                 // (the self point) in the correct place; now, when we call
@@ -907,7 +923,7 @@ namespace mips {
                 childUsedSetSize = 1; // Mark self point as used.
                 children.push_back(new MyCoverTree(dataset, threads, base, indices[0], nextScale,
                         this, distances[0], childIndices, childDistances, childNearSetSize,
-                        childFarSetSize, childUsedSetSize, *metric, my_matrix, startPos, endPos)); ////////////////
+                        childFarSetSize, childUsedSetSize, *metric, my_matrix, startPos, endPos, bulkBuild)); ////////////////
 
                 numDescendants += children.back()->NumDescendants();
 
@@ -938,12 +954,20 @@ namespace mips {
                 arma::Col<size_t>& indices,
                 arma::vec& distances,
                 const double bound,
-                const size_t pointSetSize) {
+                const size_t pointSetSize,
+                const bool sorted) {
             // Sanity check; there is no guarantee that this condition will not be true.
             // ...or is there?
             if (pointSetSize <= 1)
                 return 0;
 
+            // The near set is already at the front.
+            if (sorted)
+                return std::upper_bound(distances.memptr(), distances.memptr() + pointSetSize, bound) - distances.memptr();
+
+            if (BuildInParallel(pointSetSize))
+                return ParallelSplit(indices, distances, bound, 0, pointSetSize);
+
             // We'll traverse from both left and right.
             size_t left = 0;
             size_t right = pointSetSize - 1;
@@ -1012,12 +1036,121 @@ namespace mips {
             distanceComps += pointSetSize;
             const double* thisVector = my_matrix->getMatrixRowPtr(pointIndex);
 
+#pragma omp parallel for schedule(static) num_threads(threads) if(BuildInParallel(pointSetSize))
             for (size_t i = 0; i < pointSetSize; ++i) {
                 distances[i] = my_matrix->L2Distance(indices[i], thisVector);
             }
 
         }
 
+        template<typename MetricType, typename RootPointPolicy, typename StatisticType>
+        inline bool MyCoverTree<MetricType, RootPointPolicy, StatisticType>::BuildInParallel(
+                const size_t pointSetSize) const {
+            return threads > 1 && pointSetSize >= TREE_PARALLEL_POINTS && !omp_in_parallel();
+        }
+
+        template<typename MetricType, typename RootPointPolicy, typename StatisticType>
+        void MyCoverTree<MetricType, RootPointPolicy, StatisticType>::SortByDistance(
+                arma::Col<size_t>& indices,
+                arma::vec& distances,
+                const size_t pointSetSize) {
+
+            const bool parallel = BuildInParallel(pointSetSize);
+            std::vector<std::pair<double, size_t> > points(pointSetSize);
+
+#pragma omp parallel for schedule(static) num_threads(threads) if(parallel)
+            for (size_t i = 0; i < pointSetSize; ++i) {
+                points[i] = std::make_pair(distances[i], indices[i]);
+            }
+
+            if (parallel) {
+                // sort one chunk per thread and merge the chunks pairwise
+                const size_t chunks = threads;
+                std::vector<size_t> chunkStart(chunks + 1);
+                for (size_t c = 0; c <= chunks; ++c) {
+                    chunkStart[c] = pointSetSize * c / chunks;
+                }
+
+#pragma omp parallel for schedule(static, 1) num_threads(threads)
+                for (size_t c = 0; c < chunks; ++c) {
+                    std::sort(points.begin() + chunkStart[c], points.begin() + chunkStart[c + 1]);
+                }
+
+                for (size_t width = 1; width < chunks; width *= 2) {
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+                    for (size_t c = 0; c < chunks; c += 2 * width) {
+                        if (c + width < chunks) {
+                            std::inplace_merge(points.begin() + chunkStart[c], points.begin() + chunkStart[c + width],
+                                    points.begin() + chunkStart[std::min(c + 2 * width, chunks)]);
+                        }
+                    }
+                }
+            } else {
+                std::sort(points.begin(), points.end());
+            }
+
+#pragma omp parallel for schedule(static) num_threads(threads) if(parallel)
+            for (size_t i = 0; i < pointSetSize; ++i) {
+                distances[i] = points[i].first;
+                indices[i] = points[i].second;
+            }
+        }
+
+        template<typename MetricType, typename RootPointPolicy, typename StatisticType>
+        size_t MyCoverTree<MetricType, RootPointPolicy, StatisticType>::ParallelSplit(
+                arma::Col<size_t>& indices,
+                arma::vec& distances,
+                const double bound,
+                const size_t first,
+                const size_t last) {
+
+            const size_t pointSetSize = last - first;
+            arma::Col<size_t> tempIndices(pointSetSize);
+            arma::vec tempDistances(pointSetSize);
+            std::vector<size_t> nearBefore(threads + 1, 0); // near points in the chunks of the previous threads
+            size_t nearSetSize = 0;
+
+#pragma omp parallel num_threads(threads)
+            {
+                const size_t tid = omp_get_thread_num();
+                const size_t teamSize = omp_get_num_threads();
+                const size_t start = first + pointSetSize * tid / teamSize;
+                const size_t end = first + pointSetSize * (tid + 1) / teamSize;
+
+                size_t count = 0;
+                for (size_t i = start; i < end; ++i) {
+                    if (distances[i] <= bound)
+                        count++;
+                }
+                nearBefore[tid + 1] = count;
+
+#pragma omp barrier
+#pragma omp single
+                {
+                    for (size_t t = 1; t <= teamSize; ++t)
+                        nearBefore[t] += nearBefore[t - 1];
+                    nearSetSize = nearBefore[teamSize];
+                }
+
+                // [ near points of all chunks | far points of all chunks ], each in the original order
+                size_t nearPos = nearBefore[tid];
+                size_t farPos = nearSetSize + (start - first) - nearBefore[tid];
+                for (size_t i = start; i < end; ++i) {
+                    const size_t pos = (distances[i] <= bound ? nearPos++ : farPos++);
+                    tempIndices[pos] = indices[i];
+                    tempDistances[pos] = distances[i];
+                }
+
+#pragma omp barrier
+                for (size_t i = start; i < end; ++i) {
+                    indices[i] = tempIndices[i - first];
+                    distances[i] = tempDistances[i - first];
+                }
+            }
+
+            return nearSetSize;
+        }
+
         template<typename MetricType, typename RootPointPolicy, typename StatisticType>
         size_t MyCoverTree<MetricType, RootPointPolicy, StatisticType>::SortPointSet(
                 arma::Col<size_t>& indices,
@@ -1207,10 +1340,18 @@ namespace mips {
                 arma::vec& distances,
                 const double bound,
                 const size_t nearSetSize,
-                const size_t pointSetSize) {
+                const size_t pointSetSize,
+                const bool sorted) {
             // What we are trying to do is remove any points greater than the bound from
             // the far set.  We don't care what happens to those indices and distances...
             // so, we don't need to properly swap points -- just drop new ones in place.
+            if (sorted)
+                return std::upper_bound(distances.memptr() + nearSetSize, distances.memptr() + pointSetSize, bound)
+                    - (distances.memptr() + nearSetSize);
+
+            if (BuildInParallel(pointSetSize - nearSetSize))
+                return ParallelSplit(indices, distances, bound, nearSetSize, pointSetSize);
+
             size_t left = nearSetSize;
             size_t right = pointSetSize - 1;
             while ((distances[left] <= bound) && (left != right))
@@ -0,0 +1,64 @@
+/**
+ * @file dual_tree_traverser.hpp
+ *
+ * Defines the DualTreeTraverser for the cover tree.  It recurses over pairs of
+ * a query node and a reference node (depth-first, always splitting the node of
+ * the larger scale) with a pruning rule on node pairs and a base case rule on
+ * point pairs.
+ *
+ * This file is part of mlpack 1.0.12.
+ *
+ * mlpack is free software; you may redstribute it and/or modify it under the
+ * terms of the 3-clause BSD license.  You should have received a copy of the
+ * 3-clause BSD license along with mlpack.  If not, see
+ * http://www.opensource.org/licenses/BSD-3-Clause for more information.
+ */
+#ifndef __MLPACK_CORE_TREE_COVER_TREE_DUAL_TREE_TRAVERSER_HPP
+#define __MLPACK_CORE_TREE_COVER_TREE_DUAL_TREE_TRAVERSER_HPP
+
+#include <mips/my_mlpack/core.hpp>
+
+#include "cover_tree.hpp"
+
+namespace mips {
+namespace tree {
+
+template<typename MetricType, typename RootPointPolicy, typename StatisticType>
+template<typename RuleType>
+class MyCoverTree<MetricType, RootPointPolicy, StatisticType>::DualTreeTraverser
+{
+ public:
+  /**
+   * Initialize the dual tree traverser with the given rule.
+   */
+  DualTreeTraverser(RuleType& rule);
+
+  /**
+   * Traverse the two trees.  Every pair of a query point and a reference point
+   * reaches the base case at most once: when both are leaves and no node pair
+   * on the way was pruned.
+   *
+   * @param queryNode The root of the query tree.
+   * @param referenceNode The root of the reference tree.
+   */
+  void Traverse(MyCoverTree& queryNode, MyCoverTree& referenceNode);
+
+ private:
+  //! The rule used for the traversal.
+  RuleType& rule;
+
+  /**
+   * Recurse into the node pair.  kernel is the kernel value between the points
+   * of the two nodes (known from the parent pair if a node is a self-child).
+   */
+  void Traverse(MyCoverTree& queryNode, MyCoverTree& referenceNode,
+                const double kernel);
+};
+
+}; // namespace tree
+}; // namespace mips
+
+// Include implementation.
+#include "dual_tree_traverser_impl.hpp"
+
+#endif
@@ -0,0 +1,97 @@
+/**
+ * @file dual_tree_traverser_impl.hpp
+ *
+ * Implementation of the dual tree traverser for cover trees, which implements
+ * a depth-first traversal of node pairs.
+ *
+ * This file is part of mlpack 1.0.12.
+ *
+ * mlpack is free software; you may redstribute it and/or modify it under the
+ * terms of the 3-clause BSD license.  You should have received a copy of the
+ * 3-clause BSD license along with mlpack.  If not, see
+ * http://www.opensource.org/licenses/BSD-3-Clause for more information.
+ */
+#ifndef __MLPACK_CORE_TREE_COVER_TREE_DUAL_TREE_TRAVERSER_IMPL_HPP
+#define __MLPACK_CORE_TREE_COVER_TREE_DUAL_TREE_TRAVERSER_IMPL_HPP
+
+// In case it hasn't been included yet.
+#include "dual_tree_traverser.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+namespace mips {
+    namespace tree {
+
+        template<typename MetricType, typename RootPointPolicy, typename StatisticType>
+        template<typename RuleType>
+        MyCoverTree<MetricType, RootPointPolicy, StatisticType>::
+        DualTreeTraverser<RuleType>::DualTreeTraverser(RuleType& rule) :
+        rule(rule) {
+            /* Nothing to do. */
+        }
+
+        template<typename MetricType, typename RootPointPolicy, typename StatisticType>
+        template<typename RuleType>
+        void MyCoverTree<MetricType, RootPointPolicy, StatisticType>::
+        DualTreeTraverser<RuleType>::Traverse(
+                MyCoverTree<MetricType, RootPointPolicy, StatisticType>& queryNode,
+                MyCoverTree<MetricType, RootPointPolicy, StatisticType>& referenceNode) {
+
+            // The bounds of the query nodes from the bounds of their points.
+            rule.InitBounds(queryNode);
+
+            Traverse(queryNode, referenceNode, rule.Kernel(queryNode.Point(), referenceNode.Point()));
+        }
+
+        template<typename MetricType, typename RootPointPolicy, typename StatisticType>
+        template<typename RuleType>
+        void MyCoverTree<MetricType, RootPointPolicy, StatisticType>::
+        DualTreeTraverser<RuleType>::Traverse(
+                MyCoverTree<MetricType, RootPointPolicy, StatisticType>& queryNode,
+                MyCoverTree<MetricType, RootPointPolicy, StatisticType>& referenceNode,
+                const double kernel) {
+
+            if (rule.Score(queryNode, referenceNode, kernel) == DBL_MAX)
+                return;
+
+            if (queryNode.IsLeaf() && referenceNode.IsLeaf()) {
+                rule.BaseCase(queryNode.Point(), referenceNode.Point(), kernel);
+                return;
+            }
+
+            // Split the node of the larger scale (leaves have scale INT_MIN).
+            if (!referenceNode.IsLeaf() && (queryNode.IsLeaf() || referenceNode.Scale() >= queryNode.Scale())) {
+
+                // The reference children with the largest maximum kernel first, so that the bounds rise early.
+                std::vector<std::pair<double, size_t> > order(referenceNode.NumChildren());
+                std::vector<double> kernels(referenceNode.NumChildren());
+                for (size_t i = 0; i < referenceNode.NumChildren(); ++i) {
+                    MyCoverTree& child = referenceNode.Child(i);
+                    kernels[i] = (child.Point() == referenceNode.Point() ? kernel : rule.Kernel(queryNode.Point(), child.Point()));
+                    order[i] = std::make_pair(rule.MaxKernel(queryNode, child, kernels[i]), i);
+                }
+                std::sort(order.begin(), order.end(), std::greater<std::pair<double, size_t> >());
+
+                for (size_t i = 0; i < order.size(); ++i) {
+                    if (rule.Rescore(queryNode, order[i].first) == DBL_MAX)
+                        break; // sorted: the remaining children are pruned as well
+                    Traverse(queryNode, referenceNode.Child(order[i].second), kernels[order[i].second]);
+                }
+
+            } else {
+
+                for (size_t i = 0; i < queryNode.NumChildren(); ++i) {
+                    MyCoverTree& child = queryNode.Child(i);
+                    double childKernel = (child.Point() == queryNode.Point() ? kernel : rule.Kernel(child.Point(), referenceNode.Point()));
+                    Traverse(child, referenceNode, childKernel);
+                }
+                rule.UpdateBound(queryNode);
+            }
+        }
+
+    }; // namespace tree
+}; // namespace mips
+
+#endif
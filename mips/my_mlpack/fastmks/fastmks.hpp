@@ -89,12 +89,35 @@ class FastMKS
   void Search(const size_t k,
   		TreeType* referenceTree, VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
   		std::vector<QueueElement> & finalResults,
-  		size_t queryInd, comp_type& comparisons, int threads);
+  		size_t queryInd, comp_type& comparisons, int threads,
+  		const ItemFilter* filter = NULL);
   
   void SearchForTheta(const double theta, 
   		TreeType* referenceTree, VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
   		std::vector<MatItem> & finalResults,
-  		size_t queryInd, comp_type& comparisons, int threads);
+  		size_t queryInd, comp_type& comparisons, int threads,
+  		const ItemFilter* filter = NULL);
+
+  /**
+   * Dual-tree search of all queries of queryTree (rows [firstQuery, ...) of
+   * queryMatrix) at once.  queryBounds holds per query the minimum of its topk
+   * list (DBL_MAX: skip the query) and follows the lists as they improve.  The
+   * lists are the min-heaps of topkResults (per query at topkOffsets, or k
+   * apart if topkOffsets is empty).
+   */
+  void SearchDual(const size_t k,
+  		TreeType* queryTree, TreeType* referenceTree,
+  		VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
+  		std::vector<double>& queryBounds, size_t firstQuery,
+  		std::vector<QueueElement>& topkResults, const std::vector<row_type>& topkOffsets,
+  		comp_type& comparisons, const ItemFilter* filter = NULL);
+
+  //! Dual-tree search above theta: queryBounds holds theta (DBL_MAX: skip the query).
+  void SearchDualForTheta(TreeType* queryTree, TreeType* referenceTree,
+  		VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
+  		std::vector<double>& queryBounds, size_t firstQuery,
+  		std::vector<MatItem>& finalResults,
+  		comp_type& comparisons, const ItemFilter* filter = NULL);
 
 
   //! Get the inner-product metric induced by the given kernel.
@@ -0,0 +1,122 @@
+/**
+ * @file fastmks_dual_rules.hpp
+ *
+ * Rules for the dual tree traversal for fast max-kernel search: a batch of
+ * queries (in a cover tree) against a reference cover tree.
+ *
+ * This file is part of mlpack 1.0.12.
+ *
+ * mlpack is free software; you may redstribute it and/or modify it under the
+ * terms of the 3-clause BSD license.  You should have received a copy of the
+ * 3-clause BSD license along with mlpack.  If not, see
+ * http://www.opensource.org/licenses/BSD-3-Clause for more information.
+ */
+#ifndef __MY_MLPACK_METHODS_FASTMKS_FASTMKS_DUAL_RULES_HPP
+#define __MY_MLPACK_METHODS_FASTMKS_FASTMKS_DUAL_RULES_HPP
+
+#include <mips/my_mlpack/core.hpp>
+#include <mips/my_mlpack/core/tree/cover_tree/cover_tree.hpp>
+#include <mips/structs/BasicStructs.h>
+
+
+namespace mips {
+namespace fastmks {
+
+/**
+ * The base case and pruning rules for dual-tree FastMKS.  Every query point
+ * has a bound (queryBounds[query - firstQuery]): the kernel value a reference
+ * point must reach to be a result.  Above-theta: theta.  Top-k: the minimum of
+ * the topk list of the query, raised by every insertion.  DBL_MAX excludes the
+ * query.  Every query node keeps in its statistic the smallest bound of its
+ * points, so that a (query node, reference node) pair is pruned if no point
+ * pair can reach it.
+ */
+template<typename TreeType>
+class FastMKSDualRules
+{
+ public:
+  //! Top-k: the min-heaps of the queries in topkResults (see RetrievalArguments::topkOffset).
+  FastMKSDualRules(VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
+                   std::vector<double>& queryBounds, size_t firstQuery,
+                   std::vector<QueueElement>& topkResults,
+                   const std::vector<row_type>& topkOffsets, size_t k,
+                   const ItemFilter* filter = NULL);
+
+  //! Above-theta: the results are appended to results.
+  FastMKSDualRules(VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
+                   std::vector<double>& queryBounds, size_t firstQuery,
+                   std::vector<MatItem>& results,
+                   const ItemFilter* filter = NULL);
+
+  //! The kernel value between a query point and a reference point.
+  double Kernel(const size_t queryIndex, const size_t referenceIndex);
+
+  //! Report the point pair if its kernel value reaches the bound of the query.
+  void BaseCase(const size_t queryIndex, const size_t referenceIndex,
+                const double kernel);
+
+  /**
+   * Upper bound of the kernel value between any point of the query node and any
+   * point of the reference node, given the kernel value between their points:
+   * K(pq, pr) + l_q ||pr|| + l_r ||pq|| + l_q l_r (l: furthest descendant distance).
+   */
+  double MaxKernel(TreeType& queryNode, TreeType& referenceNode,
+                   const double kernel) const;
+
+  /**
+   * The score of the node pair: DBL_MAX if it can be pruned, otherwise its
+   * maximum kernel value.
+   */
+  double Score(TreeType& queryNode, TreeType& referenceNode,
+               const double kernel) const;
+
+  //! Re-check a maximum kernel value (from MaxKernel) against the current bound.
+  double Rescore(TreeType& queryNode, const double maxKernel) const;
+
+  //! Set the bounds of all nodes of the query tree from the bounds of their points.
+  double InitBounds(TreeType& queryNode);
+
+  //! Refresh the bound of a query node from its children.
+  void UpdateBound(TreeType& queryNode);
+
+  //! Get the number of times Kernel() was called.
+  size_t BaseCases() const { return baseCases; }
+
+ private:
+  VectorMatrix* probeMatrix;
+  VectorMatrix* queryMatrix;
+
+  std::vector<double>& queryBounds;
+  size_t firstQuery;
+
+  //! Top-k: the lists of the queries (NULL: above-theta).
+  std::vector<QueueElement>* topkResults;
+  const std::vector<row_type>* topkOffsets;
+  size_t k;
+
+  //! Above-theta: the results (NULL: top-k).
+  std::vector<MatItem>* results;
+
+  //! Items the results must not contain (NULL: none).
+  const ItemFilter* filter;
+  //! The per-query filter of filterQueryIndex.
+  const QueryItemFilter* queryFilter;
+  size_t filterQueryIndex;
+
+  //! For benchmarking.
+  size_t baseCases;
+
+  //! The bound of the query node: of its point for leaves, otherwise the statistic.
+  double Bound(TreeType& queryNode) const;
+
+  //! Deleted or filtered out for the query.
+  bool Excluded(const size_t queryIndex, const size_t referenceIndex);
+};
+
+}; // namespace fastmks
+}; // namespace mips
+
+// Include implementation.
+#include "fastmks_dual_rules_impl.hpp"
+
+#endif
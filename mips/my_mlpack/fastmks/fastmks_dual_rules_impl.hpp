@@ -0,0 +1,175 @@
+/**
+ * @file fastmks_dual_rules_impl.hpp
+ *
+ * Implementation of FastMKSDualRules for cover tree search.
+ *
+ * This file is part of mlpack 1.0.12.
+ *
+ * mlpack is free software; you may redstribute it and/or modify it under the
+ * terms of the 3-clause BSD license.  You should have received a copy of the
+ * 3-clause BSD license along with mlpack.  If not, see
+ * http://www.opensource.org/licenses/BSD-3-Clause for more information.
+ */
+#ifndef __MY_MLPACK_METHODS_FASTMKS_FASTMKS_DUAL_RULES_IMPL_HPP
+#define __MY_MLPACK_METHODS_FASTMKS_FASTMKS_DUAL_RULES_IMPL_HPP
+
+// In case it hasn't already been included.
+#include "fastmks_dual_rules.hpp"
+#include <algorithm>
+#include <mips/structs/BasicStructs.h>
+
+
+namespace mips {
+namespace fastmks {
+
+template<typename TreeType>
+FastMKSDualRules<TreeType>::FastMKSDualRules(
+		VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
+		std::vector<double>& queryBounds, size_t firstQuery,
+		std::vector<QueueElement>& topkResults,
+		const std::vector<row_type>& topkOffsets, size_t k,
+		const ItemFilter* filter) :
+		probeMatrix(probeMatrix), queryMatrix(queryMatrix),
+		queryBounds(queryBounds), firstQuery(firstQuery),
+		topkResults(&topkResults), topkOffsets(&topkOffsets), k(k),
+		results(NULL),
+		filter(filter), queryFilter(NULL), filterQueryIndex(-1),
+		baseCases(0)
+		{}
+
+template<typename TreeType>
+FastMKSDualRules<TreeType>::FastMKSDualRules(
+		VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
+		std::vector<double>& queryBounds, size_t firstQuery,
+		std::vector<MatItem>& results,
+		const ItemFilter* filter) :
+		probeMatrix(probeMatrix), queryMatrix(queryMatrix),
+		queryBounds(queryBounds), firstQuery(firstQuery),
+		topkResults(NULL), topkOffsets(NULL), k(0),
+		results(&results),
+		filter(filter), queryFilter(NULL), filterQueryIndex(-1),
+		baseCases(0)
+		{}
+
+template<typename TreeType>
+inline force_inline
+bool FastMKSDualRules<TreeType>::Excluded(
+		const size_t queryIndex,
+		const size_t referenceIndex)
+		{
+	if (probeMatrix->isDeleted(referenceIndex))
+		return true;
+	if (filter == NULL)
+		return false;
+
+	if (queryIndex != filterQueryIndex) {
+		queryFilter = filter->forQuery(queryMatrix->getId(queryIndex));
+		filterQueryIndex = queryIndex;
+	}
+	return filter->excludes(queryFilter, probeMatrix->getId(referenceIndex));
+		}
+
+template<typename TreeType>
+inline force_inline
+double FastMKSDualRules<TreeType>::Kernel(
+		const size_t queryIndex,
+		const size_t referenceIndex)
+		{
+	++baseCases;
+	return probeMatrix->innerProduct(referenceIndex, queryMatrix->getMatrixRowPtr(queryIndex));
+		}
+
+template<typename TreeType>
+inline force_inline
+void FastMKSDualRules<TreeType>::BaseCase(
+		const size_t queryIndex,
+		const size_t referenceIndex,
+		const double kernel)
+		{
+	double& bound = queryBounds[queryIndex - firstQuery];
+
+	if (kernel < bound || Excluded(queryIndex, referenceIndex))
+		return;
+
+	if (results != NULL) {
+		results->push_back(MatItem(kernel, queryMatrix->getId(queryIndex), probeMatrix->getId(referenceIndex)));
+		return;
+	}
+
+	size_t offset = (topkOffsets->empty() ? queryIndex * k : (*topkOffsets)[queryIndex]);
+	size_t size = (topkOffsets->empty() ? k : (*topkOffsets)[queryIndex + 1] - offset);
+	auto first = topkResults->begin() + offset;
+
+	std::pop_heap(first, first + size, std::greater<QueueElement>());
+	*(first + size - 1) = QueueElement(kernel, probeMatrix->getId(referenceIndex));
+	std::push_heap(first, first + size, std::greater<QueueElement>());
+
+	bound = first->data; // the new minimum of the list
+		}
+
+template<typename TreeType>
+inline force_inline
+double FastMKSDualRules<TreeType>::MaxKernel(
+		TreeType& queryNode,
+		TreeType& referenceNode,
+		const double kernel) const
+		{
+	const double queryDist = queryNode.FurthestDescendantDistance();
+	const double referenceDist = referenceNode.FurthestDescendantDistance();
+
+	return kernel + queryDist * probeMatrix->getVectorLength(referenceNode.Point()) +
+			referenceDist * queryMatrix->getVectorLength(queryNode.Point()) + queryDist * referenceDist;
+		}
+
+template<typename TreeType>
+inline force_inline
+double FastMKSDualRules<TreeType>::Bound(TreeType& queryNode) const
+		{
+	return (queryNode.IsLeaf() ? queryBounds[queryNode.Point() - firstQuery] : queryNode.Stat().Bound());
+		}
+
+template<typename TreeType>
+double FastMKSDualRules<TreeType>::Score(
+		TreeType& queryNode,
+		TreeType& referenceNode,
+		const double kernel) const
+		{
+	return Rescore(queryNode, MaxKernel(queryNode, referenceNode, kernel));
+		}
+
+template<typename TreeType>
+double FastMKSDualRules<TreeType>::Rescore(
+		TreeType& queryNode,
+		const double maxKernel) const
+		{
+	return (maxKernel >= Bound(queryNode)) ? maxKernel : DBL_MAX;
+		}
+
+template<typename TreeType>
+double FastMKSDualRules<TreeType>::InitBounds(TreeType& queryNode)
+		{
+	if (queryNode.IsLeaf())
+		return queryBounds[queryNode.Point() - firstQuery];
+
+	double bound = DBL_MAX;
+	for (size_t i = 0; i < queryNode.NumChildren(); ++i)
+		bound = std::min(bound, InitBounds(queryNode.Child(i)));
+
+	queryNode.Stat().Bound() = bound;
+	return bound;
+		}
+
+template<typename TreeType>
+void FastMKSDualRules<TreeType>::UpdateBound(TreeType& queryNode)
+		{
+	double bound = DBL_MAX;
+	for (size_t i = 0; i < queryNode.NumChildren(); ++i)
+		bound = std::min(bound, Bound(queryNode.Child(i)));
+
+	queryNode.Stat().Bound() = bound;
+		}
+
+}; // namespace fastmks
+}; // namespace mips
+
+#endif
@@ -18,6 +18,7 @@
 #include "fastmks.hpp"
 
 #include "fastmks_rules.hpp"
+#include "fastmks_dual_rules.hpp"
 #include <queue>
 #include <mips/structs/BasicStructs.h>
 
@@ -47,10 +48,10 @@ namespace mips {
         void FastMKS<TreeType>::Search(const size_t k,
                 TreeType* referenceTree, VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
                 std::vector<QueueElement> & finalResults,
-                size_t queryInd, comp_type& comparisons, int threads) {
+                size_t queryInd, comp_type& comparisons, int threads, const ItemFilter* filter) {
 
             typedef FastMKSRules<TreeType> RuleType;
-            std::vector<RuleType> rules(threads, RuleType(metric.Kernel(), probeMatrix, queryMatrix));
+            std::vector<RuleType> rules(threads, RuleType(metric.Kernel(), probeMatrix, queryMatrix, filter));
 
             typename TreeType::template SingleTreeTraverser<RuleType> traverser(rules);
             traverser.Traverse(queryInd, *referenceTree, finalResults);
@@ -70,11 +71,11 @@ namespace mips {
         void FastMKS<TreeType>::SearchForTheta(const double theta,
                 TreeType* referenceTree, VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
                 std::vector<MatItem> & finalResults,
-                size_t queryInd, comp_type& comparisons, int threads) {
+                size_t queryInd, comp_type& comparisons, int threads, const ItemFilter* filter) {
 
             typedef FastMKSRules<TreeType> RuleType;
             //RuleType rules(metric.Kernel(), probeMatrix, queryMatrix);
-            std::vector<RuleType> rules(threads, RuleType(metric.Kernel(), probeMatrix, queryMatrix));
+            std::vector<RuleType> rules(threads, RuleType(metric.Kernel(), probeMatrix, queryMatrix, filter));
 
 
             typename TreeType::template SingleTreeTraverser<RuleType> traverser(rules);
@@ -87,6 +88,39 @@ namespace mips {
 
         }
 
+        template<typename TreeType>
+        void FastMKS<TreeType>::SearchDual(const size_t k,
+                TreeType* queryTree, TreeType* referenceTree,
+                VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
+                std::vector<double>& queryBounds, size_t firstQuery,
+                std::vector<QueueElement>& topkResults, const std::vector<row_type>& topkOffsets,
+                comp_type& comparisons, const ItemFilter* filter) {
+
+            typedef FastMKSDualRules<TreeType> RuleType;
+            RuleType rules(probeMatrix, queryMatrix, queryBounds, firstQuery, topkResults, topkOffsets, k, filter);
+
+            typename TreeType::template DualTreeTraverser<RuleType> traverser(rules);
+            traverser.Traverse(*queryTree, *referenceTree);
+
+            comparisons += rules.BaseCases();
+        }
+
+        template<typename TreeType>
+        void FastMKS<TreeType>::SearchDualForTheta(TreeType* queryTree, TreeType* referenceTree,
+                VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
+                std::vector<double>& queryBounds, size_t firstQuery,
+                std::vector<MatItem>& finalResults,
+                comp_type& comparisons, const ItemFilter* filter) {
+
+            typedef FastMKSDualRules<TreeType> RuleType;
+            RuleType rules(probeMatrix, queryMatrix, queryBounds, firstQuery, finalResults, filter);
+
+            typename TreeType::template DualTreeTraverser<RuleType> traverser(rules);
+            traverser.Traverse(*queryTree, *referenceTree);
+
+            comparisons += rules.BaseCases();
+        }
+
 
 
 
@@ -30,7 +30,8 @@ class FastMKSRules
 {
  public:
   FastMKSRules(KernelType& kernel,
-               VectorMatrix* probeMatrix=NULL, VectorMatrix* queryMatrix=NULL);
+               VectorMatrix* probeMatrix=NULL, VectorMatrix* queryMatrix=NULL,
+               const ItemFilter* filter=NULL);
 
 
 
@@ -94,6 +95,8 @@ class FastMKSRules
 
   VectorMatrix* probeMatrix;
   VectorMatrix* queryMatrix;
+  //! Items the results must not contain (NULL: none).
+  const ItemFilter* filter;
   //std::vector<std::vector<QueueElement> >* finalResults; // my code
 
  private:
@@ -112,6 +115,13 @@ class FastMKSRules
   //! Calculate the bound for a given query node.
   double CalculateBound(TreeType& queryNode) const;
 
+  //! The per-query filter of filterQueryIndex.
+  const QueryItemFilter* queryFilter;
+  size_t filterQueryIndex;
+
+  //! Deleted or filtered out for the query.
+  bool Excluded(const size_t queryIndex, const size_t referenceIndex);
+
   //! For benchmarking.
   size_t baseCases;
   //! For benchmarking.
@@ -25,16 +25,36 @@ namespace fastmks {
 template<typename TreeType>
 FastMKSRules<TreeType>::FastMKSRules(
 		KernelType& kernel,
-		VectorMatrix* probeMatrix, VectorMatrix* queryMatrix) :
+		VectorMatrix* probeMatrix, VectorMatrix* queryMatrix,
+		const ItemFilter* filter) :
 		kernel(kernel),
 		lastQueryIndex(-1),
 		lastReferenceIndex(-1),
 		lastKernel(0.0),
 		baseCases(0),
 		scores(0),
-		probeMatrix(probeMatrix), queryMatrix(queryMatrix)
+		probeMatrix(probeMatrix), queryMatrix(queryMatrix),
+		filter(filter), queryFilter(NULL), filterQueryIndex(-1)
 		{}
 
+template<typename TreeType>
+inline force_inline
+bool FastMKSRules<TreeType>::Excluded(
+		const size_t queryIndex,
+		const size_t referenceIndex)
+		{
+	if (probeMatrix->isDeleted(referenceIndex))
+		return true;
+	if (filter == NULL)
+		return false;
+
+	if (queryIndex != filterQueryIndex) {
+		queryFilter = filter->forQuery(queryMatrix->getId(queryIndex));
+		filterQueryIndex = queryIndex;
+	}
+	return filter->excludes(queryFilter, probeMatrix->getId(referenceIndex));
+		}
+
 
 
 template<typename TreeType>
@@ -69,7 +89,7 @@ double FastMKSRules<TreeType>::BaseCase(
 
 
 	// If this is a better candidate, insert it into the list.
-	if (kernelEval < results.front().data)
+	if (kernelEval < results.front().data || Excluded(queryIndex, referenceIndex))
 		return kernelEval;
 
 	std::pop_heap (results.begin(), results.end(), std::greater<QueueElement>());
@@ -114,7 +134,7 @@ double FastMKSRules<TreeType>::BaseCaseForTheta(
 	lastKernel = kernelEval;
 
 	// If this is a better candidate, insert it into the list.
-	if (kernelEval < theta)
+	if (kernelEval < theta || Excluded(queryIndex, referenceIndex))
 		return kernelEval;
 
 	results.push_back(MatItem(kernelEval, queryMatrix->getId(queryIndex), probeMatrix->getId(referenceIndex)));
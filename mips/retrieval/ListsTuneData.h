@@ -227,6 +227,115 @@ namespace mips {
             findCutOffPointForList(numLists - 1, sampleSize, otherTime, retrArg[0].competitorMethod, upper);
         }
 
+        // items LENGTH scans for a query with local threshold localTheta (the bucket is sorted by decreasing length)
+        inline row_type lengthScanSize(const ProbeBucket& probeBucket, const VectorMatrix& probeMatrix, double localTheta) const {
+            if (localTheta <= 0)
+                return probeBucket.endPos - probeBucket.startPos;
+
+            double minLength = localTheta * probeBucket.normL2.second;
+            row_type low = probeBucket.startPos, high = probeBucket.endPos;
+            while (low < high) {
+                row_type mid = low + (high - low) / 2;
+                if (probeMatrix.getMatrixRowPtr(mid)[-1] >= minLength)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            return low - probeBucket.startPos;
+        }
+
+        /*
+         * Chooses phi and t_b from the costs predicted by retrArg[0].costModel, without running the sample queries.
+         * Works for Above-theta and Row-Top-k alike, since the local thresholds of the sample are in xValues.
+         * withLength: the queries below the cut-off may run LENGTH (LEMP_LI, LEMP_LC), and LENGTH may take the
+         * whole bucket. Returns false if the model is uncertain, i.e., the best plan with lists and LENGTH for all
+         * queries are predicted within the margin of the model. Then the caller tunes by timing as before.
+         */
+        template<typename L, typename R>
+        inline bool tuneByModel(ProbeBucket& probeBucket, std::vector<RetrievalArguments>& retrArg, Index_Type type, bool incremental,
+                bool withLength, R* retriever) {
+            const CostModel* model = retrArg[0].costModel;
+            L* lists = static_cast<L*> (probeBucket.getIndex(type));
+
+            if (model == nullptr || !model->calibrated || lists == nullptr)
+                return false;
+
+            if (!lists->isInitialized())
+                lists->initializeLists(*(retrArg[0].probeMatrix), probeBucket.startPos, probeBucket.endPos);
+
+            row_type sampleSize = probeBucket.xValues->size();
+            row_type bucketSize = lists->getRowNum();
+            col_type colNum = retrArg[0].queryMatrix->colNum;
+            col_type maxLists = std::min((col_type) NUM_LISTS, colNum);
+
+            // the queue of a query for phi lists is the prefix of its queue for maxLists
+            preprocess(retrArg, probeBucket, maxLists);
+
+            std::vector<double> lengthTimes(sampleSize);
+            std::vector<row_type> lengths(maxLists);
+            for (col_type phi = 0; phi < maxLists; ++phi) {
+                timeX[phi] = std::vector<double>();
+                timeX[phi].reserve(sampleSize);
+            }
+
+            for (row_type i = 0; i < sampleSize; ++i) {
+                int t = probeBucket.xValues->at(i).i;
+                int ind = probeBucket.xValues->at(i).j;
+                const double* query = retrArg[t].queryMatrix->getMatrixRowPtr(ind);
+                double localTheta = probeBucket.xValues->at(i).result;
+                const col_type* queue = getQueue(i, maxLists);
+
+                for (col_type l = 0; l < maxLists; ++l) {
+                    lengths[l] = lists->intervalLength(query[queue[l]], localTheta, queue[l]);
+                }
+                for (col_type phi = 0; phi < maxLists; ++phi) {
+                    timeX[phi].emplace_back(model->listsCost(lengths.data(), phi + 1, bucketSize, colNum, incremental));
+                }
+                lengthTimes[i] = model->lengthCost(lengthScanSize(probeBucket, *(retrArg[0].probeMatrix), localTheta));
+            }
+
+            delete [] queues;
+            queues = nullptr;
+
+            // the same cut-off search as for the measured times
+            double lengthTotal = 0;
+            for (auto time : lengthTimes)
+                lengthTotal += time;
+
+            bestTime = -1;
+            for (col_type phi = 0; phi < maxLists; ++phi) {
+                double time;
+                for (row_type i = 0; i < sampleSize; ++i) {
+                    calculateTimeInCutoff(timeX[phi], lengthTimes, i, time);
+
+                    if (bestTime < 0 || bestTime > time) {
+                        bestTime = time;
+                        t_b_indx = i;
+                        bestPhi = phi;
+                    }
+                    if (!withLength)
+                        break;
+                }
+            }
+
+            if (withLength) {
+                double lower = std::min(bestTime, lengthTotal);
+                if (fabs(bestTime - lengthTotal) < model->margin * lower)
+                    return false;
+
+                if (lengthTotal < bestTime) { // LENGTH for all queries
+                    probeBucket.setAfterTuning(1, 1);
+                    retriever->sampleTotalTime = lengthTotal;
+                    return true;
+                }
+            }
+
+            double value = (t_b_indx == 0 ? -1 : probeBucket.xValues->at(t_b_indx).result);
+            probeBucket.setAfterTuning(bestPhi + 1, value);
+            retriever->sampleTotalTime = bestTime;
+            return true;
+        }
+
         template<typename R>
         inline void tune(ProbeBucket& probeBucket, const ProbeBucket& prevBucket, std::vector<RetrievalArguments>& retrArg, R* retriever) {
 
@@ -234,7 +343,7 @@ namespace mips {
             lowerActive = true;
 
 
-            col_type list = prevBucket.numLists; // start with the best numLists of the previous bucket
+            col_type list = probeBucket.numLists; // start with the numLists of the last tuning (buckets are tuned concurrently)
 
             // explore an QueryBatchial phi value
             tuneBucketForList(probeBucket, list, -1, true, retrArg, retriever);
@@ -277,7 +386,7 @@ namespace mips {
             upperActive = true;
             lowerActive = true;
 
-            col_type list = prevBucket.numLists; // start with the best numLists of the previous bucket
+            col_type list = probeBucket.numLists; // start with the numLists of the last tuning (buckets are tuned concurrently)
             tuneBucketForListTopk(probeBucket, prevBucket, retrArg, list, -1, true, retriever);
 
             double previousForUpper = bestTimeForPhi[list - 1];
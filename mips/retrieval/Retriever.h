@@ -56,22 +56,33 @@ namespace mips {
                 //                    continue;
 
                 row_type user = queryBatch.startPos;
-                int start = queryBatch.startPos * arg->k;
-                int end = queryBatch.endPos * arg->k;
+                row_type start = arg->topkOffset(queryBatch.startPos);
+                row_type end = arg->topkOffset(queryBatch.endPos);
 
 
-                for (row_type i = start; i < end; i += arg->k) {
+                for (row_type i = start; i < end; i = arg->topkOffset(user)) {
                     const double* query = arg->queryMatrix->getMatrixRowPtr(user);
 
                     arg->queryId = arg->queryMatrix->getId(user);
+                    arg->heap.resize(arg->k); // the bucket holds k items
 
                     for (row_type j = probeBucket.startPos; j < probeBucket.endPos; j++) {
+                        if (arg->isExcluded(j)) { // keeps the heap at k elements
+                            arg->heap[j] = QueueElement(-std::numeric_limits<double>::max(), NO_ITEM);
+                            continue;
+                        }
+
                         arg->comparisons++;
                         double ip = arg->probeMatrix->innerProduct(j, query);
-
                         arg->heap[j] = QueueElement(ip, arg->probeMatrix->getId(j));
 
                     }
+
+                    row_type size = arg->topkSize(user);
+                    if (size < arg->heap.size()) { // per-query k: keep the best ones
+                        std::nth_element(arg->heap.begin(), arg->heap.begin() + size - 1, arg->heap.end(), std::greater<QueueElement>());
+                        arg->heap.resize(size);
+                    }
                     std::make_heap(arg->heap.begin(), arg->heap.end(), std::greater<QueueElement>());
 
                     if (arg->worstMinScore > arg->heap.front().data) {
@@ -95,6 +106,17 @@ namespace mips {
             exit(1);
         }
 
+        // time of the sample queries in the bucket of the last tune or tuneTopk (for choosing among methods)
+        inline virtual double sampleCost() const {
+            if (sampleTotalTime > 0)
+                return sampleTotalTime;
+
+            double total = 0;
+            for (auto time : sampleTimes)
+                total += time;
+            return total;
+        }
+
 
     };
 
@@ -113,6 +135,9 @@ namespace mips {
         inline void naive(const double *query, row_type start, row_type end, RetrievalArguments* arg) const {
 
             for (row_type j = start; j < end; ++j) {
+                if (arg->isExcluded(j))
+                    continue;
+
                 arg->comparisons++;
                 double ip = arg->probeMatrix->innerProduct(j, query);
 
@@ -126,6 +151,9 @@ namespace mips {
             double minScore = arg->heap.front().data;
 
             for (row_type j = start; j < end; ++j) {
+                if (arg->isExcluded(j))
+                    continue;
+
                 arg->comparisons++;
                 double ip = arg->probeMatrix->innerProduct(j, query);
 
@@ -154,6 +182,9 @@ namespace mips {
                         break;
                     }
 
+                    if (arg->isExcluded(j))
+                        continue;
+
                     arg->comparisons++;
 
                     double ip = len * arg->probeMatrix->cosine(j, query);
@@ -181,6 +212,8 @@ namespace mips {
                 const double* query = arg->queryMatrix->getMatrixRowPtr(i);
                 if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                     break;
+                if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                    continue;
 
                 arg->queryId = arg->queryMatrix->getId(i);
                 run(query, probeBucket, arg);
@@ -214,6 +247,9 @@ namespace mips {
                 if (item[-1] < minScoreAppr) { // stop scanning for this user
                     break;
                 }
+                if (arg->isExcluded(j))
+                    continue;
+
                 arg->comparisons++;
 
                 double ip = item[-1] * arg->probeMatrix->cosine(j, query);
@@ -252,9 +288,9 @@ namespace mips {
 #endif
 
             row_type user = queryBatch.startPos;
-            int start = queryBatch.startPos * arg->k;
-            int end = queryBatch.endPos * arg->k;
-            for (row_type i = start; i < end; i += arg->k) {
+            row_type start = arg->topkOffset(queryBatch.startPos);
+            row_type end = arg->topkOffset(queryBatch.endPos);
+            for (row_type i = start; i < end; i = arg->topkOffset(user)) {
 
                 if (queryBatch.isQueryInactive(user)) {
                     user++;
@@ -288,7 +324,7 @@ namespace mips {
                     continue;
                 }
 
-                arg->moveTopkToHeap(i);
+                arg->moveTopkToHeap(user);
 
                 arg->queryId = arg->queryMatrix->getId(user);
                 runTopK(query, probeBucket, arg);
@@ -318,9 +354,9 @@ namespace mips {
 
 
                 row_type user = queryBatch.startPos;
-                int start = queryBatch.startPos * arg->k;
-                int end = queryBatch.endPos * arg->k;
-                for (row_type i = start; i < end; i += arg->k) {
+                row_type start = arg->topkOffset(queryBatch.startPos);
+                row_type end = arg->topkOffset(queryBatch.endPos);
+                for (row_type i = start; i < end; i = arg->topkOffset(user)) {
 
                     if (queryBatch.isQueryInactive(user)) {
                         user++;
@@ -355,13 +391,13 @@ namespace mips {
 
 #ifdef         RELATIVE_APPROX                     
 
-                        arg->moveTopkToHeap(i);
+                        arg->moveTopkToHeap(user - 1);
                         arg->totalErrorAfterResults += approximateRelError(*arg);
 #endif
                         continue;
                     }
 
-                    arg->moveTopkToHeap(i);
+                    arg->moveTopkToHeap(user);
 
                     arg->queryId = arg->queryMatrix->getId(user);
                     runTopK(query, probeBucket, arg);
@@ -396,6 +432,8 @@ namespace mips {
 
                     if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                         break;
+                    if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                        continue;
 
                     arg->queryId = arg->queryMatrix->getId(i);
 
@@ -411,8 +449,7 @@ namespace mips {
         }
 
         inline virtual void tune(ProbeBucket& probeBucket, const ProbeBucket& prevBucket, std::vector<RetrievalArguments>& retrArg) {
-            //case 1: all sample queries from the same queryMatrix
-            // just call this function with retrArg[0]
+            // the queries come from the query matrix of their thread, retrArg[0] is the scratch space
             row_type sampleSize = probeBucket.xValues->size();
 
             if (sampleSize > 0) {
@@ -423,10 +460,10 @@ namespace mips {
                     int ind = probeBucket.xValues->at(i).j;
                     const double* query = retrArg[t].queryMatrix->getMatrixRowPtr(ind);
 
-                    retrArg[t].tunerTimer.start();
-                    run(query, probeBucket, &retrArg[t]);
-                    retrArg[t].tunerTimer.stop();
-                    sampleTimes.emplace_back(retrArg[t].tunerTimer.elapsedTime().nanos());
+                    retrArg[0].tunerTimer.start();
+                    run(query, probeBucket, &retrArg[0]);
+                    retrArg[0].tunerTimer.stop();
+                    sampleTimes.emplace_back(retrArg[0].tunerTimer.elapsedTime().nanos());
                     sampleTotalTime += sampleTimes[i];
 
                 }
@@ -438,7 +475,19 @@ namespace mips {
 
         }
 
+        // the LENGTH times of the sample were measured while the sample top-k lists were computed
         inline virtual void tuneTopk(ProbeBucket& probeBucket, const ProbeBucket& prevBucket, std::vector<RetrievalArguments>& retrArg) {
+            row_type sampleSize = (probeBucket.xValues != nullptr ? probeBucket.xValues->size() : 0);
+
+            sampleTimes.clear();
+            sampleTotalTime = 0;
+            for (row_type i = 0; i < sampleSize; ++i) {
+                int t = probeBucket.xValues->at(i).i;
+                int ind = probeBucket.xValues->at(i).j;
+
+                sampleTimes.push_back(probeBucket.sampleThetas[t][ind].lengthTime);
+                sampleTotalTime += sampleTimes[i];
+            }
         }
     };
 
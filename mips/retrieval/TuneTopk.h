@@ -29,7 +29,13 @@ using boost::unordered_set;
 
 namespace mips {
 
-    std::pair<row_type, row_type> findSampleForTuningTopk(std::vector<ProbeBucket>& probeBuckets, std::vector<RetrievalArguments>& retrArg) {
+    /*
+     * Runs a sample of the queries through the buckets with LENGTH, keeping their top-k results and times per bucket.
+     * Adaptive (args.sampleError > 0): the sample is run in rounds until the mean cost of its queries is stable
+     * (SampleSizer), passes: how often the tuning runs each sample query again
+     */
+    std::pair<row_type, row_type> findSampleForTuningTopk(std::vector<ProbeBucket>& probeBuckets, std::vector<RetrievalArguments>& retrArg,
+            const LempArguments& args, double passes) {
         row_type activeBuckets = 0, bucketsForInit = 0;
 
 
@@ -38,98 +44,127 @@ namespace mips {
 
         LengthRetriever plainRetriever;
 
-        // calculate how large the sample should be
-        row_type sampleSize = 0;
+        // calculate how large the sample can be
+        row_type allQueries = 0;
         for (auto& arg : retrArg) {
-            sampleSize += arg.queryMatrix->rowNum;
+            allQueries += arg.queryMatrix->rowNum;
         }
-        sampleSize *= 0.02;
-        if (sampleSize > UPPER_LIMIT_PER_BUCKET) {
-            sampleSize = UPPER_LIMIT_PER_BUCKET;
-        }
-        sampleSize /= retrArg.size();
+        double rate = (args.sampleError > 0 ? SAMPLE_MAX_RATE : SAMPLE_RATE);
+        row_type sampleSize = std::min<row_type>(args.sampleMax, std::max<row_type>(rate * allQueries, args.sampleMin));
 
         rg::Random32& random = retrArg[0].random;
 
-
         for (auto& b : probeBuckets)
             b.sampleThetas.resize(retrArg.size());
 
-        retrArg[0].heap.resize(retrArg[0].k);
-
-
-        // from the query matrix that corresponds to each thread...
+        // the sample of each thread (sorted). All buckets keep the results of a query in its slot of the sample
+        std::vector<std::pair<int, row_type> > sample; // thread, position in its query matrix
         for (int t = 0; t < retrArg.size(); ++t) {
+            row_type share = (double) sampleSize * retrArg[t].queryMatrix->rowNum / allQueries; // in proportion to the queries of the thread
+            boost::shared_ptr< std::vector<row_type> > ids(new std::vector<row_type>(rg::sample(random, share, retrArg[t].queryMatrix->rowNum)));
+            std::sort(ids->begin(), ids->end());
+
+            for (auto& b : probeBuckets)
+                b.sampleThetas[t].init(ids);
+            for (auto id : *ids)
+                sample.emplace_back(t, id);
+        }
+        rg::shuffle(sample.begin(), sample.end(), random); // any prefix is a random sample
 
-            //... get a sample
-            std::vector<row_type> sampleIndx = rg::sample(random, sampleSize, retrArg[t].queryMatrix->rowNum);
-
+        // total LENGTH time of each sample query over all buckets
+        std::vector<double> sampleCosts(sample.size(), 0);
+        SampleSizer sizer(args.sampleMin, sample.size(), args.sampleError, args.tuningBudget * 1E9, passes);
+        row_type processed = 0;
 
-            for (auto id : sampleIndx) {
+        while (processed < sample.size()) {
+            row_type target = std::min<row_type>(sizer.target(), sample.size());
+            if (target <= processed)
+                break;
 
-                const double* query = retrArg[t].queryMatrix->getMatrixRowPtr(id);
+            // the sample queries are independent: each thread runs some of them with its own scratch space and timer
+#pragma omp parallel num_threads(retrArg.size()) reduction(max : bucketsForInit)
+            {
+                RetrievalArguments& arg = retrArg[omp_get_thread_num()];
+                arg.heap.resize(arg.k);
 
-                // I will need to keep track of the topk results of each query for each bucket. The kth value in the topk list will give me the theta_b(q))
-                // that corresponds to this query
-                // I keep this info in the retrArg because it will be needed later in the ListsTuneData.h                
-                probeBuckets[0].sampleThetas[t][id] = GlobalTopkTuneData();
+#pragma omp for schedule(dynamic, 4)
+                for (row_type s = processed; s < target; ++s) {
+                    int t = sample[s].first;
+                    row_type id = sample[s].second;
 
+                    const double* query = retrArg[t].queryMatrix->getMatrixRowPtr(id);
 
-                for (row_type j = probeBuckets[0].startPos; j < probeBuckets[0].endPos; ++j) {
-                    double ip = retrArg[0].probeMatrix->innerProduct(j, query);
-                    probeBuckets[0].sampleThetas[t][id].results.emplace_back(ip, retrArg[0].probeMatrix->getId(j));
-                }
+                    // I will need to keep track of the topk results of each query for each bucket. The kth value in the topk list will give me the theta_b(q))
+                    // that corresponds to this query
+                    // I keep this info in the retrArg because it will be needed later in the ListsTuneData.h                
+                    std::vector<QueueElement>& firstResults = probeBuckets[0].sampleThetas[t].add(id).results;
 
-                // and now make the heap
-                std::make_heap(probeBuckets[0].sampleThetas[t][id].results.begin(), probeBuckets[0].sampleThetas[t][id].results.end(), std::greater<QueueElement>()); // non thread safe
+                    for (row_type j = probeBuckets[0].startPos; j < probeBuckets[0].endPos; ++j) {
+                        double ip = arg.probeMatrix->innerProduct(j, query);
+                        firstResults.emplace_back(ip, arg.probeMatrix->getId(j));
+                    }
 
-                for (row_type b = 1; b < probeBuckets.size(); ++b) {
+                    // and now make the heap
+                    std::make_heap(firstResults.begin(), firstResults.end(), std::greater<QueueElement>());
 
+                    for (row_type b = 1; b < probeBuckets.size(); ++b) {
 
-                    std::vector<QueueElement>& prevResults = probeBuckets[b - 1].sampleThetas[t][id].results;
 
+                        const std::vector<QueueElement>& prevResults = probeBuckets[b - 1].sampleThetas[t].at(id).results;
 
-                    if (prevResults.front().data >= probeBuckets[b].normL2.second) { // bucket check
-                        break;
 
-                    } else {// run LENGTH and measure the time
+                        if (prevResults.front().data >= probeBuckets[b].normL2.second) { // bucket check
+                            break;
 
-                        if (probeBuckets[b].sampleThetas.size() == 0) {
-                            probeBuckets[b].sampleThetas.resize(retrArg.size());
-                        }
+                        } else {// run LENGTH and measure the time
 
-                        probeBuckets[b].sampleThetas[t][id] = GlobalTopkTuneData();
+                            GlobalTopkTuneData& data = probeBuckets[b].sampleThetas[t].add(id);
 
-                        std::copy(prevResults.begin(), prevResults.end(), retrArg[0].heap.begin());
-                        std::make_heap(retrArg[0].heap.begin(), retrArg[0].heap.end(), std::greater<QueueElement>());
+                            std::copy(prevResults.begin(), prevResults.end(), arg.heap.begin());
+                            std::make_heap(arg.heap.begin(), arg.heap.end(), std::greater<QueueElement>());
                         
 
 
 #if defined(RELATIVE_APPROX) 
-                if (retrArg[0].heap.front().data >= 0) {
-                    retrArg[0].currEpsilonAppr = (1 + retrArg[0].epsilon);
-                } else {
-                    retrArg[0].currEpsilonAppr = 1;
-                }
+                    if (arg.heap.front().data >= 0) {
+                        arg.currEpsilonAppr = (1 + arg.epsilon);
+                    } else {
+                        arg.currEpsilonAppr = 1;
+                    }
 #else 
 #if defined(ABS_APPROX)               
-                retrArg[0].currEpsilonAppr = retrArg[t].queryMatrix->epsilonEquivalents[id];
+                    arg.currEpsilonAppr = retrArg[t].queryMatrix->epsilonEquivalents[id];
 #endif
 #endif
 
-                        retrArg[0].tunerTimer.start();
-                        plainRetriever.runTopK(query, probeBuckets[b], &retrArg[0]);
-                        retrArg[0].tunerTimer.stop();
-                        probeBuckets[b].sampleThetas[t][id].lengthTime = retrArg[0].tunerTimer.elapsedTime().nanos();
+                            arg.tunerTimer.start();
+                            plainRetriever.runTopK(query, probeBuckets[b], &arg);
+                            arg.tunerTimer.stop();
+                            data.lengthTime = arg.tunerTimer.elapsedTime().nanos();
+                            sampleCosts[s] += data.lengthTime;
 
-                        probeBuckets[b].sampleThetas[t][id].results.reserve(retrArg[0].k);
-                        std::copy_n(retrArg[0].heap.begin(), retrArg[0].k, std::back_inserter(probeBuckets[b].sampleThetas[t][id].results));
+                            data.results.reserve(arg.k);
+                            std::copy_n(arg.heap.begin(), arg.k, std::back_inserter(data.results));
 
-                        if (b > bucketsForInit)
-                            bucketsForInit = b;
+                            if (b > bucketsForInit)
+                                bucketsForInit = b;
+                        }
                     }
                 }
             }
+
+            for (row_type s = processed; s < target; ++s) {
+                sizer.add(sampleCosts[s]);
+            }
+            processed = target;
+        }
+
+        if (args.sampleError > 0)
+            std::cout << "[INFO] Tuning sample: " << processed << " of " << sample.size() << " candidate queries" << std::endl;
+
+        for (auto& b : probeBuckets) {
+            for (auto& results : b.sampleThetas)
+                results.seal();
         }
 
 
@@ -141,7 +176,7 @@ namespace mips {
                 counter += probeBuckets[b].sampleThetas[t].size();
             }
 
-            if (counter >= LOWER_LIMIT_PER_BUCKET) {
+            if (counter >= args.sampleMin) {
                 activeBuckets++;
             } else { // if I do not have enough sample queries for a bucket, it makes no sense to try  to tune
                 break;
@@ -0,0 +1,55 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   annoyRetriever.h
+ */
+
+#ifndef ANNOYRETRIEVER_H
+#define	ANNOYRETRIEVER_H
+
+namespace mips {
+
+    /*
+     * LEMP_ANNOY (approximate): queries with theta_b(q) below t_b run LENGTH, the others verify the search_k
+     * candidates of the random-projection forest of the bucket. More trees or a larger search_k: higher recall,
+     * slower queries. While another thread builds the forest, queries run LENGTH instead of waiting.
+     */
+    class AnnoyRetriever : public CandidateIndexRetriever<AnnoyIndex, ANNOY> {
+    protected:
+
+        inline virtual void initializeIndex(AnnoyIndex* index, const VectorMatrix& matrix, row_type start, row_type end) const {
+            index->initializeForest(matrix, 1, start, end);
+        }
+
+        inline virtual bool tryInitializeIndex(AnnoyIndex* index, const VectorMatrix& matrix, row_type start, row_type end) const {
+            return index->tryInitializeForest(matrix, 1, start, end);
+        }
+
+        // the search_k candidates of the forest; the search is not bounded by localTheta
+        inline virtual row_type getCandidates(const double* query, const AnnoyIndex* index, double localTheta, RetrievalArguments* arg) const {
+            return index->getCandidates(query, arg->search_k, arg->candidatesToVerify, arg->done, arg->searchQueue);
+        }
+
+    public:
+
+        AnnoyRetriever() = default;
+
+        ~AnnoyRetriever() = default;
+
+    };
+
+}
+
+#endif	/* ANNOYRETRIEVER_H */
@@ -143,7 +143,7 @@ check: // check similarity value
 
 //                    if (arg->k == 0) {
 
-                        if (ip >= arg->theta) { //simT                              
+                        if (ip >= arg->theta && !arg->isExcluded(posInProbeMatrix)) { //simT                              
 //                            arg->results.push_back(MatItem(ip, arg->queryId, arg->probeMatrix->getId(posInProbeMatrix)));
                             arg->results.emplace_back(ip, arg->queryId, arg->probeMatrix->getId(posInProbeMatrix));
                         }
@@ -275,7 +275,7 @@ check: // check similarity value
 
                     ip = cval * queryLength * arg->probeMatrix->getVectorLength(posInProbeMatrix);
 
-                    if (ip > minScore) {
+                    if (ip > minScore && !arg->isExcluded(posInProbeMatrix)) {
 
                         std::pop_heap(arg->heap.begin(), arg->heap.end(), std::greater<QueueElement>());
                         arg->heap.pop_back();
@@ -630,20 +630,19 @@ nexcid:
 #if defined(TIME_IT)
                     arg->t.start();
 #endif
-                    index->initializeLists(*(arg->probeMatrix), arg->worstMinScore, arg->queryMatrix->cweights, probeBucket.startPos, probeBucket.endPos);
+                    index->initializeLists(*(arg->probeMatrix), arg->safeMinScore(), arg->queryMatrix->cweights, probeBucket.startPos, probeBucket.endPos);
 #if defined(TIME_IT)
                     arg->t.stop();
                     arg->initializeListsTime += arg->t.elapsedTime().nanos();
 #endif
-                    arg->worstMinScore = std::numeric_limits<double>::max();
                 }
 
 
                 //////////////////////////
                 row_type user = queryBatch.startPos;
-                int start = queryBatch.startPos * arg->k;
-                int end = queryBatch.endPos * arg->k;
-                for (row_type i = start; i < end; i += arg->k) {
+                row_type start = arg->topkOffset(queryBatch.startPos);
+                row_type end = arg->topkOffset(queryBatch.endPos);
+                for (row_type i = start; i < end; i = arg->topkOffset(user)) {
 
                     if (queryBatch.isQueryInactive(user)) {
                         user++;
@@ -661,7 +660,7 @@ nexcid:
                         continue;
                     }
 
-                    arg->moveTopkToHeap(i);
+                    arg->moveTopkToHeap(user);
 
                     arg->queryId = arg->queryMatrix->getId(user);
                     row_type nnzQuery = arg->queryMatrix->vectorNNZ[user];
@@ -697,6 +696,8 @@ nexcid:
 
                     if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                         break;
+                    if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                        continue;
 
                     row_type nnzQuery = arg->queryMatrix->vectorNNZ[i];
                     double maxQueryCoord = arg->queryMatrix->maxVectorCoord[i];
@@ -128,7 +128,7 @@ namespace mips {
                                 retrArg[0].sums, retrArg[0].countsOfBlockValues, retrArg[0].sketches, true);
 
                         retrArg[0].tunerTimer.start();
-                        queryIndex.checkAndReallocateSingle(retrArg[t].queryMatrix, ind, i, activeBlocks, retrArg[t].sums);
+                        queryIndex.checkAndReallocateSingle(retrArg[t].queryMatrix, ind, i, activeBlocks, retrArg[0].sums);
 
                         LshRetriever::processIndexes(query, i, index, &queryIndex, activeBlocks, probeBucket, &retrArg[0]);
                         retrArg[0].tunerTimer.stop();
@@ -201,6 +201,8 @@ namespace mips {
 
                         if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                             break;
+                        if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                            continue;
 
                         arg->queryId = arg->queryMatrix->getId(i);
                         if (probeBucket.t_b * query[-1] > probeBucket.bucketScanThreshold) {
@@ -385,7 +387,7 @@ namespace mips {
 #ifdef TIME_IT
                     arg->t.start();
 #endif           
-                    index->initializeLists(*(arg->probeMatrix), arg->worstMinScore, true, arg->R, probeBucket.startPos, probeBucket.endPos);
+                    index->initializeLists(*(arg->probeMatrix), arg->safeMinScore(), true, arg->R, probeBucket.startPos, probeBucket.endPos);
 
 #ifdef TIME_IT
                     arg->t.stop();
@@ -393,7 +395,7 @@ namespace mips {
 #endif
                 }
                 if (index->minMatches == nullptr) {
-                    double worstCaseTheta = arg->worstMinScore;
+                    double worstCaseTheta = arg->safeMinScore();
 
                     if (worstCaseTheta > 0) {
                         worstCaseTheta *= probeBucket.invNormL2.second;
@@ -402,8 +404,7 @@ namespace mips {
                         worstCaseTheta *= probeBucket.invNormL2.first;
                         worstCaseTheta = (worstCaseTheta < -1 ? -1 : worstCaseTheta); // it will have to check everything
                     }
-                    arg->worstMinScore = std::numeric_limits<double>::max();
-                    index->lockIndex();                    
+                    index->lockIndex();
                     index->allocateBayesLSHMemory(worstCaseTheta);
                     index->unlockIndex();
                 }
@@ -432,9 +433,9 @@ namespace mips {
 
                     ///////////////////////
                     row_type user = queryBatch.startPos;
-                    int start = queryBatch.startPos * arg->k;
-                    int end = queryBatch.endPos * arg->k;
-                    for (row_type i = start; i < end; i += arg->k) {
+                    row_type start = arg->topkOffset(queryBatch.startPos);
+                    row_type end = arg->topkOffset(queryBatch.endPos);
+                    for (row_type i = start; i < end; i = arg->topkOffset(user)) {
                         if (queryBatch.isQueryInactive(user)) {
                             user++;
                             continue;
@@ -467,7 +468,7 @@ namespace mips {
                             user++;
 #ifdef         HYBRID_APPROX                     
 
-                            arg->moveTopkToHeap(i);
+                            arg->moveTopkToHeap(user - 1);
                             arg->totalErrorAfterResults += approximateHybridError(*arg, probeBucket.normL2.second, probeBucket.invNormL2.second);
 #endif                   
 
@@ -475,7 +476,7 @@ namespace mips {
                             continue;
                         }
 
-                        arg->moveTopkToHeap(i);
+                        arg->moveTopkToHeap(user);
 
 
                         arg->queryId = arg->queryMatrix->getId(user);
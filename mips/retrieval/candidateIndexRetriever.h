@@ -0,0 +1,241 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   candidateIndexRetriever.h
+ */
+
+#ifndef CANDIDATEINDEXRETRIEVER_H
+#define	CANDIDATEINDEXRETRIEVER_H
+
+namespace mips {
+
+    /*
+     * Common part of the methods that verify the candidates of a per-bucket index (IndexT, stored in the bucket under
+     * indexType): queries with theta_b(q) below t_b run LENGTH, the others verify the candidates of the index. t_b
+     * comes from the sample times with the index and with LENGTH. The index is built lazily; while another thread
+     * builds it, queries run LENGTH instead of waiting. Subclasses build the index and fetch its candidates.
+     */
+    template<class IndexT, Index_Type indexType>
+    class CandidateIndexRetriever : public Retriever {
+        LengthRetriever plain;
+        row_type t_b_indx;
+
+        inline void processIndex(const double* query, const IndexT* index, double localTheta, RetrievalArguments* arg, bool topk) const {
+#ifdef TIME_IT
+            arg->t.start();
+#endif
+            row_type numCandidatesToVerify = getCandidates(query, index, localTheta, arg);
+
+#ifdef TIME_IT
+            arg->t.stop();
+            arg->scanTime += arg->t.elapsedTime().nanos();
+            arg->t.start();
+#endif
+            if (topk)
+                verifyCandidatesTopK_lengthTest(query, numCandidatesToVerify, arg);
+            else
+                verifyCandidates_lengthTest(query, numCandidatesToVerify, arg);
+
+#ifdef TIME_IT
+            arg->t.stop();
+            arg->ipTime += arg->t.elapsedTime().nanos();
+#endif
+        }
+
+        // theta_b(q) for top-k: the cosine a direction needs to beat the heap minimum in this bucket
+        inline double localThetaTopk(const ProbeBucket& probeBucket, double minScore) const {
+            return minScore * (minScore > 0 ? probeBucket.invNormL2.second : probeBucket.invNormL2.first);
+        }
+
+        // t_b from the times of the sample with the index (sampleTimes) and with LENGTH
+        inline void setT_b(ProbeBucket& probeBucket) {
+            findCutOffPoint(sampleTimes, plain.sampleTimes, sampleTotalTime, t_b_indx);
+
+            if (plain.sampleTotalTime < sampleTotalTime) {
+                probeBucket.setAfterTuning(1, 1);
+            } else {
+                double value = (t_b_indx == 0 ? -1 : probeBucket.xValues->at(t_b_indx).result);
+                probeBucket.setAfterTuning(1, value);
+            }
+        }
+
+    protected:
+
+        // blocking: builds the index of the rows [start, end) with one thread or waits for the thread that builds it
+        virtual void initializeIndex(IndexT* index, const VectorMatrix& matrix, row_type start, row_type end) const = 0;
+
+        // non-blocking: false if another thread is building the index
+        virtual bool tryInitializeIndex(IndexT* index, const VectorMatrix& matrix, row_type start, row_type end) const = 0;
+
+        // writes the candidates of query into arg->candidatesToVerify, returns their number. localTheta: theta_b(q)
+        virtual row_type getCandidates(const double* query, const IndexT* index, double localTheta, RetrievalArguments* arg) const = 0;
+
+    public:
+
+        CandidateIndexRetriever() = default;
+
+        virtual ~CandidateIndexRetriever() = default;
+
+        inline virtual void tune(ProbeBucket& probeBucket, const ProbeBucket& prevBucket, std::vector<RetrievalArguments>& retrArg) {
+
+            row_type sampleSize = probeBucket.xValues->size();
+
+            if (sampleSize > 0) {
+                plain.tune(probeBucket, prevBucket, retrArg);
+
+                IndexT* index = static_cast<IndexT*> (probeBucket.getIndex(indexType));
+                initializeIndex(index, *(retrArg[0].probeMatrix), probeBucket.startPos, probeBucket.endPos);
+
+                sampleTimes.resize(sampleSize);
+                for (row_type i = 0; i < sampleSize; ++i) {
+                    int t = probeBucket.xValues->at(i).i;
+                    int ind = probeBucket.xValues->at(i).j;
+                    const double* query = retrArg[t].queryMatrix->getMatrixRowPtr(ind);
+
+                    retrArg[0].tunerTimer.start();
+                    processIndex(query, index, probeBucket.xValues->at(i).result, &retrArg[0], false);
+                    retrArg[0].tunerTimer.stop();
+                    sampleTimes[i] = retrArg[0].tunerTimer.elapsedTime().nanos();
+                }
+
+                setT_b(probeBucket);
+            } else {
+                probeBucket.setAfterTuning(prevBucket.numLists, prevBucket.t_b);
+            }
+        }
+
+        inline virtual void tuneTopk(ProbeBucket& probeBucket, const ProbeBucket& prevBucket, std::vector<RetrievalArguments>& retrArg) {
+
+            row_type sampleSize = (probeBucket.xValues != nullptr ? probeBucket.xValues->size() : 0);
+
+            if (sampleSize > 0) {
+                plain.tuneTopk(probeBucket, prevBucket, retrArg); // the LENGTH times of the sample top-k
+
+                IndexT* index = static_cast<IndexT*> (probeBucket.getIndex(indexType));
+                initializeIndex(index, *(retrArg[0].probeMatrix), probeBucket.startPos, probeBucket.endPos);
+
+                sampleTimes.resize(sampleSize);
+                for (row_type i = 0; i < sampleSize; ++i) {
+                    int t = probeBucket.xValues->at(i).i;
+                    int ind = probeBucket.xValues->at(i).j;
+                    const double* query = retrArg[t].queryMatrix->getMatrixRowPtr(ind);
+
+                    const std::vector<QueueElement>& prevResults = prevBucket.sampleThetas[t].at(ind).results;
+
+                    retrArg[0].heap.assign(prevResults.begin(), prevResults.end());
+                    std::make_heap(retrArg[0].heap.begin(), retrArg[0].heap.end(), std::greater<QueueElement>());
+
+                    retrArg[0].tunerTimer.start();
+                    processIndex(query, index, localThetaTopk(probeBucket, retrArg[0].heap.front().data), &retrArg[0], true);
+                    retrArg[0].tunerTimer.stop();
+                    sampleTimes[i] = retrArg[0].tunerTimer.elapsedTime().nanos();
+                }
+
+                setT_b(probeBucket);
+            } else {
+                probeBucket.setAfterTuning(prevBucket.numLists, prevBucket.t_b);
+            }
+        }
+
+        inline virtual void runTopK(ProbeBucket& probeBucket, RetrievalArguments* arg) const {
+
+            if (probeBucket.t_b == 1) {
+                plain.runTopK(probeBucket, arg);
+                return;
+            }
+
+            IndexT* index = static_cast<IndexT*> (probeBucket.getIndex(indexType));
+
+            for (auto& queryBatch : arg->queryBatches) {
+
+                if (queryBatch.isWorkDone())
+                    continue;
+
+                row_type user = queryBatch.startPos;
+                row_type start = arg->topkOffset(queryBatch.startPos);
+                row_type end = arg->topkOffset(queryBatch.endPos);
+                for (row_type i = start; i < end; i = arg->topkOffset(user)) {
+
+                    if (queryBatch.isQueryInactive(user)) {
+                        user++;
+                        continue;
+                    }
+
+                    const double* query = arg->queryMatrix->getMatrixRowPtr(user);
+                    double minScore = arg->topkResults[i].data;
+
+                    if (probeBucket.normL2.second < minScore) {// skip this bucket and all other buckets
+                        queryBatch.inactivateQuery(user);
+                        user++;
+                        continue;
+                    }
+
+                    arg->moveTopkToHeap(user);
+                    arg->queryId = arg->queryMatrix->getId(user);
+
+                    // length-based also if another thread is still building the index
+                    if (probeBucket.t_b * probeBucket.normL2.second > minScore ||
+                            !tryInitializeIndex(index, *(arg->probeMatrix), probeBucket.startPos, probeBucket.endPos)) {
+                        plain.runTopK(query, probeBucket, arg);
+                    } else {
+                        processIndex(query, index, localThetaTopk(probeBucket, minScore), arg, true);
+                    }
+
+                    arg->writeHeapToTopk(user);
+                    user++;
+                }
+            }
+        }
+
+        inline virtual void run(ProbeBucket& probeBucket, RetrievalArguments* arg) const {
+
+            IndexT* index = static_cast<IndexT*> (probeBucket.getIndex(indexType));
+
+            for (auto& queryBatch : arg->queryBatches) {
+
+                if (queryBatch.maxLength() < probeBucket.bucketScanThreshold) {
+                    break;
+                }
+
+                if (probeBucket.t_b == 1 || (probeBucket.t_b * queryBatch.minLength() > probeBucket.bucketScanThreshold) ||
+                        !tryInitializeIndex(index, *(arg->probeMatrix), probeBucket.startPos, probeBucket.endPos)) {
+                    plain.run(queryBatch, probeBucket, arg);
+
+                } else { // do it per query
+
+                    for (row_type i = queryBatch.startPos; i < queryBatch.endPos; ++i) {
+                        const double* query = arg->queryMatrix->getMatrixRowPtr(i);
+
+                        if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
+                            break;
+                        if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                            continue;
+
+                        arg->queryId = arg->queryMatrix->getId(i);
+                        if (probeBucket.t_b * query[-1] > probeBucket.bucketScanThreshold) {
+                            plain.run(query, probeBucket, arg);
+                        } else {
+                            processIndex(query, index, probeBucket.bucketScanThreshold / query[-1], arg, false);
+                        }
+                    }
+                }
+            }
+        }
+
+    };
+
+}
+
+#endif	/* CANDIDATEINDEXRETRIEVER_H */
@@ -26,11 +26,31 @@ namespace mips {
 
     class CoordRetriever : public Retriever {
     public:
-
+        LengthRetriever plain; // for the queries that reach the bucket while its lists are under construction
 
         CoordRetriever() = default;
         ~CoordRetriever() = default;
 
+        /*
+         * Non-blocking: helps sorting the lists of the bucket. Returns false if other threads are still sorting their columns.
+         * Then the caller should serve its queries with LENGTH instead of waiting
+         */
+        inline bool tryIndex(ProbeBucket& probeBucket, RetrievalArguments* arg) const {
+            IntLists* invLists = static_cast<IntLists*> (probeBucket.getIndex(INT_SL));
+
+            if (invLists->isInitialized())
+                return true;
+#ifdef TIME_IT
+            arg->t.start();
+#endif
+            bool ready = invLists->tryInitializeLists(*(arg->probeMatrix), probeBucket.startPos, probeBucket.endPos);
+#ifdef TIME_IT
+            arg->t.stop();
+            arg->initializeListsTime += arg->t.elapsedTime().nanos();
+#endif
+            return ready;
+        }
+
         inline void run(const double* query, ProbeBucket& probeBucket, RetrievalArguments* arg) const {
 
             IntLists* invLists = static_cast<IntLists*> (probeBucket.getIndex(INT_SL));
@@ -118,6 +138,8 @@ namespace mips {
 
                 if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                     break;
+                if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                    continue;
 
                 col_type* localQueue = queryBatch.getQueue(i - queryBatch.startPos, arg->maxLists);
                 arg->setQueues(localQueue);
@@ -220,9 +242,9 @@ namespace mips {
             arg->numLists = probeBucket.numLists;
 
             row_type user = queryBatch.startPos;
-            int start = queryBatch.startPos * arg->k;
-            int end = queryBatch.endPos * arg->k;
-            for (row_type i = start; i < end; i += arg->k) {
+            row_type start = arg->topkOffset(queryBatch.startPos);
+            row_type end = arg->topkOffset(queryBatch.endPos);
+            for (row_type i = start; i < end; i = arg->topkOffset(user)) {
 
                 if (queryBatch.isQueryInactive(user)) {
                     user++;
@@ -237,7 +259,7 @@ namespace mips {
                     continue;
                 }
 
-                arg->moveTopkToHeap(i);
+                arg->moveTopkToHeap(user);
                 arg->queryId = arg->queryMatrix->getId(user);
                 col_type* localQueue = queryBatch.getQueue(user - queryBatch.startPos, arg->maxLists);
                 arg->setQueues(localQueue);
@@ -251,9 +273,18 @@ namespace mips {
 
         }
 
+        // tuning by the cost model (false: uncertain, tune by timing). tuned: gets the predicted total time
+        inline bool tuneByModel(ProbeBucket& probeBucket, std::vector<RetrievalArguments>& retrArg, bool withLength, Retriever* tuned) {
+            ListTuneData dataForTuning;
+            return dataForTuning.tuneByModel<IntLists>(probeBucket, retrArg, INT_SL, false, withLength, tuned);
+        }
+
         inline virtual void tune(ProbeBucket& probeBucket, const ProbeBucket& prevBucket, std::vector<RetrievalArguments>& retrArg) {
 
             if (probeBucket.xValues->size() > 0) {
+                if (retrArg[0].competitorMethod == nullptr && tuneByModel(probeBucket, retrArg, false, this))
+                    return;
+
                 ListTuneData dataForTuning;
                 dataForTuning.tune<CoordRetriever>(probeBucket, prevBucket, retrArg, this);
             } else {
@@ -264,6 +295,9 @@ namespace mips {
         inline virtual void tuneTopk(ProbeBucket& probeBucket, const ProbeBucket& prevBucket, std::vector<RetrievalArguments>& retrArg) {
             row_type sampleSize = (probeBucket.xValues != nullptr ? probeBucket.xValues->size() : 0);
             if (sampleSize > 0) {
+                if (retrArg[0].competitorMethod == nullptr && tuneByModel(probeBucket, retrArg, false, this))
+                    return;
+
                 ListTuneData dataForTuning;
                 dataForTuning.tuneTopk<CoordRetriever>(probeBucket, prevBucket, retrArg, this);
             } else {
@@ -278,6 +312,11 @@ namespace mips {
             for (auto& queryBatch : arg->queryBatches) {
                 if (queryBatch.isWorkDone())
                     continue;
+
+                if (!tryIndex(probeBucket, arg)) { // the lists are still sorted by other threads: scan this batch meanwhile
+                    plain.runTopK(queryBatch, probeBucket, arg);
+                    continue;
+                }
 #ifdef TIME_IT
                 arg->t.start();
 #endif
@@ -290,9 +329,9 @@ namespace mips {
 #endif                
 
                 row_type user = queryBatch.startPos;
-                int start = queryBatch.startPos * arg->k;
-                int end = queryBatch.endPos * arg->k;
-                for (row_type i = start; i < end; i += arg->k) {
+                row_type start = arg->topkOffset(queryBatch.startPos);
+                row_type end = arg->topkOffset(queryBatch.endPos);
+                for (row_type i = start; i < end; i = arg->topkOffset(user)) {
 
                     if (queryBatch.isQueryInactive(user)) {
                         user++;
@@ -308,7 +347,7 @@ namespace mips {
                         continue;
                     }
 
-                    arg->moveTopkToHeap(i);
+                    arg->moveTopkToHeap(user);
                     arg->queryId = arg->queryMatrix->getId(user);
                     col_type* localQueue = queryBatch.getQueue(user - queryBatch.startPos, arg->maxLists);
                     arg->setQueues(localQueue);
@@ -348,6 +387,8 @@ namespace mips {
 
                     if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                         break;
+                    if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                        continue;
 
                     col_type* localQueue = queryBatch.getQueue(i - queryBatch.startPos, arg->maxLists);
                     arg->setQueues(localQueue);
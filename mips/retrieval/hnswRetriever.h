@@ -0,0 +1,56 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   hnswRetriever.h
+ */
+
+#ifndef HNSWRETRIEVER_H
+#define	HNSWRETRIEVER_H
+
+namespace mips {
+
+    /*
+     * LEMP_HNSW (approximate): queries with theta_b(q) below t_b run LENGTH, the others verify the directions that
+     * the graph search of the bucket finds (at most ef). The search is bounded by theta_b(q): in top-k by the current
+     * heap minimum, so it stops early in buckets that can add little. The bucket skipping of top-k (by the length of
+     * the longest vector) applies as for the exact methods. While another thread builds the graph, queries run LENGTH.
+     */
+    class HnswRetriever : public CandidateIndexRetriever<HnswIndex, HNSW> {
+    protected:
+
+        inline virtual void initializeIndex(HnswIndex* index, const VectorMatrix& matrix, row_type start, row_type end) const {
+            index->initializeGraph(matrix, 1, start, end);
+        }
+
+        inline virtual bool tryInitializeIndex(HnswIndex* index, const VectorMatrix& matrix, row_type start, row_type end) const {
+            return index->tryInitializeGraph(matrix, 1, start, end);
+        }
+
+        inline virtual row_type getCandidates(const double* query, const HnswIndex* index, double localTheta, RetrievalArguments* arg) const {
+            row_type ef = std::max(arg->ef, arg->k);
+            return index->getCandidates(query, ef, localTheta, arg->candidatesToVerify, arg->done, arg->searchQueue, arg->searchResults);
+        }
+
+    public:
+
+        HnswRetriever() = default;
+
+        ~HnswRetriever() = default;
+
+    };
+
+}
+
+#endif	/* HNSWRETRIEVER_H */
@@ -147,7 +147,7 @@ namespace mips {
                                 retrArg[0].sums, retrArg[0].countsOfBlockValues, retrArg[0].sketches, false);
 
                         retrArg[0].tunerTimer.start();
-                        queryIndex.checkAndReallocateSingle(retrArg[t].queryMatrix, ind, i, activeBlocks, retrArg[t].sums);
+                        queryIndex.checkAndReallocateSingle(retrArg[t].queryMatrix, ind, i, activeBlocks, retrArg[0].sums);
 
                         processIndexes(query, i, index, &queryIndex, activeBlocks, probeBucket, &retrArg[0]);
                         retrArg[0].tunerTimer.stop();
@@ -339,9 +339,9 @@ namespace mips {
 
                     ///////////////////////
                     row_type user = queryBatch.startPos;
-                    int start = queryBatch.startPos * arg->k;
-                    int end = queryBatch.endPos * arg->k;
-                    for (row_type i = start; i < end; i += arg->k) {
+                    row_type start = arg->topkOffset(queryBatch.startPos);
+                    row_type end = arg->topkOffset(queryBatch.endPos);
+                    for (row_type i = start; i < end; i = arg->topkOffset(user)) {
                         if (queryBatch.isQueryInactive(user)) {
                             user++;
                             continue;
@@ -372,7 +372,7 @@ namespace mips {
                             user++;
 #ifdef         HYBRID_APPROX                     
 
-                            arg->moveTopkToHeap(i);
+                            arg->moveTopkToHeap(user - 1);
                             arg->totalErrorAfterResults += approximateHybridError(*arg, probeBucket.normL2.second, probeBucket.invNormL2.second);
 #endif                   
 
@@ -380,7 +380,7 @@ namespace mips {
                             continue;
                         }
 
-                        arg->moveTopkToHeap(i);
+                        arg->moveTopkToHeap(user);
 
 
                         arg->queryId = arg->queryMatrix->getId(user);
@@ -416,20 +416,28 @@ namespace mips {
 #ifdef TIME_IT
                                 arg->t.start();
 #endif 
-                                if (activeBlocks > index->initializedSketchesForIndex) {
-                                    index->lockIndex();
+                                if (activeBlocks > index->initializedSketchesForIndex && index->tryLockIndex()) {
                                     index->checkAndReallocateAll(arg->probeMatrix, true, probeBucket.startPos, probeBucket.endPos, activeBlocks,
                                             arg->sums, arg->countsOfBlockValues, arg->sketches, false); // need for lock here
                                     index->unlockIndex();
                                 }
 
-                                queryIndex->checkAndReallocateSingle(arg->queryMatrix, user, user - queryBatch.startPos, activeBlocks, arg->sums);
+                                if (activeBlocks > index->initializedSketchesForIndex) {
+                                    // another thread is still extending the sketches: scan instead of waiting for it
 #ifdef TIME_IT
-                                arg->t.stop();
-                                arg->preprocessTime += arg->t.elapsedTime().nanos();
+                                    arg->t.stop();
+                                    arg->preprocessTime += arg->t.elapsedTime().nanos();
+#endif 
+                                    plain.runTopK(query, probeBucket, arg);
+                                } else {
+                                    queryIndex->checkAndReallocateSingle(arg->queryMatrix, user, user - queryBatch.startPos, activeBlocks, arg->sums);
+#ifdef TIME_IT
+                                    arg->t.stop();
+                                    arg->preprocessTime += arg->t.elapsedTime().nanos();
 #endif 
 
-                                processIndexesTopk(query, user - queryBatch.startPos, index, queryIndex, activeBlocks, probeBucket, arg);
+                                    processIndexesTopk(query, user - queryBatch.startPos, index, queryIndex, activeBlocks, probeBucket, arg);
+                                }
 
 
                             }
@@ -483,6 +491,8 @@ namespace mips {
 
                         if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                             break;
+                        if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                            continue;
 
                         arg->queryId = arg->queryMatrix->getId(i);
                         if (probeBucket.t_b * query[-1] > probeBucket.bucketScanThreshold) {
@@ -38,9 +38,18 @@ namespace mips {
             return &plainRetriever;
         }
 
+        // LENGTH for all sample queries or the best mix with the lists
+        inline virtual double sampleCost() const {
+            if (sampleTotalTime > 0)
+                return sampleTotalTime;
+            return std::min(plainRetriever.sampleTotalTime, otherRetriever.sampleTotalTime);
+        }
+
         inline virtual void tune(ProbeBucket& probeBucket, const ProbeBucket& prevBucket, std::vector<RetrievalArguments>& retrArg) {
 
             if (probeBucket.xValues->size() > 0) {
+                if (otherRetriever.tuneByModel(probeBucket, retrArg, true, this))
+                    return;
 
                 plainRetriever.tune(probeBucket, prevBucket, retrArg);
                 retrArg[0].competitorMethod = &plainRetriever.sampleTimes;
@@ -63,6 +72,9 @@ namespace mips {
 
 
             if (sampleSize > 0) {
+                if (otherRetriever.tuneByModel(probeBucket, retrArg, true, this))
+                    return;
+
                 plainRetriever.sampleTimes.reserve(sampleSize);
 
                 for (row_type i = 0; i < sampleSize; ++i) {
@@ -89,7 +101,9 @@ namespace mips {
         inline virtual void runTopK(ProbeBucket& probeBucket, RetrievalArguments* arg) const {
 
 
-            if (probeBucket.t_b == 1) {
+            OnlineTuner* tuner = probeBucket.onlineTuner.get();
+
+            if (probeBucket.t_b == 1 && tuner == nullptr) {
                 plainRetriever.runTopK(probeBucket, arg);
             } else { // do it per query
                 arg->numLists = probeBucket.numLists;
@@ -100,9 +114,9 @@ namespace mips {
                         continue;
 
                     row_type user = queryBatch.startPos;
-                    int start = queryBatch.startPos * arg->k;
-                    int end = queryBatch.endPos * arg->k;
-                    for (row_type i = start; i < end; i += arg->k) {
+                    row_type start = arg->topkOffset(queryBatch.startPos);
+                    row_type end = arg->topkOffset(queryBatch.endPos);
+                    for (row_type i = start; i < end; i = arg->topkOffset(user)) {
 
                         if (queryBatch.isQueryInactive(user)) {
                             user++;
@@ -140,18 +154,37 @@ namespace mips {
 
 #ifdef         RELATIVE_APPROX                     
 
-                            arg->moveTopkToHeap(i);
+                            arg->moveTopkToHeap(user - 1);
                             arg->totalErrorAfterResults += approximateRelError(*arg);
 #endif   
                             continue;
                         }
 
-                        arg->moveTopkToHeap(i);
+                        arg->moveTopkToHeap(user);
 
                         arg->queryId = arg->queryMatrix->getId(user);
 
-                        if (probeBucket.t_b * probeBucket.normL2.second > minScore) {// do length-based
-                            plainRetriever.runTopK(query, probeBucket, arg);
+                        OnlineTuner::Choice choice;
+                        double localTheta = 0;
+                        bool length;
+                        if (tuner != nullptr) {
+                            localTheta = minScore * (minScore > 0 ? probeBucket.invNormL2.second : probeBucket.invNormL2.first);
+                            choice = tuner->choose(localTheta, arg->maxLists);
+                            length = choice.length;
+                        } else {
+                            length = probeBucket.t_b * probeBucket.normL2.second > minScore;
+                        }
+
+                        // length-based also if other threads are still building the index (instead of waiting for them)
+                        if (length || !otherRetriever.tryIndex(probeBucket, arg)) {
+                            if (tuner != nullptr && length) {
+                                arg->tunerTimer.start();
+                                plainRetriever.runTopK(query, probeBucket, arg);
+                                arg->tunerTimer.stop();
+                                tuner->record(choice, localTheta, arg->tunerTimer.elapsedTime().nanos());
+                            } else {
+                                plainRetriever.runTopK(query, probeBucket, arg);
+                            }
 
                         } else {
 #ifdef TIME_IT
@@ -167,7 +200,16 @@ namespace mips {
 #endif
                             col_type* localQueue = queryBatch.getQueue(user - queryBatch.startPos, arg->maxLists);
                             arg->setQueues(localQueue);
-                            otherRetriever.runTopK(query, probeBucket, arg);
+
+                            if (tuner != nullptr) {
+                                arg->numLists = choice.numLists;
+                                arg->tunerTimer.start();
+                                otherRetriever.runTopK(query, probeBucket, arg);
+                                arg->tunerTimer.stop();
+                                tuner->record(choice, localTheta, arg->tunerTimer.elapsedTime().nanos());
+                            } else {
+                                otherRetriever.runTopK(query, probeBucket, arg);
+                            }
 
                         }
 
@@ -179,8 +221,52 @@ namespace mips {
             }
         }
 
+        /*
+         * Above-theta with online re-tuning: the tuner of the bucket decides per query between LENGTH and lists
+         * (and how many) and learns from the time the query took
+         */
+        inline void runAdaptive(QueryBatch& queryBatch, ProbeBucket& probeBucket, RetrievalArguments* arg, OnlineTuner& tuner) const {
+#ifdef TIME_IT
+            arg->t.start();
+#endif
+            if (!queryBatch.hasInitializedQueues()) { //preprocess
+                queryBatch.preprocess(*(arg->queryMatrix), arg->maxLists);
+            }
+#ifdef TIME_IT
+            arg->t.stop();
+            arg->preprocessTime += arg->t.elapsedTime().nanos();
+#endif
+
+            for (row_type i = queryBatch.startPos; i < queryBatch.endPos; ++i) {
+                const double* query = arg->queryMatrix->getMatrixRowPtr(i);
+
+                if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
+                    break;
+                if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                    continue;
+
+                arg->queryId = arg->queryMatrix->getId(i);
+                double localTheta = probeBucket.bucketScanThreshold / query[-1];
+                OnlineTuner::Choice choice = tuner.choose(localTheta, arg->maxLists);
+
+                arg->tunerTimer.start();
+                if (choice.length) {
+                    plainRetriever.run(query, probeBucket, arg);
+                } else {
+                    col_type* localQueue = queryBatch.getQueue(i - queryBatch.startPos, arg->maxLists);
+                    arg->setQueues(localQueue);
+                    arg->numLists = choice.numLists;
+                    otherRetriever.run(query, probeBucket, arg);
+                }
+                arg->tunerTimer.stop();
+                tuner.record(choice, localTheta, arg->tunerTimer.elapsedTime().nanos());
+            }
+            arg->numLists = probeBucket.numLists;
+        }
+
         inline virtual void run(ProbeBucket& probeBucket, RetrievalArguments* arg) const {
             arg->numLists = probeBucket.numLists;
+            OnlineTuner* tuner = probeBucket.onlineTuner.get();
 
             for (auto& queryBatch : arg->queryBatches) {
 
@@ -188,7 +274,9 @@ namespace mips {
                     break;
                 }
 
-                if (probeBucket.t_b == 1 || (probeBucket.t_b * queryBatch.minLength() > probeBucket.bucketScanThreshold)) {
+                if (tuner != nullptr) {
+                    runAdaptive(queryBatch, probeBucket, arg, *tuner);
+                } else if (probeBucket.t_b == 1 || (probeBucket.t_b * queryBatch.minLength() > probeBucket.bucketScanThreshold)) {
                     plainRetriever.run(queryBatch, probeBucket, arg);
                 } else if (probeBucket.t_b * queryBatch.maxLength() <= probeBucket.bucketScanThreshold) {
                     otherRetriever.run(queryBatch, probeBucket, arg);
@@ -213,6 +301,8 @@ namespace mips {
 
                         if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                             break;
+                        if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                            continue;
 
                         arg->queryId = arg->queryMatrix->getId(i);
                         if (probeBucket.t_b * query[-1] > probeBucket.bucketScanThreshold) {// do length-based
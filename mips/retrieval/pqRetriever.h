@@ -0,0 +1,59 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   pqRetriever.h
+ */
+
+#ifndef PQRETRIEVER_H
+#define	PQRETRIEVER_H
+
+namespace mips {
+
+    /*
+     * LEMP_PQ: queries with theta_b(q) below t_b run LENGTH, the others screen the bucket by the product-quantized
+     * cosines and verify what passes. exact: every vector whose approximate cosine plus quantization error reaches
+     * theta_b(q) (in top-k: of the heap minimum), so no result is lost. Otherwise (approximate) at most search_k
+     * vectors with the best approximate cosines are verified. While another thread builds the codes, queries run LENGTH.
+     */
+    class PqRetriever : public CandidateIndexRetriever<PqIndex, PQ> {
+        bool exact;
+
+    protected:
+
+        inline virtual void initializeIndex(PqIndex* index, const VectorMatrix& matrix, row_type start, row_type end) const {
+            index->initializeCodes(matrix, 1, start, end);
+        }
+
+        inline virtual bool tryInitializeIndex(PqIndex* index, const VectorMatrix& matrix, row_type start, row_type end) const {
+            return index->tryInitializeCodes(matrix, 1, start, end);
+        }
+
+        inline virtual row_type getCandidates(const double* query, const PqIndex* index, double localTheta, RetrievalArguments* arg) const {
+            row_type maxCandidates = std::max(arg->search_k, arg->k);
+            return index->getCandidates(query, localTheta, exact, maxCandidates, arg->candidatesToVerify, arg->adcTables, arg->adcCosines);
+        }
+
+    public:
+
+        PqRetriever(bool exact = true) : exact(exact) {
+        }
+
+        ~PqRetriever() = default;
+
+    };
+
+}
+
+#endif	/* PQRETRIEVER_H */
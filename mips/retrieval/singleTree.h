@@ -32,6 +32,7 @@
 #include <mips/my_mlpack/fastmks/fastmks_rules.hpp>
 #include <queue>
 #include <mips/my_mlpack/core/tree/cover_tree/single_tree_traverser.hpp>
+#include <mips/my_mlpack/core/tree/cover_tree/dual_tree_traverser.hpp>
 
 
 using namespace mips::fastmks;
@@ -40,12 +41,78 @@ using namespace mips::metric;
 
 namespace mips {
 
+    /*
+     * LEMP_TREE: FastMKS on the cover tree of the bucket. Single-tree: one traversal per query. Dual-tree: the queries
+     * of each batch in a cover tree of their own (built on first use, kept for all buckets), traversed together with
+     * the bucket tree, so that similar queries share the bound computations. The pruning bounds of the queries are
+     * those of the batch: theta, or the minimum of the topk list, which rises as results are found
+     */
     class SingleTree : public Retriever {
         FastMKS<TreeType>* fastmks;
+        LengthRetriever plain; // for the queries that reach the bucket while its tree is under construction
+        bool dualTree;
+
+        inline void prepareQueryTree(QueryBatch& queryBatch, RetrievalArguments* arg) const {
+#ifdef TIME_IT
+            arg->t.start();
+#endif
+            if (queryBatch.treeIndex == nullptr) {
+                queryBatch.createTreeIndex(*(arg->queryMatrix));
+            }
+#ifdef TIME_IT
+            arg->t.stop();
+            arg->preprocessTime += arg->t.elapsedTime().nanos();
+#endif
+        }
+
+        inline void runTopKDual(QueryBatch& queryBatch, TreeIndex* index, ProbeBucket& probeBucket, RetrievalArguments* arg) const {
+
+            arg->queryBounds.resize(queryBatch.endPos - queryBatch.startPos);
+            for (row_type user = queryBatch.startPos; user < queryBatch.endPos; ++user) {
+                double& bound = arg->queryBounds[user - queryBatch.startPos];
+
+                if (queryBatch.isQueryInactive(user)) {
+                    bound = DBL_MAX;
+                    continue;
+                }
+
+                bound = arg->topkResults[arg->topkOffset(user)].data;
+                if (probeBucket.normL2.second < bound) {// skip this bucket and all other buckets
+                    queryBatch.inactivateQuery(user);
+                    bound = DBL_MAX;
+                }
+            }
+
+            if (queryBatch.isWorkDone())
+                return;
+
+            prepareQueryTree(queryBatch, arg);
+            fastmks->SearchDual(arg->k, queryBatch.treeIndex->tree, index->tree, arg->probeMatrix, arg->queryMatrix, arg->queryBounds,
+                    queryBatch.startPos, arg->topkResults, arg->topkOffsets, arg->comparisons, arg->itemFilter);
+        }
+
+        inline void runDual(QueryBatch& queryBatch, TreeIndex* index, ProbeBucket& probeBucket, RetrievalArguments* arg) const {
+
+            bool anyQuery = false;
+            arg->queryBounds.resize(queryBatch.endPos - queryBatch.startPos);
+            for (row_type i = queryBatch.startPos; i < queryBatch.endPos; ++i) {
+                const double* query = arg->queryMatrix->getMatrixRowPtr(i);
+                bool skip = (query[-1] < probeBucket.bucketScanThreshold || queryBatch.isQueryInactive(i));
+                arg->queryBounds[i - queryBatch.startPos] = (skip ? DBL_MAX : arg->theta);
+                anyQuery = anyQuery || !skip;
+            }
+
+            if (!anyQuery)
+                return;
+
+            prepareQueryTree(queryBatch, arg);
+            fastmks->SearchDualForTheta(queryBatch.treeIndex->tree, index->tree, arg->probeMatrix, arg->queryMatrix, arg->queryBounds,
+                    queryBatch.startPos, arg->results, arg->comparisons, arg->itemFilter);
+        }
 
     public:
 
-        inline SingleTree() {
+        inline SingleTree(bool dualTree = false) : dualTree(dualTree) {
             fastmks = new FastMKS<TreeType>(true, false);
         }
 
@@ -58,12 +125,12 @@ namespace mips {
 
         inline  void run(const double* query, ProbeBucket& probeBucket, RetrievalArguments* arg) const{
 
-            fastmks->SearchForTheta(arg->theta, arg->tree->tree, arg->probeMatrix, arg->queryMatrix, arg->results, arg->queryPos, arg->comparisons, arg->threads);
+            fastmks->SearchForTheta(arg->theta, arg->tree->tree, arg->probeMatrix, arg->queryMatrix, arg->results, arg->queryPos, arg->comparisons, arg->threads, arg->itemFilter);
         }
 
 
         inline  void runTopK(const double* query, ProbeBucket& probeBucket, RetrievalArguments* arg) const{
-            fastmks->Search(arg->k, arg->tree->tree, arg->probeMatrix, arg->queryMatrix, arg->heap, arg->queryPos, arg->comparisons, arg->threads);
+            fastmks->Search(arg->k, arg->tree->tree, arg->probeMatrix, arg->queryMatrix, arg->heap, arg->queryPos, arg->comparisons, arg->threads, arg->itemFilter);
         }
 
 
@@ -128,14 +195,21 @@ namespace mips {
                 if (queryBatch.isWorkDone())
                     continue;
 
-                if (!index->isInitialized()) {
-                    index->initializeTree(*(arg->probeMatrix), arg->threads, probeBucket.startPos, probeBucket.endPos);
+                if (!index->tryInitializeTree(*(arg->probeMatrix), arg->threads, probeBucket.startPos, probeBucket.endPos)) {
+                    // another thread builds the tree: scan this batch meanwhile
+                    plain.runTopK(queryBatch, probeBucket, arg);
+                    continue;
+                }
+
+                if (dualTree) {
+                    runTopKDual(queryBatch, index, probeBucket, arg);
+                    continue;
                 }
 
                 row_type user = queryBatch.startPos;
-                int start = queryBatch.startPos * arg->k;
-                int end = queryBatch.endPos * arg->k;
-                for (row_type i = start; i < end; i += arg->k) {
+                row_type start = arg->topkOffset(queryBatch.startPos);
+                row_type end = arg->topkOffset(queryBatch.endPos);
+                for (row_type i = start; i < end; i = arg->topkOffset(user)) {
 
                     if (queryBatch.isQueryInactive(user)) {
                         user++;
@@ -150,9 +224,9 @@ namespace mips {
                         continue;
                     }
 
-                    arg->moveTopkToHeap(i);
+                    arg->moveTopkToHeap(user);
                     arg->queryId = arg->queryMatrix->getId(user);
-                    fastmks->Search(arg->k, index->tree, arg->probeMatrix, arg->queryMatrix, arg->heap, user, arg->comparisons, arg->threads);
+                    fastmks->Search(arg->k, index->tree, arg->probeMatrix, arg->queryMatrix, arg->heap, user, arg->comparisons, arg->threads, arg->itemFilter);
 
                     arg->writeHeapToTopk(user);
                     user++;
@@ -171,13 +245,20 @@ namespace mips {
                     break;
                 }
 
+                if (dualTree) {
+                    runDual(queryBatch, index, probeBucket, arg);
+                    continue;
+                }
+
                 for (row_type i = queryBatch.startPos; i < queryBatch.endPos; ++i) {
                     const double* query = arg->queryMatrix->getMatrixRowPtr(i);
 
                     if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                         break;
+                    if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                        continue;
                     arg->queryId = arg->queryMatrix->getId(i);
-                    fastmks->SearchForTheta(arg->theta, index->tree, arg->probeMatrix, arg->queryMatrix, arg->results, i, arg->comparisons, arg->threads);
+                    fastmks->SearchForTheta(arg->theta, index->tree, arg->probeMatrix, arg->queryMatrix, arg->results, i, arg->comparisons, arg->threads, arg->itemFilter);
                 }
             }
         }
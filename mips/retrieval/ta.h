@@ -264,9 +264,9 @@ namespace mips {
                 arg->state->initializeForNewBucket(invLists);
 
                 row_type user = queryBatch.startPos;
-                int start = queryBatch.startPos * arg->k;
-                int end = queryBatch.endPos * arg->k;
-                for (row_type i = start; i < end; i += arg->k) {
+                row_type start = arg->topkOffset(queryBatch.startPos);
+                row_type end = arg->topkOffset(queryBatch.endPos);
+                for (row_type i = start; i < end; i = arg->topkOffset(user)) {
                     if (queryBatch.isQueryInactive(user)) {
                         user++;
                         continue;
@@ -283,7 +283,7 @@ namespace mips {
                         continue;
                     }
 
-                    arg->moveTopkToHeap(i);
+                    arg->moveTopkToHeap(user);
 
                     arg->queryId = arg->queryMatrix->getId(user);
                     runTopK(query, probeBucket, arg);
@@ -313,6 +313,8 @@ namespace mips {
 
                     if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                         break;
+                    if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                        continue;
                     arg->queryId = arg->queryMatrix->getId(i);
                     run(query, probeBucket, arg);
                 }
@@ -175,6 +175,8 @@ namespace mips {
 
                     if (query[-1] < probeBucket.bucketScanThreshold)// skip all users from this point on for this bucket
                         break;
+                    if (queryBatch.isQueryInactive(i)) // the bucket bounds rule it out
+                        continue;
                     arg->queryId = arg->queryMatrix->getId(i);
                     run(query, probeBucket, arg);
                 }
@@ -0,0 +1,205 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   AnnoyIndex.h
+ */
+
+#ifndef ANNOYINDEX_H
+#define	ANNOYINDEX_H
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <boost/dynamic_bitset.hpp>
+
+namespace mips {
+
+    /*
+     * Forest of random-hyperplane trees over the directions of the probe vectors of one bucket (LEMP_ANNOY). Every
+     * split is the hyperplane through the origin between two random vectors of the node (normal: their difference),
+     * so that vectors of similar direction tend to share leaves. A query visits the nodes of all trees best-first,
+     * by its smallest margin to the splits on the way, until it has search_k candidates.
+     */
+    class AnnoyIndex : public Index {
+
+        struct Node {
+            bool leaf;
+            row_type first, second; // split: the children (first: non-negative side). leaf: its range of items
+            row_type normal; // split: offset of its normal in normals
+        };
+
+        struct Tree {
+            std::vector<Node> nodes; // nodes[0] is the root
+            std::vector<double> normals;
+            std::vector<row_type> items; // rows of the probe matrix, in the order of the leaves
+        };
+
+        std::vector<Tree> trees;
+        int numTrees;
+        col_type colNum;
+        row_type startRow;
+
+        static inline double dot(const double* a, const double* b, col_type n) {
+            double sum = 0;
+            for (col_type j = 0; j < n; ++j) {
+                sum += a[j] * b[j];
+            }
+            return sum;
+        }
+
+        // the node over rows[begin, end). Partitions rows so that the leaves are contiguous
+        inline row_type buildNode(Tree& tree, const VectorMatrix& matrix, std::vector<row_type>& rows, row_type begin, row_type end, rg::Random32& random) {
+            row_type id = tree.nodes.size();
+            tree.nodes.push_back(Node());
+            row_type n = end - begin;
+
+            if (n <= ANNOY_LEAF_SIZE) {
+                tree.nodes[id].leaf = true;
+                tree.nodes[id].first = begin;
+                tree.nodes[id].second = end;
+                return id;
+            }
+
+            row_type a = begin + std::min<row_type>(n - 1, random.nextDouble() * n);
+            row_type b = begin + std::min<row_type>(n - 2, random.nextDouble() * (n - 1));
+            if (b >= a)
+                b++;
+
+            row_type offset = tree.normals.size();
+            tree.normals.resize(offset + colNum);
+            const double* pa = matrix.getMatrixRowPtr(rows[a]);
+            const double* pb = matrix.getMatrixRowPtr(rows[b]);
+            for (col_type j = 0; j < colNum; ++j) {
+                tree.normals[offset + j] = pa[j] - pb[j];
+            }
+
+            const double* normal = &tree.normals[offset];
+            row_type mid = std::partition(rows.begin() + begin, rows.begin() + end, [&](row_type row) {
+                return dot(normal, matrix.getMatrixRowPtr(row), colNum) >= 0;
+            }) - rows.begin();
+
+            if (mid == begin || mid == end) // (nearly) identical directions: split anyway
+                mid = begin + n / 2;
+
+            row_type first = buildNode(tree, matrix, rows, begin, mid, random);
+            row_type second = buildNode(tree, matrix, rows, mid, end, random);
+
+            tree.nodes[id].leaf = false;
+            tree.nodes[id].first = first;
+            tree.nodes[id].second = second;
+            tree.nodes[id].normal = offset;
+            return id;
+        }
+
+    public:
+
+        inline AnnoyIndex(int numTrees = 1) : numTrees(std::max(1, numTrees)), colNum(0), startRow(0) {
+        }
+
+        /*
+         * Non-blocking. The first caller builds the forest, the trees in parallel. The others return false
+         * immediately, so that they can serve their queries differently until the forest is ready
+         */
+        inline bool tryInitializeForest(const VectorMatrix& matrix, int threads, row_type start = 0, row_type end = 0) {
+
+            if (isInitialized())
+                return true;
+
+            if (claim()) {
+                if (start == end) {
+                    start = 0;
+                    end = matrix.rowNum;
+                }
+                colNum = matrix.colNum;
+                startRow = start;
+                trees.resize(numTrees);
+
+#pragma omp parallel for schedule(dynamic,1) num_threads(std::max(1, std::min(threads, numTrees)))
+                for (int t = 0; t < numTrees; ++t) {
+                    rg::Random32 random(123 + t);
+                    std::vector<row_type> rows(end - start);
+                    std::iota(rows.begin(), rows.end(), start);
+
+                    buildNode(trees[t], matrix, rows, 0, rows.size(), random);
+                    trees[t].items.swap(rows);
+                }
+
+                publish();
+                return true;
+            }
+            return false;
+        }
+
+        inline void initializeForest(const VectorMatrix& matrix, int threads, row_type start = 0, row_type end = 0) {
+
+            if (tryInitializeForest(matrix, threads, start, end))
+                return;
+
+            rg::Timer t;
+            t.start();
+            while (!isInitialized()) {
+                std::this_thread::yield();
+            }
+            t.stop();
+            addWaitTime(t.elapsedTime().nanos());
+        }
+
+        /*
+         * Writes up to about searchK rows of the probe matrix (whole leaves, no duplicates) into candidates and
+         * returns how many. done (at least one bit per vector of the bucket) and queue are scratch space
+         */
+        inline row_type getCandidates(const double* query, row_type searchK, row_type* candidates, boost::dynamic_bitset<>& done,
+                std::vector<QueueElement>& queue) const {
+            row_type found = 0;
+
+            done.reset();
+            queue.clear();
+            for (int t = 0; t < numTrees; ++t) { // node id * numTrees + tree
+                queue.emplace_back(std::numeric_limits<double>::max(), t);
+            }
+
+            while (!queue.empty() && found < searchK) {
+                std::pop_heap(queue.begin(), queue.end(), std::less<QueueElement>());
+                QueueElement top = queue.back();
+                queue.pop_back();
+
+                const Tree& tree = trees[top.id % numTrees];
+                const Node& node = tree.nodes[top.id / numTrees];
+
+                if (node.leaf) {
+                    for (row_type i = node.first; i < node.second; ++i) {
+                        row_type row = tree.items[i];
+                        if (!done[row - startRow]) {
+                            done[row - startRow] = true;
+                            candidates[found++] = row;
+                        }
+                    }
+                } else {
+                    double margin = dot(&tree.normals[node.normal], query, colNum);
+
+                    queue.emplace_back(std::min(top.data, margin), node.first * numTrees + top.id % numTrees);
+                    std::push_heap(queue.begin(), queue.end(), std::less<QueueElement>());
+                    queue.emplace_back(std::min(top.data, -margin), node.second * numTrees + top.id % numTrees);
+                    std::push_heap(queue.begin(), queue.end(), std::less<QueueElement>());
+                }
+            }
+            return found;
+        }
+
+    };
+
+}
+
+#endif	/* ANNOYINDEX_H */
@@ -35,7 +35,11 @@ namespace mips {
         LEMP_C = 7,
         LEMP_AP = 8,
         LEMP_TANRA = 9,
-        LEMP_BLSH = 10
+        LEMP_BLSH = 10,
+        LEMP_AUTO = 11, // per bucket one of LEMP_L, LEMP_LI, LEMP_LC, LEMP_TA, LEMP_TREE, chosen by tuning
+        LEMP_ANNOY = 12, // approximate: forests of random-projection trees (numTrees, search_k)
+        LEMP_HNSW = 13, // approximate: navigable small-world graphs (ef)
+        LEMP_PQ = 14 // product quantization: exact screening or approximate (pqExact, pqSubspaces, search_k)
 
     };
 
@@ -63,9 +67,35 @@ namespace mips {
         double R, epsilon; // for LSH R:recall
         int numTrees;
         int search_k;
+        int ef; // for LEMP_HNSW: candidates kept per query and bucket
+        int pqSubspaces; // for LEMP_PQ: bytes per code
+        bool pqExact; // for LEMP_PQ: screen with the quantization error (exact) or verify the search_k best codes (approximate)
+        bool bulkTree; // for LEMP_TREE: bulk build of the cover trees
+        bool dualTree; // for LEMP_TREE: each query batch in a cover tree, searched against the bucket tree at once
+        bool pinThreads; // pin each thread of the team to its own core
+        bool intraQuery; // top-k with fewer queries than threads: split the probe buckets among the threads
+        double rebalanceFraction; // incremental updates: rebucketize when new and deleted vectors exceed this fraction of P (0: never)
+        bool reuseTuning; // reuse the tuned parameters of earlier runs (other theta, k or queries) instead of tuning again
+        double tuningCoverage; // reuse only if at least this fraction of the new sample lies in the tuned range of theta_b(q) (0: no check)
+        bool dedupQueries; // online: identical queries of one batch are retrieved once
+        bool modelTuning; // tune by the costs predicted by the cost model, timing only where it is uncertain
+        double modelMargin; // the model is uncertain if the best plan with lists and LENGTH are predicted within this fraction
+        bool onlineTuning; // LEMP_LI, LEMP_LC: keep adjusting t_b and numLists of each bucket during retrieval
+        row_type sampleMin, sampleMax; // queries in the tuning sample of a bucket. Fewer than 3 * sampleMin queries: no tuning
+        double sampleError; // the sample grows until the mean cost of its queries is known within this relative error (0: fixed rate)
+        double tuningBudget; // seconds the tuning may take, the samples are cut to fit (0: no budget)
+        bool rangeBounds; // per bucket the range of each coordinate of its directions: skip buckets per query
+        int coneClusters; // per bucket this many cones (centroid direction and angular radius) around its directions (0: none)
 
         LempArguments() : cacheSizeinKB(sysconf(_SC_LEVEL2_CACHE_SIZE) / pow(2, 10)),
-        method(LEMP_LI),  R(1.0), epsilon(0), isTARR(false), numTrees(1), search_k(1000) {
+        method(LEMP_LI),  R(1.0), epsilon(0), isTARR(false), numTrees(10), search_k(1000), ef(HNSW_EF), pqSubspaces(PQ_SUBSPACES), pqExact(true), bulkTree(false), dualTree(false), pinThreads(false), intraQuery(true), rebalanceFraction(0.05),
+        reuseTuning(false), tuningCoverage(0.5), dedupQueries(false), modelTuning(false), modelMargin(0.1), onlineTuning(false),
+        sampleMin(LOWER_LIMIT_PER_BUCKET), sampleMax(UPPER_LIMIT_PER_BUCKET), sampleError(SAMPLE_ERROR), tuningBudget(0), rangeBounds(false), coneClusters(0) {
+        }
+
+        // buckets keep bounds on the directions of their vectors
+        inline bool bucketBounds() const {
+            return rangeBounds || coneClusters > 0;
         }
     };
 
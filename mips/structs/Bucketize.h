@@ -44,6 +44,7 @@ namespace mips {
         switch (args.method) {
             case LEMP_I:
             case LEMP_LI:
+            case LEMP_AUTO: // the largest of its methods
                 singleVectorSpace += row_typeSize; // for the candidatesToVerify
                 singleVectorSpace += (doubleSize + doubleSize); // for the ext_cp_array
                 singleVectorSpace += (doubleSize + row_typeSize) * rank; // index space
@@ -93,6 +94,29 @@ namespace mips {
 
 		break;
 
+            case LEMP_ANNOY:
+                singleVectorSpace += row_typeSize; // for the candidatesToVerify
+                singleVectorSpace += args.numTrees * row_typeSize; // index space: the items of the leaves
+                singleVectorSpace += args.numTrees * (rank * doubleSize * 2) / ANNOY_LEAF_SIZE; // index space: the normals (max)
+
+                break;
+
+            case LEMP_HNSW:
+                singleVectorSpace += row_typeSize; // for the candidatesToVerify
+                singleVectorSpace += rank * doubleSize; // index space: the copy of the directions
+                singleVectorSpace += (HNSW_M0 + 1) * row_typeSize; // index space: the links of level 0
+
+                break;
+
+            case LEMP_PQ:
+                singleVectorSpace += row_typeSize; // for the candidatesToVerify
+                singleVectorSpace += args.pqSubspaces + sizeof (float); // index space: the codes and the quantization error
+                singleVectorSpace += doubleSize; // for the adcCosines
+                if (cacheSizeInKB > 2 * PQ_CENTROIDS * rank * doubleSize)
+                    cacheSizeInKB -= PQ_CENTROIDS * rank * doubleSize; // the centroids
+
+                break;
+
 
         }
 
@@ -163,6 +187,7 @@ namespace mips {
             case LEMP_LI:
             case LEMP_C:
             case LEMP_LC:
+            case LEMP_AUTO:
                 singleVectorSpace += rank * col_typeSize; // queue
                 break;
             case LEMP_LSH:
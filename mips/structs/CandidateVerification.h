@@ -39,7 +39,7 @@ namespace mips {
         double countAbove = 0;
         
                 
-        for(row_type i=0; i<arg.k; i++){
+        for(row_type i=0; i<arg.heap.size(); i++){
             if(arg.heap[i].data >= lengthNextBucket){          
                 countAbove++;
             }else{
@@ -49,7 +49,7 @@ namespace mips {
         error += countAbove * (1-arg.R);
                
         countABOVE += countAbove;
-        return error/arg.k;    
+        return error/arg.heap.size();    
     }
     
     
@@ -58,13 +58,13 @@ namespace mips {
         double margin = arg.heap.front().data * (1 + arg.epsilon);
         double invMargin = 1/ margin;
                 
-        for(row_type i=0; i<arg.k; i++){
+        for(row_type i=0; i<arg.heap.size(); i++){
             if(arg.heap[i].data < margin){                    
                 error += 1-arg.heap[i].data * invMargin;
             }        
         }        
      
-        return error/arg.k;    
+        return error/arg.heap.size();    
     }
 
     inline void verifyCandidates_lengthTest(const double * query, row_type numCandidatesToVerify, RetrievalArguments* arg) {
@@ -72,6 +72,9 @@ namespace mips {
 
         for (row_type i = 0; i < numCandidatesToVerify; ++i) {
             row_type row = arg->candidatesToVerify[i];
+            if (arg->isExcluded(row))
+                continue;
+
             p = arg->probeMatrix->passesThreshold(row, query, arg->theta);
 
             if (p.first) {
@@ -86,9 +89,12 @@ namespace mips {
 
         for (row_type i = 0; i < numCandidatesToVerify; ++i) {
             row_type row = arg->candidatesToVerify[i];
+            if (arg->isExcluded(row))
+                continue;
+
             double ip = arg->probeMatrix->innerProduct(row, query);
 
-            if (ip >= arg->theta) {               
+            if (ip >= arg->theta) {
                  arg->results.emplace_back(ip, arg->queryId, arg->probeMatrix->getId(row));
 //                 std::cout<<"row: "<<row<<" id: "<<arg->probeMatrix->getId(row)<<" ip: "<<ip<<std::endl;
             }
@@ -104,6 +110,9 @@ namespace mips {
 
         for (row_type i = 0; i < numCandidatesToVerify; ++i) {
             row_type row = arg->candidatesToVerify[i];
+            if (arg->isExcluded(row))
+                continue;
+
             double ip = arg->probeMatrix->innerProduct(row, query);
 
             if (ip > minScore) {
@@ -126,7 +135,7 @@ namespace mips {
         for (row_type i = 0; i < numCandidatesToVerify; ++i) {
             row_type row = arg->candidatesToVerify[i];
 
-            if (arg->probeMatrix->getVectorLength(row) <= minScore)
+            if (arg->probeMatrix->getVectorLength(row) <= minScore || arg->isExcluded(row))
                 continue;
 
             double ip = arg->probeMatrix->innerProduct(row, query);
@@ -147,6 +156,9 @@ namespace mips {
     // examines if the item should be included in the result and does the corresponding housekeeping
 
     inline void verifyCandidate(row_type posMatrix, const double* query, RetrievalArguments* arg) {
+        if (arg->isExcluded(posMatrix))
+            return;
+
         arg->comparisons++;
 
         std::pair<bool, double> p;
@@ -158,6 +170,9 @@ namespace mips {
     }
 
     inline void verifyCandidateTopk(row_type posMatrix, const double* query, RetrievalArguments* arg) {
+        if (arg->isExcluded(posMatrix))
+            return;
+
         std::pair<bool, double> p;
         arg->comparisons++;       
         p = arg->probeMatrix->passesThreshold(posMatrix, query, arg->heap.front().data);
@@ -0,0 +1,147 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   CostModel.h
+ */
+
+#ifndef COSTMODEL_H
+#define	COSTMODEL_H
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+namespace mips {
+
+    /*
+     * Predicted cost (nanos) of one query in one probe bucket, from the per-operation costs measured once on the
+     * probe matrix. COORD and ICOORD: bounds (two binary searches per list), scanning the intervals of the lists
+     * (the shortest one twice: counting and final filter) and verifying the expected candidates, assuming the
+     * lists are independent: n * prod_j(|I_j| / n). LENGTH: one inner product per scanned item.
+     */
+    class CostModel {
+    public:
+        double ipCost; // per inner product
+        double scanCost; // per list entry in COORD (counter increment)
+        double incrScanCost; // per list entry in ICOORD (partial inner product)
+        double searchCost; // per binary search step
+        double margin; // uncertain if the best plan with lists and LENGTH for all queries are predicted within this fraction
+        bool calibrated;
+
+        inline CostModel() : ipCost(0), scanCost(0), incrScanCost(0), searchCost(0), margin(0.1), calibrated(false) {
+        }
+
+        inline void calibrate(const VectorMatrix& probeMatrix) {
+            row_type rows = std::min<row_type>(probeMatrix.rowNum, CALIBRATION_ROWS);
+            if (rows == 0)
+                return;
+
+            rg::Timer timer;
+            row_type reps = CALIBRATION_OPS / rows + 1;
+            double ops = (double) reps * rows;
+            volatile double sink = 0;
+
+            std::vector<row_type> ids(rows);
+            std::iota(ids.begin(), ids.end(), 0);
+            rg::Random32 random(123);
+            rg::shuffle(ids.begin(), ids.end(), random);
+
+            // inner products
+            const double* query = probeMatrix.getMatrixRowPtr(0);
+            double ipSum = 0;
+            timer.start();
+            for (row_type r = 0; r < reps; ++r) {
+                for (row_type j = 0; j < rows; ++j) {
+                    ipSum += probeMatrix.innerProduct(ids[j], query);
+                }
+            }
+            timer.stop();
+            sink = ipSum;
+            ipCost = timer.elapsedTime().nanos() / ops;
+
+            // COORD: counters of the candidates, in list order (random in row order)
+            std::vector<row_type> counters(rows, 0);
+            timer.start();
+            for (row_type r = 0; r < reps; ++r) {
+                for (row_type j = 0; j < rows; ++j) {
+                    counters[ids[j]]++;
+                }
+            }
+            timer.stop();
+            sink = counters[ids[0]];
+            scanCost = timer.elapsedTime().nanos() / ops;
+
+            // ICOORD: partial inner products
+            std::vector<double> partial(rows, 0);
+            timer.start();
+            for (row_type r = 0; r < reps; ++r) {
+                for (row_type j = 0; j < rows; ++j) {
+                    partial[ids[j]] += query[j % probeMatrix.colNum] * j;
+                }
+            }
+            timer.stop();
+            sink = partial[ids[0]];
+            incrScanCost = timer.elapsedTime().nanos() / ops;
+
+            // bounds
+            std::vector<double> values(rows);
+            for (row_type j = 0; j < rows; ++j) {
+                values[j] = (double) j / rows;
+            }
+            row_type found = 0;
+            timer.start();
+            for (row_type r = 0; r < reps; ++r) {
+                for (row_type j = 0; j < rows; ++j) {
+                    found += std::lower_bound(values.begin(), values.end(), values[ids[j]]) - values.begin();
+                }
+            }
+            timer.stop();
+            sink = found;
+            searchCost = timer.elapsedTime().nanos() / (ops * log2(rows + 1));
+
+            calibrated = true;
+        }
+
+        /*
+         * lengths: interval lengths of the lists in the order of the query's queue (lists: how many are used),
+         * bucketSize: entries per list, colNum: to select the lists of the query
+         */
+        inline double listsCost(const row_type* lengths, col_type lists, row_type bucketSize, col_type colNum, bool incremental) const {
+            double cost = scanCost * colNum + 2 * lists * searchCost * log2(bucketSize + 1); // queue and bounds
+
+            double scanned = 0, candidates = bucketSize;
+            row_type shortest = bucketSize;
+            for (col_type l = 0; l < lists; ++l) {
+                if (lengths[l] == 0) // no scan
+                    return cost;
+
+                scanned += lengths[l];
+                candidates *= (double) lengths[l] / bucketSize;
+                shortest = std::min(shortest, lengths[l]);
+            }
+
+            return cost + (incremental ? incrScanCost : scanCost) * (scanned + shortest) + ipCost * candidates;
+        }
+
+        inline double lengthCost(row_type scanned) const {
+            return ipCost * scanned;
+        }
+
+    };
+
+}
+
+#endif	/* COSTMODEL_H */
@@ -37,18 +37,43 @@
 #define ITEMS_PER_BLOCK  30
 
 // for tuning
-#define UPPER_LIMIT_PER_BUCKET 250
-#define LOWER_LIMIT_PER_BUCKET  20
+#define UPPER_LIMIT_PER_BUCKET 250 // default of the largest tuning sample per bucket (LempArguments::sampleMax)
+#define LOWER_LIMIT_PER_BUCKET  20 // default of the smallest tuning sample per bucket (LempArguments::sampleMin)
+#define SAMPLE_RATE 0.02 // fixed-size samples (sampleError = 0): this fraction of the queries
+#define SAMPLE_MAX_RATE 0.1 // adaptive samples: at most this fraction of the queries (but sampleMin)
+#define SAMPLE_ERROR 0.05 // adaptive samples: default relative error of the mean cost of the sample queries
+#define SAMPLE_CONFIDENCE 1.96 // adaptive samples: z of the confidence level (95%)
 #define NUM_LISTS    10
+#define CALIBRATION_ROWS 4096 // cost model: probe vectors used to measure the per-operation costs
+#define CALIBRATION_OPS 262144 // cost model: operations measured per operation type
+
+// for online re-tuning
+#define ONLINE_EXPLORE_PERIOD 20 // every 20th query of a bucket tries an alternative to the current parameters
+#define ONLINE_MIN_SAMPLES 16 // queries per alternative before the parameters may change
+#define ONLINE_UPDATE_PERIOD 128 // recorded queries of a bucket between two updates of its parameters
+#define ONLINE_WINDOW 1024 // queries per statistic before the older half is forgotten
+#define ONLINE_BINS 8 // ranges of theta_b(q) for t_b
 
 //  #define RELATIVE_APPROX
 //#define ABS_APPROX
 // #define HYBRID_APPROX
 
 // for probeBuckets
-#define NUM_INDEXES 8 // 0: no index 1: sorted list 2: int sorted list 3: tree 4: AP 5:LSH  6: BLSH 7:ANNOY
+#define NUM_INDEXES 10 // 0: no index 1: sorted list 2: int sorted list 3: tree 4: AP 5:LSH  6: BLSH 7:ANNOY 8:HNSW 9:PQ
 #define LSH_SIGNATURES 200 //so that if I am about to get more than 80% of the probe vectors I will run length || only multiples of 4 please
 #define LSH_CODE_LENGTH 8//please choose among values: 8, 16, 32, 64
+#define ANNOY_LEAF_SIZE 32 // max probe vectors in a leaf of an ANNOY tree
+#define HNSW_M 16 // neighbors per vector on the upper levels of an HNSW graph
+#define HNSW_M0 (2 * HNSW_M) // neighbors per vector on level 0
+#define HNSW_MAX_LEVEL 16
+#define HNSW_EF_CONSTRUCTION 100 // candidates kept while linking a new vector
+#define HNSW_EF 100 // default of the candidates kept per query (LempArguments::ef)
+#define HNSW_PARALLEL_POINTS 10000 // buckets at least this large are built one after the other with all threads
+#define PQ_SUBSPACES 8 // default of the subspaces of product quantization (LempArguments::pqSubspaces)
+#define PQ_CENTROIDS 256 // per subspace: one byte per code
+#define PQ_ITERATIONS 8 // of k-means
+#define PQ_TRAIN_POINTS 4096 // k-means runs on a sample of at most this many vectors of the bucket
+#define CONE_ITERATIONS 5 // of the spherical k-means that splits a bucket into cones (LempArguments::coneClusters > 1)
 
 
 #define INVPI  1 / PI
@@ -56,6 +81,7 @@
 
 // for parallelizing the Trees
 #define PADDING 8 // padding for doubles so that there will be no false sharing
+#define TREE_PARALLEL_POINTS 50000 // point sets at least this large split distances and partitioning across threads during tree construction
 
 
 
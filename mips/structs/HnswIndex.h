@@ -0,0 +1,407 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   HnswIndex.h
+ */
+
+#ifndef HNSWINDEX_H
+#define	HNSWINDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <boost/dynamic_bitset.hpp>
+
+namespace mips {
+
+    /*
+     * Hierarchical navigable small-world graph over the directions of the probe vectors of one bucket (LEMP_HNSW).
+     * Similarity is the cosine, i.e., the inner product of the normalized vectors. Every vector has a random level;
+     * on each level up to its own it is linked to HNSW_M diverse near neighbors (2 * HNSW_M on level 0). A search
+     * descends greedily from the entry point to level 0, where it keeps the ef best directions found so far.
+     *
+     * The graph keeps its own copy of the directions, so that it survives reallocations of the probe matrix.
+     * The vectors are inserted in parallel, each node under its own lock.
+     */
+    class HnswIndex : public Index {
+
+        struct BuildScratch {
+            std::vector<row_type> visited; // the tag of the search that visited the node last
+            row_type tag;
+            std::vector<QueueElement> candidates, results, selected, pruned;
+            std::vector<row_type> buffer;
+
+            inline BuildScratch(row_type n) : visited(n, 0), tag(0) {
+            }
+        };
+
+        std::vector<double> directions; // n x colNum
+        std::vector<row_type> links0; // level 0: per node the number of neighbors and HNSW_M0 slots
+        std::vector<std::vector<row_type> > links; // levels 1..level of a node: per level the number of neighbors and HNSW_M slots
+        std::vector<int> levels;
+        std::vector<omp_lock_t> nodeLocks; // only during construction
+        omp_lock_t entryLock;
+        row_type n, startRow, entry;
+        int maxLevel;
+        col_type colNum;
+
+        static inline double dot(const double* a, const double* b, col_type n) {
+            double sum = 0;
+            for (col_type j = 0; j < n; ++j) {
+                sum += a[j] * b[j];
+            }
+            return sum;
+        }
+
+        inline const double* direction(row_type node) const {
+            return &directions[(size_t) node * colNum];
+        }
+
+        inline row_type* neighbors(row_type node, int level) {
+            return (level == 0 ? &links0[(size_t) node * (HNSW_M0 + 1)] : &links[node][(level - 1) * (HNSW_M + 1)]);
+        }
+
+        inline const row_type* neighbors(row_type node, int level) const {
+            return (level == 0 ? &links0[(size_t) node * (HNSW_M0 + 1)] : &links[node][(level - 1) * (HNSW_M + 1)]);
+        }
+
+        // the neighbors of node on level, read under the lock of the node
+        inline void copyNeighbors(row_type node, int level, std::vector<row_type>& buffer) {
+            omp_set_lock(&nodeLocks[node]);
+            const row_type* list = neighbors(node, level);
+            buffer.assign(list + 1, list + 1 + list[0]);
+            omp_unset_lock(&nodeLocks[node]);
+        }
+
+        // greedy walk on one level towards q during construction
+        inline void descend(const double* q, row_type& cur, double& curSim, int level, BuildScratch& scratch) {
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                copyNeighbors(cur, level, scratch.buffer);
+                for (auto e : scratch.buffer) {
+                    double sim = dot(q, direction(e), colNum);
+                    if (sim > curSim) {
+                        curSim = sim;
+                        cur = e;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        // the ef most similar directions to q on level, as a min-heap in scratch.results
+        inline void searchLayer(const double* q, row_type ep, double epSim, row_type ef, int level, BuildScratch& scratch) {
+            scratch.tag++;
+            scratch.visited[ep] = scratch.tag;
+            scratch.candidates.clear();
+            scratch.results.clear();
+            scratch.candidates.emplace_back(epSim, ep);
+            scratch.results.emplace_back(epSim, ep);
+
+            while (!scratch.candidates.empty()) {
+                std::pop_heap(scratch.candidates.begin(), scratch.candidates.end(), std::less<QueueElement>());
+                QueueElement c = scratch.candidates.back();
+                scratch.candidates.pop_back();
+
+                if (scratch.results.size() >= ef && c.data < scratch.results.front().data)
+                    break;
+
+                copyNeighbors(c.id, level, scratch.buffer);
+                for (auto e : scratch.buffer) {
+                    if (scratch.visited[e] == scratch.tag)
+                        continue;
+                    scratch.visited[e] = scratch.tag;
+
+                    double sim = dot(q, direction(e), colNum);
+                    if (scratch.results.size() < ef || sim > scratch.results.front().data) {
+                        scratch.candidates.emplace_back(sim, e);
+                        std::push_heap(scratch.candidates.begin(), scratch.candidates.end(), std::less<QueueElement>());
+                        scratch.results.emplace_back(sim, e);
+                        std::push_heap(scratch.results.begin(), scratch.results.end(), std::greater<QueueElement>());
+                        if (scratch.results.size() > ef) {
+                            std::pop_heap(scratch.results.begin(), scratch.results.end(), std::greater<QueueElement>());
+                            scratch.results.pop_back();
+                        }
+                    }
+                }
+            }
+        }
+
+        /*
+         * Up to m of the candidates (similarity to the node in data), most similar first, skipping those that are more
+         * similar to an already selected neighbor than to the node: the links then lead into different directions
+         */
+        inline void selectNeighbors(std::vector<QueueElement>& candidates, row_type m, std::vector<QueueElement>& selected) const {
+            std::sort(candidates.begin(), candidates.end(), std::greater<QueueElement>());
+            selected.clear();
+
+            for (auto& c : candidates) {
+                if (selected.size() >= m)
+                    break;
+
+                bool diverse = true;
+                for (auto& s : selected) {
+                    if (dot(direction(c.id), direction(s.id), colNum) > c.data) {
+                        diverse = false;
+                        break;
+                    }
+                }
+                if (diverse)
+                    selected.push_back(c);
+            }
+        }
+
+        // links node from e on level, replacing the neighbors of e if its list is full
+        inline void connect(row_type e, row_type node, double sim, int level, BuildScratch& scratch) {
+            row_type m = (level == 0 ? HNSW_M0 : HNSW_M);
+
+            omp_set_lock(&nodeLocks[e]);
+            row_type* list = neighbors(e, level);
+
+            if (list[0] < m) {
+                list[1 + list[0]] = node;
+                list[0]++;
+            } else {
+                scratch.pruned.clear();
+                scratch.pruned.emplace_back(sim, node);
+                for (row_type i = 1; i <= list[0]; ++i) {
+                    scratch.pruned.emplace_back(dot(direction(e), direction(list[i]), colNum), list[i]);
+                }
+                selectNeighbors(scratch.pruned, m, scratch.candidates); // candidates: free after searchLayer
+
+                list[0] = scratch.candidates.size();
+                for (row_type i = 0; i < scratch.candidates.size(); ++i) {
+                    list[1 + i] = scratch.candidates[i].id;
+                }
+            }
+            omp_unset_lock(&nodeLocks[e]);
+        }
+
+        inline void insert(row_type node, BuildScratch& scratch) {
+            int level = levels[node];
+            const double* q = direction(node);
+
+            omp_set_lock(&entryLock);
+            row_type cur = entry;
+            int top = maxLevel;
+            bool raise = (level > top); // the node becomes the entry point. Keep the others out until it is linked
+            if (!raise)
+                omp_unset_lock(&entryLock);
+
+            double curSim = dot(q, direction(cur), colNum);
+            for (int l = top; l > level; --l) {
+                descend(q, cur, curSim, l, scratch);
+            }
+
+            for (int l = std::min(level, top); l >= 0; --l) {
+                searchLayer(q, cur, curSim, HNSW_EF_CONSTRUCTION, l, scratch);
+
+                selectNeighbors(scratch.results, (l == 0 ? HNSW_M0 : HNSW_M), scratch.selected);
+
+                omp_set_lock(&nodeLocks[node]);
+                row_type* list = neighbors(node, l);
+                list[0] = scratch.selected.size();
+                for (row_type i = 0; i < scratch.selected.size(); ++i) {
+                    list[1 + i] = scratch.selected[i].id;
+                }
+                omp_unset_lock(&nodeLocks[node]);
+
+                for (auto& s : scratch.selected) {
+                    connect(s.id, node, s.data, l, scratch);
+                }
+
+                cur = scratch.selected.front().id; // the most similar one
+                curSim = scratch.selected.front().data;
+            }
+
+            if (raise) {
+                entry = node;
+                maxLevel = level;
+                omp_unset_lock(&entryLock);
+            }
+        }
+
+    public:
+
+        inline HnswIndex() : n(0), startRow(0), entry(0), maxLevel(0), colNum(0) {
+            omp_init_lock(&entryLock);
+        }
+
+        inline ~HnswIndex() {
+            omp_destroy_lock(&entryLock);
+        }
+
+        /*
+         * Non-blocking. The first caller builds the graph, inserting the vectors with up to threads threads.
+         * The others return false immediately, so that they can serve their queries differently until the graph is ready
+         */
+        inline bool tryInitializeGraph(const VectorMatrix& matrix, int threads, row_type start = 0, row_type end = 0) {
+
+            if (isInitialized())
+                return true;
+
+            if (claim()) {
+                if (start == end) {
+                    start = 0;
+                    end = matrix.rowNum;
+                }
+                n = end - start;
+                startRow = start;
+                colNum = matrix.colNum;
+
+                directions.resize((size_t) n * colNum);
+                for (row_type i = 0; i < n; ++i) {
+                    std::copy(matrix.getMatrixRowPtr(start + i), matrix.getMatrixRowPtr(start + i) + colNum, &directions[(size_t) i * colNum]);
+                }
+
+                // levels: geometric with ratio 1/HNSW_M
+                rg::Random32 random(123);
+                double mL = 1 / std::log((double) HNSW_M);
+                levels.resize(n);
+                links.resize(n);
+                for (row_type i = 0; i < n; ++i) {
+                    levels[i] = std::min(HNSW_MAX_LEVEL, (int) (-std::log(1 - random.nextDouble()) * mL));
+                    links[i].assign(levels[i] * (HNSW_M + 1), 0);
+                }
+                links0.assign((size_t) n * (HNSW_M0 + 1), 0);
+
+                if (n > 0) {
+                    nodeLocks.resize(n);
+                    for (auto& lock : nodeLocks) {
+                        omp_init_lock(&lock);
+                    }
+
+                    entry = 0;
+                    maxLevel = levels[0];
+
+#pragma omp parallel num_threads(std::max(1, threads))
+                    {
+                        BuildScratch scratch(n);
+
+#pragma omp for schedule(dynamic,64)
+                        for (row_type i = 1; i < n; ++i) {
+                            insert(i, scratch);
+                        }
+                    }
+
+                    for (auto& lock : nodeLocks) {
+                        omp_destroy_lock(&lock);
+                    }
+                    nodeLocks.clear();
+                    nodeLocks.shrink_to_fit();
+                }
+
+                publish();
+                return true;
+            }
+            return false;
+        }
+
+        inline void initializeGraph(const VectorMatrix& matrix, int threads, row_type start = 0, row_type end = 0) {
+
+            if (tryInitializeGraph(matrix, threads, start, end))
+                return;
+
+            rg::Timer t;
+            t.start();
+            while (!isInitialized()) {
+                std::this_thread::yield();
+            }
+            t.stop();
+            addWaitTime(t.elapsedTime().nanos());
+        }
+
+        /*
+         * Writes the rows of the probe matrix among the ef most similar directions to the query that the search finds
+         * into candidates and returns how many. The search stops at directions with cosine below cosCutoff: they cannot
+         * reach theta or the current k-th score. done (at least one bit per vector of the bucket) and queue, results
+         * are scratch space
+         */
+        inline row_type getCandidates(const double* query, row_type ef, double cosCutoff, row_type* candidates, boost::dynamic_bitset<>& done,
+                std::vector<QueueElement>& queue, std::vector<QueueElement>& results) const {
+
+            if (n == 0)
+                return 0;
+
+            row_type cur = entry;
+            double curSim = dot(query, direction(cur), colNum);
+            for (int l = maxLevel; l > 0; --l) {
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    const row_type* list = neighbors(cur, l);
+                    for (row_type i = 1; i <= list[0]; ++i) {
+                        double sim = dot(query, direction(list[i]), colNum);
+                        if (sim > curSim) {
+                            curSim = sim;
+                            cur = list[i];
+                            changed = true;
+                        }
+                    }
+                }
+            }
+
+            done.reset();
+            queue.clear();
+            results.clear();
+            done[cur] = true;
+            queue.emplace_back(curSim, cur);
+            results.emplace_back(curSim, cur);
+
+            while (!queue.empty()) {
+                std::pop_heap(queue.begin(), queue.end(), std::less<QueueElement>());
+                QueueElement c = queue.back();
+                queue.pop_back();
+
+                if (c.data < cosCutoff) // and so are all directions still in the queue
+                    break;
+                if (results.size() >= ef && c.data < results.front().data)
+                    break;
+
+                const row_type* list = neighbors(c.id, 0);
+                for (row_type i = 1; i <= list[0]; ++i) {
+                    row_type e = list[i];
+                    if (done[e])
+                        continue;
+                    done[e] = true;
+
+                    double sim = dot(query, direction(e), colNum);
+                    if (results.size() < ef || sim > results.front().data) {
+                        queue.emplace_back(sim, e);
+                        std::push_heap(queue.begin(), queue.end(), std::less<QueueElement>());
+                        results.emplace_back(sim, e);
+                        std::push_heap(results.begin(), results.end(), std::greater<QueueElement>());
+                        if (results.size() > ef) {
+                            std::pop_heap(results.begin(), results.end(), std::greater<QueueElement>());
+                            results.pop_back();
+                        }
+                    }
+                }
+            }
+
+            row_type found = 0;
+            for (auto& r : results) {
+                if (r.data >= cosCutoff)
+                    candidates[found++] = startRow + r.id;
+            }
+            return found;
+        }
+
+    };
+
+}
+
+#endif	/* HNSWINDEX_H */
@@ -0,0 +1,126 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   ItemFilter.h
+ */
+
+#ifndef ITEMFILTER_H
+#define	ITEMFILTER_H
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <boost/dynamic_bitset.hpp>
+
+namespace mips {
+
+    // the items one query may (allowlist) or may not (denylist) get
+    struct QueryItemFilter {
+        std::vector<row_type> ids; // sorted
+        bool allow;
+    };
+
+    /*
+     * Items (by probe id) that must not appear in the results. The global filter holds for all queries, a per-query
+     * filter (by query id) is applied on top of it. The retrievers check the filter before computing the inner
+     * product, so excluded items never take a place in a top-k heap and the top-k lists stay exact.
+     */
+    class ItemFilter {
+        boost::dynamic_bitset<> excluded; // global filter by probe id
+        bool excludedBeyond; // for ids that the global filter does not cover (allowlist: true)
+        std::unordered_map<row_type, QueryItemFilter> perQuery;
+
+        inline void setGlobal(const std::vector<row_type>& ids, row_type numIds, bool allow) {
+            row_type size = numIds;
+            for (auto id : ids) {
+                if (id >= size)
+                    size = id + 1;
+            }
+
+            excluded.clear();
+            excluded.resize(size, allow);
+            for (auto id : ids) {
+                excluded[id] = !allow;
+            }
+            excludedBeyond = allow;
+        }
+
+        inline void setQuery(row_type queryId, const std::vector<row_type>& ids, bool allow) {
+            QueryItemFilter& filter = perQuery[queryId];
+            filter.ids = ids;
+            std::sort(filter.ids.begin(), filter.ids.end());
+            filter.allow = allow;
+        }
+
+    public:
+
+        inline ItemFilter() : excludedBeyond(false) {
+        }
+
+        // numIds: the number of probe ids (ids beyond the lists are handled too)
+        inline void setGlobalDenylist(const std::vector<row_type>& ids, row_type numIds = 0) {
+            setGlobal(ids, numIds, false);
+        }
+
+        inline void setGlobalAllowlist(const std::vector<row_type>& ids, row_type numIds = 0) {
+            setGlobal(ids, numIds, true);
+        }
+
+        inline void setQueryDenylist(row_type queryId, const std::vector<row_type>& ids) {
+            setQuery(queryId, ids, false);
+        }
+
+        inline void setQueryAllowlist(row_type queryId, const std::vector<row_type>& ids) {
+            setQuery(queryId, ids, true);
+        }
+
+        inline void clear() {
+            excluded.clear();
+            excludedBeyond = false;
+            perQuery.clear();
+        }
+
+        inline bool empty() const {
+            return excluded.empty() && !excludedBeyond && perQuery.empty();
+        }
+
+        inline bool hasQueryFilters() const {
+            return !perQuery.empty();
+        }
+
+        // nullptr if the query has no filter of its own
+        inline const QueryItemFilter* forQuery(row_type queryId) const {
+            if (perQuery.empty())
+                return nullptr;
+            auto it = perQuery.find(queryId);
+            return (it == perQuery.end() ? nullptr : &it->second);
+        }
+
+        inline bool excludes(const QueryItemFilter* queryFilter, row_type probeId) const {
+            if (probeId < excluded.size() ? excluded[probeId] : excludedBeyond)
+                return true;
+
+            if (queryFilter == nullptr)
+                return false;
+
+            bool listed = std::binary_search(queryFilter->ids.begin(), queryFilter->ids.end(), probeId);
+            return listed != queryFilter->allow;
+        }
+
+    };
+
+}
+
+#endif	/* ITEMFILTER_H */
@@ -22,16 +22,35 @@
 #ifndef LISTS_H
 #define	LISTS_H
 
+#include <atomic>
+#include <thread>
 
 namespace mips {
 
+    /*
+     * Indexes are built lazily, on first touch, by the thread that claims them. Indexes that can be built cooperatively
+     * (the sorted lists) let the other threads help; the rest can be checked with isInitialized() so that
+     * a thread that finds the index under construction can do other work instead of blocking.
+     */
     class Index {
     protected:
         omp_lock_t writelock;
-        bool initialized;
+        std::atomic<bool> initialized; // the index is ready to be used
+        std::atomic<bool> claimed; // some thread has started building the index
+        std::atomic<uint64_t> waitTime; // nanos spent by threads while the index was built by somebody else
+
+        // true only for the one thread that should build the index
+        inline bool claim() {
+            return !claimed.exchange(true, std::memory_order_acq_rel);
+        }
+
+        inline void publish() {
+            initialized.store(true, std::memory_order_release);
+        }
+
     public:
 
-        inline Index() : initialized(false) {
+        inline Index() : initialized(false), claimed(false), waitTime(0) {
             omp_init_lock(&writelock);
         }
 
@@ -40,23 +59,58 @@ namespace mips {
         }
 
         inline bool isInitialized() const {
-            return initialized;
+            return initialized.load(std::memory_order_acquire);
         }
 
         inline void lockIndex() {
             omp_set_lock(&writelock);
         }
 
+        inline bool tryLockIndex() {
+            return omp_test_lock(&writelock);
+        }
+
         inline void unlockIndex() {
             omp_unset_lock(&writelock);
         }
 
+        inline void addWaitTime(uint64_t nanos) {
+            waitTime.fetch_add(nanos, std::memory_order_relaxed);
+        }
+
+        inline uint64_t getWaitTime() const {
+            return waitTime.load(std::memory_order_relaxed);
+        }
+
     };
 
     class QueueElementLists : public Index {
         std::vector<QueueElement> sortedCoord;
         col_type colNum;
-        row_type size;
+        row_type size, startRow;
+        std::atomic<bool> allocated; // sortedCoord has its final size, columns can be sorted
+        std::atomic<row_type> nextCol, sortedCols; // columns handed out to threads and columns finished
+
+        // sorts columns that nobody has picked yet, possibly in parallel with other threads
+        inline void sortColumns(const VectorMatrix& matrix) {
+            row_type j;
+
+            if (nextCol.load(std::memory_order_relaxed) >= colNum)
+                return;
+
+            while ((j = nextCol.fetch_add(1, std::memory_order_relaxed)) < colNum) {
+                QueueElement* column = &sortedCoord[j * size];
+
+                for (row_type i = 0; i < size; ++i) { // scans the matrix as it is, i.e., perhaps in sorted order
+                    column[i] = QueueElement(matrix.getMatrixRowPtr(startRow + i)[j], i);
+                    // QueueElement.id is the position of the vector in the matrix, not necessarily the vectorID
+                }
+                std::sort(column, column + size, std::less<QueueElement>());
+
+                if (sortedCols.fetch_add(1, std::memory_order_acq_rel) + 1 == colNum)
+                    publish();
+            }
+        }
 
         /*
          * returns true if there is possibility for sufficient, otherwise false
@@ -121,15 +175,20 @@ namespace mips {
 
     public:
 
-        inline QueueElementLists() = default;
+        inline QueueElementLists() : colNum(0), size(0), startRow(0), allocated(false), nextCol(0), sortedCols(0) {
+        }
         inline ~QueueElementLists() = default;
 
-        inline void initializeLists(const VectorMatrix& matrix, ta_size_type start = 0, ta_size_type end = 0) {
-
-            omp_set_lock(&writelock);
+        /*
+         * Non-blocking. The first caller allocates the lists and every caller sorts columns that are not taken yet.
+         * Returns false if the lists are not ready because other threads are still sorting their columns
+         */
+        inline bool tryInitializeLists(const VectorMatrix& matrix, ta_size_type start = 0, ta_size_type end = 0) {
 
-            if (!initialized) {
+            if (isInitialized())
+                return true;
 
+            if (claim()) {
                 colNum = matrix.colNum;
 
                 if (start == end) {
@@ -137,18 +196,59 @@ namespace mips {
                     end = matrix.rowNum;
                 }
                 size = end - start;
-                sortedCoord.reserve(colNum * size);
-
-                for (col_type j = 0; j < colNum; ++j) {
-                    for (row_type i = start; i < end; ++i) { // scans the matrix as it is, i.e., perhaps in sorted order
-                        sortedCoord.emplace_back(matrix.getMatrixRowPtr(i)[j], i - start);
-                        // QueueElement.id is the position of the vector in the matrix, not necessarily the vectorID
-                    }
-                    std::sort(sortedCoord.begin()+(j * size), sortedCoord.end(), std::less<QueueElement>());
+                startRow = start;
+                sortedCoord.resize(colNum * size);
+
+                if (colNum == 0)
+                    publish();
+                allocated.store(true, std::memory_order_release);
+                sortColumns(matrix);
+            } else if (allocated.load(std::memory_order_acquire)) {
+                rg::Timer t;
+                t.start();
+                sortColumns(matrix);
+                t.stop();
+                addWaitTime(t.elapsedTime().nanos());
+            }
+
+            return isInitialized();
+        }
+
+        // helps with the construction and then waits for the columns that are still sorted by other threads
+        inline void initializeLists(const VectorMatrix& matrix, ta_size_type start = 0, ta_size_type end = 0) {
+
+            if (tryInitializeLists(matrix, start, end))
+                return;
+
+            rg::Timer t;
+            t.start();
+            while (!tryInitializeLists(matrix, start, end)) {
+                std::this_thread::yield();
+            }
+            t.stop();
+            addWaitTime(t.elapsedTime().nanos());
+        }
+
+        /*
+         * Patches the initialized lists after the vector at position row of the bucket was inserted into the matrix
+         * (the vectors that were at row, row + 1, ... of the bucket moved down by one)
+         */
+        inline void insertRow(const VectorMatrix& matrix, row_type row) {
+            const double* vec = matrix.getMatrixRowPtr(startRow + row);
+            std::vector<QueueElement> patched(colNum * (size + 1));
+
+            for (col_type j = 0; j < colNum; ++j) {
+                QueueElement* column = &sortedCoord[j * size];
+                QueueElement* out = &patched[j * (size + 1)];
+                row_type pos = std::upper_bound(column, column + size, QueueElement(vec[j], row)) - column;
+
+                for (row_type i = 0; i < size; ++i) {
+                    out[i < pos ? i : i + 1] = QueueElement(column[i].data, column[i].id + (column[i].id >= row ? 1 : 0));
                 }
-                initialized = true;
+                out[pos] = QueueElement(vec[j], row);
             }
-            omp_unset_lock(&writelock);
+            sortedCoord.swap(patched);
+            size++;
         }
 
         inline row_type getRowPointer(row_type row, col_type col) const {
@@ -193,6 +293,13 @@ namespace mips {
             return true;
         }
 
+        // number of entries of list col that calculateIntervals scans for localTheta (for the cost model)
+        inline row_type intervalLength(double qi, double localTheta, col_type col) const {
+            std::pair<row_type, row_type> necessaryIndices;
+            getBounds(qi, localTheta, col, necessaryIndices);
+            return (necessaryIndices.second > necessaryIndices.first ? necessaryIndices.second - necessaryIndices.first : 0);
+        }
+
 
     };
 
@@ -203,7 +310,36 @@ namespace mips {
         std::vector<double> values;
         std::vector<row_type> ids;
         col_type colNum;
-        row_type size;
+        row_type size, startRow;
+        std::atomic<bool> allocated; // values and ids have their final size, columns can be sorted
+        std::atomic<row_type> nextCol, sortedCols; // columns handed out to threads and columns finished
+
+        // sorts columns that nobody has picked yet, possibly in parallel with other threads
+        inline void sortColumns(const VectorMatrix& matrix) {
+            if (nextCol.load(std::memory_order_relaxed) >= colNum)
+                return;
+
+            std::vector<QueueElement> sortedCoord(size);
+            row_type i;
+
+            while ((i = nextCol.fetch_add(1, std::memory_order_relaxed)) < colNum) {
+
+                for (row_type j = 0; j < size; ++j) { // scans the matrix as it is, i.e., perhaps in sorted order
+                    sortedCoord[j] = QueueElement(matrix.getMatrixRowPtr(startRow + j)[i], j);
+                    // j is the position of the vector in the matrix, not necessarily the vectorID
+                }
+
+                std::sort(sortedCoord.begin(), sortedCoord.end(), std::less<QueueElement>());
+
+                for (row_type j = 0; j < size; ++j) {
+                    ids[i * size + j] = sortedCoord[j].id;
+                    values[i * size + j] = sortedCoord[j].data;
+                }
+
+                if (sortedCols.fetch_add(1, std::memory_order_acq_rel) + 1 == colNum)
+                    publish();
+            }
+        }
 
         inline void getBounds(double qi, double theta, col_type col, std::pair<row_type, row_type>& necessaryIndices) const {
 
@@ -262,17 +398,20 @@ namespace mips {
     public:
 
 
-        inline IntLists() = default;
+        inline IntLists() : colNum(0), size(0), startRow(0), allocated(false), nextCol(0), sortedCols(0) {
+        }
         inline ~IntLists() = default;
 
-        inline void initializeLists(const VectorMatrix& matrix, ta_size_type start = 0, ta_size_type end = 0) {
-            omp_set_lock(&writelock);
-            if (!initialized) {
-                std::vector<std::vector<QueueElement> > sortedCoord;
+        /*
+         * Non-blocking. The first caller allocates the lists and every caller sorts columns that are not taken yet.
+         * Returns false if the lists are not ready because other threads are still sorting their columns
+         */
+        inline bool tryInitializeLists(const VectorMatrix& matrix, ta_size_type start = 0, ta_size_type end = 0) {
 
-                sortedCoord.clear();
-                sortedCoord.resize(matrix.colNum);
+            if (isInitialized())
+                return true;
 
+            if (claim()) {
                 colNum = matrix.colNum;
 
                 if (start == end) {
@@ -280,28 +419,64 @@ namespace mips {
                     end = matrix.rowNum;
                 }
                 size = end - start;
+                startRow = start;
+                ids.resize(colNum * size);
+                values.resize(colNum * size);
+
+                if (colNum == 0)
+                    publish();
+                allocated.store(true, std::memory_order_release);
+                sortColumns(matrix);
+            } else if (allocated.load(std::memory_order_acquire)) {
+                rg::Timer t;
+                t.start();
+                sortColumns(matrix);
+                t.stop();
+                addWaitTime(t.elapsedTime().nanos());
+            }
 
-                ids.reserve(colNum * size);
-                values.reserve(colNum * size);
+            return isInitialized();
+        }
 
-                for (col_type i = 0; i < colNum; ++i) {
+        // helps with the construction and then waits for the columns that are still sorted by other threads
+        inline void initializeLists(const VectorMatrix& matrix, ta_size_type start = 0, ta_size_type end = 0) {
 
-                    for (row_type j = start; j < end; ++j) { // scans the matrix as it is, i.e., perhaps in sorted order
-                        //                        sortedCoord[i].push_back(QueueElement(matrix.getMatrixRowPtr(j)[i], j - start));
-                        sortedCoord[i].emplace_back(matrix.getMatrixRowPtr(j)[i], j - start);
-                        // i is the position of the vector in the matrix, not necessarily the vectorID
-                    }
+            if (tryInitializeLists(matrix, start, end))
+                return;
 
-                    std::sort(sortedCoord[i].begin(), sortedCoord[i].end(), std::less<QueueElement>());
+            rg::Timer t;
+            t.start();
+            while (!tryInitializeLists(matrix, start, end)) {
+                std::this_thread::yield();
+            }
+            t.stop();
+            addWaitTime(t.elapsedTime().nanos());
+        }
 
-                    for (row_type j = 0; j < sortedCoord[i].size(); ++j) {
-                        ids.push_back(sortedCoord[i][j].id);
-                        values.push_back(sortedCoord[i][j].data);
-                    }
+        /*
+         * Patches the initialized lists after the vector at position row of the bucket was inserted into the matrix
+         * (the vectors that were at row, row + 1, ... of the bucket moved down by one)
+         */
+        inline void insertRow(const VectorMatrix& matrix, row_type row) {
+            const double* vec = matrix.getMatrixRowPtr(startRow + row);
+            std::vector<double> patchedValues(colNum * (size + 1));
+            std::vector<row_type> patchedIds(colNum * (size + 1));
+
+            for (col_type j = 0; j < colNum; ++j) {
+                row_type start = j * size, outStart = j * (size + 1);
+                row_type pos = std::upper_bound(values.begin() + start, values.begin() + start + size, vec[j]) - (values.begin() + start);
+
+                for (row_type i = 0; i < size; ++i) {
+                    row_type out = outStart + (i < pos ? i : i + 1);
+                    patchedValues[out] = values[start + i];
+                    patchedIds[out] = ids[start + i] + (ids[start + i] >= row ? 1 : 0);
                 }
-                initialized = true;
+                patchedValues[outStart + pos] = vec[j];
+                patchedIds[outStart + pos] = row;
             }
-            omp_unset_lock(&writelock);
+            values.swap(patchedValues);
+            ids.swap(patchedIds);
+            size++;
         }
 
         inline row_type getRowPointer(row_type row, col_type col) const {
@@ -347,6 +522,13 @@ namespace mips {
             return true;
         }
 
+        // number of entries of list col that calculateIntervals scans for localTheta (for the cost model)
+        inline row_type intervalLength(double qi, double localTheta, col_type col) const {
+            std::pair<row_type, row_type> necessaryIndices;
+            getBounds(qi, localTheta, col, necessaryIndices);
+            return (necessaryIndices.second > necessaryIndices.first ? necessaryIndices.second - necessaryIndices.first : 0);
+        }
+
     };
 
 }
@@ -33,7 +33,7 @@ namespace mips {
         CosineSketches* cosSketches;
         LshBins* lshBins;
         std::vector<row_type> initializedSketches;
-        row_type initializedSketchesForIndex;
+        std::atomic<row_type> initializedSketchesForIndex; // published after the sketches and bins of the blocks are built
 
         inline LshIndex() : initializedSketchesForIndex(0), cosSketches(nullptr), lshBins(nullptr) {
         }
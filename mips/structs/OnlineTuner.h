@@ -0,0 +1,263 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   OnlineTuner.h
+ */
+
+#ifndef ONLINETUNER_H
+#define	ONLINETUNER_H
+
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+namespace mips {
+
+    /*
+     * Re-tunes t_b and numLists of one probe bucket (LEMP_LI, LEMP_LC) while it is retrieving, from the measured
+     * costs of its queries. A bandit with bounded exploration: every ONLINE_EXPLORE_PERIOD-th query of the bucket
+     * runs an alternative (the other side of t_b, or one list less or more) instead of the current parameters.
+     *
+     * numLists: the mean cost of the lists queries with numLists - 1, numLists and numLists + 1. Once each has
+     * ONLINE_MIN_SAMPLES queries, the cheapest one becomes numLists.
+     * t_b: the mean cost of LENGTH and of lists per range of theta_b(q) (ONLINE_BINS ranges over the theta_b(q) of
+     * the tuning sample). t_b moves to the border between ranges that minimizes the cost of the observed queries.
+     *
+     * Any thread may choose and record. The parameters are atomic, the statistics are kept under a lock that is
+     * never waited for: an observation that finds it taken is dropped.
+     */
+    class OnlineTuner {
+
+        struct CostStats {
+            double sum;
+            row_type count;
+
+            inline CostStats() : sum(0), count(0) {
+            }
+
+            inline void add(double cost) {
+                if (count >= ONLINE_WINDOW) { // forget the older half, the workload may drift
+                    sum /= 2;
+                    count /= 2;
+                }
+                sum += cost;
+                count++;
+            }
+
+            inline double mean() const {
+                return sum / count;
+            }
+        };
+
+        omp_lock_t lock;
+        CostStats lengthCost[ONLINE_BINS], listsCost[ONLINE_BINS]; // per range of theta_b(q), lists with the current numLists
+        CostStats listsArm[3]; // lists queries with numLists - 1, numLists, numLists + 1
+        std::atomic<double> t_b;
+        std::atomic<col_type> numLists;
+        std::atomic<uint64_t> visits;
+        uint64_t observations;
+        row_type changes;
+        col_type maxLists;
+        double low, width; // ranges of theta_b(q)
+
+        inline int bin(double localTheta) const {
+            int b = (int) std::floor((localTheta - low) / width);
+            return std::max(0, std::min(ONLINE_BINS - 1, b));
+        }
+
+        // t_b for: ranges below cutoff do LENGTH
+        inline double border(int cutoff) const {
+            if (cutoff == 0)
+                return -std::numeric_limits<double>::max();
+            if (cutoff == ONLINE_BINS)
+                return std::numeric_limits<double>::max();
+            return low + cutoff * width;
+        }
+
+        inline void updateNumLists() {
+            col_type lists = numLists.load(std::memory_order_relaxed);
+            bool available[3] = {lists > 1, true, lists < maxLists};
+
+            for (int arm = 0; arm < 3; ++arm) {
+                if (available[arm] && listsArm[arm].count < ONLINE_MIN_SAMPLES)
+                    return;
+            }
+
+            int best = 1;
+            for (int arm = 0; arm < 3; ++arm) {
+                if (available[arm] && listsArm[arm].mean() < listsArm[best].mean())
+                    best = arm;
+            }
+
+            for (int arm = 0; arm < 3; ++arm) {
+                listsArm[arm] = CostStats();
+            }
+
+            if (best != 1) { // the costs of lists belong to the old numLists
+                numLists.store(lists + best - 1, std::memory_order_relaxed);
+                for (int b = 0; b < ONLINE_BINS; ++b) {
+                    listsCost[b] = CostStats();
+                }
+                changes++;
+            }
+        }
+
+        inline void updateT_b() {
+            int current = (int) std::ceil((t_b.load(std::memory_order_relaxed) - low) / width);
+            current = std::max(0, std::min(ONLINE_BINS, current));
+
+            double bestCost = -1, currentCost = -1;
+            int best = current;
+
+            for (int cutoff = 0; cutoff <= ONLINE_BINS; ++cutoff) {
+                double cost = 0;
+                bool known = true;
+
+                for (int b = 0; b < ONLINE_BINS && known; ++b) {
+                    row_type queries = lengthCost[b].count + listsCost[b].count;
+                    if (queries == 0)
+                        continue;
+
+                    const CostStats& stats = (b < cutoff ? lengthCost[b] : listsCost[b]);
+                    if (stats.count < ONLINE_MIN_SAMPLES)
+                        known = false;
+                    else
+                        cost += queries * stats.mean();
+                }
+
+                if (!known)
+                    continue;
+                if (cutoff == current)
+                    currentCost = cost;
+                if (bestCost < 0 || cost < bestCost) {
+                    bestCost = cost;
+                    best = cutoff;
+                }
+            }
+
+            // move only if clearly better than the current t_b
+            if (best != current && currentCost > 0 && bestCost < 0.95 * currentCost) {
+                t_b.store(border(best), std::memory_order_relaxed);
+                changes++;
+            }
+        }
+
+    public:
+
+        struct Choice {
+            bool length;
+            bool explored;
+            int arm; // 0: numLists - 1, 1: numLists, 2: numLists + 1
+            col_type numLists;
+        };
+
+        // [minTheta, maxTheta]: the theta_b(q) of the tuning sample, maxLists: the lists the queues of the queries hold
+        inline OnlineTuner(double t_b, col_type numLists, double minTheta, double maxTheta, col_type maxLists) :
+        t_b(t_b), numLists(std::max<col_type>(1, std::min(numLists, maxLists))), visits(0), observations(0), changes(0), maxLists(maxLists) {
+            omp_init_lock(&lock);
+
+            if (maxTheta <= minTheta) {
+                minTheta = -1;
+                maxTheta = 1;
+            }
+            low = minTheta;
+            width = (maxTheta - minTheta) / ONLINE_BINS;
+        }
+
+        inline ~OnlineTuner() {
+            omp_destroy_lock(&lock);
+        }
+
+        // LENGTH or lists (with how many) for a query with local threshold localTheta
+        inline Choice choose(double localTheta, col_type queueLists) {
+            uint64_t visit = visits.fetch_add(1, std::memory_order_relaxed);
+            Choice choice;
+
+            choice.length = t_b.load(std::memory_order_relaxed) > localTheta;
+            choice.explored = (visit % ONLINE_EXPLORE_PERIOD == 0);
+            choice.arm = 1;
+
+            if (choice.explored) {
+                if (choice.length) {
+                    choice.length = false;
+                } else {
+                    switch ((visit / ONLINE_EXPLORE_PERIOD) % 3) {
+                        case 0:
+                            choice.length = true;
+                            break;
+                        case 1:
+                            choice.arm = 0;
+                            break;
+                        default:
+                            choice.arm = 2;
+                    }
+                }
+            }
+
+            col_type lists = numLists.load(std::memory_order_relaxed);
+            col_type limit = std::min(maxLists, queueLists);
+            if ((choice.arm == 0 && lists <= 1) || (choice.arm == 2 && lists >= limit))
+                choice.arm = 1;
+            choice.numLists = std::min<col_type>(lists + choice.arm - 1, limit);
+
+            return choice;
+        }
+
+        // nanos: what the query of choice cost in this bucket
+        inline void record(const Choice& choice, double localTheta, double nanos) {
+            if (!omp_test_lock(&lock)) // somebody else is recording: drop this one
+                return;
+
+            bool stale = (choice.numLists + 1 - choice.arm != numLists.load(std::memory_order_relaxed));
+            int b = bin(localTheta);
+
+            if (choice.length) {
+                lengthCost[b].add(nanos);
+            } else if (!stale) {
+                if (choice.arm == 1)
+                    listsCost[b].add(nanos);
+                if (!choice.explored || choice.arm != 1) // not a LENGTH query sent to the lists
+                    listsArm[choice.arm].add(nanos);
+            }
+
+            observations++;
+            if (observations % ONLINE_UPDATE_PERIOD == 0) {
+                updateNumLists();
+                updateT_b();
+            }
+
+            omp_unset_lock(&lock);
+        }
+
+        inline double getT_b() const {
+            return t_b.load(std::memory_order_relaxed);
+        }
+
+        inline col_type getNumLists() const {
+            return numLists.load(std::memory_order_relaxed);
+        }
+
+        // how often t_b or numLists changed
+        inline row_type getChanges() const {
+            return changes;
+        }
+
+    };
+
+    typedef boost::shared_ptr<OnlineTuner> online_tuner_ptr;
+
+}
+
+#endif	/* ONLINETUNER_H */
@@ -0,0 +1,277 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   PqIndex.h
+ */
+
+#ifndef PQINDEX_H
+#define	PQINDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+namespace mips {
+
+    /*
+     * Product quantization of the directions of the probe vectors of one bucket (LEMP_PQ). The coordinates are split
+     * into m subspaces; in each one k-means (on a sample of the bucket) finds up to PQ_CENTROIDS centroids and every
+     * vector is stored as the byte of its nearest centroid: m bytes per vector instead of r doubles.
+     *
+     * A query computes per subspace its inner product with all centroids once (the ADC tables); the approximate cosine
+     * of a vector is then the sum of m table entries. Per vector the index also keeps the norm of its quantization
+     * error (rounded up), so that cos(q, p) <= approximate cosine + error for any normalized q: an exact filter.
+     */
+    class PqIndex : public Index {
+
+        std::vector<double> centroids; // subspace s: PQ_CENTROIDS x (its dimensions), from PQ_CENTROIDS * bounds[s]
+        std::vector<uint8_t> codes; // subspace-major: codes[s * n + i]
+        std::vector<float> errors; // per vector: an upper bound of ||p - decoded(p)||
+        std::vector<col_type> bounds; // subspace s: coordinates [bounds[s], bounds[s + 1])
+        row_type n, startRow;
+        int m;
+        col_type colNum;
+
+        static inline double squaredDistance(const double* a, const double* b, col_type n) {
+            double sum = 0;
+            for (col_type j = 0; j < n; ++j) {
+                double diff = a[j] - b[j];
+                sum += diff * diff;
+            }
+            return sum;
+        }
+
+        // the nearest of the numCentroids centroids (dim coordinates each) to x and its squared distance
+        static inline std::pair<uint8_t, double> nearest(const double* x, const double* subCentroids, row_type numCentroids, col_type dim) {
+            std::pair<uint8_t, double> best(0, std::numeric_limits<double>::max());
+            for (row_type c = 0; c < numCentroids; ++c) {
+                double dist = squaredDistance(x, subCentroids + c * dim, dim);
+                if (dist < best.second) {
+                    best.first = c;
+                    best.second = dist;
+                }
+            }
+            return best;
+        }
+
+        // k-means of subspace s over the sample rows (of the probe matrix)
+        inline void train(const VectorMatrix& matrix, int s, const std::vector<row_type>& sample, row_type numCentroids) {
+            col_type first = bounds[s];
+            col_type dim = bounds[s + 1] - first;
+            double* subCentroids = &centroids[PQ_CENTROIDS * first];
+
+            for (row_type c = 0; c < numCentroids; ++c) { // the sample is shuffled
+                std::copy(matrix.getMatrixRowPtr(sample[c]) + first, matrix.getMatrixRowPtr(sample[c]) + first + dim, subCentroids + c * dim);
+            }
+
+            std::vector<double> sums(numCentroids * dim);
+            std::vector<row_type> counts(numCentroids);
+            std::vector<uint8_t> assignment(sample.size(), 0);
+
+            for (int iter = 0; iter < PQ_ITERATIONS; ++iter) {
+                bool changed = (iter == 0);
+                std::fill(sums.begin(), sums.end(), 0);
+                std::fill(counts.begin(), counts.end(), 0);
+
+                for (row_type i = 0; i < sample.size(); ++i) {
+                    const double* x = matrix.getMatrixRowPtr(sample[i]) + first;
+                    uint8_t c = nearest(x, subCentroids, numCentroids, dim).first;
+                    if (c != assignment[i]) {
+                        assignment[i] = c;
+                        changed = true;
+                    }
+                    counts[c]++;
+                    for (col_type j = 0; j < dim; ++j) {
+                        sums[c * dim + j] += x[j];
+                    }
+                }
+
+                if (!changed)
+                    break;
+
+                for (row_type c = 0; c < numCentroids; ++c) {
+                    if (counts[c] == 0) // empty: keep the old centroid
+                        continue;
+                    for (col_type j = 0; j < dim; ++j) {
+                        subCentroids[c * dim + j] = sums[c * dim + j] / counts[c];
+                    }
+                }
+            }
+        }
+
+    public:
+
+        inline PqIndex(int subspaces = PQ_SUBSPACES) : n(0), startRow(0), m(std::max(1, subspaces)), colNum(0) {
+        }
+
+        /*
+         * Non-blocking. The first caller trains and encodes, the subspaces in parallel with up to threads threads.
+         * The others return false immediately, so that they can serve their queries differently until the codes are ready
+         */
+        inline bool tryInitializeCodes(const VectorMatrix& matrix, int threads, row_type start = 0, row_type end = 0) {
+
+            if (isInitialized())
+                return true;
+
+            if (claim()) {
+                if (start == end) {
+                    start = 0;
+                    end = matrix.rowNum;
+                }
+                n = end - start;
+                startRow = start;
+                colNum = matrix.colNum;
+                m = std::min<int>(m, colNum);
+
+                bounds.resize(m + 1);
+                for (int s = 0; s <= m; ++s) {
+                    bounds[s] = (s * colNum) / m;
+                }
+
+                // the training sample: a random subset of the bucket
+                std::vector<row_type> sample(n);
+                std::iota(sample.begin(), sample.end(), start);
+                row_type sampleSize = std::min<row_type>(n, PQ_TRAIN_POINTS);
+                rg::Random32 random(123);
+                for (row_type i = 0; i < sampleSize; ++i) {
+                    row_type j = i + std::min<row_type>(n - i - 1, random.nextDouble() * (n - i));
+                    std::swap(sample[i], sample[j]);
+                }
+                sample.resize(sampleSize);
+
+                row_type numCentroids = std::min<row_type>(PQ_CENTROIDS, sampleSize);
+                centroids.assign(PQ_CENTROIDS * colNum, 0);
+                codes.resize((size_t) m * n);
+                std::vector<double> squaredErrors((size_t) m * n);
+
+#pragma omp parallel for schedule(dynamic,1) num_threads(std::max(1, std::min(threads, m)))
+                for (int s = 0; s < m; ++s) {
+                    if (numCentroids == 0)
+                        continue;
+
+                    train(matrix, s, sample, numCentroids);
+
+                    col_type dim = bounds[s + 1] - bounds[s];
+                    const double* subCentroids = &centroids[PQ_CENTROIDS * bounds[s]];
+                    for (row_type i = 0; i < n; ++i) {
+                        std::pair<uint8_t, double> p = nearest(matrix.getMatrixRowPtr(start + i) + bounds[s], subCentroids, numCentroids, dim);
+                        codes[(size_t) s * n + i] = p.first;
+                        squaredErrors[(size_t) s * n + i] = p.second;
+                    }
+                }
+
+                errors.resize(n);
+                for (row_type i = 0; i < n; ++i) {
+                    double sum = 0;
+                    for (int s = 0; s < m; ++s) {
+                        sum += squaredErrors[(size_t) s * n + i];
+                    }
+                    // rounded up, plus some slack for the rounding of the approximate cosines
+                    errors[i] = std::nextafter((float) (std::sqrt(sum) + 1e-9), std::numeric_limits<float>::max());
+                }
+
+                publish();
+                return true;
+            }
+            return false;
+        }
+
+        inline void initializeCodes(const VectorMatrix& matrix, int threads, row_type start = 0, row_type end = 0) {
+
+            if (tryInitializeCodes(matrix, threads, start, end))
+                return;
+
+            rg::Timer t;
+            t.start();
+            while (!isInitialized()) {
+                std::this_thread::yield();
+            }
+            t.stop();
+            addWaitTime(t.elapsedTime().nanos());
+        }
+
+        // the approximate cosines of query with all vectors of the bucket. tables: scratch space
+        inline void approximateCosines(const double* query, std::vector<double>& tables, std::vector<double>& cosines) const {
+            tables.resize((size_t) m * PQ_CENTROIDS);
+            for (int s = 0; s < m; ++s) {
+                col_type dim = bounds[s + 1] - bounds[s];
+                const double* subCentroids = &centroids[PQ_CENTROIDS * bounds[s]];
+                const double* subQuery = query + bounds[s];
+                double* table = &tables[s * PQ_CENTROIDS];
+
+                for (row_type c = 0; c < PQ_CENTROIDS; ++c) {
+                    double ip = 0;
+                    for (col_type j = 0; j < dim; ++j) {
+                        ip += subQuery[j] * subCentroids[c * dim + j];
+                    }
+                    table[c] = ip;
+                }
+            }
+
+            cosines.assign(n, 0);
+            for (int s = 0; s < m; ++s) { // one subspace at a time: sequential codes, one table in the cache
+                const double* table = &tables[s * PQ_CENTROIDS];
+                const uint8_t* subCodes = &codes[(size_t) s * n];
+                for (row_type i = 0; i < n; ++i) {
+                    cosines[i] += table[subCodes[i]];
+                }
+            }
+        }
+
+        /*
+         * Writes rows of the probe matrix that may have cosine >= cosCutoff with the query into candidates and returns
+         * how many. exact: all vectors whose approximate cosine plus quantization error reaches cosCutoff. Otherwise
+         * (approximate) the at most maxCandidates vectors with the largest approximate cosines that reach cosCutoff
+         */
+        inline row_type getCandidates(const double* query, double cosCutoff, bool exact, row_type maxCandidates, row_type* candidates,
+                std::vector<double>& tables, std::vector<double>& cosines) const {
+
+            if (n == 0)
+                return 0;
+
+            approximateCosines(query, tables, cosines);
+
+            row_type found = 0;
+            if (exact) {
+                for (row_type i = 0; i < n; ++i) {
+                    if (cosines[i] + errors[i] >= cosCutoff)
+                        candidates[found++] = startRow + i;
+                }
+                return found;
+            }
+
+            for (row_type i = 0; i < n; ++i) {
+                if (cosines[i] >= cosCutoff)
+                    candidates[found++] = i;
+            }
+            if (found > maxCandidates) {
+                std::nth_element(candidates, candidates + maxCandidates, candidates + found, [&cosines](row_type a, row_type b) {
+                    return cosines[a] > cosines[b];
+                });
+                found = maxCandidates;
+            }
+            for (row_type i = 0; i < found; ++i) {
+                candidates[i] += startRow;
+            }
+            return found;
+        }
+
+    };
+
+}
+
+#endif	/* PQINDEX_H */
@@ -20,7 +20,10 @@ namespace mips {
         TREE = 3,
         AP = 4,
         LSH = 5,
-        BLSH = 6
+        BLSH = 6,
+        ANNOY = 7,
+        HNSW = 8,
+        PQ = 9
 
     };
 
@@ -32,11 +35,79 @@ namespace mips {
         }
     };
 
+    typedef boost::shared_ptr< const std::vector<row_type> > sample_ptr;
+
+    /*
+     * Sample results of the queries of one thread for one bucket. Flat and preallocated: one slot per query of the
+     * sample of the thread (sorted ids, shared by all buckets). Slots of different queries may be filled
+     * concurrently; seal lists the filled ones (the queries that reached the bucket) afterwards.
+     */
+    class SampleResults {
+        sample_ptr ids;
+        std::vector<GlobalTopkTuneData> slots;
+        std::vector<char> filled;
+        std::vector<row_type> used; // filled slots, ascending
+
+        inline row_type slot(row_type id) const {
+            return std::lower_bound(ids->begin(), ids->end(), id) - ids->begin();
+        }
+
+    public:
+
+        // keeps the slots (and the capacity of their results) of earlier runs
+        inline void init(const sample_ptr& sampleIds) {
+            ids = sampleIds;
+            slots.resize(ids->size());
+            filled.assign(ids->size(), 0);
+            used.clear();
+        }
+
+        inline GlobalTopkTuneData& add(row_type id) {
+            row_type s = slot(id);
+            filled[s] = 1;
+            slots[s].lengthTime = 0;
+            slots[s].results.clear();
+            return slots[s];
+        }
+
+        inline void seal() {
+            used.clear();
+            for (row_type s = 0; s < filled.size(); ++s) {
+                if (filled[s])
+                    used.push_back(s);
+            }
+        }
+
+        inline const GlobalTopkTuneData& at(row_type id) const {
+            return slots[slot(id)];
+        }
+
+        inline const GlobalTopkTuneData& operator[](row_type id) const {
+            return at(id);
+        }
+
+        // number of sample queries that reached the bucket
+        inline row_type size() const {
+            return used.size();
+        }
+
+        inline row_type idAt(row_type n) const {
+            return (*ids)[used[n]];
+        }
+
+        inline void clear() {
+            ids.reset();
+            slots.clear();
+            filled.clear();
+            used.clear();
+        }
+    };
+
     class Retriever;
 
 
     typedef boost::shared_ptr<Retriever> retriever_ptr;
-    typedef std::vector< std::unordered_map< row_type, GlobalTopkTuneData > > Thread2Sample2Result;
+    typedef std::vector<SampleResults> Thread2Sample2Result;
 
     class ProbeBucket {
     public:
@@ -47,36 +118,101 @@ namespace mips {
         col_type colNum, numLists;
         row_type startPos, endPos, rowNum;
         retriever_ptr ptrRetriever;
+        LEMP_Method method; // of ptrRetriever (with LEMP_AUTO it differs from bucket to bucket)
 
         row_type activeQueries; // active queries for this bucket. If multiple threads this will just be an estimation 
         xValues_ptr xValues; // data: theta_b(q) id: sampleId
         Thread2Sample2Result sampleThetas; // 1: thread 2: valid sample points for bucket -->result
+        online_tuner_ptr onlineTuner; // re-tunes t_b and numLists during retrieval (nullptr: fixed parameters)
+        std::vector<double> coordMin, coordMax; // per coordinate the range of the directions of the bucket (empty: no range bounds)
+        std::vector<double> coneCentroids; // cone c: its normalized centroid direction at c * colNum (empty: no cone bounds)
+        std::vector<double> coneCosRadius; // cone c: the smallest cosine of a direction of the cone with its centroid
 
-        inline ProbeBucket() : numLists(1), t_b(1), runtime(0), activeQueries(0) {
+        inline ProbeBucket() : numLists(1), t_b(1), runtime(0), activeQueries(0), method(LEMP_L) {
             for (int i = 0; i < NUM_INDEXES; ++i) {
                 ptrIndexes[i] = nullptr;
             }
         }
 
-        inline ~ProbeBucket() {
-            if (ptrIndexes[SL] != nullptr) {
-                delete static_cast<QueueElementLists*> (ptrIndexes[SL]);
-            }
-            if (ptrIndexes[INT_SL] != nullptr) {
-                delete static_cast<IntLists*> (ptrIndexes[INT_SL]);
-            }
-            if (ptrIndexes[TREE] != nullptr) {
-                delete static_cast<TreeIndex*> (ptrIndexes[TREE]);
-            }
-            if (ptrIndexes[AP] != nullptr) {
-                delete static_cast<L2apIndex*> (ptrIndexes[AP]);
+        // the bucket owns its indexes: it can be moved (e.g., when a bucket is inserted), but not copied
+        inline ProbeBucket(ProbeBucket&& other) noexcept : ProbeBucket() {
+            *this = std::move(other);
+        }
+
+        inline ProbeBucket& operator=(ProbeBucket&& other) noexcept {
+            if (this != &other) {
+                for (int i = 0; i < NUM_INDEXES; ++i) {
+                    std::swap(ptrIndexes[i], other.ptrIndexes[i]);
+                }
+                normL2 = other.normL2;
+                invNormL2 = other.invNormL2;
+                bucketScanThreshold = other.bucketScanThreshold;
+                runtime = other.runtime;
+                t_b = other.t_b;
+                colNum = other.colNum;
+                numLists = other.numLists;
+                startPos = other.startPos;
+                endPos = other.endPos;
+                rowNum = other.rowNum;
+                ptrRetriever = std::move(other.ptrRetriever);
+                method = other.method;
+                activeQueries = other.activeQueries;
+                xValues = std::move(other.xValues);
+                sampleThetas = std::move(other.sampleThetas);
+                onlineTuner = std::move(other.onlineTuner);
+                coordMin = std::move(other.coordMin);
+                coordMax = std::move(other.coordMax);
+                coneCentroids = std::move(other.coneCentroids);
+                coneCosRadius = std::move(other.coneCosRadius);
             }
-            if (ptrIndexes[LSH] != nullptr) {
-                delete static_cast<LshIndex*> (ptrIndexes[LSH]);
+            return *this;
+        }
+
+        ProbeBucket(const ProbeBucket&) = delete;
+        ProbeBucket& operator=(const ProbeBucket&) = delete;
+
+        inline ~ProbeBucket() {
+            for (int i = 0; i < NUM_INDEXES; ++i) {
+                deleteIndex((Index_Type) i);
             }
-            if (ptrIndexes[BLSH] != nullptr) {
-                delete static_cast<BlshIndex*> (ptrIndexes[BLSH]);
+        }
+
+        inline void deleteIndex(Index_Type type) {
+            if (ptrIndexes[type] == nullptr)
+                return;
+
+            switch (type) {
+                case SL:
+                    delete static_cast<QueueElementLists*> (ptrIndexes[SL]);
+                    break;
+                case INT_SL:
+                    delete static_cast<IntLists*> (ptrIndexes[INT_SL]);
+                    break;
+                case TREE:
+                    delete static_cast<TreeIndex*> (ptrIndexes[TREE]);
+                    break;
+                case AP:
+                    delete static_cast<L2apIndex*> (ptrIndexes[AP]);
+                    break;
+                case LSH:
+                    delete static_cast<LshIndex*> (ptrIndexes[LSH]);
+                    break;
+                case BLSH:
+                    delete static_cast<BlshIndex*> (ptrIndexes[BLSH]);
+                    break;
+                case ANNOY:
+                    delete static_cast<AnnoyIndex*> (ptrIndexes[ANNOY]);
+                    break;
+                case HNSW:
+                    delete static_cast<HnswIndex*> (ptrIndexes[HNSW]);
+                    break;
+                case PQ:
+                    delete static_cast<PqIndex*> (ptrIndexes[PQ]);
+                    break;
+                default:
+                    break;
             }
+            ptrIndexes[type] = nullptr;
         }
 
         inline void init(const VectorMatrix& matrix, row_type startInd, row_type endInd, const LempArguments& args) {
@@ -90,6 +226,163 @@ namespace mips {
             invNormL2.second = 1 / normL2.second;
 
             colNum = matrix.colNum;
+
+            coordMin.clear();
+            coordMax.clear();
+            if (args.rangeBounds && rowNum > 0) {
+                coordMin.assign(colNum, std::numeric_limits<double>::max());
+                coordMax.assign(colNum, -std::numeric_limits<double>::max());
+                for (row_type i = startPos; i < endPos; ++i) {
+                    const double* vec = matrix.getMatrixRowPtr(i);
+                    for (col_type j = 0; j < colNum; ++j) {
+                        coordMin[j] = std::min(coordMin[j], vec[j]);
+                        coordMax[j] = std::max(coordMax[j], vec[j]);
+                    }
+                }
+            }
+
+            coneCentroids.clear();
+            coneCosRadius.clear();
+            if (args.coneClusters > 0 && rowNum > 0) {
+                initCones(matrix, std::min<row_type>(args.coneClusters, rowNum));
+            }
+        }
+
+        /*
+         * Splits the directions of the bucket into cones by spherical k-means (seeded with random directions of the
+         * bucket). Each cone keeps its centroid and the smallest cosine of its directions with it (its angular radius)
+         */
+        inline void initCones(const VectorMatrix& matrix, row_type clusters) {
+            coneCentroids.assign(clusters * colNum, 0);
+            std::vector<row_type> assignment(rowNum, 0);
+
+            if (clusters == 1) {
+                for (row_type i = startPos; i < endPos; ++i) {
+                    const double* vec = matrix.getMatrixRowPtr(i);
+                    for (col_type j = 0; j < colNum; ++j) {
+                        coneCentroids[j] += vec[j];
+                    }
+                }
+            } else {
+                rg::Random32 random(123);
+                for (row_type c = 0; c < clusters; ++c) {
+                    row_type row = startPos + std::min<row_type>(rowNum - 1, random.nextDouble() * rowNum);
+                    std::copy(matrix.getMatrixRowPtr(row), matrix.getMatrixRowPtr(row) + colNum, &coneCentroids[c * colNum]);
+                }
+
+                for (int iter = 0; iter < CONE_ITERATIONS; ++iter) {
+                    for (row_type i = 0; i < rowNum; ++i) {
+                        assignment[i] = nearestCone(matrix.getMatrixRowPtr(startPos + i)).first;
+                    }
+
+                    std::fill(coneCentroids.begin(), coneCentroids.end(), 0);
+                    for (row_type i = 0; i < rowNum; ++i) {
+                        const double* vec = matrix.getMatrixRowPtr(startPos + i);
+                        double* centroid = &coneCentroids[assignment[i] * colNum];
+                        for (col_type j = 0; j < colNum; ++j) {
+                            centroid[j] += vec[j];
+                        }
+                    }
+                    normalizeCones();
+                }
+            }
+            normalizeCones();
+
+            // the radius of each cone over the final assignment. A zero centroid (its directions cancel out) keeps cosine 0: bound 1
+            coneCosRadius.assign(clusters, 1);
+            std::vector<bool> empty(clusters, true);
+            for (row_type i = 0; i < rowNum; ++i) {
+                const double* vec = matrix.getMatrixRowPtr(startPos + i);
+                std::pair<row_type, double> cone = nearestCone(vec);
+                empty[cone.first] = false;
+                coneCosRadius[cone.first] = std::min(coneCosRadius[cone.first], cone.second);
+            }
+
+            row_type kept = 0;
+            for (row_type c = 0; c < clusters; ++c) {
+                if (empty[c])
+                    continue;
+                std::copy(&coneCentroids[c * colNum], &coneCentroids[(c + 1) * colNum], &coneCentroids[kept * colNum]);
+                coneCosRadius[kept++] = coneCosRadius[c];
+            }
+            coneCentroids.resize(kept * colNum);
+            coneCosRadius.resize(kept);
+        }
+
+        inline void normalizeCones() {
+            for (row_type c = 0; c < coneCentroids.size() / colNum; ++c) {
+                double* centroid = &coneCentroids[c * colNum];
+                double len = 0;
+                for (col_type j = 0; j < colNum; ++j) {
+                    len += centroid[j] * centroid[j];
+                }
+                len = std::sqrt(len);
+                if (len > 0) {
+                    for (col_type j = 0; j < colNum; ++j) {
+                        centroid[j] /= len;
+                    }
+                }
+            }
+        }
+
+        // the cone whose centroid is closest in angle to vec and their cosine
+        inline std::pair<row_type, double> nearestCone(const double* vec) const {
+            std::pair<row_type, double> best(0, -std::numeric_limits<double>::max());
+            for (row_type c = 0; c < coneCentroids.size() / colNum; ++c) {
+                const double* centroid = &coneCentroids[c * colNum];
+                double cos = 0;
+                for (col_type j = 0; j < colNum; ++j) {
+                    cos += vec[j] * centroid[j];
+                }
+                if (cos > best.second) {
+                    best.first = c;
+                    best.second = cos;
+                }
+            }
+            return best;
+        }
+
+        /*
+         * Upper bound of the cosine of query (normalized) with the directions of the bucket. Ranges: coordinate-wise
+         * the larger product with the ends of the range. Cones: cos(max(0, angle(q, c) - radius)) for the best cone.
+         * The query cannot reach theta in the bucket if the bound is below theta_b(q)
+         */
+        inline double maxCosine(const double* query) const {
+            double bound = 1;
+
+            if (!coordMax.empty()) {
+                double rangeBound = 0;
+                for (col_type j = 0; j < colNum; ++j) {
+                    rangeBound += query[j] * (query[j] > 0 ? coordMax[j] : coordMin[j]);
+                }
+                bound = std::min(bound, rangeBound);
+            }
+
+            if (!coneCosRadius.empty()) {
+                double coneBound = -1;
+                for (row_type c = 0; c < coneCosRadius.size() && coneBound < bound; ++c) {
+                    const double* centroid = &coneCentroids[c * colNum];
+                    double cosQ = 0;
+                    for (col_type j = 0; j < colNum; ++j) {
+                        cosQ += query[j] * centroid[j];
+                    }
+                    cosQ = std::max(-1.0, std::min(cosQ, 1.0));
+
+                    double cosR = coneCosRadius[c];
+                    if (cosQ >= cosR) { // the query lies inside the cone
+                        coneBound = 1;
+                    } else { // cos(angle(q, c) - radius)
+                        coneBound = std::max(coneBound, cosQ * cosR + std::sqrt((1 - cosQ * cosQ) * (1 - cosR * cosR)));
+                    }
+                }
+                bound = std::min(bound, coneBound);
+            }
+
+            return bound;
+        }
+
+        inline bool hasDirectionBounds() const {
+            return !coordMax.empty() || !coneCosRadius.empty();
         }
 
         inline void setAfterTuning(col_type lists, double thres) {          
@@ -108,15 +401,54 @@ namespace mips {
             return ptrIndexes[type];
         }
 
-        bool isTunable(row_type availableQueries) {
-            if (availableQueries < LOWER_LIMIT_PER_BUCKET * 3) {
+        // time (nanos) threads spent on the indexes of this bucket while other threads were building them
+        inline uint64_t getIndexWaitTime() const {
+            uint64_t waitTime = 0;
+
+            if (ptrIndexes[SL] != nullptr) {
+                waitTime += static_cast<QueueElementLists*> (ptrIndexes[SL])->getWaitTime();
+            }
+            if (ptrIndexes[INT_SL] != nullptr) {
+                waitTime += static_cast<IntLists*> (ptrIndexes[INT_SL])->getWaitTime();
+            }
+            if (ptrIndexes[TREE] != nullptr) {
+                waitTime += static_cast<TreeIndex*> (ptrIndexes[TREE])->getWaitTime();
+            }
+            if (ptrIndexes[AP] != nullptr) {
+                waitTime += static_cast<L2apIndex*> (ptrIndexes[AP])->getWaitTime();
+            }
+            if (ptrIndexes[LSH] != nullptr) {
+                waitTime += static_cast<LshIndex*> (ptrIndexes[LSH])->getWaitTime();
+            }
+            if (ptrIndexes[BLSH] != nullptr) {
+                waitTime += static_cast<BlshIndex*> (ptrIndexes[BLSH])->getWaitTime();
+            }
+            if (ptrIndexes[ANNOY] != nullptr) {
+                waitTime += static_cast<AnnoyIndex*> (ptrIndexes[ANNOY])->getWaitTime();
+            }
+            if (ptrIndexes[HNSW] != nullptr) {
+                waitTime += static_cast<HnswIndex*> (ptrIndexes[HNSW])->getWaitTime();
+            }
+            if (ptrIndexes[PQ] != nullptr) {
+                waitTime += static_cast<PqIndex*> (ptrIndexes[PQ])->getWaitTime();
+            }
+            return waitTime;
+        }
+
+        bool isTunable(row_type availableQueries, const LempArguments& args) {
+            if (availableQueries < args.sampleMin * 3) {
                 return false;
             } else {
                 return true;
             }
         }
 
-        inline void sampling(std::vector<RetrievalArguments>& retrArg) {
+        /*
+         * Draws the tuning sample from the queries that reach the bucket. Fixed size (args.sampleError = 0):
+         * SAMPLE_RATE of them, sorted by theta_b(q). Adaptive: up to SAMPLE_MAX_RATE of them in random order, of
+         * which fitSample keeps as many as the tuning needs
+         */
+        inline void sampling(std::vector<RetrievalArguments>& retrArg, const LempArguments& args) {
             xValues_ptr ptr(new std::vector<MatItem> ());
             xValues = ptr;
             row_type sampleSize;
@@ -124,6 +456,7 @@ namespace mips {
 
             // first find how many queries in total will be fired in this Above-theta problem
             std::vector<row_type> activeQueriesInPartition(retrArg.size());
+            activeQueries = 0;
 
             for (int t = 0; t < retrArg.size(); ++t) {
                 std::vector<QueueElement>::const_iterator up = std::lower_bound(retrArg[t].queryMatrix->lengthInfo.begin(),
@@ -135,18 +468,11 @@ namespace mips {
 
             
             // and based on the number of active queries pick up a good sample size
-            if (activeQueries < LOWER_LIMIT_PER_BUCKET * 3) {
+            if (activeQueries < args.sampleMin * 3) { // if very few elements qualify for this bucket, it does not pay off to tune.
                 sampleSize = 0;
             } else {
-                sampleSize = 0.02 * activeQueries;
-
-                if (sampleSize > UPPER_LIMIT_PER_BUCKET) {
-                    sampleSize = UPPER_LIMIT_PER_BUCKET;
-                }
-
-                if (sampleSize < LOWER_LIMIT_PER_BUCKET) {// if very few elements qualify for this bucket, it does not pay off to tune.
-                    sampleSize = LOWER_LIMIT_PER_BUCKET;
-                }
+                double rate = (args.sampleError > 0 ? SAMPLE_MAX_RATE : SAMPLE_RATE);
+                sampleSize = std::min<row_type>(args.sampleMax, std::max<row_type>(rate * activeQueries, args.sampleMin));
             }
 
             rg::Random32& random = retrArg[0].random;
@@ -154,12 +480,11 @@ namespace mips {
 
             if (sampleSize > 0) {
                 xValues->reserve(sampleSize);
-                sampleSize /= retrArg.size();
-
 
                 for (int t = 0; t < retrArg.size(); ++t) {
-                    // do the actual sampling
-                    std::vector<row_type> sampleIndx = rg::sample(random, sampleSize, activeQueriesInPartition[t]);
+                    // do the actual sampling, from each thread in proportion to its active queries
+                    row_type share = (double) sampleSize * activeQueriesInPartition[t] / activeQueries;
+                    std::vector<row_type> sampleIndx = rg::sample(random, share, activeQueriesInPartition[t]);
 
                     // calculate the actual theta_b(q)) values
                     for (row_type i = 0; i < sampleIndx.size(); ++i) {
@@ -167,10 +492,21 @@ namespace mips {
                         xValues->emplace_back(theta_b_q, t, sampleIndx[i]);
                     }
                 }
-                std::sort(xValues->begin(), xValues->end(), std::less<MatItem>());
+
+                if (args.sampleError > 0)
+                    rg::shuffle(xValues->begin(), xValues->end(), random);
+                else
+                    std::sort(xValues->begin(), xValues->end(), std::less<MatItem>());
             }
         }
 
+        // adaptive sampling: keeps the first size queries of the sample and sorts them by theta_b(q)
+        inline void fitSample(row_type size) {
+            if (xValues->size() > size)
+                xValues->resize(size);
+            std::sort(xValues->begin(), xValues->end(), std::less<MatItem>());
+        }
+
         inline void setup_xValues_topk(const std::vector<RetrievalArguments>& retrArg, const Thread2Sample2Result& previousSampleThetas) {
             // for the Row-Top-k we already have the sample of queries, 
             // but the order of sample queries on the x-axis (theta_b(q)) is changing from bucket to bucket
@@ -180,15 +516,11 @@ namespace mips {
 
             for (int t = 0; t < retrArg.size(); ++t) {
 
-                row_type lastInd = sampleThetas[t].size();
-                auto it = sampleThetas[t].begin();
-
-                while (lastInd > 0) {
-                    double localTheta = previousSampleThetas[t].at(it->first).results.front().data;
+                for (row_type n = 0; n < sampleThetas[t].size(); ++n) {
+                    row_type id = sampleThetas[t].idAt(n);
+                    double localTheta = previousSampleThetas[t].at(id).results.front().data;
                     localTheta *= (localTheta > 0 ? invNormL2.second : invNormL2.first);
-                    xValues->emplace_back(localTheta, t, it->first);
-                    lastInd--;
-                    ++it;
+                    xValues->emplace_back(localTheta, t, id);
                 }
             }
             std::sort(xValues->begin(), xValues->end(), std::less<MatItem>());
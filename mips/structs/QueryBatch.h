@@ -28,6 +28,7 @@ namespace mips {
 
     class QueryBatch {
         col_type* queues;
+        row_type queuesSize; // allocated size of queues
         bool initializedQueues;
         row_type rowNum;
         std::vector<bool> inactiveQueries;
@@ -37,6 +38,7 @@ namespace mips {
     public:
 
         LshIndex * lshIndex;
+        TreeIndex * treeIndex; // cover tree of the queries of the batch, for dual-tree LEMP_TREE
         row_type startPos, endPos;
         
 
@@ -54,7 +56,13 @@ namespace mips {
         }
 
         inline bool isQueryInactive(row_type queryPosInWholeMatrix) const {
-            return inactiveQueries[queryPosInWholeMatrix - startPos];
+            return inactiveCounter > 0 && inactiveQueries[queryPosInWholeMatrix - startPos];
+        }
+
+        // undoes inactivateQuery (the query skipped only one probe bucket)
+        inline void reactivateQuery(row_type queryPosInWholeMatrix) {
+            inactiveQueries[queryPosInWholeMatrix - startPos] = false;
+            inactiveCounter--;
         }
 
         inline double maxLength() const{
@@ -77,7 +85,12 @@ namespace mips {
             lshIndex->initializeLists(matrix, false, startPos, endPos);
         }
 
-        inline QueryBatch() : initializedQueues(false), queues(nullptr), inactiveCounter(0), lshIndex(nullptr) {
+        inline void createTreeIndex(VectorMatrix& matrix) {
+            treeIndex = new TreeIndex();
+            treeIndex->initializeTree(matrix, 1, startPos, endPos);
+        }
+
+        inline QueryBatch() : initializedQueues(false), queues(nullptr), queuesSize(0), inactiveCounter(0), lshIndex(nullptr), treeIndex(nullptr) {
         };
 
         inline ~QueryBatch() {
@@ -86,6 +99,9 @@ namespace mips {
 
             if (lshIndex != nullptr)
                 delete lshIndex;
+
+            if (treeIndex != nullptr)
+                delete treeIndex;
         }
 
         inline void init(const VectorMatrix& matrix, row_type startInd, row_type endInd, const LempArguments& args) {
@@ -95,16 +111,44 @@ namespace mips {
             normL2.second = matrix.getVectorLength(startPos);
             normL2.first = matrix.getVectorLength(endPos - 1);
 
-            if (args.k > 0) {
+            if (args.k > 0 || args.bucketBounds()) {
                 inactiveQueries.resize(rowNum);
             }
         }
 
+        // reuses the batch for other queries (online retrieval). Allocated space is kept
+        inline void reset(const VectorMatrix& matrix, row_type startInd, row_type endInd, const LempArguments& args) {
+            if (lshIndex != nullptr) {
+                delete lshIndex;
+                lshIndex = nullptr;
+            }
+            if (treeIndex != nullptr) {
+                delete treeIndex;
+                treeIndex = nullptr;
+            }
+            initializedQueues = false;
+            inactiveCounter = 0;
+            inactiveQueries.clear();
+
+            if (startInd == endInd) { // nothing to do for this batch
+                startPos = endPos = startInd;
+                rowNum = 0;
+                normL2 = std::make_pair(0.0, 0.0);
+                return;
+            }
+            init(matrix, startInd, endInd, args);
+        }
+
     };
 
     inline void QueryBatch::preprocess(const VectorMatrix& userMatrix, col_type maxLists) {
 
-        queues = new col_type[rowNum * maxLists];
+        if (queuesSize < rowNum * maxLists) {
+            if (queues != nullptr)
+                delete[] queues;
+            queuesSize = rowNum * maxLists;
+            queues = new col_type[queuesSize];
+        }
 
         std::vector<QueueElement> tmp;
         tmp.resize(maxLists);
@@ -0,0 +1,180 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   QueryCache.h
+ */
+
+#ifndef QUERYCACHE_H
+#define	QUERYCACHE_H
+
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+namespace mips {
+
+    struct CachedQuery {
+        std::vector<double> query; // as it was given (not normalized)
+        uint64_t key, directionKey;
+        double length;
+        std::vector<QueueElement> results; // (score, probe id)
+    };
+
+    /*
+     * Results of earlier online queries, least recently used evicted first. A query is found by an exact hash of its
+     * coordinates. Optionally (directionLevels > 0), also by its direction quantized to directionLevels steps per
+     * coordinate: the top-k items of two queries with the same direction are the same and their scores differ by the
+     * ratio of the lengths, so a near-duplicate direction gets approximate top-k results.
+     */
+    class QueryCache {
+        typedef std::list<CachedQuery>::iterator entry_ptr;
+
+        std::list<CachedQuery> entries; // most recently used first
+        std::unordered_multimap<uint64_t, entry_ptr> byKey;
+        std::unordered_map<uint64_t, entry_ptr> byDirection;
+        row_type capacity;
+        int directionLevels;
+
+        static inline uint64_t fnv(const void* data, size_t bytes, uint64_t h = 14695981039346656037ULL) {
+            const unsigned char* p = static_cast<const unsigned char*> (data);
+            for (size_t i = 0; i < bytes; ++i) {
+                h ^= p[i];
+                h *= 1099511628211ULL;
+            }
+            return h;
+        }
+
+        inline uint64_t computeDirectionKey(const double* query, col_type colNum, double length) const {
+            uint64_t h = 14695981039346656037ULL;
+            for (col_type c = 0; c < colNum; ++c) {
+                int64_t step = std::llround(query[c] / length * directionLevels);
+                h = fnv(&step, sizeof (step), h);
+            }
+            return h;
+        }
+
+        inline void evict() {
+            entry_ptr last = std::prev(entries.end());
+
+            auto range = byKey.equal_range(last->key);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == last) {
+                    byKey.erase(it);
+                    break;
+                }
+            }
+            auto dir = byDirection.find(last->directionKey);
+            if (dir != byDirection.end() && dir->second == last)
+                byDirection.erase(dir);
+
+            entries.pop_back();
+        }
+
+        inline const CachedQuery* use(entry_ptr entry) {
+            entries.splice(entries.begin(), entries, entry);
+            return &(*entry);
+        }
+
+    public:
+        uint64_t hits, directionHits, misses;
+
+        inline QueryCache() : capacity(0), directionLevels(0), hits(0), directionHits(0), misses(0) {
+        }
+
+        // capacity: number of queries kept (0: no cache)
+        inline void init(row_type cap, int levels) {
+            clear();
+            capacity = cap;
+            directionLevels = levels;
+        }
+
+        inline bool enabled() const {
+            return capacity > 0;
+        }
+
+        inline bool byDirectionEnabled() const {
+            return directionLevels > 0;
+        }
+
+        inline void clear() {
+            entries.clear();
+            byKey.clear();
+            byDirection.clear();
+        }
+
+        static inline uint64_t hash(const double* query, col_type colNum) {
+            return fnv(query, sizeof (double) * colNum);
+        }
+
+        static inline double length(const double* query, col_type colNum) {
+            double sum = 0;
+            for (col_type c = 0; c < colNum; ++c) {
+                sum += query[c] * query[c];
+            }
+            return sqrt(sum);
+        }
+
+        // key: hash(query, colNum)
+        inline const CachedQuery* find(const double* query, col_type colNum, uint64_t key) {
+            auto range = byKey.equal_range(key);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (memcmp(it->second->query.data(), query, sizeof (double) * colNum) == 0) {
+                    hits++;
+                    return use(it->second);
+                }
+            }
+            return nullptr;
+        }
+
+        inline const CachedQuery* findDirection(const double* query, col_type colNum, double length) {
+            if (directionLevels <= 0 || length <= 0)
+                return nullptr;
+
+            auto it = byDirection.find(computeDirectionKey(query, colNum, length));
+            if (it == byDirection.end())
+                return nullptr;
+
+            directionHits++;
+            return use(it->second);
+        }
+
+        inline void store(const double* query, col_type colNum, uint64_t key, std::vector<QueueElement>& results) {
+            misses++;
+            if (capacity == 0)
+                return;
+
+            if (entries.size() >= capacity)
+                evict();
+
+            entries.emplace_front();
+            CachedQuery& entry = entries.front();
+            entry.query.assign(query, query + colNum);
+            entry.key = key;
+            entry.length = length(query, colNum);
+            entry.directionKey = (directionLevels > 0 && entry.length > 0 ? computeDirectionKey(query, colNum, entry.length) : 0);
+            entry.results.swap(results);
+
+            byKey.emplace(key, entries.begin());
+            if (directionLevels > 0 && entry.length > 0)
+                byDirection[entry.directionKey] = entries.begin();
+        }
+
+    };
+
+}
+
+#endif	/* QUERYCACHE_H */
@@ -16,22 +16,31 @@ namespace mips {
 
     typedef boost::shared_ptr< std::vector<MatItem> > xValues_ptr; // data: localTheta i: thread j: posInMatrix
 
+    const ta_size_type NO_ITEM = std::numeric_limits<ta_size_type>::max(); // placeholder in topk lists
+
     struct RetrievalArguments {
         std::vector<IntervalElement> intervals;
         std::vector<MatItem > results;
         std::vector<QueueElement> topkResults;
         std::vector<QueueElement> heap;
+        std::vector<row_type> topkOffsets; // per-query k: the list of the query at position q is topkResults[topkOffsets[q], topkOffsets[q+1]). Empty: k for all
 
 
         boost::dynamic_bitset<> done; // for LSH
         std::vector<float> sums; // for LSH
         std::vector<row_type> countsOfBlockValues; // for LSH
+        std::vector<QueueElement> searchQueue; // for ANNOY, HNSW: the nodes still to visit
+        std::vector<QueueElement> searchResults; // for HNSW: the best nodes found so far
+        std::vector<double> adcTables, adcCosines; // for PQ: inner products of the query with the centroids, approximate cosines
+        std::vector<double> queryBounds; // for dual-tree Tree: per query of the batch the score a result needs (DBL_MAX: skip)
 
         row_type* candidatesToVerify;
+        row_type scratchSize; // the bucket-sized scratch space fits buckets of this size
         row_type* cp_array; // for coord
         Candidate_incr* ext_cp_array; // for icoord
 
         std::vector<QueryBatch> queryBatches;
+        std::vector<std::pair<row_type, row_type> > maskedQueries; // batch and position of the queries that skip the current bucket (bucket bounds)
 
         std::vector<double> accum, hashval; // for L2AP
         double* hashlen; // for L2AP
@@ -39,6 +48,7 @@ namespace mips {
 
         // for tuning
         std::vector<double>* competitorMethod;
+        const CostModel* costModel; // tune by predicted instead of measured times (nullptr: measure)
 
 
         uint8_t* sketches; //for LSH no need to keep the actual sketches for the probe vectors. just keep the buckets with the ids
@@ -52,13 +62,17 @@ namespace mips {
         TANRAState* tanraState; //for TANRA
 
         TreeIndex* tree; //for Tree
+        SharedMinScore* sharedMinScore; // for L2AP, BLSH (shared by all threads)
+        const ItemFilter* itemFilter; // items excluded from the results (nullptr: none)
+        const QueryItemFilter* queryFilter; // per-query filter of queryFilterId (cached)
+        row_type queryFilterId;
         const col_type* listsQueue; // for ICOORD or COORD
 
         rg::Timer t, tunerTimer;
         rg::Random32 random;
 
         int threads, k;
-        int numTrees, search_k;
+        int numTrees, search_k, ef;
 
         double theta, t_b, R, epsilon, currEpsilonAppr; // for ICOORD or COORD
         double worstMinScore; // for L2AP, BLSH
@@ -87,14 +101,15 @@ namespace mips {
         colnum(colnum), comparisons(0), probeMatrix(probeMatrix), queryMatrix(queryMatrix), forCosine(forCosine), method(method),
         boundsTime(0), ipTime(0), scanTime(0), preprocessTime(0), filterTime(0), initializeListsTime(0), lengthTime(0), tanraState(nullptr),
         threads(1), worstMinScore(std::numeric_limits<double>::max()), hashwgt(nullptr), hashlen(nullptr), state(nullptr),
-        competitorMethod(nullptr), sketches(nullptr), isTARR(isTARR), cp_array(nullptr), ext_cp_array(nullptr), candidatesToVerify(nullptr) {
+        competitorMethod(nullptr), costModel(nullptr), sketches(nullptr), isTARR(isTARR), cp_array(nullptr), ext_cp_array(nullptr), candidatesToVerify(nullptr), scratchSize(0),
+        sharedMinScore(nullptr), itemFilter(nullptr), queryFilter(nullptr), queryFilterId(std::numeric_limits<row_type>::max()) {
             random = rg::Random32(123); // PSEUDO-RANDOM
         }
 
         inline void initializeBasics(
                 VectorMatrix& queryMatrix1, VectorMatrix& probeMatrix1,
                 LEMP_Method method1, double theta1, int k1,
-                int threads1, double R1, double epsilon1, int numTrees1, int sk, bool forCosine1 = true, bool isTARR1 = false) {
+                int threads1, double R1, double epsilon1, int numTrees1, int sk, bool forCosine1 = true, bool isTARR1 = false, int ef1 = HNSW_EF) {
 
             queryMatrix = &queryMatrix1;
             probeMatrix = &probeMatrix1;
@@ -111,6 +126,7 @@ namespace mips {
             isTARR = isTARR1;
             numTrees = numTrees1;
             search_k = sk;
+            ef = ef1;
 
 #if defined(RELATIVE_APPROX) || defined(HYBRID_APPROX)
             epsilon = epsilon / (1 - epsilon);
@@ -146,22 +162,109 @@ namespace mips {
             ipTime = 0;
             initializeListsTime = 0;
             comparisons = 0;
+            worstMinScore = std::numeric_limits<double>::max();
             results.clear();
         }
 
-        inline void moveTopkToHeap(row_type pos) {
-            std::copy(topkResults.begin() + pos, topkResults.begin() + pos + k, heap.begin());
+        inline void setItemFilter(const ItemFilter* filter) {
+            itemFilter = (filter != nullptr && !filter->empty() ? filter : nullptr);
+            queryFilter = nullptr;
+            queryFilterId = std::numeric_limits<row_type>::max();
+        }
+
+        // deleted or filtered out for the current query (queryId). Checked before the inner product is computed
+        inline bool isExcluded(row_type row) {
+            if (probeMatrix->isDeleted(row))
+                return true;
+            if (itemFilter == nullptr)
+                return false;
+
+            if (queryFilterId != queryId) {
+                queryFilter = itemFilter->forQuery(queryId);
+                queryFilterId = queryId;
+            }
+            return itemFilter->excludes(queryFilter, probeMatrix->getId(row));
+        }
+
+        // threshold for building indexes that are shared with the other threads (L2AP, BLSH)
+        inline double safeMinScore() const {
+            return (sharedMinScore != nullptr ? sharedMinScore->get() : worstMinScore);
+        }
+
+        // start of the topk list of the query at position queryPos in topkResults
+        inline row_type topkOffset(row_type queryPos) const {
+            return (topkOffsets.empty() ? queryPos * k : topkOffsets[queryPos]);
+        }
+
+        inline row_type topkSize(row_type queryPos) const {
+            return (topkOffsets.empty() ? k : topkOffsets[queryPos + 1] - topkOffsets[queryPos]);
+        }
+
+        /*
+         * Per-query k (kPerId[id] for the query with that id, at most k). Has to be called after the query matrix
+         * is set and before allocTopkResults. An empty vector restores k for all queries.
+         */
+        inline void setTopkSizes(const std::vector<int>& kPerId) {
+            topkOffsets.clear();
+            if (kPerId.empty())
+                return;
+
+            topkOffsets.resize(queryMatrix->rowNum + 1);
+            topkOffsets[0] = 0;
+            for (row_type q = 0; q < queryMatrix->rowNum; ++q) {
+                topkOffsets[q + 1] = topkOffsets[q] + kPerId[queryMatrix->getId(q)];
+            }
+        }
 
+        // the heap takes the size of the topk list of the query
+        inline void moveTopkToHeap(row_type queryPos) {
+            row_type pos = topkOffset(queryPos);
+            heap.resize(topkSize(queryPos));
+            std::copy(topkResults.begin() + pos, topkResults.begin() + pos + heap.size(), heap.begin());
         }
 
         inline void writeHeapToTopk(row_type queryPos) {
-            row_type p = queryPos*k;
+            row_type p = topkOffset(queryPos);
             std::copy(heap.begin(), heap.end(), topkResults.begin() + p);
         }
 
+        // Raises the minimum score of the topk list of a query to bound. Items below the bound are replaced by
+        // placeholders (id NO_ITEM) that are dropped when the lists of all threads are merged
+        inline void liftTopk(row_type queryPos, double bound) {
+            auto first = topkResults.begin() + topkOffset(queryPos);
+            auto last = first + topkSize(queryPos);
+
+            if (first->data >= bound)
+                return;
+
+            for (auto it = first; it != last; ++it) {
+                if (it->data < bound)
+                    *it = QueueElement(bound, NO_ITEM);
+            }
+            std::make_heap(first, last, std::greater<QueueElement>());
+        }
+
         inline void init(row_type maxProbeBucketSize) {
 
-            if ((method == LEMP_LI || method == LEMP_I) && ext_cp_array == nullptr) {
+            if (maxProbeBucketSize > scratchSize) { // a bucket has grown (incremental updates): reallocate below
+                delete[] ext_cp_array;
+                delete[] candidatesToVerify;
+                delete[] cp_array;
+                delete[] sketches;
+                ext_cp_array = nullptr;
+                candidatesToVerify = nullptr;
+                cp_array = nullptr;
+                sketches = nullptr;
+
+                if (method == LEMP_AP)
+                    accum.resize(maxProbeBucketSize, -1);
+                scratchSize = maxProbeBucketSize;
+            }
+
+            // LEMP_AUTO: the buckets may use any of its methods
+            bool autoMethod = (method == LEMP_AUTO);
+
+            if ((method == LEMP_LI || method == LEMP_I || autoMethod) && ext_cp_array == nullptr) {
                 ext_cp_array = new Candidate_incr[maxProbeBucketSize];
             }
 
@@ -170,7 +273,8 @@ namespace mips {
             if ((method == LEMP_LI || method == LEMP_I ||
                     method == LEMP_LC || method == LEMP_C ||
                     method == LEMP_AP || method == LEMP_LSH ||
-                    method == LEMP_BLSH) && candidatesToVerify == nullptr) {
+                    method == LEMP_BLSH || method == LEMP_ANNOY || method == LEMP_HNSW ||
+                    method == LEMP_PQ || autoMethod) && candidatesToVerify == nullptr) {
                 candidatesToVerify = new row_type[maxProbeBucketSize];
             }
 
@@ -181,11 +285,11 @@ namespace mips {
                 hashwgt = new double[colnum];
             }
 
-            if ((method == LEMP_LC || method == LEMP_C) && cp_array == nullptr) {
+            if ((method == LEMP_LC || method == LEMP_C || autoMethod) && cp_array == nullptr) {
                 cp_array = new row_type[maxProbeBucketSize];
             }
 
-            if (method == LEMP_TA && state == nullptr) {
+            if ((method == LEMP_TA || autoMethod) && state == nullptr) {
                 if (isTARR) {
                     state = new TAStateRR(colnum);
                 } else {
@@ -204,6 +308,10 @@ namespace mips {
                     candidatesToVerify = new row_type[maxProbeBucketSize];
             }
 
+            if ((method == LEMP_ANNOY || method == LEMP_HNSW) && done.size() < maxProbeBucketSize) {
+                done.resize(maxProbeBucketSize);
+            }
+
             if ((method == LEMP_LSH || method == LEMP_BLSH) && sketches == nullptr) {
 
                 done.resize(maxProbeBucketSize);
@@ -219,8 +327,9 @@ namespace mips {
 
         inline void allocTopkResults() {
             heap.resize(k);
-            if (topkResults.size() < queryMatrix->rowNum * k)
-                topkResults.resize(queryMatrix->rowNum * k);
+            row_type size = (topkOffsets.empty() ? queryMatrix->rowNum * k : topkOffsets.back());
+            if (topkResults.size() < size)
+                topkResults.resize(size);
         }
 
         inline void setIntervals(col_type lists) {
@@ -254,13 +363,14 @@ namespace mips {
             results.clear();
             results.reserve(topkResults.size());
 
-            row_type query = 0;
-            for (long i = 0; i < topkResults.size() && query < queryMatrix->rowNum; i += k) {
-                row_type queryId = queryMatrix->getId(query);
-                for (int j = 0; j < k; ++j) {
-                    results.push_back(MatItem(topkResults[i + j].data, queryId, topkResults[i + j].id));
+            for (auto& queryBatch : queryBatches) {
+                for (row_type query = queryBatch.startPos; query < queryBatch.endPos; ++query) {
+                    row_type queryId = queryMatrix->getId(query);
+                    for (long i = topkOffset(query); i < (long) topkOffset(query) + topkSize(query); ++i) {
+                        if (topkResults[i].id != NO_ITEM)
+                            results.push_back(MatItem(topkResults[i].data, queryId, topkResults[i].id));
+                    }
                 }
-                query++;
             }
         }
 
@@ -0,0 +1,85 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   SampleSizer.h
+ */
+
+#ifndef SAMPLESIZER_H
+#define	SAMPLESIZER_H
+
+#include <algorithm>
+#include <cmath>
+
+namespace mips {
+
+    /*
+     * Size of a tuning sample, chosen while it is drawn: the sample grows until the mean cost of its queries is
+     * known within a relative error (z * s / sqrt(n) <= error * mean, z for SAMPLE_CONFIDENCE) and the cut-off
+     * decision made on it is therefore stable. It never grows beyond maxSize or beyond what the tuning is
+     * predicted to spend within the budget (each sample query runs about `passes` times during tuning).
+     */
+    class SampleSizer {
+        double sum, sumSq;
+        row_type n;
+        row_type minSize, maxSize;
+        double error, budget, passes;
+
+    public:
+
+        // error <= 0: fixed size (maxSize), budget <= 0: no budget (nanos)
+        inline SampleSizer(row_type minSize, row_type maxSize, double error, double budget, double passes) :
+        sum(0), sumSq(0), n(0), minSize(std::min(minSize, maxSize)), maxSize(maxSize), error(error), budget(budget), passes(passes) {
+        }
+
+        inline void add(double cost) {
+            sum += cost;
+            sumSq += cost * cost;
+            n++;
+        }
+
+        inline row_type size() const {
+            return n;
+        }
+
+        // sample queries needed, given the costs so far (at least the ones measured)
+        inline row_type target() const {
+            if (error <= 0)
+                return maxSize;
+            if (n < minSize)
+                return minSize;
+
+            double mean = sum / n;
+            if (mean <= 0)
+                return n;
+
+            double variance = std::max(0.0, (sumSq - n * mean * mean) / std::max<row_type>(1, n - 1));
+            double needed = std::ceil(variance * SAMPLE_CONFIDENCE * SAMPLE_CONFIDENCE / (error * error * mean * mean));
+
+            if (budget > 0)
+                needed = std::min(needed, budget / (passes * mean));
+
+            row_type size = (row_type) std::min<double>(maxSize, std::max<double>(needed, minSize));
+            return std::max(size, n);
+        }
+
+        inline bool done() const {
+            return n >= target();
+        }
+
+    };
+
+}
+
+#endif	/* SAMPLESIZER_H */
@@ -0,0 +1,158 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   ShardChannel.h
+ */
+
+#ifndef SHARDCHANNEL_H
+#define	SHARDCHANNEL_H
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+namespace mips {
+
+    enum Shard_Command {
+        SHARD_TOPK = 0,
+        SHARD_ABOVE_THETA = 1,
+        SHARD_QUIT = 2
+    };
+
+    enum Shard_Partition {
+        SHARD_BY_LENGTH = 0, // contiguous ranges of the probe vectors sorted by length (longest first)
+        SHARD_BY_HASH = 1
+    };
+
+    /*
+     * One end of a local stream socket between the coordinator and a shard worker. Messages are plain memory
+     * images: both ends are the same binary on the same host.
+     */
+    class ShardChannel {
+        int fd;
+
+        inline void writeAll(const void* buf, size_t bytes) {
+            const char* p = static_cast<const char*> (buf);
+
+            while (bytes > 0) {
+                ssize_t n = ::send(fd, p, bytes, MSG_NOSIGNAL); // a dead peer is an error, not a signal
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    perror("[ERROR] Shard channel write");
+                    exit(1);
+                }
+                p += n;
+                bytes -= n;
+            }
+        }
+
+        inline void readAll(void* buf, size_t bytes) {
+            char* p = static_cast<char*> (buf);
+
+            while (bytes > 0) {
+                ssize_t n = read(fd, p, bytes);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    std::cerr << "[ERROR] Shard channel closed unexpectedly" << std::endl;
+                    exit(1);
+                }
+                p += n;
+                bytes -= n;
+            }
+        }
+
+    public:
+
+        inline ShardChannel() : fd(-1) {
+        }
+
+        inline explicit ShardChannel(int fd) : fd(fd) {
+        }
+
+        // creates a connected pair: one end for the coordinator, one for the worker
+        static inline void createPair(ShardChannel& coordinatorEnd, ShardChannel& workerEnd) {
+            int fds[2];
+
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+                perror("[ERROR] socketpair");
+                exit(1);
+            }
+            coordinatorEnd.fd = fds[0];
+            workerEnd.fd = fds[1];
+        }
+
+        inline void close() {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+        template<typename T>
+        inline void send(const T& value) {
+            writeAll(&value, sizeof (T));
+        }
+
+        template<typename T>
+        inline T receive() {
+            T value;
+            readAll(&value, sizeof (T));
+            return value;
+        }
+
+        template<typename T>
+        inline void sendVector(const std::vector<T>& v) {
+            send<uint64_t>(v.size());
+            if (!v.empty())
+                writeAll(v.data(), sizeof (T) * v.size());
+        }
+
+        template<typename T>
+        inline void receiveVector(std::vector<T>& v) {
+            v.resize(receive<uint64_t>());
+            if (!v.empty())
+                readAll(v.data(), sizeof (T) * v.size());
+        }
+
+        // rows [start, end) of the matrix, without lengths or padding
+        inline void sendMatrix(const VectorMatrix& matrix, row_type start, row_type end) {
+            send<row_type>(end - start);
+            send<col_type>(matrix.colNum);
+            for (row_type i = start; i < end; ++i) {
+                writeAll(matrix.getMatrixRowPtr(i), sizeof (double) * matrix.colNum);
+            }
+        }
+
+        inline void receiveMatrix(VectorMatrix& matrix) {
+            row_type rowNum = receive<row_type>();
+            col_type colNum = receive<col_type>();
+
+            matrix.initializeBasics(colNum, rowNum, false);
+            for (row_type i = 0; i < rowNum; ++i) {
+                readAll(matrix.getMatrixRowPtr(i), sizeof (double) * colNum);
+                matrix.setLengthInData(i, 1);
+            }
+        }
+
+    };
+
+}
+
+#endif	/* SHARDCHANNEL_H */
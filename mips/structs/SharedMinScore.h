@@ -0,0 +1,135 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   SharedMinScore.h
+ */
+
+#ifndef SHAREDMINSCORE_H
+#define	SHAREDMINSCORE_H
+
+#include <atomic>
+#include <limits>
+
+namespace mips {
+
+    /*
+     * Lower bound of the top-k minimum scores over the queries of all threads (needed by L2AP, BLSH).
+     * Each thread publishes the worst top-k minimum score of its own queries in its own slot.
+     * Since the top-k minimum score of a query can only grow from bucket to bucket, a published value stays valid
+     * for all following buckets. Hence, slots only grow and their minimum is a safe threshold for building an index
+     * that will be used by all threads, without any thread having to wait for the others.
+     */
+    class SharedMinScore {
+        std::atomic<double>* slots; // one slot per thread, PADDING apart to avoid false sharing
+        int threads;
+
+    public:
+
+        inline SharedMinScore() : slots(nullptr), threads(0) {
+        }
+
+        inline ~SharedMinScore() {
+            if (slots != nullptr)
+                delete[] slots;
+        }
+
+        inline void init(int numThreads) {
+            if (threads != numThreads) {
+                if (slots != nullptr)
+                    delete[] slots;
+                slots = new std::atomic<double>[numThreads * PADDING];
+                threads = numThreads;
+            }
+
+            // nothing published yet: no bound at all
+            for (int t = 0; t < threads; ++t) {
+                slots[t * PADDING].store(-std::numeric_limits<double>::max(), std::memory_order_relaxed);
+            }
+        }
+
+        // monotone maximum on the slot of the thread
+        inline void publish(int tid, double minScore) {
+            std::atomic<double>& slot = slots[tid * PADDING];
+            double current = slot.load(std::memory_order_relaxed);
+
+            while (current < minScore &&
+                    !slot.compare_exchange_weak(current, minScore, std::memory_order_release, std::memory_order_relaxed)) {
+            }
+        }
+
+        inline double get() const {
+            double bound = std::numeric_limits<double>::max();
+
+            for (int t = 0; t < threads; ++t) {
+                double value = slots[t * PADDING].load(std::memory_order_acquire);
+                if (value < bound)
+                    bound = value;
+            }
+            return bound;
+        }
+
+    };
+
+    /*
+     * Per-query lower bound of the top-k minimum score, for threads that work on the same queries but on different
+     * probe buckets. A thread that holds k items with a score of at least x for a query may raise the bound of that
+     * query to x. Any other thread can then ignore everything below the bound.
+     */
+    class SharedTopkBounds {
+        std::atomic<double>* bounds; // one bound per query, PADDING apart to avoid false sharing
+        row_type queries, capacity;
+
+    public:
+
+        inline SharedTopkBounds() : bounds(nullptr), queries(0), capacity(0) {
+        }
+
+        inline ~SharedTopkBounds() {
+            if (bounds != nullptr)
+                delete[] bounds;
+        }
+
+        inline void init(row_type numQueries) {
+            if (capacity < numQueries) {
+                if (bounds != nullptr)
+                    delete[] bounds;
+                bounds = new std::atomic<double>[numQueries * PADDING];
+                capacity = numQueries;
+            }
+            queries = numQueries;
+
+            for (row_type q = 0; q < queries; ++q) {
+                bounds[q * PADDING].store(-std::numeric_limits<double>::max(), std::memory_order_relaxed);
+            }
+        }
+
+        inline void raise(row_type queryPos, double minScore) {
+            std::atomic<double>& bound = bounds[queryPos * PADDING];
+            double current = bound.load(std::memory_order_relaxed);
+
+            while (current < minScore &&
+                    !bound.compare_exchange_weak(current, minScore, std::memory_order_release, std::memory_order_relaxed)) {
+            }
+        }
+
+        inline double get(row_type queryPos) const {
+            return bounds[queryPos * PADDING].load(std::memory_order_acquire);
+        }
+
+    };
+
+}
+
+#endif	/* SHAREDMINSCORE_H */
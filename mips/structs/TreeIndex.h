@@ -39,35 +39,57 @@ namespace mips {
     class TreeIndex : public Index {
         double base;
         const arma::mat dataset; //dummy
+        bool bulkBuild; // sort the points by distance once instead of partitioning them on every level
 
     public:
 
         TreeType* tree;
 
-        inline TreeIndex() : base(1.3), tree(0) {
+        inline TreeIndex(bool bulkBuild = false) : base(1.3), bulkBuild(bulkBuild), tree(0) {
         }
 
         inline ~TreeIndex() {
-            if (!tree) {
+            if (tree) {
                 delete tree;
             }
         }
 
-        inline void initializeTree(VectorMatrix& matrix, int threads, ta_size_type start = 0, ta_size_type end = 0) {
-            omp_set_lock(&writelock);
+        /*
+         * Non-blocking. The first caller builds the tree. The others return false immediately,
+         * so that they can serve their queries differently until the tree is ready
+         */
+        inline bool tryInitializeTree(VectorMatrix& matrix, int threads, ta_size_type start = 0, ta_size_type end = 0) {
+
+            if (isInitialized())
+                return true;
 
-            if (!initialized) {
+            if (claim()) {
                 if (start == end) {
                     start = 0;
                     end = matrix.rowNum;
                 }
 
                 // now build the tree
-                tree = new TreeType(dataset, threads, base, &matrix, start, end);
+                tree = new TreeType(dataset, threads, base, &matrix, start, end, NULL, bulkBuild);
+
+                publish();
+                return true;
+            }
+            return false;
+        }
+
+        inline void initializeTree(VectorMatrix& matrix, int threads, ta_size_type start = 0, ta_size_type end = 0) {
+
+            if (tryInitializeTree(matrix, threads, start, end))
+                return;
 
-                initialized = true;
+            rg::Timer t;
+            t.start();
+            while (!isInitialized()) {
+                std::this_thread::yield();
             }
-            omp_unset_lock(&writelock);
+            t.stop();
+            addWaitTime(t.elapsedTime().nanos());
         }
 
     };
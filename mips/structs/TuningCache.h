@@ -0,0 +1,217 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   TuningCache.h
+ */
+
+#ifndef TUNINGCACHE_H
+#define	TUNINGCACHE_H
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+namespace mips {
+
+    /*
+     * Tuned parameters of one probe bucket. t_b is a cut-off on the local threshold theta_b(q), not on theta, and
+     * numLists does not depend on theta or k. Hence, both stay valid for other values of theta and k as long as the
+     * bucket (and the query distribution) is the same. [minTheta, maxTheta] is the range of theta_b(q) of the sample
+     * the parameters were tuned with.
+     */
+    struct TuningEntry {
+        bool topk;
+        row_type startPos, endPos;
+        double maxLength;
+        col_type numLists;
+        double t_b;
+        double minTheta, maxTheta;
+    };
+
+    /*
+     * Tuned parameters of the probe buckets of earlier runs, separately for Above-theta and Row-Top-k (the retrievers
+     * differ). A bucket is identified by its range in the sorted probe matrix and its maximum length, so entries of
+     * a different bucketization (e.g., after a rebalance) are simply not found.
+     */
+    class TuningCache {
+        std::vector<TuningEntry> entries;
+        LEMP_Method method;
+        bool hasMethod;
+
+        inline bool matches(const TuningEntry& entry, bool topk, const ProbeBucket& bucket) const {
+            return entry.topk == topk && entry.startPos == bucket.startPos && entry.endPos == bucket.endPos &&
+                    fabs(entry.maxLength - bucket.normL2.second) <= 1e-9 * bucket.normL2.second;
+        }
+
+    public:
+
+        inline TuningCache() : hasMethod(false) {
+        }
+
+        // the parameters of one method are useless for another
+        inline void setMethod(LEMP_Method m) {
+            if (hasMethod && method != m)
+                entries.clear();
+            method = m;
+            hasMethod = true;
+        }
+
+        inline void clear() {
+            entries.clear();
+        }
+
+        inline row_type size() const {
+            return entries.size();
+        }
+
+        inline const TuningEntry* find(bool topk, const ProbeBucket& bucket) const {
+            for (auto& entry : entries) {
+                if (matches(entry, topk, bucket))
+                    return &entry;
+            }
+            return nullptr;
+        }
+
+        // keeps the parameters the bucket was just tuned with (needs the sample in xValues)
+        inline void store(bool topk, const ProbeBucket& bucket) {
+            if (bucket.xValues == nullptr || bucket.xValues->empty())
+                return;
+
+            TuningEntry entry;
+            entry.topk = topk;
+            entry.startPos = bucket.startPos;
+            entry.endPos = bucket.endPos;
+            entry.maxLength = bucket.normL2.second;
+            entry.numLists = bucket.numLists;
+            entry.t_b = bucket.t_b;
+            entry.minTheta = bucket.xValues->front().result; // xValues are sorted
+            entry.maxTheta = bucket.xValues->back().result;
+
+            for (auto& old : entries) {
+                if (matches(old, topk, bucket)) {
+                    old = entry;
+                    return;
+                }
+            }
+            entries.push_back(entry);
+        }
+
+        // fraction of the current sample of the bucket whose theta_b(q) lies in the range the entry was tuned for
+        inline double coverage(const TuningEntry& entry, const ProbeBucket& bucket) const {
+            if (bucket.xValues == nullptr || bucket.xValues->empty())
+                return 1;
+
+            row_type inside = 0;
+            for (auto& x : *bucket.xValues) {
+                if (x.result >= entry.minTheta && x.result <= entry.maxTheta)
+                    inside++;
+            }
+            return (double) inside / bucket.xValues->size();
+        }
+
+        /*
+         * For a bucket without an entry: t_b is interpolated linearly (in the maximum length) between the entries of
+         * the closest longer and the closest shorter bucket, numLists is taken from the closer one. False if the
+         * bucket is not enclosed by entries.
+         */
+        inline bool interpolate(bool topk, const ProbeBucket& bucket, col_type& numLists, double& t_b) const {
+            const TuningEntry* longer = nullptr;
+            const TuningEntry* shorter = nullptr;
+            double length = bucket.normL2.second;
+
+            for (auto& entry : entries) {
+                if (entry.topk != topk)
+                    continue;
+                if (entry.maxLength >= length && (longer == nullptr || entry.maxLength < longer->maxLength))
+                    longer = &entry;
+                if (entry.maxLength <= length && (shorter == nullptr || entry.maxLength > shorter->maxLength))
+                    shorter = &entry;
+            }
+
+            if (longer == nullptr || shorter == nullptr)
+                return false;
+
+            double span = longer->maxLength - shorter->maxLength;
+            double w = (span > 0 ? (longer->maxLength - length) / span : 0); // 0: at longer, 1: at shorter
+
+            t_b = (1 - w) * longer->t_b + w * shorter->t_b;
+            numLists = (w <= 0.5 ? longer->numLists : shorter->numLists);
+            return true;
+        }
+
+        /*
+         * Plain text: a header line "LEMP_TUNING <method> <entries>" followed by one line per entry
+         * (topk startPos endPos maxLength numLists t_b minTheta maxTheta)
+         */
+        inline void save(const std::string& fileName) const {
+            std::ofstream out(fileName.c_str());
+
+            if (!out.is_open()) {
+                std::cout << "[WARNING] Cannot write the tuning parameters to " << fileName << std::endl;
+                return;
+            }
+
+            out << std::setprecision(17);
+            out << "LEMP_TUNING " << (int) method << " " << entries.size() << std::endl;
+            for (auto& e : entries) {
+                out << e.topk << " " << e.startPos << " " << e.endPos << " " << e.maxLength << " " << (int) e.numLists << " "
+                        << e.t_b << " " << e.minTheta << " " << e.maxTheta << std::endl;
+            }
+        }
+
+        // false if the file does not exist or belongs to another method
+        inline bool load(const std::string& fileName) {
+            std::ifstream in(fileName.c_str());
+
+            if (!in.is_open())
+                return false;
+
+            std::string magic;
+            int fileMethod;
+            row_type count;
+            in >> magic >> fileMethod >> count;
+
+            if (!in || magic != "LEMP_TUNING") {
+                std::cout << "[WARNING] " << fileName << " does not contain tuning parameters" << std::endl;
+                return false;
+            }
+
+            if (hasMethod && fileMethod != method) {
+                std::cout << "[WARNING] The tuning parameters in " << fileName << " belong to another method. Ignoring them" << std::endl;
+                return false;
+            }
+
+            entries.clear();
+            for (row_type i = 0; i < count; ++i) {
+                TuningEntry e;
+                int lists;
+                in >> e.topk >> e.startPos >> e.endPos >> e.maxLength >> lists >> e.t_b >> e.minTheta >> e.maxTheta;
+                if (!in) {
+                    std::cout << "[WARNING] " << fileName << " is truncated. Read " << i << " of " << count << " entries" << std::endl;
+                    break;
+                }
+                e.numLists = lists;
+                entries.push_back(e);
+            }
+            return true;
+        }
+
+    };
+
+}
+
+#endif	/* TUNINGCACHE_H */
@@ -99,6 +99,26 @@ class VectorMatrix {
   row_type offset;
   col_type lengthOffset;
   int sizeDiv2; // for simd instruction
+  row_type capacity; // rows that fit into data
+  std::vector<char> deleted; // tombstones (empty if no row was deleted)
+
+  // row i starts at data[i * offset] (padding, length, coordinates, padding)
+  inline void growCapacity(row_type rows) {
+    double *newData;
+    int res = posix_memalign((void **)&(newData), 16,
+                             sizeof(double) * offset * rows);
+
+    if (res != 0) {
+      std::cout << "[ERROR] Problem with allocating memory for VectorMatrix!"
+                << std::endl;
+      exit(1);
+    }
+    std::memcpy((void *)newData, (void *)data,
+                sizeof(double) * offset * rowNum);
+    free(data);
+    data = newData;
+    capacity = rows;
+  }
 
   inline void zeroOutLastPadding() {
     for (row_type i = 0; i < rowNum; ++i) {
@@ -137,8 +157,8 @@ class VectorMatrix {
           << "[WARNING] You have " << rowNum
           << " vectors and the tuner will try to take a sample of at least  "
           << LOWER_LIMIT_PER_BUCKET
-          << " vectors per probe bucket. Perhaps you want to change the "
-             "parameter LOWER_LIMIT_PER_BUCKET in Definitions.h and recompile!"
+          << " vectors per probe bucket. Perhaps you want to lower the "
+             "minimum tuning sample (LempArguments::sampleMin)!"
           << std::endl;
     }
 
@@ -258,18 +278,19 @@ public:
 
   inline VectorMatrix()
       : data(nullptr), shuffled(false), normalized(false),
-        lengthOffset(1) { ////////////////////// 1 is for padding
+        lengthOffset(1), capacity(0) { ////////////////////// 1 is for padding
   }
 
   inline VectorMatrix(double *ptr, col_type _colNum, row_type _rowNum)
       : data(ptr), colNum(_colNum), rowNum(_rowNum), shuffled(false),
-        normalized(false) {}
-  inline VectorMatrix(const std::vector<std::vector<double> > m)
-      : data(nullptr), shuffled(false), normalized(false), lengthOffset(1) {
+        normalized(false), capacity(_rowNum) {}
+  inline VectorMatrix(const std::vector<std::vector<double> > m, int threads = 1)
+      : data(nullptr), shuffled(false), normalized(false), lengthOffset(1),
+        capacity(0) {
 
     initializeBasics(m[0].size(), m.size(), false);
 
-#pragma omp parallel for schedule(static, 1000)
+#pragma omp parallel for schedule(static, 1000) num_threads(threads)
     for (int i = 0; i < rowNum; ++i) {
       double *v1 = getMatrixRowPtr(i);
       const double *v2 = &m[i][0];
@@ -298,6 +319,8 @@ public:
     offset = r.offset;
     lengthOffset = r.lengthOffset;
     sizeDiv2 = r.sizeDiv2;
+    capacity = r.rowNum;
+    deleted = r.deleted;
 
     lengthInfo.clear();
     lengthInfo.reserve(r.lengthInfo.size());
@@ -363,9 +386,15 @@ public:
       offset++;
 
     rowNum = numOfRows;
+    capacity = rowNum;
+    deleted.clear();
 
     normalized = norm;
     lengthInfo.resize(rowNum);
+    if (data != nullptr) {
+      free(data);
+      data = nullptr;
+    }
     int res =
         posix_memalign((void **)&(data), 16, sizeof(double) * offset * rowNum);
 
@@ -399,11 +428,12 @@ public:
     }
   }
 
-  inline void init(const VectorMatrix &matrix, bool sort, bool ignoreLength) {
+  // threads: the team size of the copy (the caller's thread count, not the OpenMP default)
+  inline void init(const VectorMatrix &matrix, bool sort, bool ignoreLength, int threads = 1) {
     initializeBasics(matrix.colNum, matrix.rowNum, true);
 
     if (ignoreLength) {
-#pragma omp parallel for schedule(static, 1000)
+#pragma omp parallel for schedule(static, 1000) num_threads(threads)
       // get lengths
       for (int i = 0; i < rowNum; ++i) {
         const double *vec = matrix.getMatrixRowPtr(i);
@@ -416,7 +446,7 @@ public:
       }
 
     } else {
-#pragma omp parallel for schedule(static, 1000)
+#pragma omp parallel for schedule(static, 1000) num_threads(threads)
       for (int i = 0; i < rowNum; ++i) {
         const double *vec = matrix.getMatrixRowPtr(i);
         double len = calculateLength(vec, colNum);
@@ -429,7 +459,7 @@ public:
                   std::greater<QueueElement>());
       }
 
-#pragma omp parallel for schedule(static, 1000)
+#pragma omp parallel for schedule(static, 1000) num_threads(threads)
       for (int i = 0; i < rowNum; ++i) {
         setLengthInData(i, lengthInfo[i].data);
         double x = 1 / lengthInfo[i].data;
@@ -451,6 +481,95 @@ public:
     }
   }
 
+  /*
+   * Inserts vec (not normalized) with the given id as row pos of a normalized
+   * matrix. The rows pos, pos + 1, ... move down by one. The space grows by 1/8
+   * when it is exhausted, so row pointers are only valid until the next insert
+   */
+  inline void insertRow(row_type pos, const double *vec, row_type id) {
+    if (rowNum == capacity) {
+      growCapacity(capacity + std::max<row_type>(capacity / 8, 1024));
+    }
+
+    std::memmove((void *)&data[(pos + 1) * offset], (void *)&data[pos * offset],
+                 sizeof(double) * offset * (rowNum - pos));
+    rowNum++;
+
+    double len = calculateLength(vec, colNum);
+    data[pos * offset] = 0;
+    data[(pos + 1) * offset - 1] = 0; // the last padding
+    setLengthInData(pos, len);
+    scaleAndCopy(getMatrixRowPtr(pos), vec, 1 / len, colNum);
+
+    lengthInfo.insert(lengthInfo.begin() + pos, QueueElement(len, id));
+    if (!deleted.empty()) {
+      deleted.insert(deleted.begin() + pos, 0);
+    }
+  }
+
+  // the row stays in place, but retrieval ignores it until it is compacted away
+  inline void markDeleted(row_type row) {
+    if (deleted.empty()) {
+      deleted.assign(rowNum, 0);
+    }
+    deleted[row] = 1;
+  }
+
+  inline bool isDeleted(row_type row) const {
+    return !deleted.empty() && deleted[row];
+  }
+
+  /*
+   * The rows [0, sortedRows) and [sortedRows, rowNum) are each sorted by
+   * decreasing length. Drops the deleted rows and merges the two parts in place
+   * into one sorted matrix
+   */
+  inline void compactAndMerge(row_type sortedRows) {
+    // the second part is the small one. Set it aside
+    std::vector<double> tail;
+    std::vector<QueueElement> tailInfo;
+    for (row_type i = sortedRows; i < rowNum; ++i) {
+      if (isDeleted(i))
+        continue;
+      tail.insert(tail.end(), &data[i * offset], &data[(i + 1) * offset]);
+      tailInfo.push_back(lengthInfo[i]);
+    }
+
+    row_type head = 0;
+    for (row_type i = 0; i < sortedRows; ++i) {
+      if (isDeleted(i))
+        continue;
+      if (head != i) {
+        std::memcpy((void *)&data[head * offset], (void *)&data[i * offset],
+                    sizeof(double) * offset);
+        lengthInfo[head] = lengthInfo[i];
+      }
+      head++;
+    }
+
+    // merge from the back: the output never overtakes the unread rows
+    row_type t = tailInfo.size();
+    rowNum = head + t;
+    lengthInfo.resize(rowNum);
+
+    for (row_type out = rowNum; t > 0;) {
+      --out;
+      if (head > 0 && std::greater<QueueElement>()(tailInfo[t - 1],
+                                                   lengthInfo[head - 1])) {
+        --head;
+        std::memcpy((void *)&data[out * offset], (void *)&data[head * offset],
+                    sizeof(double) * offset);
+        lengthInfo[out] = lengthInfo[head];
+      } else {
+        --t;
+        std::memcpy((void *)&data[out * offset], (void *)&tail[t * offset],
+                    sizeof(double) * offset);
+        lengthInfo[out] = tailInfo[t];
+      }
+    }
+    deleted.clear();
+  }
+
   inline double *getMatrixRowPtr(row_type row)
       const { // the row starts from pos 1. Do ptr[-1] to get the length
     return &data[row * offset + 1 + lengthOffset];
@@ -586,8 +705,6 @@ inline void splitMatrices(const VectorMatrix &originalMatrix,
       scaleAndCopy(d1, vec, 1, originalMatrix.colNum);
     }
   } else {
-    omp_set_num_threads(threads);
-
     std::vector<row_type> permuteVector(originalMatrix.rowNum);
     std::iota(permuteVector.begin(), permuteVector.end(), 0);
 
@@ -596,7 +713,7 @@ inline void splitMatrices(const VectorMatrix &originalMatrix,
     std::vector<row_type> blockOffsets;
     computeDefaultBlockOffsets(permuteVector.size(), threads, blockOffsets);
 
-#pragma omp parallel
+#pragma omp parallel num_threads(threads)
     {
       row_type tid = omp_get_thread_num();
 
@@ -676,8 +793,6 @@ inline void initializeMatrices(const VectorMatrix &originalMatrix,
 
   } else { // multiple threads
 
-    omp_set_num_threads(threads);
-
     std::vector<row_type> permuteVector(originalMatrix.rowNum);
     std::iota(permuteVector.begin(), permuteVector.end(), 0);
 
@@ -686,7 +801,7 @@ inline void initializeMatrices(const VectorMatrix &originalMatrix,
     std::vector<row_type> blockOffsets;
     computeDefaultBlockOffsets(permuteVector.size(), threads, blockOffsets);
 
-#pragma omp parallel
+#pragma omp parallel num_threads(threads)
     {
       row_type tid = omp_get_thread_num();
 
@@ -751,7 +866,7 @@ void calculateAPneededForQuery(std::vector<VectorMatrix> &matrices,
 
   global_cweights.resize(matrices[0].colNum, 0);
 
-#pragma omp parallel
+#pragma omp parallel num_threads(matrices.size())
   {
 
     row_type tid = omp_get_thread_num();
@@ -0,0 +1,113 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * File:   WorkerPool.h
+ */
+
+#ifndef WORKERPOOL_H
+#define	WORKERPOOL_H
+
+#include <omp.h>
+#include <sched.h>
+#include <pthread.h>
+#include <vector>
+#include <iostream>
+
+namespace mips {
+
+    /*
+     * The team of threads of an algorithm. Instead of changing the process-global team size with omp_set_num_threads,
+     * every parallel region asks for its size explicitly (num_threads clause). As long as the size does not change
+     * the OpenMP runtime keeps the same threads alive between regions, so successive runs pay no team spin-up.
+     * Optionally, thread tid of each team is pinned to the tid-th core the process may run on. Per-thread scratch
+     * allocated by thread tid inside a parallel region then stays on the core of that thread across runs.
+     */
+    class WorkerPool {
+        int threads;
+        bool pinThreads;
+        bool started;
+        std::vector<int> cores; // cores available to the process
+
+        inline void pinCurrentThread(int tid) const {
+#ifdef __linux__
+            if (cores.empty())
+                return;
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cores[tid % cores.size()], &set);
+            pthread_setaffinity_np(pthread_self(), sizeof (cpu_set_t), &set);
+#endif
+        }
+
+    public:
+
+        inline WorkerPool() : threads(1), pinThreads(false), started(false) {
+        }
+
+        inline void init(int numThreads, bool pin = false) {
+            threads = (numThreads > 0 ? numThreads : 1);
+            pinThreads = pin;
+            started = false;
+            cores.clear();
+
+            if (!pinThreads)
+                return;
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof (cpu_set_t), &set) == 0) {
+                for (int c = 0; c < CPU_SETSIZE; ++c) {
+                    if (CPU_ISSET(c, &set))
+                        cores.push_back(c);
+                }
+            }
+
+            if (cores.size() < (size_t) threads) {
+                std::cout << "[WARNING] " << threads << " threads share " << cores.size() << " core(s)" << std::endl;
+            }
+#else
+            std::cout << "[WARNING] Pinning threads is supported only on Linux" << std::endl;
+#endif
+        }
+
+        inline int size() const {
+            return threads;
+        }
+
+        inline bool isPinned() const {
+            return pinThreads;
+        }
+
+        /*
+         * Creates (and pins) the team once. Later calls return immediately
+         */
+        inline void start() {
+            if (started)
+                return;
+
+#pragma omp parallel num_threads(threads)
+            {
+                if (pinThreads)
+                    pinCurrentThread(omp_get_thread_num());
+            }
+            started = true;
+        }
+
+    };
+
+}
+
+#endif	/* WORKERPOOL_H */
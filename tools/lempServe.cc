@@ -0,0 +1,568 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*
+ * Query-serving daemon. Loads the probe matrix once, prepares LEMP for online retrieval and answers queries that
+ * arrive over a Unix domain socket. Queries of concurrent requests are grouped into micro-batches.
+ *
+ * Protocol (native byte order, both sides on the same host):
+ *   request:  uint32 type (0: queries, 1: statistics, 2: queries with own k or theta), uint32 n,
+ *             then (type 2 only) one double: k (top-k) or theta (above-theta, positive) for all queries of the request,
+ *             then n * r doubles (types 0 and 2)
+ *   response to queries: uint64 count, then count records { double score; uint32 query; uint32 item; }
+ *             where query is the position of the query within its request
+ *   response to statistics: uint64 length, then length characters of text
+ *   A request with more than MAX_REQUEST_BATCHES * maxBatch queries is refused: the connection is closed
+ *   Requests may be pipelined. The responses of a connection come in the order of its requests
+ */
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <mips/mips.h>
+
+using namespace std;
+using namespace mips;
+using namespace boost::program_options;
+
+typedef std::chrono::steady_clock Clock;
+
+enum Request_Type {
+    REQUEST_QUERIES = 0,
+    REQUEST_STATS = 1,
+    REQUEST_QUERIES_WITH_PARAMETER = 2
+};
+
+const row_type MAX_REQUEST_BATCHES = 64; // the largest request: this many micro-batches of maxBatch queries
+
+struct ServeResult {
+    double score;
+    uint32_t query;
+    uint32_t item;
+};
+
+/*
+ * A client connection. Only the engine thread writes responses, in the order of the requests of the connection.
+ * The socket is closed when the last pending request of the connection is answered.
+ */
+struct Connection {
+    int fd;
+    std::mutex writeLock;
+
+    Connection(int fd) : fd(fd) {
+    }
+
+    ~Connection() {
+        close(fd);
+    }
+
+    bool readAll(void* buf, size_t bytes) {
+        char* p = static_cast<char*> (buf);
+        while (bytes > 0) {
+            ssize_t n = read(fd, p, bytes);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            bytes -= n;
+        }
+        return true;
+    }
+
+    bool writeAll(const void* buf, size_t bytes) {
+        const char* p = static_cast<const char*> (buf);
+        while (bytes > 0) {
+            ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            bytes -= n;
+        }
+        return true;
+    }
+
+    void respond(const std::vector<ServeResult>& results) {
+        std::lock_guard<std::mutex> guard(writeLock);
+        uint64_t count = results.size();
+        if (writeAll(&count, sizeof (count)) && count > 0)
+            writeAll(results.data(), sizeof (ServeResult) * count);
+    }
+
+    void respond(const std::string& text) {
+        std::lock_guard<std::mutex> guard(writeLock);
+        uint64_t length = text.size();
+        if (writeAll(&length, sizeof (length)) && length > 0)
+            writeAll(text.data(), length);
+    }
+};
+
+struct Request {
+    std::shared_ptr<Connection> connection;
+    Request_Type type;
+    std::vector<double> queries;
+    row_type n; // 0 for statistics and for requests answered with no results
+    double parameter; // k or theta of the request (0: the one of the daemon)
+    Clock::time_point arrival;
+};
+
+/*
+ * Latency and load statistics of the daemon
+ */
+class ServeStats {
+    std::mutex lock;
+    std::vector<double> latencies; // microseconds of the last requests (ring buffer)
+    size_t next = 0;
+    uint64_t requests = 0, queries = 0, batches = 0;
+    size_t maxQueueDepth = 0;
+
+public:
+
+    ServeStats() : latencies() {
+        latencies.reserve(10000);
+    }
+
+    void addBatch(row_type batchQueries, size_t queueDepth) {
+        std::lock_guard<std::mutex> guard(lock);
+        batches++;
+        queries += batchQueries;
+        if (maxQueueDepth < queueDepth)
+            maxQueueDepth = queueDepth;
+    }
+
+    void addLatency(double micros) {
+        std::lock_guard<std::mutex> guard(lock);
+        requests++;
+        if (latencies.size() < latencies.capacity()) {
+            latencies.push_back(micros);
+        } else {
+            latencies[next] = micros;
+            next = (next + 1) % latencies.size();
+        }
+    }
+
+    std::string report(size_t queueDepth, row_type batchTarget) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<double> sorted(latencies);
+        std::sort(sorted.begin(), sorted.end());
+
+        auto percentile = [&sorted](double p) {
+            return (sorted.empty() ? 0.0 : sorted[(size_t) (p * (sorted.size() - 1))]);
+        };
+
+        std::stringstream out;
+        out << "[STATS] requests = " << requests << " queries = " << queries << " batches = " << batches << std::endl;
+        out << "[STATS] queries per batch = " << (batches > 0 ? (double) queries / batches : 0) << " (target " << batchTarget << ")" << std::endl;
+        out << "[STATS] queue depth = " << queueDepth << " (max " << maxQueueDepth << ")" << std::endl;
+        out << "[STATS] latency p50 = " << percentile(0.5) << "us p99 = " << percentile(0.99) << "us max = " << percentile(1.0) << "us" << std::endl;
+        return out.str();
+    }
+};
+
+/*
+ * Requests waiting for the engine. take() forms a micro-batch: it waits for the first request and then for more
+ * until the batch holds target queries or the oldest request has waited for the latency budget
+ */
+class RequestQueue {
+    std::mutex lock;
+    std::condition_variable arrived;
+    std::deque<Request> requests;
+    size_t queries = 0;
+
+public:
+
+    void push(Request&& request) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            queries += request.n;
+            requests.push_back(std::move(request));
+        }
+        arrived.notify_one();
+    }
+
+    size_t depth() {
+        std::lock_guard<std::mutex> guard(lock);
+        return queries;
+    }
+
+    void take(std::vector<Request>& batch, row_type target, std::chrono::microseconds budget) {
+        std::unique_lock<std::mutex> guard(lock);
+        arrived.wait(guard, [this] {
+            return !requests.empty();
+        });
+
+        Clock::time_point deadline = requests.front().arrival + budget;
+        arrived.wait_until(guard, deadline, [this, target] {
+            return queries >= target;
+        });
+
+        batch.clear();
+        row_type total = 0;
+        while (!requests.empty() && (total == 0 || total + requests.front().n <= target)) {
+            total += requests.front().n;
+            queries -= requests.front().n;
+            batch.push_back(std::move(requests.front()));
+            requests.pop_front();
+        }
+    }
+};
+
+std::atomic<row_type> batchTarget(1);
+
+// k, theta: the ones of the daemon (k = 0 for above-theta). maxQueries: the largest n a request may have
+void serveConnection(std::shared_ptr<Connection> connection, col_type colNum, int k, double theta, row_type maxQueries, RequestQueue& queue) {
+    uint32_t header[2];
+
+    while (connection->readAll(header, sizeof (header))) {
+
+        Request request;
+        request.connection = connection;
+        request.n = 0;
+        request.parameter = 0;
+
+        // every response goes through the queue, behind the pending requests of the connection
+        if (header[0] == REQUEST_STATS) {
+            request.type = REQUEST_STATS;
+            request.arrival = Clock::now();
+            queue.push(std::move(request));
+            continue;
+        }
+
+        if (header[0] != REQUEST_QUERIES && header[0] != REQUEST_QUERIES_WITH_PARAMETER) {
+            std::cerr << "[WARNING] Unknown request type " << header[0] << ". Closing the connection" << std::endl;
+            break;
+        }
+
+        if (header[1] > maxQueries) { // do not allocate what the header claims
+            std::cerr << "[WARNING] Request of " << header[1] << " queries exceeds the limit of " << maxQueries << ". Closing the connection" << std::endl;
+            break;
+        }
+
+        request.type = (Request_Type) header[0];
+        request.n = header[1];
+
+        if (header[0] == REQUEST_QUERIES_WITH_PARAMETER && !connection->readAll(&request.parameter, sizeof (double)))
+            break;
+
+        request.queries.resize((size_t) request.n * colNum);
+
+        if (!connection->readAll(request.queries.data(), sizeof (double) * request.queries.size()))
+            break;
+
+        request.arrival = Clock::now();
+
+        bool invalid;
+        if (k > 0) {
+            invalid = (request.parameter != (int) request.parameter || request.parameter < 0 || request.parameter > k);
+        } else { // own thetas need a positive theta of the daemon
+            invalid = (request.parameter < 0 || (request.parameter > 0 && theta <= 0));
+        }
+        if (invalid) {
+            std::cerr << "[WARNING] Invalid k or theta " << request.parameter << " in a request. Answering it with no results" << std::endl;
+        }
+        if (request.n == 0 || invalid) { // answered with no results, in turn
+            request.n = 0;
+            request.parameter = 0;
+            request.queries.clear();
+        }
+        queue.push(std::move(request));
+    }
+}
+
+void runEngine(Lemp& algo, col_type colNum, int k, double theta, RequestQueue& queue, ServeStats& stats, row_type maxBatch, std::chrono::microseconds budget) {
+    std::vector<Request> batch;
+    std::vector<double> queries;
+    std::vector<int> queryK; // requests with their own k or theta share the batch with the others
+    std::vector<double> queryTheta;
+    std::vector<row_type> owner; // query of the batch -> request
+    std::vector<MatItem> results;
+    std::vector<std::vector<ServeResult> > responses;
+
+    while (true) {
+        queue.take(batch, batchTarget.load(), budget);
+
+        queries.clear();
+        owner.clear();
+        queryK.clear();
+        queryTheta.clear();
+        bool ownParameters = false;
+        for (row_type r = 0; r < batch.size(); ++r) {
+            queries.insert(queries.end(), batch[r].queries.begin(), batch[r].queries.end());
+            owner.insert(owner.end(), batch[r].n, r);
+
+            double parameter = (batch[r].parameter > 0 ? batch[r].parameter : (k > 0 ? k : theta));
+            ownParameters = ownParameters || batch[r].parameter > 0;
+            if (k > 0) {
+                queryK.insert(queryK.end(), batch[r].n, (int) parameter);
+            } else {
+                queryTheta.insert(queryTheta.end(), batch[r].n, parameter);
+            }
+        }
+        row_type n = owner.size();
+
+        if (ownParameters) {
+            if (k > 0)
+                algo.setQueryK(queryK);
+            else
+                algo.setQueryTheta(queryTheta);
+        }
+        if (n > 0) {
+            algo.queryBatch(queries.data(), n, results);
+        } else { // only statistics and empty requests
+            results.clear();
+        }
+
+        // the first query of each request in the batch
+        std::vector<row_type> firstQuery(batch.size(), 0);
+        for (row_type r = 1; r < batch.size(); ++r) {
+            firstQuery[r] = firstQuery[r - 1] + batch[r - 1].n;
+        }
+
+        responses.resize(batch.size());
+        for (auto& response : responses)
+            response.clear();
+
+        for (auto& item : results) {
+            row_type r = owner[item.i];
+            responses[r].push_back(ServeResult{item.result, (uint32_t) (item.i - firstQuery[r]), (uint32_t) item.j});
+        }
+
+        Clock::time_point now = Clock::now();
+        for (row_type r = 0; r < batch.size(); ++r) {
+            if (batch[r].type == REQUEST_STATS) {
+                batch[r].connection->respond(stats.report(queue.depth(), batchTarget.load()));
+                continue;
+            }
+            batch[r].connection->respond(responses[r]);
+            if (batch[r].n > 0)
+                stats.addLatency(std::chrono::duration_cast<std::chrono::microseconds>(now - batch[r].arrival).count());
+        }
+
+        if (n == 0)
+            continue;
+
+        // adapt the batch size: grow while requests pile up, shrink when batches do not fill up
+        size_t depth = queue.depth();
+        stats.addBatch(n, depth);
+
+        row_type target = batchTarget.load();
+        if (depth > 0 && target < maxBatch) {
+            batchTarget.store(std::min(maxBatch, target * 2));
+        } else if (depth == 0 && n < target) {
+            batchTarget.store(std::max<row_type>(1, target / 2));
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double theta, R, epsilon, sampleError, tuningBudget;
+    string itemsFile, sampleFile, socketPath, logFile;
+    int k, cacheSizeinKB, threads, r, n, sampleSize, maxBatch, budgetInMicros, statsInterval, resultCacheSize, cacheLevels, sampleMin, sampleMax, numTrees, search_k, ef, pqSubspaces;
+    std::string methodStr;
+    LEMP_Method method;
+    bool isTARR = true;
+    bool pqExact = true;
+    bool rangeBounds = false;
+    int coneClusters = 0;
+    bool dedup = true;
+    bool onlineTuning = false;
+
+    options_description desc("Options");
+    desc.add_options()
+            ("help", "produce help message")
+            ("P", value<string>(&itemsFile), "file containing the probe matrix")
+            ("socket", value<string>(&socketPath)->default_value("/tmp/lemp.sock"), "path of the Unix domain socket")
+            ("sample", value<string>(&sampleFile)->default_value(""), "file with sample queries for tuning (default: a sample of P)")
+            ("sampleSize", value<int>(&sampleSize)->default_value(1000), "number of probe vectors used for tuning if no sample file is given")
+            ("theta", value<double>(&theta)->default_value(0), "theta value")
+            ("k", value<int>(&k)->default_value(10), "top k (default 10). If 0 Above-theta is served")
+            ("R", value<double>(&R)->default_value(0.97), "recall parameter for LSH")
+            ("epsilon", value<double>(&epsilon)->default_value(0.0), "epsilon value for LEMP-LI with Absolute or Relative Approximation")
+            ("isTARR", value<bool>(&isTARR)->default_value(true), "for LEMP-TA. If 1 Round Robin schedule is used (default). Otherwise Max PiQi")
+            ("method", value<string>(&methodStr)->default_value("LEMP_LI"), "LEMP_X where X: L, LI, LC, I, C, TA, TREE, LSH, BLSH, AUTO, ANNOY, HNSW, PQ")
+            ("numTrees", value<int>(&numTrees)->default_value(10), "for LEMP_ANNOY. Random-projection trees per probe bucket (more: higher recall, larger index)")
+            ("search_k", value<int>(&search_k)->default_value(1000), "for LEMP_ANNOY. Candidates verified per query and probe bucket (more: higher recall, slower)")
+            ("ef", value<int>(&ef)->default_value(HNSW_EF), "for LEMP_HNSW. Candidates kept per query and probe bucket during the graph search (more: higher recall, slower)")
+            ("pqSubspaces", value<int>(&pqSubspaces)->default_value(PQ_SUBSPACES), "for LEMP_PQ. Subspaces of product quantization, i.e., bytes per probe vector")
+            ("pqExact", value<bool>(&pqExact)->default_value(true), "for LEMP_PQ. If 1 the codes only screen out vectors (exact). Otherwise the search_k vectors with the best codes are verified (approximate)")
+            ("rangeBounds", value<bool>(&rangeBounds)->default_value(false), "If 1 each bucket keeps the range of every coordinate of its directions and queries that cannot reach theta in it skip the bucket")
+            ("coneClusters", value<int>(&coneClusters)->default_value(0), "If > 0 each bucket keeps up to this many cones (centroid direction and angular radius) around its directions and queries that cannot reach theta in any of them skip the bucket")
+            ("maxBatch", value<int>(&maxBatch)->default_value(1024), "maximum number of queries in a micro-batch")
+            ("budget", value<int>(&budgetInMicros)->default_value(500), "latency budget in microseconds for forming a micro-batch")
+            ("resultCache", value<int>(&resultCacheSize)->default_value(0), "number of queries whose results are kept for repeated queries (default 0: no cache)")
+            ("cacheLevels", value<int>(&cacheLevels)->default_value(0), "for top-k with resultCache. If > 0, queries whose direction quantized to this many steps per coordinate matches a cached one get its results (approximate)")
+            ("dedup", value<bool>(&dedup)->default_value(true), "if 1 identical queries of a micro-batch are retrieved once (default)")
+            ("onlineTuning", value<bool>(&onlineTuning)->default_value(false), "for LEMP_LI, LEMP_LC. If 1 t_b and the number of lists of each bucket keep adapting to the served queries")
+            ("sampleMin", value<int>(&sampleMin)->default_value(LOWER_LIMIT_PER_BUCKET), "smallest tuning sample per probe bucket. Fewer than 3 * sampleMin queries are not tuned")
+            ("sampleMax", value<int>(&sampleMax)->default_value(UPPER_LIMIT_PER_BUCKET), "largest tuning sample per probe bucket")
+            ("sampleError", value<double>(&sampleError)->default_value(SAMPLE_ERROR), "the tuning sample grows until the mean query cost is known within this relative error (0: fixed sample rate)")
+            ("tuningBudget", value<double>(&tuningBudget)->default_value(0), "seconds the tuning may take. The samples are cut to fit (0: no budget)")
+            ("statsInterval", value<int>(&statsInterval)->default_value(60), "seconds between statistics reports on stdout (0: never)")
+            ("logFile", value<string>(&logFile)->default_value(""), "output File (contains runtime information)")
+            ("cacheSizeinKB", value<int>(&cacheSizeinKB)->default_value(8192), "cache size in KB")
+            ("t", value<int>(&threads)->default_value(1), "num of threads (default 1)")
+            ("r", value<int>(&r)->default_value(0), "num of coordinates in each vector (needed when reading from csv files)")
+            ("n", value<int>(&n)->default_value(0), "num of vectors in P (needed when reading from csv files)")
+            ;
+
+    positional_options_description pdesc;
+    pdesc.add("P", 1);
+
+    variables_map vm;
+    store(command_line_parser(argc, argv).options(desc).positional(pdesc).run(), vm);
+    notify(vm);
+
+    if (vm.count("help") || vm.count("P") == 0) {
+        cout << "lempServe [options] <P>" << endl << endl;
+        cout << desc << endl;
+        return 1;
+    }
+
+    InputArguments args;
+    args.logFile = logFile;
+    args.theta = theta;
+    args.k = k;
+    args.threads = threads;
+
+    if (methodStr.compare("LEMP_LI") == 0) {
+        method = LEMP_LI;
+    } else if (methodStr.compare("LEMP_LC") == 0) {
+        method = LEMP_LC;
+    } else if (methodStr.compare("LEMP_L") == 0) {
+        method = LEMP_L;
+    } else if (methodStr.compare("LEMP_I") == 0) {
+        method = LEMP_I;
+    } else if (methodStr.compare("LEMP_C") == 0) {
+        method = LEMP_C;
+    } else if (methodStr.compare("LEMP_TA") == 0) {
+        method = LEMP_TA;
+    } else if (methodStr.compare("LEMP_TREE") == 0) {
+        method = LEMP_TREE;
+    } else if (methodStr.compare("LEMP_LSH") == 0) {
+        method = LEMP_LSH;
+    } else if (methodStr.compare("LEMP_BLSH") == 0) {
+        method = LEMP_BLSH;
+    } else if (methodStr.compare("LEMP_AUTO") == 0) {
+        method = LEMP_AUTO;
+    } else if (methodStr.compare("LEMP_ANNOY") == 0) {
+        method = LEMP_ANNOY;
+    } else if (methodStr.compare("LEMP_HNSW") == 0) {
+        method = LEMP_HNSW;
+    } else if (methodStr.compare("LEMP_PQ") == 0) {
+        method = LEMP_PQ;
+    } else {
+        cout << "[ERROR] This method is not possible. Please try {LEMP_L, LEMP_LI, LEMP_LC, LEMP_I, LEMP_C, LEMP_TA, LEMP_TREE, LEMP_LSH, LEMP_BLSH, LEMP_AUTO, LEMP_ANNOY, LEMP_HNSW, LEMP_PQ}" << endl << endl;
+        cout << desc << endl;
+        return 1;
+    }
+
+    VectorMatrix rightMatrix, sampleMatrix;
+    rightMatrix.readFromFile(itemsFile, r, n, false);
+
+    if (sampleFile != "") {
+        sampleMatrix.readFromFile(sampleFile, r, 0, true);
+    } else {
+        std::cout << "[WARNING] No sample queries given. Tuning with a sample of the probe vectors" << std::endl;
+        rg::Random32 random(123);
+        std::vector<row_type> ids = rg::sample(random, std::min<row_type>(sampleSize, rightMatrix.rowNum), rightMatrix.rowNum);
+        sampleMatrix.addVectors(rightMatrix, ids);
+    }
+
+    mips::Lemp algo(args, cacheSizeinKB, method, isTARR, R, epsilon);
+    algo.setQueryCache(std::max(0, resultCacheSize), cacheLevels);
+    algo.setDeduplicateQueries(dedup);
+    algo.setOnlineTuning(onlineTuning);
+    algo.setAnnoy(numTrees, search_k);
+    algo.setHnsw(ef);
+    algo.setPq(pqSubspaces, pqExact);
+    algo.setRangeBounds(rangeBounds);
+    algo.setConeBounds(coneClusters);
+    algo.setTuningSample(std::max(1, sampleMin), std::max(1, sampleMax), sampleError, tuningBudget);
+    algo.initialize(rightMatrix);
+    algo.prepare(sampleMatrix);
+
+    // listen
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        perror("[ERROR] socket");
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof (address.sun_path) - 1);
+    unlink(socketPath.c_str());
+
+    if (bind(listenFd, (struct sockaddr*) &address, sizeof (address)) != 0 || listen(listenFd, 128) != 0) {
+        perror("[ERROR] bind/listen");
+        return 1;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "[INFO] Serving " << (k > 0 ? "top-k" : "above-theta") << " queries on " << socketPath << std::endl;
+
+    RequestQueue queue;
+    ServeStats stats;
+    col_type colNum = rightMatrix.colNum;
+
+    row_type maxQueries = MAX_REQUEST_BATCHES * (row_type) std::max(1, maxBatch);
+
+    std::thread engine(runEngine, std::ref(algo), colNum, k, theta, std::ref(queue), std::ref(stats), (row_type) std::max(1, maxBatch),
+            std::chrono::microseconds(budgetInMicros));
+    engine.detach();
+
+    if (statsInterval > 0) {
+        std::thread reporter([&queue, &stats, statsInterval] {
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(statsInterval));
+                std::cout << stats.report(queue.depth(), batchTarget.load()) << std::flush;
+            }
+        });
+        reporter.detach();
+    }
+
+    while (true) {
+        int clientFd = accept(listenFd, nullptr, nullptr);
+        if (clientFd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("[ERROR] accept");
+            break;
+        }
+
+        std::thread client(serveConnection, std::make_shared<Connection>(clientFd), colNum, k, theta, maxQueries, std::ref(queue));
+        client.detach();
+    }
+
+    close(listenFd);
+    return 1;
+}
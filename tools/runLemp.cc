@@ -23,6 +23,7 @@
 #include <boost/program_options.hpp>
 
 #include <iostream>
+#include <sstream>
 #include <mips/mips.h>
 
 #include <cblas.h>
@@ -109,14 +110,23 @@ inline double decisionRuleBlockedMM(VectorMatrix &q, VectorMatrix &p,
 
 
 int main(int argc, char *argv[]) {
-    double theta, R, epsilon, user_sample_ratio;
+    double theta, R, epsilon, user_sample_ratio, tuningCoverage, modelMargin, sampleError, tuningBudget;
     string usersFile;
     string itemsFile;
-    string logFile, resultsFile;
+    string logFile, resultsFile, tuningFile, thetasStr, denyFile, allowFile;
 
     bool querySideLeft = true;
     bool isTARR = true;
-    int k, cacheSizeinKB, threads, r, m, n;
+    bool pqExact = true;
+    bool rangeBounds = false;
+    int coneClusters = 0;
+    bool bulkTree = false;
+    bool dualTree = false;
+    bool pinThreads = false;
+    bool intraQuery = true;
+    bool modelTuning = false;
+    bool onlineTuning = false;
+    int k, cacheSizeinKB, threads, r, m, n, sampleMin, sampleMax, numTrees, search_k, ef, pqSubspaces;
     std::string methodStr;
     LEMP_Method method;
 
@@ -127,13 +137,36 @@ int main(int argc, char *argv[]) {
             ("Q^T", value<string>(&usersFile), "file containing the query matrix (left side)")
             ("P", value<string>(&itemsFile), "file containing the probe matrix (right side)")
             ("theta", value<double>(&theta), "theta value")
+            ("thetas", value<string>(&thetasStr)->default_value(""), "comma-separated increasing theta values for Above-theta in a single pass. Results of each tier go to resultsFile.<i>")
             ("R", value<double>(&R)->default_value(0.97), "recall parameter for LSH")
             ("x", value<double>(&user_sample_ratio)->default_value(0.0), "user sample ratio")
 	    ("epsilon", value<double>(&epsilon)->default_value(0.0), "epsilon value for LEMP-LI with Absolute or Relative Approximation")
             ("querySideLeft", value<bool>(&querySideLeft)->default_value(true), "1 if Q^T contains the queries (default). Interesting for Row-Top-k")
             ("isTARR", value<bool>(&isTARR)->default_value(true), "for LEMP-TA. If 1 Round Robin schedule is used (default). Otherwise Max PiQi")
-            ("method", value<string>(&methodStr), "LEMP_X where X: L, LI, LC, I, C, TA, TREE, AP, LSH")
+            ("method", value<string>(&methodStr), "LEMP_X where X: L, LI, LC, I, C, TA, TREE, AP, LSH, BLSH, AUTO, ANNOY, HNSW, PQ")
+            ("bulkTree", value<bool>(&bulkTree)->default_value(false), "for LEMP-TREE. If 1 the cover trees are bulk built (points sorted by distance once)")
+            ("dualTree", value<bool>(&dualTree)->default_value(false), "for LEMP-TREE. If 1 each query batch gets a cover tree and is searched against the bucket trees at once (dual-tree)")
+            ("numTrees", value<int>(&numTrees)->default_value(10), "for LEMP_ANNOY. Random-projection trees per probe bucket (more: higher recall, larger index)")
+            ("search_k", value<int>(&search_k)->default_value(1000), "for LEMP_ANNOY. Candidates verified per query and probe bucket (more: higher recall, slower)")
+            ("ef", value<int>(&ef)->default_value(HNSW_EF), "for LEMP_HNSW. Candidates kept per query and probe bucket during the graph search (more: higher recall, slower)")
+            ("pqSubspaces", value<int>(&pqSubspaces)->default_value(PQ_SUBSPACES), "for LEMP_PQ. Subspaces of product quantization, i.e., bytes per probe vector")
+            ("pqExact", value<bool>(&pqExact)->default_value(true), "for LEMP_PQ. If 1 the codes only screen out vectors (exact). Otherwise the search_k vectors with the best codes are verified (approximate)")
+            ("rangeBounds", value<bool>(&rangeBounds)->default_value(false), "If 1 each bucket keeps the range of every coordinate of its directions and queries that cannot reach theta in it skip the bucket")
+            ("coneClusters", value<int>(&coneClusters)->default_value(0), "If > 0 each bucket keeps up to this many cones (centroid direction and angular radius) around its directions and queries that cannot reach theta in any of them skip the bucket")
+            ("intraQuery", value<bool>(&intraQuery)->default_value(true), "for top-k. If 1 and there are fewer queries than threads, the threads split the probe buckets (default)")
+            ("pinThreads", value<bool>(&pinThreads)->default_value(false), "if 1 each thread is pinned to its own core")
             ("k", value<int>(&k)->default_value(0), "top k (default 0). If 0 Above-theta will run")
+            ("tuningFile", value<string>(&tuningFile)->default_value(""), "file with the tuning parameters of earlier runs (any theta or k). They are reused and the file is updated")
+            ("tuningCoverage", value<double>(&tuningCoverage)->default_value(0.5), "with tuningFile: a bucket is tuned again if less than this fraction of its sample lies in the tuned range (0: never)")
+            ("modelTuning", value<bool>(&modelTuning)->default_value(false), "for LEMP_LI, LEMP_LC, LEMP_I, LEMP_C. If 1 phi and t_b are chosen from predicted instead of measured query times")
+            ("modelMargin", value<double>(&modelMargin)->default_value(0.1), "with modelTuning: buckets where lists and LENGTH are predicted within this fraction of each other are tuned by timing")
+            ("onlineTuning", value<bool>(&onlineTuning)->default_value(false), "for LEMP_LI, LEMP_LC. If 1 t_b and the number of lists of each bucket keep adapting to the measured query times during retrieval")
+            ("sampleMin", value<int>(&sampleMin)->default_value(LOWER_LIMIT_PER_BUCKET), "smallest tuning sample per probe bucket. Fewer than 3 * sampleMin queries are not tuned")
+            ("sampleMax", value<int>(&sampleMax)->default_value(UPPER_LIMIT_PER_BUCKET), "largest tuning sample per probe bucket")
+            ("sampleError", value<double>(&sampleError)->default_value(SAMPLE_ERROR), "the tuning sample grows until the mean query cost is known within this relative error (0: fixed sample rate)")
+            ("tuningBudget", value<double>(&tuningBudget)->default_value(0), "seconds the tuning may take. The samples are cut to fit (0: no budget)")
+            ("denyFile", value<string>(&denyFile)->default_value(""), "file with ids of P (one per line) that must not appear in the results")
+            ("allowFile", value<string>(&allowFile)->default_value(""), "file with the only ids of P (one per line) that may appear in the results")
             ("logFile", value<string>(&logFile)->default_value(""), "output File (contains runtime information)")
 	    ("resultsFile", value<string>(&resultsFile)->default_value(""), "output File (contains the results)")
             ("cacheSizeinKB", value<int>(&cacheSizeinKB)->default_value(8192), "cache size in KB")
@@ -183,9 +216,17 @@ int main(int argc, char *argv[]) {
         method = LEMP_LSH;
     } else if (methodStr.compare("LEMP_BLSH") == 0) {
         method = LEMP_BLSH;
+    } else if (methodStr.compare("LEMP_AUTO") == 0) {
+        method = LEMP_AUTO;
+    } else if (methodStr.compare("LEMP_ANNOY") == 0) {
+        method = LEMP_ANNOY;
+    } else if (methodStr.compare("LEMP_HNSW") == 0) {
+        method = LEMP_HNSW;
+    } else if (methodStr.compare("LEMP_PQ") == 0) {
+        method = LEMP_PQ;
     } 
     else {
-        cout << "[ERROR] This method is not possible. Please try {LEMP_L, LEMP_LI, LEMP_LC, LEMP_I, LEMP_C, LEMP_TA, LEMP_TREE, LEMP_AP, LEMP_LSH, LEMP_BLSH}" << endl << endl;
+        cout << "[ERROR] This method is not possible. Please try {LEMP_L, LEMP_LI, LEMP_LC, LEMP_I, LEMP_C, LEMP_TA, LEMP_TREE, LEMP_AP, LEMP_LSH, LEMP_BLSH, LEMP_AUTO, LEMP_ANNOY, LEMP_HNSW, LEMP_PQ}" << endl << endl;
         cout << desc << endl;
         return 1;
     }
@@ -201,9 +242,47 @@ int main(int argc, char *argv[]) {
     }
 
     mips::Lemp algo(args, cacheSizeinKB, method, isTARR, R, epsilon);
+    algo.setBulkTree(bulkTree);
+    algo.setDualTree(dualTree);
+    algo.setAnnoy(numTrees, search_k);
+    algo.setHnsw(ef);
+    algo.setPq(pqSubspaces, pqExact);
+    algo.setRangeBounds(rangeBounds);
+    algo.setConeBounds(coneClusters);
+    algo.setPinThreads(pinThreads);
+    algo.setIntraQuery(intraQuery);
+    algo.setModelTuning(modelTuning, modelMargin);
+    algo.setOnlineTuning(onlineTuning);
+    algo.setTuningSample(std::max(1, sampleMin), std::max(1, sampleMax), sampleError, tuningBudget);
     
     algo.initialize(rightMatrix);
 
+    if (tuningFile != "") {
+        algo.setReuseTuning(true);
+        algo.setTuningCoverage(tuningCoverage);
+        algo.loadTuning(tuningFile);
+    }
+
+    ItemFilter itemFilter;
+    if (denyFile != "" || allowFile != "") {
+        std::vector<row_type> ids;
+        std::ifstream in((allowFile != "" ? allowFile : denyFile).c_str());
+        if (!in.is_open()) {
+            cout << "[ERROR] Cannot read " << (allowFile != "" ? allowFile : denyFile) << endl;
+            return 1;
+        }
+        row_type id;
+        while (in >> id)
+            ids.push_back(id);
+
+        if (allowFile != "")
+            itemFilter.setGlobalAllowlist(ids, rightMatrix.rowNum);
+        else
+            itemFilter.setGlobalDenylist(ids, rightMatrix.rowNum);
+        algo.setItemFilter(&itemFilter);
+        cout << "[INFO] " << ids.size() << " item(s) in the " << (allowFile != "" ? "allowlist" : "denylist") << endl;
+    }
+
     Results results;
     if (args.k > 0) {
 #ifdef ONLINE_DECISION_RULE
@@ -262,12 +341,34 @@ int main(int argc, char *argv[]) {
       algo.runTopK(leftMatrix, results);
       algo.outputStats();
 #endif
+    } else if (thetasStr != "") {
+        std::vector<double> thetas;
+        std::stringstream ss(thetasStr);
+        std::string token;
+        while (std::getline(ss, token, ',')) {
+            thetas.push_back(std::stod(token));
+        }
+
+        std::vector<Results> tiers;
+        algo.runAboveThetaMulti(leftMatrix, thetas, tiers);
+        algo.outputStats();
+
+        if (resultsFile != "") {
+            for (int i = 0; i < tiers.size(); ++i) {
+                std::string tierFile = resultsFile + "." + std::to_string(i);
+                tiers[i].writeToFile(tierFile);
+            }
+        }
     } else {
         algo.runAboveTheta(leftMatrix, results);
         algo.outputStats();
     }
     
-    if (resultsFile != "") {
+    if (tuningFile != "") {
+        algo.saveTuning(tuningFile);
+    }
+
+    if (resultsFile != "" && thetasStr == "") {
         results.writeToFile(resultsFile);
     }
 
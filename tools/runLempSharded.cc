@@ -0,0 +1,185 @@
+//    Copyright 2015 Christina Teflioudi
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include <iostream>
+#include <mips/mips.h>
+
+using namespace std;
+using namespace mips;
+using namespace boost::program_options;
+
+int main(int argc, char *argv[]) {
+    double theta, R, epsilon;
+    string usersFile;
+    string itemsFile;
+    string logFile, resultsFile;
+    string partitionStr;
+
+    bool querySideLeft = true;
+    bool isTARR = true;
+    bool pqExact = true;
+    bool rangeBounds = false;
+    int coneClusters = 0;
+    bool bulkTree = false;
+    bool dualTree = false;
+    bool intraQuery = true;
+    bool propagate = true;
+    int k, cacheSizeinKB, threads, shards, batchSize, r, m, n, numTrees, search_k, ef, pqSubspaces;
+    std::string methodStr;
+    LEMP_Method method;
+
+    // read command line
+    options_description desc("Options");
+    desc.add_options()
+            ("help", "produce help message")
+            ("Q^T", value<string>(&usersFile), "file containing the query matrix (left side)")
+            ("P", value<string>(&itemsFile), "file containing the probe matrix (right side)")
+            ("theta", value<double>(&theta), "theta value")
+            ("R", value<double>(&R)->default_value(0.97), "recall parameter for LSH")
+            ("epsilon", value<double>(&epsilon)->default_value(0.0), "epsilon value for LEMP-LI with Absolute or Relative Approximation")
+            ("querySideLeft", value<bool>(&querySideLeft)->default_value(true), "1 if Q^T contains the queries (default). Interesting for Row-Top-k")
+            ("isTARR", value<bool>(&isTARR)->default_value(true), "for LEMP-TA. If 1 Round Robin schedule is used (default). Otherwise Max PiQi")
+            ("method", value<string>(&methodStr), "LEMP_X where X: L, LI, LC, I, C, TA, TREE, AP, LSH, BLSH, AUTO, ANNOY, HNSW, PQ")
+            ("bulkTree", value<bool>(&bulkTree)->default_value(false), "for LEMP-TREE. If 1 the cover trees are bulk built (points sorted by distance once)")
+            ("dualTree", value<bool>(&dualTree)->default_value(false), "for LEMP-TREE. If 1 each query batch gets a cover tree and is searched against the bucket trees at once (dual-tree)")
+            ("numTrees", value<int>(&numTrees)->default_value(10), "for LEMP_ANNOY. Random-projection trees per probe bucket (more: higher recall, larger index)")
+            ("search_k", value<int>(&search_k)->default_value(1000), "for LEMP_ANNOY. Candidates verified per query and probe bucket (more: higher recall, slower)")
+            ("ef", value<int>(&ef)->default_value(HNSW_EF), "for LEMP_HNSW. Candidates kept per query and probe bucket during the graph search (more: higher recall, slower)")
+            ("pqSubspaces", value<int>(&pqSubspaces)->default_value(PQ_SUBSPACES), "for LEMP_PQ. Subspaces of product quantization, i.e., bytes per probe vector")
+            ("pqExact", value<bool>(&pqExact)->default_value(true), "for LEMP_PQ. If 1 the codes only screen out vectors (exact). Otherwise the search_k vectors with the best codes are verified (approximate)")
+            ("rangeBounds", value<bool>(&rangeBounds)->default_value(false), "If 1 each bucket keeps the range of every coordinate of its directions and queries that cannot reach theta in it skip the bucket")
+            ("coneClusters", value<int>(&coneClusters)->default_value(0), "If > 0 each bucket keeps up to this many cones (centroid direction and angular radius) around its directions and queries that cannot reach theta in any of them skip the bucket")
+            ("intraQuery", value<bool>(&intraQuery)->default_value(true), "for top-k. If 1 and there are fewer queries than threads, the threads split the probe buckets (default)")
+            ("shards", value<int>(&shards)->default_value(2), "number of worker processes, each owning a part of P (default 2)")
+            ("partition", value<string>(&partitionStr)->default_value("length"), "how P is partitioned among the shards: length (ranges of vector lengths, default) or hash")
+            ("propagate", value<bool>(&propagate)->default_value(true), "for top-k. If 1 the shard with the longest vectors runs first and its top-k minimum prunes the other shards (default)")
+            ("batchSize", value<int>(&batchSize)->default_value(10000), "number of queries sent to the shards at once (default 10000)")
+            ("k", value<int>(&k)->default_value(0), "top k (default 0). If 0 Above-theta will run")
+            ("logFile", value<string>(&logFile)->default_value(""), "output File (contains runtime information)")
+            ("resultsFile", value<string>(&resultsFile)->default_value(""), "output File (contains the results)")
+            ("cacheSizeinKB", value<int>(&cacheSizeinKB)->default_value(8192), "cache size in KB")
+            ("t", value<int>(&threads)->default_value(1), "num of threads in total, split among the shards (default 1)")
+            ("r", value<int>(&r)->default_value(0), "num of coordinates in each vector (needed when reading from csv files)")
+            ("m", value<int>(&m)->default_value(0), "num of vectors in Q^T (needed when reading from csv files)")
+            ("n", value<int>(&n)->default_value(0), "num of vectors in P (needed when reading from csv files)")
+            ;
+
+    positional_options_description pdesc;
+    pdesc.add("Q^T", 1);
+    pdesc.add("P", 2);
+
+    variables_map vm;
+    store(command_line_parser(argc, argv).options(desc).positional(pdesc).run(), vm);
+    notify(vm);
+
+    if (vm.count("help") || vm.count("Q^T") == 0 || vm.count("P") == 0) {
+        cout << "runLempSharded [options] <Q^T> <P>" << endl << endl;
+        cout << desc << endl;
+        return 1;
+    }
+
+    InputArguments args;
+    args.logFile = logFile;
+    args.theta = theta;
+    args.k = k;
+    args.threads = threads;
+
+    if (methodStr.compare("LEMP_LI") == 0) {
+        method = LEMP_LI;
+    } else if (methodStr.compare("LEMP_LC") == 0) {
+        method = LEMP_LC;
+    } else if (methodStr.compare("LEMP_L") == 0) {
+        method = LEMP_L;
+    } else if (methodStr.compare("LEMP_I") == 0) {
+        method = LEMP_I;
+    } else if (methodStr.compare("LEMP_C") == 0) {
+        method = LEMP_C;
+    } else if (methodStr.compare("LEMP_TA") == 0) {
+        method = LEMP_TA;
+    } else if (methodStr.compare("LEMP_TREE") == 0) {
+        method = LEMP_TREE;
+    } else if (methodStr.compare("LEMP_AP") == 0) {
+        method = LEMP_AP;
+    } else if (methodStr.compare("LEMP_LSH") == 0) {
+        method = LEMP_LSH;
+    } else if (methodStr.compare("LEMP_BLSH") == 0) {
+        method = LEMP_BLSH;
+    } else if (methodStr.compare("LEMP_AUTO") == 0) {
+        method = LEMP_AUTO;
+    } else if (methodStr.compare("LEMP_ANNOY") == 0) {
+        method = LEMP_ANNOY;
+    } else if (methodStr.compare("LEMP_HNSW") == 0) {
+        method = LEMP_HNSW;
+    } else if (methodStr.compare("LEMP_PQ") == 0) {
+        method = LEMP_PQ;
+    } else {
+        cout << "[ERROR] This method is not possible. Please try {LEMP_L, LEMP_LI, LEMP_LC, LEMP_I, LEMP_C, LEMP_TA, LEMP_TREE, LEMP_AP, LEMP_LSH, LEMP_BLSH, LEMP_AUTO, LEMP_ANNOY, LEMP_HNSW, LEMP_PQ}" << endl << endl;
+        cout << desc << endl;
+        return 1;
+    }
+
+    Shard_Partition partition;
+    if (partitionStr.compare("length") == 0) {
+        partition = SHARD_BY_LENGTH;
+    } else if (partitionStr.compare("hash") == 0) {
+        partition = SHARD_BY_HASH;
+    } else {
+        cout << "[ERROR] This partitioning is not possible. Please try {length, hash}" << endl << endl;
+        cout << desc << endl;
+        return 1;
+    }
+
+    VectorMatrix leftMatrix, rightMatrix;
+
+    if (querySideLeft) {
+        leftMatrix.readFromFile(usersFile, r, m, true);
+        rightMatrix.readFromFile(itemsFile, r, n, false);
+    } else {
+        leftMatrix.readFromFile(itemsFile, r, n, false);
+        rightMatrix.readFromFile(usersFile, r, m, true);
+    }
+
+    mips::ShardedLemp algo(args, shards, cacheSizeinKB, method, isTARR, R, epsilon);
+    algo.setPartition(partition);
+    algo.setPropagateBounds(propagate);
+    algo.setBatchSize(batchSize);
+    algo.setBulkTree(bulkTree);
+    algo.setDualTree(dualTree);
+    algo.setAnnoy(numTrees, search_k);
+    algo.setHnsw(ef);
+    algo.setPq(pqSubspaces, pqExact);
+    algo.setRangeBounds(rangeBounds);
+    algo.setConeBounds(coneClusters);
+    algo.setIntraQuery(intraQuery);
+
+    algo.initialize(rightMatrix); // forks the shards
+
+    Results results;
+    if (args.k > 0) {
+        algo.runTopK(leftMatrix, results);
+    } else {
+        algo.runAboveTheta(leftMatrix, results);
+    }
+    algo.outputStats();
+
+    if (resultsFile != "") {
+        results.writeToFile(resultsFile);
+    }
+
+    return 0;
+}